@@ -0,0 +1,374 @@
+#include "analysis.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#include "utils.h"
+#include "recipe.h"
+
+// Crafts/tick of a factory running its recipe.
+static float craft_rate(const recipe_t *recipe) {
+    return 1.0f / (recipe->duration + 1 + recipe->output_count);
+}
+
+static float recipe_inputs(const recipe_t *recipe) {
+    return recipe_count_sum(recipe->input_counts);
+}
+
+static float input_capacity(const analysis_node_t *node) {
+    switch (node->type) {
+        case BUILDING_TYPE_BELT: return ANALYSIS_BELT_RATE;
+        case BUILDING_TYPE_FACTORY: return craft_rate(recipes + node->recipe) * recipe_inputs(recipes + node->recipe);
+        default: return 0.0f; // miners accept nothing
+    }
+}
+
+static float output_rate(const analysis_node_t *node) {
+    switch (node->type) {
+        case BUILDING_TYPE_MINER: return ANALYSIS_MINER_RATE;
+        case BUILDING_TYPE_BELT: return fminf(node->offered_in, ANALYSIS_BELT_RATE);
+        case BUILDING_TYPE_FACTORY:
+            {
+                const recipe_t *recipe = recipes + node->recipe;
+                return fminf(node->offered_in / recipe_inputs(recipe), craft_rate(recipe)) * recipe->output_count;
+            }
+        default: return 0.0f;
+    }
+}
+
+// Items a node emits given what it receives.
+static uint64_t output_items(const analysis_node_t *node) {
+    switch (node->type) {
+        case BUILDING_TYPE_MINER: return (((uint64_t)1 << MINER_ITEM_KINDS) - 1) << 1; // items 1..MINER_ITEM_KINDS
+        case BUILDING_TYPE_BELT: return node->items_in;
+        case BUILDING_TYPE_FACTORY: return recipe_item_bit(recipes[node->recipe].output_item);
+        default: return 0;
+    }
+}
+
+// Whether everything the node emits is taken by its target.
+static bool accepts_items(const analysis_node_t *node, const analysis_node_t *target) {
+    if (target->type != BUILDING_TYPE_FACTORY) return true;
+    return (node->items & ~recipes[target->recipe].accept_mask) == 0;
+}
+
+static void reserve(analysis_t *analysis, size_t capacity) {
+    if (analysis->capacity >= capacity) return;
+
+    size_t new_capacity = analysis->capacity ? analysis->capacity : 1024;
+    while (new_capacity < capacity) new_capacity *= 2;
+
+    analysis->nodes = realloc(analysis->nodes, sizeof(analysis_node_t) * new_capacity);
+    analysis->pending = realloc(analysis->pending, sizeof(uint32_t) * new_capacity);
+    analysis->order = realloc(analysis->order, sizeof(uint32_t) * new_capacity);
+    analysis->members = realloc(analysis->members, sizeof(uint32_t) * new_capacity);
+    analysis->marks = realloc(analysis->marks, sizeof(uint32_t) * new_capacity);
+    assert(analysis->nodes);
+    assert(analysis->pending);
+    assert(analysis->order);
+    assert(analysis->members);
+    assert(analysis->marks);
+
+    for (size_t slot=analysis->capacity; slot<new_capacity; slot++) {
+        analysis->nodes[slot] = (analysis_node_t) { .type = ANALYSIS_NO_BUILDING };
+        analysis->marks[slot] = 0;
+    }
+    analysis->capacity = new_capacity;
+}
+
+void analysis_init(analysis_t *analysis) {
+    assert(analysis);
+    memset(analysis, 0, sizeof(analysis_t));
+}
+
+void analysis_free(analysis_t *analysis) {
+    assert(analysis);
+    free(analysis->nodes);
+    free(analysis->pending);
+    free(analysis->order);
+    free(analysis->members);
+    free(analysis->marks);
+    memset(analysis, 0, sizeof(analysis_t));
+}
+
+// Adds (sign 1) or removes (sign -1) a node's share of the summary.
+static void account(analysis_t *analysis, const analysis_node_t *node, int sign) {
+    const uint8_t flags = node->flags;
+    analysis->building_count += sign;
+    if (flags & ANALYSIS_DEAD_END) analysis->dead_ends += sign;
+    if (flags & ANALYSIS_STALLED) analysis->stalled += sign;
+    if (flags & ANALYSIS_SATURATED) analysis->saturated += sign;
+    if (flags & ANALYSIS_STARVED) analysis->starved_factories += sign;
+    if (flags & ANALYSIS_IDLE) analysis->idle_factories += sign;
+    if (flags & ANALYSIS_LOOP_START) analysis->loops += sign;
+    if (flags & ANALYSIS_MISMATCH) analysis->mismatched += sign;
+    if (node->type == BUILDING_TYPE_MINER) analysis->mined += sign * node->sustained;
+    if (node->type == BUILDING_TYPE_FACTORY) analysis->produced += sign * node->sustained;
+}
+
+// Analyzes the buildings at the given slots, which must include both ends of
+// every flow edge touching them (whole weakly connected components).
+static void analyze(analysis_t *analysis, const game_state_t *gs, const uint32_t *members, size_t count) {
+    analysis_node_t *nodes = analysis->nodes;
+    uint32_t *pending = analysis->pending;
+    uint32_t *order = analysis->order;
+
+    for (size_t i=0; i<count; i++) {
+        const uint32_t slot = members[i];
+        const building_t *b = gs->buildings + gs->building_handles.slots[slot].dense;
+        assert(b->slot == slot);
+        nodes[slot] = (analysis_node_t) { .type = b->type, .generation = gs->building_handles.slots[slot].generation };
+        if (b->type == BUILDING_TYPE_FACTORY) nodes[slot].recipe = GET_FACTORY(gs, b->data)->recipe;
+        pending[slot] = 0;
+    }
+
+    // Wire up targets; an output to something that accepts no items is a dead end.
+    for (size_t i=0; i<count; i++) {
+        const uint32_t slot = members[i];
+        const uint32_t *targets;
+        if (flow_graph_outputs(&gs->flow_graph, slot, &targets)) {
+            const uint32_t target = targets[0];
+            if (input_capacity(nodes + target) > 0.0f) {
+                nodes[slot].target = target;
+                pending[target]++;
+            }
+        }
+    }
+
+    // Forward, sources first (Kahn). Each building has at most one output, so
+    // whatever is left afterwards sits on a closed loop.
+    size_t order_count = 0;
+    for (size_t i=0; i<count; i++) {
+        if (pending[members[i]] == 0) order[order_count++] = members[i];
+    }
+    // A source whose items the target factory can't take offers it nothing.
+    for (size_t head=0; head<order_count; head++) {
+        analysis_node_t *node = nodes + order[head];
+        node->offered = output_rate(node);
+        node->items = output_items(node);
+
+        if (node->target) {
+            analysis_node_t *target = nodes + node->target;
+            if (!node->items || accepts_items(node, target)) {
+                target->offered_in += node->offered;
+                target->items_in |= node->items;
+            } else {
+                node->flags |= ANALYSIS_MISMATCH;
+            }
+            if (--pending[node->target] == 0) {
+                order[order_count++] = node->target;
+            }
+        }
+    }
+
+    if (order_count < count) {
+        for (size_t i=0; i<count; i++) {
+            const uint32_t slot = members[i];
+            if (pending[slot] == 0 || pending[slot] == UINT32_MAX) continue;
+
+            // Walk the loop once. Inflow from outside the loop is already summed
+            // in offered_in, the items circulating inside it are not. Visited
+            // loop nodes keep a nonzero pending count, the backward pass relies on it.
+            // Items are taken as the union of all fed in, loops jam anyway.
+            float inflow = 0.0f;
+            uint64_t items = 0;
+            uint32_t s = slot;
+            do {
+                inflow += nodes[s].offered_in;
+                items |= nodes[s].items_in | output_items(nodes + s);
+                pending[s] = UINT32_MAX;
+                s = nodes[s].target;
+            } while (s != slot);
+
+            do {
+                analysis_node_t *node = nodes + s;
+                node->offered = output_rate(node);
+                node->items = items;
+                if (inflow > 0.0f) node->flags |= ANALYSIS_LOOP; // empty loops never jam
+                s = node->target;
+            } while (s != slot);
+
+            if (inflow > 0.0f) nodes[slot].flags |= ANALYSIS_LOOP_START;
+        }
+    }
+
+    // Backward, sinks first. Loops and dead ends absorb nothing in the long run.
+    for (size_t k=order_count; k-->0;) {
+        analysis_node_t *node = nodes + order[k];
+
+        float accepted = 0.0f;
+        if (node->target && !pending[node->target] && !(node->flags & ANALYSIS_MISMATCH)) {
+            const analysis_node_t *target = nodes + node->target;
+            float target_in = target->sustained;
+            if (target->type == BUILDING_TYPE_FACTORY) {
+                const recipe_t *recipe = recipes + target->recipe;
+                target_in *= recipe_inputs(recipe) / recipe->output_count;
+            }
+            accepted = (target->offered_in > 0.0f) ? target_in * (node->offered / target->offered_in) : 0.0f;
+        }
+        node->sustained = fminf(node->offered, accepted);
+    }
+
+    for (size_t i=0; i<count; i++) {
+        analysis_node_t *node = nodes + members[i];
+
+        if (node->offered > 0.0f) {
+            if (!node->target && !(node->flags & ANALYSIS_LOOP)) node->flags |= ANALYSIS_DEAD_END;
+            if (node->sustained <= 0.0f) node->flags |= ANALYSIS_STALLED;
+        }
+        if (node->type != BUILDING_TYPE_MINER && node->offered_in > input_capacity(node) * 1.001f) {
+            node->flags |= ANALYSIS_SATURATED;
+        }
+        if (node->type == BUILDING_TYPE_FACTORY) {
+            if (node->offered_in <= 0.0f) {
+                node->flags |= ANALYSIS_IDLE;
+            } else if (node->offered_in < input_capacity(node) * 0.999f) {
+                node->flags |= ANALYSIS_STARVED;
+            }
+        }
+        account(analysis, node, 1);
+    }
+}
+
+void analysis_run(analysis_t *analysis, const game_state_t *gs) {
+    assert(analysis);
+    assert(gs);
+
+    const double start = get_time_ms();
+
+    const size_t slot_count = gs->building_handles.slot_count;
+    reserve(analysis, slot_count);
+
+    for (size_t slot=0; slot<slot_count; slot++) {
+        analysis->nodes[slot] = (analysis_node_t) { .type = ANALYSIS_NO_BUILDING };
+    }
+
+    size_t count = 0;
+    for (size_t i=1; i<gs->building_count; i++) {
+        const building_t *b = gs->buildings + i;
+        if (b->flags & ENTITY_FLAGS_DELETED) continue;
+        analysis->members[count++] = b->slot;
+    }
+
+    analysis->building_count = 0;
+    analysis->saturated = 0;
+    analysis->starved_factories = 0;
+    analysis->idle_factories = 0;
+    analysis->dead_ends = 0;
+    analysis->stalled = 0;
+    analysis->loops = 0;
+    analysis->mismatched = 0;
+    analysis->mined = 0.0;
+    analysis->produced = 0.0;
+
+    analyze(analysis, gs, analysis->members, count);
+
+    analysis->edit_version = gs->edit_version;
+    analysis->touches = gs->flow_graph.touches;
+    analysis->updated = count;
+    analysis->time_ms = get_time_ms() - start;
+}
+
+static bool is_live(const game_state_t *gs, uint32_t slot) {
+    // Only valid for slots not released yet, i.e. the ones in this tick's touch log.
+    const uint32_t dense = gs->building_handles.slots[slot].dense;
+    if (dense == 0 || dense >= gs->building_count) return false;
+    const building_t *b = gs->buildings + dense;
+    return b->slot == slot && !(b->flags & ENTITY_FLAGS_DELETED);
+}
+
+void analysis_update(analysis_t *analysis, const game_state_t *gs) {
+    assert(analysis);
+    assert(gs);
+
+    // Redo only the components around nodes touched since the last run, if
+    // the touch log still holds all of them.
+    const flow_graph_t *graph = &gs->flow_graph;
+    if (!analysis->nodes ||
+            analysis->touches < graph->touched_since ||
+            graph->touches != graph->touched_since + graph->touched_count) {
+        analysis_run(analysis, gs);
+        return;
+    }
+
+    const double start = get_time_ms();
+
+    reserve(analysis, gs->building_handles.slot_count);
+
+    if (++analysis->epoch == 0) {
+        memset(analysis->marks, 0, sizeof(uint32_t) * analysis->capacity);
+        analysis->epoch = 1;
+    }
+    const uint32_t epoch = analysis->epoch;
+    uint32_t *members = analysis->members;
+    uint32_t *marks = analysis->marks;
+
+    size_t count = 0;
+    for (size_t i=analysis->touches - graph->touched_since; i<graph->touched_count; i++) {
+        const uint32_t seed = graph->touched[i];
+        if (marks[seed] == epoch) continue;
+        marks[seed] = epoch;
+        members[count++] = seed;
+
+        for (size_t k=count-1; k<count; k++) {
+            const uint32_t *neighbors;
+            size_t n = flow_graph_outputs(graph, members[k], &neighbors);
+            for (size_t j=0; j<n; j++) {
+                if (marks[neighbors[j]] != epoch) {
+                    marks[neighbors[j]] = epoch;
+                    members[count++] = neighbors[j];
+                }
+            }
+            n = flow_graph_inputs(graph, members[k], &neighbors);
+            for (size_t j=0; j<n; j++) {
+                if (marks[neighbors[j]] != epoch) {
+                    marks[neighbors[j]] = epoch;
+                    members[count++] = neighbors[j];
+                }
+            }
+        }
+    }
+
+    // Take the old results out of the summary, drop removed buildings.
+    size_t live_count = 0;
+    for (size_t i=0; i<count; i++) {
+        const uint32_t slot = members[i];
+        analysis_node_t *node = analysis->nodes + slot;
+        if (node->type != ANALYSIS_NO_BUILDING) account(analysis, node, -1);
+
+        if (is_live(gs, slot)) {
+            members[live_count++] = slot;
+        } else {
+            *node = (analysis_node_t) { .type = ANALYSIS_NO_BUILDING };
+        }
+    }
+
+    analyze(analysis, gs, members, live_count);
+
+    analysis->edit_version = gs->edit_version;
+    analysis->touches = graph->touches;
+    analysis->updated = count;
+    analysis->time_ms = get_time_ms() - start;
+}
+
+void analysis_print(const analysis_t *analysis) {
+    assert(analysis);
+    printf("analysis: %lu buildings (%lu redone) in %.2f ms\n", analysis->building_count,
+            analysis->updated, analysis->time_ms);
+    printf("  mined %.3f/tick, produced %.3f/tick (sustained)\n", analysis->mined, analysis->produced);
+    printf("  %lu saturated, %lu starved and %lu idle factories\n", analysis->saturated,
+            analysis->starved_factories, analysis->idle_factories);
+    printf("  %lu dead ends, %lu loops, %lu buildings stall\n", analysis->dead_ends,
+            analysis->loops, analysis->stalled);
+    printf("  %lu feed items their factory has no recipe input for\n", analysis->mismatched);
+}
+
+const analysis_node_t *analysis_get_node(const analysis_t *analysis, handle_t building) {
+    assert(analysis);
+    if (handle_is_none(building) || building.index >= analysis->capacity) return NULL;
+    const analysis_node_t *node = analysis->nodes + building.index;
+    return (node->type == ANALYSIS_NO_BUILDING || node->generation != building.generation) ? NULL : node;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "game_state.h"
+
+// Static throughput analysis over the flow graph, without simulating.
+//
+// Forward pass (sources first): the rate each building would emit given its
+// inputs and its own limit. Backward pass (sinks first): what downstream can
+// actually absorb, shared between merging inputs in proportion to their
+// offered rates. Rates are steady-state items/tick; the real split at merges
+// depends on update order, so sustained rates are estimates.
+//
+// Chains that end in a dead end or a closed loop stall once their buffers
+// fill, so their sustained rate is 0. So do chains that carry an item the
+// factory at their end has no recipe input for: the belt jams on it.
+//
+// Factory rates come from their recipe: one craft per duration + 1 + output
+// count ticks (check inputs, produce, unload each output).
+//
+// A building's results only depend on its weakly connected component, so
+// after edits analysis_update redoes just the components the flow graph
+// logged as touched; analysis_run redoes everything.
+
+#define ANALYSIS_MINER_RATE       (1.0f / (MINER_WORK_PER_ITEM + 1))     // mine, then unload
+#define ANALYSIS_BELT_RATE        (1.0f / BELT_WORK_PER_ITEM)
+
+#define ANALYSIS_DEAD_END         (1)  // emits items, but its output accepts none
+#define ANALYSIS_LOOP             (2)  // on a closed loop that is fed items: jams once full
+#define ANALYSIS_STALLED          (4)  // emits items, but everything downstream eventually blocks
+#define ANALYSIS_SATURATED        (8)  // offered input exceeds what it can pass on
+#define ANALYSIS_STARVED          (16) // factory gets less input than it could process
+#define ANALYSIS_IDLE             (32) // factory without any input
+#define ANALYSIS_LOOP_START       (64) // the one node each fed loop is counted at
+#define ANALYSIS_MISMATCH         (128) // pushes items its target factory's recipe doesn't take
+
+typedef struct {
+    float offered_in;
+    float offered;    // items/tick out, ignoring downstream limits
+    float sustained;  // items/tick out, in steady state
+    uint8_t type;     // BUILDING_TYPE_*, ANALYSIS_NO_BUILDING for free slots
+    uint8_t flags;
+    uint32_t target;  // building slot, 0 = none
+    uint32_t recipe;  // factories
+    uint32_t generation; // of the building's handle, stale handles don't match
+    uint64_t items_in; // recipe_item_bit() of the items it may receive
+    uint64_t items;    // ... and emit
+} analysis_node_t;
+
+#define ANALYSIS_NO_BUILDING (0xff)
+
+typedef struct {
+    size_t capacity;
+    analysis_node_t *nodes; // by building slot
+    uint32_t *pending;      // scratch
+    uint32_t *order;        // scratch
+    uint32_t *members;      // scratch
+    uint32_t *marks;        // scratch, == epoch when visited
+    uint32_t epoch;
+
+    uint64_t edit_version;  // of the analyzed state
+    uint64_t touches;       // flow graph touches seen
+    size_t updated;         // nodes redone by the last run
+
+    // summary
+    size_t building_count;
+    size_t saturated;
+    size_t starved_factories;
+    size_t idle_factories;
+    size_t dead_ends;
+    size_t stalled;
+    size_t loops;
+    size_t mismatched;
+    double mined;     // items/tick, sustained
+    double produced;  // factory items/tick, sustained
+    double time_ms;
+} analysis_t;
+
+void analysis_init(analysis_t *analysis);
+void analysis_free(analysis_t *analysis);
+
+void analysis_run(analysis_t *analysis, const game_state_t *gs);
+void analysis_update(analysis_t *analysis, const game_state_t *gs);
+void analysis_print(const analysis_t *analysis);
+
+// NULL for none, stale and not yet analyzed handles.
+const analysis_node_t *analysis_get_node(const analysis_t *analysis, handle_t building);
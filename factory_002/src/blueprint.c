@@ -0,0 +1,231 @@
+#include "blueprint.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "utils.h"
+#include "recipe.h"
+#include "job_system.h"
+
+#define STAMP_GRAIN (512) // instances per job at least, see parallel_for()
+
+void blueprint_init(blueprint_t *bp) {
+    assert(bp);
+    memset(bp, 0, sizeof(blueprint_t));
+    recipes_init();
+}
+
+static bool rects_overlap(coord_t a_pos, building_size_t a_size, coord_t b_pos, building_size_t b_size) {
+    return a_pos.x < b_pos.x + b_size.w && b_pos.x < a_pos.x + a_size.w &&
+           a_pos.y < b_pos.y + b_size.h && b_pos.y < a_pos.y + a_size.h;
+}
+
+uint32_t blueprint_add(blueprint_t *bp, uint32_t type, coord_t offset) {
+    assert(bp);
+    assert(type < BUILDING_TYPE_COUNT);
+    assert(bp->building_count < BLUEPRINT_MAX_BUILDINGS);
+
+    const building_size_t size = get_building_size(type);
+    for (size_t k=0; k<bp->building_count; k++) {
+        const blueprint_building_t *other = bp->buildings + k;
+        if (rects_overlap(offset, size, other->offset, other->size)) {
+            printf("blueprint: building at %d,%d overlaps building %lu\n", offset.x, offset.y, k);
+            return BLUEPRINT_NONE;
+        }
+    }
+
+    const uint32_t index = bp->building_count++;
+    bp->buildings[index] = (blueprint_building_t) {
+        .type = type,
+        .offset = offset,
+        .size = size,
+        .rank = bp->type_counts[type]++,
+        .target = BLUEPRINT_NONE,
+    };
+    return index;
+}
+
+void blueprint_set_recipe(blueprint_t *bp, uint32_t factory, uint32_t recipe) {
+    assert(bp);
+    assert(factory < bp->building_count);
+    assert(bp->buildings[factory].type == BUILDING_TYPE_FACTORY);
+    assert(recipe < recipe_count);
+    bp->buildings[factory].recipe = recipe;
+}
+
+bool blueprint_connect(blueprint_t *bp, uint32_t source, uint32_t target) {
+    assert(bp);
+    assert(source < bp->building_count);
+    assert(target < bp->building_count);
+    assert(source != target);
+
+    blueprint_building_t *s = bp->buildings + source;
+    blueprint_building_t *t = bp->buildings + target;
+
+    // Same check as connect_buildings(), on the relative footprints.
+    const building_t source_building = { .pos = s->offset, .size = s->size };
+    const building_t target_building = { .pos = t->offset, .size = t->size };
+    uint8_t conn_dir = 0;
+    if (!buildings_adjacent(&source_building, &target_building, &conn_dir)) {
+        printf("blueprint: can't connect buildings %u %u\n", source, target);
+        return false;
+    }
+
+    s->target = target;
+    s->out_dir = conn_dir;
+    t->in_dir = conn_dir;
+    return true;
+}
+
+// -----
+
+typedef struct {
+    game_state_t *gs;
+    const blueprint_t *bp;
+    const coord_t *positions;
+
+    uint32_t first_building;
+    uint32_t first_slot;
+    uint32_t first_data[BUILDING_TYPE_COUNT];
+    uint32_t first_data_slot[BUILDING_TYPE_COUNT];
+    uint16_t in_pos[BLUEPRINT_MAX_BUILDINGS]; // of each output edge in its target's input row
+} stamp_t;
+
+static handle_t data_handle(const stamp_t *st, size_t instance, const blueprint_building_t *bb) {
+    const uint32_t slot = st->first_data_slot[bb->type] + instance * st->bp->type_counts[bb->type] + bb->rank;
+    return (handle_t) { slot, 1 };
+}
+
+// Writes instances [begin, end). Every instance owns disjoint entity, slot
+// and edge ranges, so ranges can be stamped concurrently.
+static void stamp_range(const stamp_t *st, size_t begin, size_t end) {
+    game_state_t *gs = st->gs;
+    const blueprint_t *bp = st->bp;
+    const size_t building_count = bp->building_count;
+    flow_adjacency_t *outputs = &gs->flow_graph.outputs;
+    flow_adjacency_t *inputs = &gs->flow_graph.inputs;
+
+    for (size_t i=begin; i<end; i++) {
+        const coord_t origin = st->positions[i];
+        const uint32_t building_base = st->first_building + i * building_count;
+        const uint32_t slot_base = st->first_slot + i * building_count;
+
+        for (size_t k=0; k<building_count; k++) {
+            const blueprint_building_t *bb = bp->buildings + k;
+            const handle_t data = data_handle(st, i, bb);
+            const uint32_t data_index = st->first_data[bb->type] + i * bp->type_counts[bb->type] + bb->rank;
+            const uint32_t slot = slot_base + k;
+
+            gs->buildings[building_base + k] = (building_t) {
+                .slot = slot,
+                .pos = { origin.x + bb->offset.x, origin.y + bb->offset.y },
+                .size = bb->size,
+                .type = bb->type,
+                .data = data,
+            };
+
+            item_output_t output = {};
+            if (bb->target != BLUEPRINT_NONE) {
+                const blueprint_building_t *target = bp->buildings + bb->target;
+                output = (item_output_t) { .type = target->type, .handle = data_handle(st, i, target) };
+
+                outputs->edges[outputs->rows[slot].offset] = slot_base + bb->target;
+                inputs->edges[inputs->rows[slot_base + bb->target].offset + st->in_pos[k]] = slot;
+            }
+
+            switch (bb->type) {
+                case BUILDING_TYPE_MINER:
+                    gs->miners[data_index] = (miner_t) { .slot = data.index, .output = output };
+                    break;
+                case BUILDING_TYPE_FACTORY:
+                    gs->factories[data_index] = (factory_t) { .slot = data.index, .recipe = bb->recipe, .output = output };
+                    break;
+                case BUILDING_TYPE_BELT:
+                    gs->belts[data_index] = (belt_t) {
+                        .slot = data.index,
+                        .output = output,
+                        .in_dir = bb->in_dir,
+                        .out_dir = bb->out_dir,
+                    };
+                    break;
+            }
+        }
+    }
+}
+
+static void stamp_job(void *ctx, size_t begin, size_t end, job_worker_t *worker) {
+    (void)worker;
+    stamp_range(ctx, begin, end);
+}
+
+static bool fits_entities(size_t count, const handle_table_t *table, size_t additional) {
+    return count + additional <= MAX_ENTITY_COUNT && table->slot_count + additional <= table->capacity;
+}
+
+uint32_t stamp_blueprint(game_state_t *gs, const blueprint_t *bp, const coord_t *positions, size_t n) {
+    assert(gs);
+    assert(bp);
+    assert(positions || n == 0);
+
+    const size_t building_count = bp->building_count;
+    if (n == 0 || building_count == 0) return 0;
+
+    size_t *counts[BUILDING_TYPE_COUNT] = { &gs->miner_count, &gs->factory_count, &gs->belt_count };
+    handle_table_t *tables[BUILDING_TYPE_COUNT] = { &gs->miner_handles, &gs->factory_handles, &gs->belt_handles };
+
+    bool fits = fits_entities(gs->building_count, &gs->building_handles, n * building_count);
+    for (size_t type=0; type<BUILDING_TYPE_COUNT; type++) {
+        fits = fits && fits_entities(*counts[type], tables[type], n * bp->type_counts[type]);
+    }
+    if (!fits) {
+        printf("no room to stamp %lu copies of a blueprint\n", n);
+        return 0;
+    }
+
+    // The copies join whatever groups they land in, bring those up to date first.
+    if (gs->regions) {
+        for (size_t i=0; i<n; i++) {
+            for (size_t k=0; k<building_count; k++) {
+                const coord_t offset = bp->buildings[k].offset;
+                region_scheduler_sync(gs->regions, gs, (coord_t) { positions[i].x + offset.x, positions[i].y + offset.y });
+            }
+        }
+    }
+
+    // Reserve dense ranges and handle slots for all copies up front.
+    stamp_t st = {
+        .gs = gs,
+        .bp = bp,
+        .positions = positions,
+        .first_building = gs->building_count,
+    };
+    st.first_slot = handle_table_alloc_range(&gs->building_handles, gs->building_count, n * building_count);
+    gs->building_count += n * building_count;
+
+    for (size_t type=0; type<BUILDING_TYPE_COUNT; type++) {
+        const size_t count = n * bp->type_counts[type];
+        st.first_data[type] = *counts[type];
+        st.first_data_slot[type] = handle_table_alloc_range(tables[type], *counts[type], count);
+        *counts[type] += count;
+    }
+
+    // Flow graph rows for all copies, the edges are filled in while stamping.
+    uint16_t out_degrees[BLUEPRINT_MAX_BUILDINGS] = {};
+    uint16_t in_degrees[BLUEPRINT_MAX_BUILDINGS] = {};
+    for (size_t k=0; k<building_count; k++) {
+        const uint32_t target = bp->buildings[k].target;
+        if (target == BLUEPRINT_NONE) continue;
+        out_degrees[k] = 1;
+        st.in_pos[k] = in_degrees[target]++;
+    }
+    flow_graph_append_blocks(&gs->flow_graph, st.first_slot, building_count, n, out_degrees, in_degrees);
+
+    // On the state's job workers if it has them, like the index rebuild.
+    if (gs->jobs) job_system_reset(gs->jobs);
+    parallel_for(gs->jobs, n, STAMP_GRAIN, stamp_job, &st);
+
+    mark_all_dirty(gs);
+    return st.first_slot;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "game_state.h"
+
+// A group of buildings and connections, placed relative to an origin.
+// Footprints and connections are validated once when the blueprint is put
+// together, stamping it then writes many copies straight into the state
+// without any per-building checks.
+
+#define BLUEPRINT_MAX_BUILDINGS (64)
+#define BLUEPRINT_NONE          (UINT32_MAX)
+
+typedef struct {
+    uint32_t type;
+    coord_t offset; // from the origin
+    building_size_t size;
+    uint32_t rank;  // among the blueprint's buildings of the same type
+    uint32_t target; // building index, BLUEPRINT_NONE = no output
+    uint8_t in_dir;  // for belts, like connect_buildings() sets them
+    uint8_t out_dir;
+    uint32_t recipe; // for factories
+} blueprint_building_t;
+
+typedef struct {
+    size_t building_count;
+    blueprint_building_t buildings[BLUEPRINT_MAX_BUILDINGS];
+    size_t type_counts[BUILDING_TYPE_COUNT];
+} blueprint_t;
+
+void blueprint_init(blueprint_t *bp);
+
+// Index of the new building, BLUEPRINT_NONE if it overlaps another one.
+uint32_t blueprint_add(blueprint_t *bp, uint32_t type, coord_t offset);
+// Like connect_buildings(): replaces the source's output, fails unless adjacent.
+bool blueprint_connect(blueprint_t *bp, uint32_t source, uint32_t target);
+// Like set_factory_recipe(), factories default to RECIPE_ASSEMBLER.
+void blueprint_set_recipe(blueprint_t *bp, uint32_t factory, uint32_t recipe);
+
+// Places n copies, the i-th with its origin at positions[i]. Entities get
+// consecutive dense indices and fresh handle slots; instance i, building k
+// has the building slot first_slot + i * bp->building_count + k (generation 1).
+// Returns first_slot, 0 if the copies don't fit. With gs->jobs, ranges of
+// copies are written on the job workers.
+uint32_t stamp_blueprint(game_state_t *gs, const blueprint_t *bp, const coord_t *positions, size_t n);
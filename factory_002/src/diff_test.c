@@ -0,0 +1,687 @@
+#include "diff_test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "game_state.h"
+#include "reference.h"
+#include "recipe.h"
+#include "job_system.h"
+#include "visible_set.h"
+#include "utils.h"
+
+#define DIFF_WORLD_W      (64)
+#define DIFF_WORLD_H      (32)
+#define DIFF_MAX_OPS      (4096)
+#define DIFF_MESSAGE_SIZE (256)
+#define DIFF_INDEX_ITEMS  (4096) // into the quad tree, in DIFF_WORLD_W x DIFF_WORLD_H cells
+#define DIFF_INDEX_CHUNK_SIZE (1024) // arena chunks of the small chunk tree
+#define DIFF_VISIBLE_SIZE     (64)   // side of the block of belts the view pans across
+#define DIFF_VISIBLE_VIEW     (24)   // side of the view, cells
+#define DIFF_VISIBLE_CAPACITY (64)   // initial items of the visible set
+
+#define ENGINE_REFERENCE  (1)
+#define ENGINE_REGIONS    (2)  // region scheduler, everything in view
+#define ENGINE_LOD        (4)  // ... with nothing in view, compared after syncing
+#define ENGINE_BATCHED    (8)  // transfer queue
+#define ENGINE_JOBS       (16) // steps 1 and 4 on the job system
+
+#define DIFF_JOB_WORKERS  (4)
+
+#define OP_SPAWN          (0)
+#define OP_CONNECT        (1)
+#define OP_DELETE         (2)
+#define OP_RECIPE         (3)
+
+typedef struct {
+    const char *name;
+    uint32_t flags;
+    uint32_t oracle_flags;
+    uint64_t compare_interval; // ticks
+} diff_pair_t;
+
+static const diff_pair_t pairs[] = {
+    { "direct", 0, ENGINE_REFERENCE, 1 },
+    { "regions", ENGINE_REGIONS, ENGINE_REFERENCE, 1 },
+    { "regions lod", ENGINE_REGIONS | ENGINE_LOD, ENGINE_REFERENCE, 2 * REGION_DORMANT_INTERVAL + 3 },
+    { "batched regions", ENGINE_BATCHED | ENGINE_REGIONS, ENGINE_BATCHED, 1 },
+    { "jobs", ENGINE_JOBS, ENGINE_REFERENCE, 1 },
+};
+
+typedef struct {
+    uint64_t tick;    // applied before the update of this tick
+    uint8_t kind;     // OP_*
+    uint8_t type;     // spawned building
+    uint32_t recipe;
+    coord_t pos;
+    coord_t target;   // of a connect
+} diff_op_t;
+
+typedef struct {
+    uint32_t flags;
+    game_state_t *active;
+    game_state_t *next;
+    region_scheduler_t regions;
+    transfer_queue_t transfers;
+    job_system_t *jobs;
+} engine_t;
+
+// -----
+
+static uint64_t next_random(uint64_t *state) {
+    // splitmix64, the same sequence on every platform
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static uint32_t random_below(uint64_t *state, uint32_t n) {
+    return next_random(state) % n;
+}
+
+static coord_t random_pos(uint64_t *state) {
+    return (coord_t) { random_below(state, DIFF_WORLD_W), random_below(state, DIFF_WORLD_H) };
+}
+
+static coord_t step_dir(coord_t pos, uint32_t dir) {
+    switch (dir) {
+        case DIR_UP: pos.y--; break;
+        case DIR_DOWN: pos.y++; break;
+        case DIR_LEFT: pos.x--; break;
+        case DIR_RIGHT: pos.x++; break;
+    }
+    return pos;
+}
+
+static size_t add_op(diff_op_t *ops, size_t count, diff_op_t op) {
+    if (count < DIFF_MAX_OPS) ops[count++] = op;
+    return count;
+}
+
+// Spawns at tick 0, connects at tick 1 once they are all there, then edits.
+static size_t generate_case(uint64_t seed, uint64_t ticks, diff_op_t *ops) {
+    uint64_t rng = seed;
+    size_t count = 0;
+    diff_op_t connects[DIFF_MAX_OPS];
+    size_t connect_count = 0;
+
+    const uint32_t chains = 4 + random_below(&rng, 12);
+    for (uint32_t c=0; c<chains; c++) {
+        coord_t pos = random_pos(&rng);
+        count = add_op(ops, count, (diff_op_t) { .tick = 0, .kind = OP_SPAWN, .type = BUILDING_TYPE_MINER, .pos = pos });
+        coord_t previous = pos;
+        coord_t cursor = { pos.x + 2, pos.y };
+
+        const uint32_t length = 2 + random_below(&rng, 14);
+        for (uint32_t i=0; i<length; i++) {
+            count = add_op(ops, count, (diff_op_t) { .tick = 0, .kind = OP_SPAWN, .type = BUILDING_TYPE_BELT, .pos = cursor });
+            connect_count = add_op(connects, connect_count, (diff_op_t) { .tick = 1, .kind = OP_CONNECT, .pos = previous, .target = cursor });
+            previous = cursor;
+            const uint32_t turn = random_below(&rng, 4);
+            cursor = step_dir(cursor, turn == 0 ? DIR_UP : turn == 1 ? DIR_DOWN : DIR_RIGHT);
+        }
+
+        if (random_below(&rng, 3) != 0) {
+            count = add_op(ops, count, (diff_op_t) { .tick = 0, .kind = OP_SPAWN, .type = BUILDING_TYPE_FACTORY, .pos = cursor });
+            connect_count = add_op(connects, connect_count, (diff_op_t) { .tick = 1, .kind = OP_CONNECT, .pos = previous, .target = cursor });
+            const coord_t out = { cursor.x + 2, cursor.y };
+            count = add_op(ops, count, (diff_op_t) { .tick = 0, .kind = OP_SPAWN, .type = BUILDING_TYPE_BELT, .pos = out });
+            connect_count = add_op(connects, connect_count, (diff_op_t) { .tick = 1, .kind = OP_CONNECT, .pos = cursor, .target = out });
+        }
+    }
+    for (size_t i=0; i<connect_count; i++) count = add_op(ops, count, connects[i]);
+
+    for (uint64_t tick=2; tick<ticks; tick++) {
+        if (random_below(&rng, 6) != 0) continue;
+
+        const coord_t pos = random_pos(&rng);
+        static const uint32_t dirs[] = { DIR_UP, DIR_DOWN, DIR_LEFT, DIR_RIGHT };
+        const coord_t neighbor = step_dir(pos, dirs[random_below(&rng, ARRAY_LENGTH(dirs))]);
+        diff_op_t op = { .tick = tick, .pos = pos };
+        switch (random_below(&rng, 6)) {
+            case 0:
+            case 1:
+                op.kind = OP_SPAWN;
+                op.type = random_below(&rng, 4) ? BUILDING_TYPE_BELT : random_below(&rng, BUILDING_TYPE_BELT);
+                break;
+            case 2:
+                op.kind = OP_DELETE;
+                break;
+            case 3:
+                op.kind = OP_RECIPE;
+                op.recipe = random_below(&rng, 4);
+                break;
+            default:
+                op.kind = OP_CONNECT;
+                op.target = neighbor;
+                break;
+        }
+        count = add_op(ops, count, op);
+    }
+    return count;
+}
+
+// -----
+
+static bool cells_free(game_state_t *gs, coord_t pos, building_size_t size) {
+    for (int32_t y=pos.y; y<pos.y+size.h; y++) {
+        for (int32_t x=pos.x; x<pos.x+size.w; x++) {
+            if (!handle_is_none(get_building(gs, (coord_t) { x, y }))) return false;
+        }
+    }
+    return true;
+}
+
+// Edits through the public API, skipping the ones that would be refused.
+static void apply_op(game_state_t *gs, const diff_op_t *op) {
+    switch (op->kind) {
+        case OP_SPAWN:
+            if (!cells_free(gs, op->pos, get_building_size(op->type))) return;
+            switch (op->type) {
+                case BUILDING_TYPE_MINER: spawn_miner(gs, op->pos); break;
+                case BUILDING_TYPE_FACTORY: spawn_factory(gs, op->pos); break;
+                case BUILDING_TYPE_BELT: spawn_belt(gs, op->pos); break;
+            }
+            break;
+
+        case OP_CONNECT:
+            {
+                const handle_t source = get_building(gs, op->pos);
+                const handle_t target = get_building(gs, op->target);
+                if (handle_is_none(source) || handle_is_none(target) || handle_equals(source, target)) return;
+                const size_t source_id = get_building_index(gs, source);
+                const size_t target_id = get_building_index(gs, target);
+                if (!buildings_adjacent(gs->buildings + source_id, gs->buildings + target_id, NULL)) return;
+                connect_buildings(gs, source, target);
+            }
+            break;
+
+        case OP_DELETE:
+            {
+                const handle_t building = get_building(gs, op->pos);
+                if (!handle_is_none(building)) delete_building(gs, building);
+            }
+            break;
+
+        case OP_RECIPE:
+            set_factory_recipe(gs, get_building(gs, op->pos), op->recipe % recipe_count);
+            break;
+    }
+}
+
+static void print_op(const diff_op_t *op) {
+    static const char *type_names[BUILDING_TYPE_COUNT] = { "miner", "factory", "belt" };
+    switch (op->kind) {
+        case OP_SPAWN: printf("  tick %4lu: spawn %s at %d,%d\n", op->tick, type_names[op->type], op->pos.x, op->pos.y); break;
+        case OP_CONNECT: printf("  tick %4lu: connect %d,%d -> %d,%d\n", op->tick, op->pos.x, op->pos.y, op->target.x, op->target.y); break;
+        case OP_DELETE: printf("  tick %4lu: delete at %d,%d\n", op->tick, op->pos.x, op->pos.y); break;
+        case OP_RECIPE: printf("  tick %4lu: recipe %u at %d,%d\n", op->tick, op->recipe, op->pos.x, op->pos.y); break;
+    }
+}
+
+// -----
+
+static void engine_init(engine_t *e, uint32_t flags) {
+    memset(e, 0, sizeof(engine_t));
+    e->flags = flags;
+    e->active = create_game_state();
+    e->next = create_game_state();
+
+    if (flags & ENGINE_REGIONS) {
+        region_scheduler_init(&e->regions);
+        e->regions.lod_enabled = true;
+        const quad_aabb_t nothing = { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN };
+        const quad_aabb_t everything = { -DIFF_WORLD_W, -DIFF_WORLD_H, 2 * DIFF_WORLD_W, 2 * DIFF_WORLD_H };
+        region_scheduler_set_view(&e->regions, (flags & ENGINE_LOD) ? nothing : everything);
+        e->active->regions = &e->regions;
+    }
+    if (flags & ENGINE_BATCHED) {
+        transfer_queue_init(&e->transfers);
+        e->active->transfers = &e->transfers;
+    }
+    if (flags & ENGINE_JOBS) {
+        e->jobs = job_system_create(DIFF_JOB_WORKERS);
+        e->active->jobs = e->jobs;
+    }
+}
+
+static void engine_free(engine_t *e) {
+    destroy_game_state(e->active);
+    destroy_game_state(e->next);
+    if (e->flags & ENGINE_REGIONS) region_scheduler_free(&e->regions);
+    if (e->flags & ENGINE_BATCHED) transfer_queue_free(&e->transfers);
+    if (e->flags & ENGINE_JOBS) job_system_destroy(e->jobs);
+}
+
+static void engine_step(engine_t *e) {
+    if (e->flags & ENGINE_REFERENCE) {
+        reference_update(e->active, e->next);
+    } else {
+        update_game_state(e->active, e->next);
+    }
+    game_state_t *t = e->active;
+    e->active = e->next;
+    e->next = t;
+}
+
+// Brings every group up to the current tick.
+static void engine_sync(engine_t *e) {
+    if (!(e->flags & ENGINE_REGIONS)) return;
+    for (size_t i=1; i<e->active->building_count; i++) {
+        region_scheduler_sync(&e->regions, e->active, e->active->buildings[i].pos);
+    }
+}
+
+// -----
+
+static bool outputs_equal(item_output_t a, item_output_t b) {
+    return a.type == b.type && handle_equals(a.handle, b.handle);
+}
+
+static bool handles_equal(const handle_table_t *a, const handle_table_t *b) {
+    if (a->slot_count != b->slot_count || a->free_head != b->free_head) return false;
+    for (size_t i=0; i<a->slot_count; i++) {
+        if (a->slots[i].dense != b->slots[i].dense || a->slots[i].generation != b->slots[i].generation) return false;
+    }
+    return true;
+}
+
+#define DIFFER(...) do { snprintf(message, DIFF_MESSAGE_SIZE, __VA_ARGS__); return false; } while (0)
+
+static bool quad_nodes_equal(const quad_node_t *a, const quad_node_t *b, char *message) {
+    if (memcmp(&a->bounds, &b->bounds, sizeof(quad_aabb_t)) || memcmp(&a->stats, &b->stats, sizeof(quad_stats_t)) ||
+            a->item_count != b->item_count || (a->item_count && memcmp(a->items, b->items, sizeof(size_t) * a->item_count))) {
+        DIFFER("quad node %d,%d %dx%d", a->bounds.x_min, a->bounds.y_min,
+                a->bounds.x_max - a->bounds.x_min, a->bounds.y_max - a->bounds.y_min);
+    }
+    for (size_t i=0; i<ARRAY_LENGTH(a->children); i++) {
+        if (!a->children[i] != !b->children[i]) DIFFER("quad node %d,%d child %lu", a->bounds.x_min, a->bounds.y_min, i);
+        if (a->children[i] && !quad_nodes_equal(a->children[i], b->children[i], message)) return false;
+    }
+    return true;
+}
+
+// Field by field, padding may differ. The quad trees only with index, stats
+// of dormant entities lag until they are synced.
+static bool states_equal(const game_state_t *a, const game_state_t *b, bool index, char *message) {
+    if (a->tick != b->tick) DIFFER("tick %lu vs %lu", a->tick, b->tick);
+    if (a->building_count != b->building_count) DIFFER("%lu vs %lu buildings", a->building_count, b->building_count);
+    if (a->miner_count != b->miner_count) DIFFER("%lu vs %lu miners", a->miner_count, b->miner_count);
+    if (a->factory_count != b->factory_count) DIFFER("%lu vs %lu factories", a->factory_count, b->factory_count);
+    if (a->belt_count != b->belt_count) DIFFER("%lu vs %lu belts", a->belt_count, b->belt_count);
+
+    for (size_t i=1; i<a->building_count; i++) {
+        const building_t *x = a->buildings + i, *y = b->buildings + i;
+        if (x->flags != y->flags || x->slot != y->slot || x->pos.x != y->pos.x || x->pos.y != y->pos.y ||
+                x->type != y->type || !handle_equals(x->data, y->data)) {
+            DIFFER("building %lu at %d,%d", i, x->pos.x, x->pos.y);
+        }
+    }
+    for (size_t i=1; i<a->miner_count; i++) {
+        const miner_t *x = a->miners + i, *y = b->miners + i;
+        if (x->flags != y->flags || x->slot != y->slot || x->work != y->work || x->state != y->state ||
+                x->next_item != y->next_item || !outputs_equal(x->output, y->output)) {
+            DIFFER("miner %lu: state %u/%u, work %u/%u, next item %u/%u", i, x->state, y->state,
+                    x->work, y->work, x->next_item, y->next_item);
+        }
+    }
+    for (size_t i=1; i<a->factory_count; i++) {
+        const factory_t *x = a->factories + i, *y = b->factories + i;
+        if (x->flags != y->flags || x->slot != y->slot || x->work != y->work || x->recipe != y->recipe ||
+                x->state != y->state || x->pending != y->pending || x->counts != y->counts ||
+                !outputs_equal(x->output, y->output)) {
+            DIFFER("factory %lu: state %u/%u, work %u/%u, counts %08x/%08x", i, x->state, y->state,
+                    x->work, y->work, x->counts, y->counts);
+        }
+    }
+    for (size_t i=1; i<a->belt_count; i++) {
+        const belt_t *x = a->belts + i, *y = b->belts + i;
+        if (x->flags != y->flags || x->slot != y->slot || memcmp(x->items, y->items, BELT_ITEM_COUNT) ||
+                memcmp(x->works, y->works, BELT_ITEM_COUNT) || !outputs_equal(x->output, y->output) ||
+                x->in_dir != y->in_dir || x->out_dir != y->out_dir) {
+            DIFFER("belt %lu: items %u %u %u %u / %u %u %u %u, works %u %u %u %u / %u %u %u %u", i,
+                    x->items[0], x->items[1], x->items[2], x->items[3], y->items[0], y->items[1], y->items[2], y->items[3],
+                    x->works[0], x->works[1], x->works[2], x->works[3], y->works[0], y->works[1], y->works[2], y->works[3]);
+        }
+    }
+
+    if (!handles_equal(&a->building_handles, &b->building_handles)) DIFFER("building handles");
+    if (!handles_equal(&a->miner_handles, &b->miner_handles)) DIFFER("miner handles");
+    if (!handles_equal(&a->factory_handles, &b->factory_handles)) DIFFER("factory handles");
+    if (!handles_equal(&a->belt_handles, &b->belt_handles)) DIFFER("belt handles");
+
+    for (uint32_t slot=1; slot<a->building_handles.slot_count; slot++) {
+        const uint32_t *x, *y;
+        size_t n = flow_graph_outputs(&a->flow_graph, slot, &x);
+        if (n != flow_graph_outputs(&b->flow_graph, slot, &y) || (n && memcmp(x, y, sizeof(uint32_t) * n))) {
+            DIFFER("flow graph outputs of slot %u", slot);
+        }
+        n = flow_graph_inputs(&a->flow_graph, slot, &x);
+        if (n != flow_graph_inputs(&b->flow_graph, slot, &y) || (n && memcmp(x, y, sizeof(uint32_t) * n))) {
+            DIFFER("flow graph inputs of slot %u", slot);
+        }
+    }
+
+    if (index && a->spatial_index == SPATIAL_INDEX_QUAD_TREE && b->spatial_index == SPATIAL_INDEX_QUAD_TREE) {
+        return quad_nodes_equal(a->quad_tree->root, b->quad_tree->root, message);
+    }
+    return true;
+}
+
+// -----
+
+static int compare_items(const void *a, const void *b) {
+    const size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+// The quad tree on its own: random items, several per cell, inserted one by
+// one. Queries return exactly the items in their bounds, a bulk build gives
+// the same tree, a rebuild after a reset reuses the arena, and outgrown item
+// arrays are reused from the free lists.
+static bool index_case(uint64_t seed, char *message) {
+    uint64_t random = seed;
+    quad_build_item_t *items = malloc(sizeof(quad_build_item_t) * DIFF_INDEX_ITEMS);
+    size_t *found = malloc(sizeof(size_t) * DIFF_INDEX_ITEMS);
+    size_t *expected = malloc(sizeof(size_t) * DIFF_INDEX_ITEMS);
+    assert(items && found && expected);
+    for (size_t i=0; i<DIFF_INDEX_ITEMS; i++) {
+        items[i] = (quad_build_item_t) { .pos = random_pos(&random), .item = i + 1 };
+        items[i].stats.type_counts[random_below(&random, QUAD_STATS_TYPE_COUNT)] = 1;
+        items[i].stats.item_count = 1;
+    }
+
+    quad_tree_t *tree = quad_tree_create();
+    quad_tree_t *built = quad_tree_create();
+    bool passed = false;
+
+    quad_tree_reset(tree);
+    for (size_t i=0; i<DIFF_INDEX_ITEMS; i++) quad_tree_insert(tree, items[i].pos, items[i].item, &items[i].stats);
+    if (tree->root->stats.item_count != DIFF_INDEX_ITEMS) {
+        snprintf(message, DIFF_MESSAGE_SIZE, "index: root counts %u items", tree->root->stats.item_count);
+        goto done;
+    }
+
+    for (size_t q=0; q<64; q++) {
+        const coord_t a = random_pos(&random), b = random_pos(&random);
+        const quad_aabb_t bounds = {
+            a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y, a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y,
+        };
+        quad_tree_query_result_t result = { .capacity = DIFF_INDEX_ITEMS, .count = 0, .items = found };
+        quad_tree_query(tree, bounds, &result);
+        size_t count = 0;
+        for (size_t i=0; i<DIFF_INDEX_ITEMS; i++) {
+            // The cell [pos, pos + 1] touches the bounds.
+            const coord_t p = items[i].pos;
+            if (p.x + 1 >= bounds.x_min && p.x <= bounds.x_max && p.y + 1 >= bounds.y_min && p.y <= bounds.y_max) {
+                expected[count++] = items[i].item;
+            }
+        }
+        qsort(found, result.count, sizeof(size_t), compare_items);
+        if (result.count != count || memcmp(found, expected, sizeof(size_t) * count)) {
+            snprintf(message, DIFF_MESSAGE_SIZE, "index: query %d,%d..%d,%d finds %lu of %lu items",
+                    bounds.x_min, bounds.y_min, bounds.x_max, bounds.y_max, result.count, count);
+            goto done;
+        }
+    }
+
+    quad_tree_reset(built);
+    quad_tree_build(built, items, DIFF_INDEX_ITEMS, NULL);
+    if (!quad_nodes_equal(tree->root, built->root, message)) goto done;
+
+    const quad_arena_stats_t first = tree->arena_stats;
+    quad_tree_reset(tree);
+    for (size_t i=0; i<DIFF_INDEX_ITEMS; i++) quad_tree_insert(tree, items[i].pos, items[i].item, &items[i].stats);
+    const quad_arena_stats_t again = tree->arena_stats;
+    if (again.reserved != first.reserved || again.used != first.used || again.node_count != first.node_count) {
+        snprintf(message, DIFF_MESSAGE_SIZE, "index: rebuild uses %lu of %lu bytes reserved, was %lu of %lu",
+                again.used, again.reserved, first.used, first.reserved);
+        goto done;
+    }
+
+    // A second cell grown as far as the fullest one so far pops each of its
+    // outgrown arrays from the list the other one left and pushes its own.
+    const coord_t empty = { -DIFF_WORLD_W, -DIFF_WORLD_H };
+    const size_t free_listed = again.free_listed;
+    for (size_t i=0; i<DIFF_INDEX_ITEMS; i++) quad_tree_insert(tree, empty, DIFF_INDEX_ITEMS + i + 1, NULL);
+    const size_t grown = tree->arena_stats.free_listed - free_listed;
+    for (size_t i=0; i<DIFF_INDEX_ITEMS; i++) quad_tree_insert(tree, (coord_t) { empty.x + 1, empty.y }, 2 * DIFF_INDEX_ITEMS + i + 1, NULL);
+    if (tree->arena_stats.free_listed - free_listed != grown) {
+        snprintf(message, DIFF_MESSAGE_SIZE, "index: free lists went from %lu to %lu bytes, outgrown arrays not reused",
+                free_listed + grown, tree->arena_stats.free_listed);
+        goto done;
+    }
+
+    // Tiny chunks: the arena spreads over more page_alloc() blocks than a
+    // fixed table would hold, and still gives the same tree.
+    quad_tree_destroy(built);
+    built = quad_tree_create();
+    built->chunk_size = DIFF_INDEX_CHUNK_SIZE;
+    quad_tree_reset(built);
+    for (size_t i=0; i<DIFF_INDEX_ITEMS; i++) quad_tree_insert(built, items[i].pos, items[i].item, &items[i].stats);
+    quad_tree_reset(tree);
+    for (size_t i=0; i<DIFF_INDEX_ITEMS; i++) quad_tree_insert(tree, items[i].pos, items[i].item, &items[i].stats);
+    if (built->chunk_count <= 256) {
+        snprintf(message, DIFF_MESSAGE_SIZE, "index: %lu chunks of %d bytes", built->chunk_count, DIFF_INDEX_CHUNK_SIZE);
+        goto done;
+    }
+    if (!quad_nodes_equal(tree->root, built->root, message)) goto done;
+    passed = true;
+
+done:
+    quad_tree_destroy(tree);
+    quad_tree_destroy(built);
+    free(items);
+    free(found);
+    free(expected);
+    return passed;
+}
+
+// The visible set on its own: a view pans from empty space across a block of
+// belts, every cell taken, in steps that expose strips of more buildings than
+// its initial capacity. After every step it holds exactly the buildings a
+// full query finds.
+static bool visible_case(uint64_t seed, char *message) {
+    uint64_t random = seed;
+    game_state_t *gs = create_game_state();
+    gs->spatial_index = (seed & 1) ? SPATIAL_INDEX_LINEAR : SPATIAL_INDEX_QUAD_TREE;
+    for (int32_t y=0; y<DIFF_VISIBLE_SIZE; y++) {
+        for (int32_t x=0; x<DIFF_VISIBLE_SIZE; x++) spawn_belt(gs, (coord_t) { x, y });
+    }
+    rebuild_spatial_index(gs);
+
+    visible_set_t vs;
+    visible_set_init(&vs, DIFF_VISIBLE_CAPACITY);
+    size_t *found = malloc(sizeof(size_t) * gs->building_count);
+    size_t *expected = malloc(sizeof(size_t) * gs->building_count);
+    assert(found && expected);
+    bool passed = false;
+
+    int32_t x = -DIFF_VISIBLE_VIEW - 8;
+    int32_t y = (DIFF_VISIBLE_SIZE - DIFF_VISIBLE_VIEW) / 2;
+    for (size_t step=0; x<DIFF_VISIBLE_SIZE + 8; step++) {
+        const quad_aabb_t bounds = { x, y, x + DIFF_VISIBLE_VIEW - 1, y + DIFF_VISIBLE_VIEW - 1 };
+        visible_set_update(&vs, gs, bounds);
+        if (step > 0 && vs.last_update != VISIBLE_SET_INCREMENTAL) {
+            snprintf(message, DIFF_MESSAGE_SIZE, "visible: pan %lu not incremental", step);
+            goto done;
+        }
+
+        size_t count = 0;
+        for (size_t i=1; i<gs->building_count; i++) {
+            // The cell [pos, pos + 1] touches the bounds.
+            const coord_t p = gs->buildings[i].pos;
+            if (p.x + 1 >= bounds.x_min && p.x <= bounds.x_max && p.y + 1 >= bounds.y_min && p.y <= bounds.y_max) {
+                expected[count++] = i;
+            }
+        }
+        memcpy(found, vs.items, sizeof(size_t) * vs.count);
+        qsort(found, vs.count, sizeof(size_t), compare_items);
+        if (vs.count != count || memcmp(found, expected, sizeof(size_t) * count)) {
+            snprintf(message, DIFF_MESSAGE_SIZE, "visible: pan %lu to %d,%d holds %lu of %lu buildings",
+                    step, x, y, vs.count, count);
+            goto done;
+        }
+
+        x += 1 + random_below(&random, 8);
+        y += (int32_t)random_below(&random, 5) - 2;
+    }
+    passed = true;
+
+done:
+    visible_set_free(&vs);
+    destroy_game_state(gs);
+    free(found);
+    free(expected);
+    return passed;
+}
+
+// Runs ticks ticks of the ops (sorted by tick), false with the first tick
+// that differs and what differs.
+static bool run_case(const diff_pair_t *pair, const diff_op_t *ops, size_t op_count, uint64_t ticks,
+        uint64_t *fail_tick, char *message) {
+    engine_t oracle, engine;
+    engine_init(&oracle, pair->oracle_flags);
+    engine_init(&engine, pair->flags);
+
+    bool passed = true;
+    size_t next_op = 0;
+    for (uint64_t tick=0; tick<ticks; tick++) {
+        for (; next_op<op_count && ops[next_op].tick == tick; next_op++) {
+            apply_op(oracle.active, ops + next_op);
+            apply_op(engine.active, ops + next_op);
+        }
+        engine_step(&oracle);
+        engine_step(&engine);
+
+        if ((tick + 1) % pair->compare_interval == 0 || tick + 1 == ticks) {
+            engine_sync(&engine);
+            if (!states_equal(oracle.active, engine.active, !(pair->flags & ENGINE_LOD), message)) {
+                *fail_tick = tick + 1;
+                passed = false;
+                break;
+            }
+        }
+    }
+
+    engine_free(&oracle);
+    engine_free(&engine);
+    return passed;
+}
+
+// Drops chunks of ops, halving the chunk size when none can go, and cuts
+// the ticks after the first difference. Returns the op count left.
+static size_t shrink_case(const diff_pair_t *pair, diff_op_t *ops, size_t op_count, uint64_t *ticks, char *message) {
+    diff_op_t *candidate = malloc(sizeof(diff_op_t) * DIFF_MAX_OPS);
+    assert(candidate);
+    char candidate_message[DIFF_MESSAGE_SIZE];
+
+    size_t chunk = op_count / 2;
+    while (chunk > 0) {
+        bool removed = false;
+        for (size_t start=0; start<op_count; ) {
+            const size_t n = (start + chunk < op_count) ? chunk : op_count - start;
+            memcpy(candidate, ops, sizeof(diff_op_t) * start);
+            memcpy(candidate + start, ops + start + n, sizeof(diff_op_t) * (op_count - start - n));
+
+            uint64_t fail_tick;
+            if (!run_case(pair, candidate, op_count - n, *ticks, &fail_tick, candidate_message)) {
+                op_count -= n;
+                memcpy(ops, candidate, sizeof(diff_op_t) * op_count);
+                memcpy(message, candidate_message, DIFF_MESSAGE_SIZE);
+                *ticks = fail_tick;
+                while (op_count && ops[op_count - 1].tick >= *ticks) op_count--;
+                removed = true;
+            } else {
+                start += n;
+            }
+        }
+        if (!removed) chunk /= 2;
+        else if (chunk > op_count / 2) chunk = op_count / 2;
+    }
+
+    free(candidate);
+    return op_count;
+}
+
+// Update timings and refused edits go to stdout, not wanted in between
+// the results.
+static int quiet_begin() {
+    fflush(stdout);
+    const int saved = dup(STDOUT_FILENO);
+    const int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    return saved;
+}
+
+static void quiet_end(int saved) {
+    fflush(stdout);
+    if (saved < 0) return;
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+bool diff_test_run(uint64_t first_seed, size_t seed_count, uint64_t ticks) {
+    recipes_init();
+    diff_op_t *ops = malloc(sizeof(diff_op_t) * DIFF_MAX_OPS);
+    assert(ops);
+    char message[DIFF_MESSAGE_SIZE];
+
+    size_t failures = 0;
+    const double start = get_time_ms();
+    for (uint64_t seed=first_seed; seed<first_seed + seed_count; seed++) {
+        if (!index_case(seed, message)) {
+            failures++;
+            printf("seed %lu: %s\n", seed, message);
+        }
+        // Growing the set overflows queries, which print.
+        int saved = quiet_begin();
+        const bool visible_passed = visible_case(seed, message);
+        quiet_end(saved);
+        if (!visible_passed) {
+            failures++;
+            printf("seed %lu: %s\n", seed, message);
+        }
+
+        const size_t op_count = generate_case(seed, ticks, ops);
+
+        for (size_t p=0; p<ARRAY_LENGTH(pairs); p++) {
+            const diff_pair_t *pair = pairs + p;
+
+            saved = quiet_begin();
+            uint64_t fail_tick;
+            const bool passed = run_case(pair, ops, op_count, ticks, &fail_tick, message);
+            quiet_end(saved);
+            if (passed) continue;
+
+            failures++;
+            printf("seed %lu, %s: differs at tick %lu: %s\n", seed, pair->name, fail_tick, message);
+
+            // Shrinking changes the ops, work on a copy.
+            diff_op_t *shrunk = malloc(sizeof(diff_op_t) * DIFF_MAX_OPS);
+            assert(shrunk);
+            memcpy(shrunk, ops, sizeof(diff_op_t) * op_count);
+            uint64_t shrunk_ticks = fail_tick;
+            saved = quiet_begin();
+            const size_t shrunk_count = shrink_case(pair, shrunk, op_count, &shrunk_ticks, message);
+            quiet_end(saved);
+
+            printf("  shrunk to %lu of %lu edits, %lu ticks: %s\n", shrunk_count, op_count, shrunk_ticks, message);
+            for (size_t i=0; i<shrunk_count; i++) print_op(shrunk + i);
+            free(shrunk);
+        }
+    }
+
+    printf("diff test: %lu seeds x %lu engines, %lu ticks each, %lu failures (%.1f s)\n", seed_count,
+            ARRAY_LENGTH(pairs), ticks, failures, (get_time_ms() - start) / 1000.0);
+    free(ops);
+    return failures == 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Differential testing of the update engines. Every seed generates a small
+// random world (miners feeding belt chains into factories) and a random
+// sequence of edits (spawn, connect, delete, recipe changes). Each engine
+// runs the case in lockstep with its oracle, both getting the same edits,
+// and the full live state (entities, handles, flow graph) is compared after
+// every tick.
+//
+// The oracle is reference_update() (reference.h), except for engines with
+// batched transfers, which change the rules: they are checked against the
+// plain batched sweep. A failing case is shrunk by dropping edits and ticks
+// while it still fails, and printed as a list of edits.
+//
+// Every seed also checks the quad tree on its own: queries against the
+// inserted set, bulk build against inserts, and reuse of the arena after a
+// reset and of outgrown item arrays from the free lists, and an arena of
+// hundreds of small chunks. It also pans a visible set across a block of
+// buildings larger than its initial capacity.
+
+// Runs seeds [first_seed, first_seed + seed_count), true if all pass.
+bool diff_test_run(uint64_t first_seed, size_t seed_count, uint64_t ticks);
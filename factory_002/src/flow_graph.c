@@ -0,0 +1,263 @@
+#include "flow_graph.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#define MIN_ROW_CAPACITY (2)
+
+static void adjacency_free(flow_adjacency_t *adj) {
+    free(adj->rows);
+    free(adj->edges);
+    memset(adj, 0, sizeof(flow_adjacency_t));
+}
+
+static void adjacency_copy(flow_adjacency_t *dst, const flow_adjacency_t *src) {
+    if (dst->row_capacity < src->row_capacity) {
+        dst->rows = realloc(dst->rows, sizeof(flow_row_t) * src->row_capacity);
+        assert(dst->rows);
+    }
+    if (dst->edge_capacity < src->edge_capacity) {
+        dst->edges = realloc(dst->edges, sizeof(uint32_t) * src->edge_capacity);
+        assert(dst->edges);
+    }
+    dst->row_capacity = src->row_capacity;
+    dst->edge_capacity = src->edge_capacity;
+    dst->edge_end = src->edge_end;
+    dst->edge_count = src->edge_count;
+
+    if (src->row_capacity) memcpy(dst->rows, src->rows, sizeof(flow_row_t) * src->row_capacity);
+    if (src->edge_end) memcpy(dst->edges, src->edges, sizeof(uint32_t) * src->edge_end);
+}
+
+static void ensure_row(flow_adjacency_t *adj, uint32_t node) {
+    if (node < adj->row_capacity) return;
+
+    size_t new_capacity = adj->row_capacity ? adj->row_capacity : 1024;
+    while (new_capacity <= node) new_capacity *= 2;
+
+    adj->rows = realloc(adj->rows, sizeof(flow_row_t) * new_capacity);
+    assert(adj->rows);
+    memset(adj->rows + adj->row_capacity, 0, sizeof(flow_row_t) * (new_capacity - adj->row_capacity));
+    adj->row_capacity = new_capacity;
+}
+
+static void compact(flow_adjacency_t *adj, size_t min_free) {
+    // Rows back in node order, each with its live edges plus one spare.
+    size_t needed = min_free;
+    for (size_t node=0; node<adj->row_capacity; node++) {
+        const flow_row_t *row = adj->rows + node;
+        if (row->count) needed += row->count + 1;
+    }
+
+    size_t new_capacity = adj->edge_capacity ? adj->edge_capacity : 4096;
+    while (new_capacity < needed * 2) new_capacity *= 2;
+
+    uint32_t *new_edges = malloc(sizeof(uint32_t) * new_capacity);
+    assert(new_edges);
+
+    size_t end = 0;
+    for (size_t node=0; node<adj->row_capacity; node++) {
+        flow_row_t *row = adj->rows + node;
+        if (!row->count) {
+            *row = (flow_row_t) {};
+            continue;
+        }
+        memcpy(new_edges + end, adj->edges + row->offset, sizeof(uint32_t) * row->count);
+        row->offset = end;
+        row->capacity = row->count + 1;
+        end += row->capacity;
+    }
+
+    free(adj->edges);
+    adj->edges = new_edges;
+    adj->edge_capacity = new_capacity;
+    adj->edge_end = end;
+}
+
+static void adjacency_add(flow_adjacency_t *adj, uint32_t node, uint32_t neighbor) {
+    ensure_row(adj, node);
+    flow_row_t *row = adj->rows + node;
+
+    if (row->count == row->capacity) {
+        assert(row->capacity < UINT16_MAX / 2);
+        const size_t new_row_capacity = row->capacity ? row->capacity * 2 : MIN_ROW_CAPACITY;
+
+        if (adj->edge_end + new_row_capacity > adj->edge_capacity) {
+            compact(adj, new_row_capacity);
+        }
+
+        // Compaction leaves a spare slot in non-empty rows, otherwise move the
+        // row to the end. Its old space is abandoned until the next compaction.
+        if (row->count == row->capacity) {
+            memcpy(adj->edges + adj->edge_end, adj->edges + row->offset, sizeof(uint32_t) * row->count);
+            row->offset = adj->edge_end;
+            row->capacity = new_row_capacity;
+            adj->edge_end += new_row_capacity;
+        }
+    }
+
+    adj->edges[row->offset + row->count++] = neighbor;
+    adj->edge_count++;
+}
+
+static bool adjacency_remove(flow_adjacency_t *adj, uint32_t node, uint32_t neighbor) {
+    if (node >= adj->row_capacity) return false;
+    flow_row_t *row = adj->rows + node;
+    uint32_t *edges = adj->edges + row->offset;
+
+    for (size_t i=0; i<row->count; i++) {
+        if (edges[i] == neighbor) {
+            edges[i] = edges[--row->count];
+            adj->edge_count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void adjacency_append_blocks(flow_adjacency_t *adj, uint32_t first_node, size_t block_size,
+        size_t block_count, const uint16_t *degrees) {
+    size_t block_edges = 0;
+    for (size_t k=0; k<block_size; k++) block_edges += degrees[k];
+    const size_t total = block_edges * block_count;
+
+    ensure_row(adj, first_node + block_size * block_count - 1);
+    if (adj->edge_end + total > adj->edge_capacity) {
+        compact(adj, total);
+    }
+
+    size_t offset = adj->edge_end;
+    flow_row_t *row = adj->rows + first_node;
+    for (size_t b=0; b<block_count; b++) {
+        for (size_t k=0; k<block_size; k++, row++) {
+            assert(row->count == 0);
+            *row = (flow_row_t) { .offset = offset, .count = degrees[k], .capacity = degrees[k] };
+            offset += degrees[k];
+        }
+    }
+    adj->edge_end = offset;
+    adj->edge_count += total;
+}
+
+static size_t adjacency_get(const flow_adjacency_t *adj, uint32_t node, const uint32_t **nodes) {
+    if (node >= adj->row_capacity) {
+        *nodes = NULL;
+        return 0;
+    }
+    const flow_row_t *row = adj->rows + node;
+    *nodes = adj->edges + row->offset;
+    return row->count;
+}
+
+// -----
+
+void flow_graph_init(flow_graph_t *graph) {
+    assert(graph);
+    memset(graph, 0, sizeof(flow_graph_t));
+}
+
+void flow_graph_free(flow_graph_t *graph) {
+    assert(graph);
+    adjacency_free(&graph->outputs);
+    adjacency_free(&graph->inputs);
+    graph->version = 0;
+}
+
+void flow_graph_copy(flow_graph_t *dst, const flow_graph_t *src) {
+    assert(dst);
+    assert(src);
+    adjacency_copy(&dst->outputs, &src->outputs);
+    adjacency_copy(&dst->inputs, &src->inputs);
+    dst->version = src->version;
+}
+
+void flow_graph_touch(flow_graph_t *graph, uint32_t node) {
+    assert(graph);
+    if (graph->touched_count < FLOW_GRAPH_MAX_TOUCHED) {
+        graph->touched[graph->touched_count++] = node;
+    }
+    graph->touches++;
+}
+
+void flow_graph_touch_range(flow_graph_t *graph, uint32_t first_node, size_t count) {
+    assert(graph);
+    for (size_t i=0; i<count && graph->touched_count < FLOW_GRAPH_MAX_TOUCHED; i++) {
+        graph->touched[graph->touched_count++] = first_node + i;
+    }
+    graph->touches += count;
+}
+
+void flow_graph_clear_touched(flow_graph_t *graph) {
+    assert(graph);
+    graph->touched_since = graph->touches;
+    graph->touched_count = 0;
+}
+
+void flow_graph_add_edge(flow_graph_t *graph, uint32_t source, uint32_t target) {
+    assert(graph);
+    adjacency_add(&graph->outputs, source, target);
+    adjacency_add(&graph->inputs, target, source);
+    flow_graph_touch(graph, source);
+    flow_graph_touch(graph, target);
+    graph->version++;
+}
+
+void flow_graph_remove_edge(flow_graph_t *graph, uint32_t source, uint32_t target) {
+    assert(graph);
+    if (adjacency_remove(&graph->outputs, source, target)) {
+        bool found = adjacency_remove(&graph->inputs, target, source);
+        assert(found);
+        flow_graph_touch(graph, source);
+        flow_graph_touch(graph, target);
+        graph->version++;
+    }
+}
+
+void flow_graph_clear_outputs(flow_graph_t *graph, uint32_t node) {
+    assert(graph);
+
+    const uint32_t *targets;
+    size_t count;
+    while ((count = flow_graph_outputs(graph, node, &targets))) {
+        flow_graph_remove_edge(graph, node, targets[count - 1]);
+    }
+}
+
+void flow_graph_remove_node(flow_graph_t *graph, uint32_t node) {
+    assert(graph);
+
+    flow_graph_clear_outputs(graph, node);
+
+    const uint32_t *sources;
+    size_t count;
+    while ((count = flow_graph_inputs(graph, node, &sources))) {
+        flow_graph_remove_edge(graph, sources[count - 1], node);
+    }
+}
+
+void flow_graph_append_blocks(flow_graph_t *graph, uint32_t first_node, size_t block_size, size_t block_count,
+        const uint16_t *out_degrees, const uint16_t *in_degrees) {
+    assert(graph);
+    assert(out_degrees);
+    assert(in_degrees);
+    if (block_size == 0 || block_count == 0) return;
+
+    adjacency_append_blocks(&graph->outputs, first_node, block_size, block_count, out_degrees);
+    adjacency_append_blocks(&graph->inputs, first_node, block_size, block_count, in_degrees);
+    flow_graph_touch_range(graph, first_node, block_size * block_count);
+    graph->version++;
+}
+
+size_t flow_graph_outputs(const flow_graph_t *graph, uint32_t node, const uint32_t **nodes) {
+    assert(graph);
+    assert(nodes);
+    return adjacency_get(&graph->outputs, node, nodes);
+}
+
+size_t flow_graph_inputs(const flow_graph_t *graph, uint32_t node, const uint32_t **nodes) {
+    assert(graph);
+    assert(nodes);
+    return adjacency_get(&graph->inputs, node, nodes);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Item-flow graph between buildings, forward (outputs) and reverse (inputs).
+// Nodes are building handle slots, which survive compaction, so the graph
+// is only touched by edits.
+//
+// Each direction is a CSR-like edge array with slack: every node owns a row
+// of edges with some spare capacity. A row that outgrows its capacity moves
+// to the end of the array; once the abandoned space exceeds the live edges
+// the array is compacted back into node order.
+
+typedef struct {
+    uint32_t offset;
+    uint16_t count;
+    uint16_t capacity;
+} flow_row_t;
+
+typedef struct {
+    size_t row_capacity;
+    flow_row_t *rows;   // by node
+
+    size_t edge_capacity;
+    size_t edge_end;    // rows live in [0, edge_end), including abandoned space
+    size_t edge_count;  // live edges
+    uint32_t *edges;    // neighbor nodes
+} flow_adjacency_t;
+
+#define FLOW_GRAPH_MAX_TOUCHED (1024)
+
+typedef struct {
+    flow_adjacency_t outputs;
+    flow_adjacency_t inputs;
+    uint64_t version; // bumped by every change
+
+    // Nodes whose edges changed, or that were added or removed, this tick.
+    // Entry i is touch number touched_since + i; consumers remember how many
+    // touches they have seen and redo only the affected nodes. The log is
+    // cleared every tick, so slots in it are never released ones.
+    uint64_t touches;       // ever
+    uint64_t touched_since;
+    size_t touched_count;   // stops growing at FLOW_GRAPH_MAX_TOUCHED
+    uint32_t touched[FLOW_GRAPH_MAX_TOUCHED];
+} flow_graph_t;
+
+void flow_graph_init(flow_graph_t *graph);
+void flow_graph_free(flow_graph_t *graph);
+void flow_graph_copy(flow_graph_t *dst, const flow_graph_t *src);
+
+void flow_graph_touch(flow_graph_t *graph, uint32_t node);
+void flow_graph_touch_range(flow_graph_t *graph, uint32_t first_node, size_t count);
+void flow_graph_clear_touched(flow_graph_t *graph);
+
+void flow_graph_add_edge(flow_graph_t *graph, uint32_t source, uint32_t target);
+void flow_graph_remove_edge(flow_graph_t *graph, uint32_t source, uint32_t target);
+void flow_graph_clear_outputs(flow_graph_t *graph, uint32_t node);
+void flow_graph_remove_node(flow_graph_t *graph, uint32_t node);
+
+// Bulk insert for nodes [first_node, first_node + block_size * block_count),
+// which must not have edges yet: node k of every block gets rows of
+// out_degrees[k] outputs and in_degrees[k] inputs at the end of the edge
+// arrays. The caller then writes the neighbors straight into
+// edges[rows[node].offset ...] of both directions, possibly from several
+// threads, before using the graph again.
+void flow_graph_append_blocks(flow_graph_t *graph, uint32_t first_node, size_t block_size, size_t block_count,
+        const uint16_t *out_degrees, const uint16_t *in_degrees);
+
+// Neighbors of a node, valid until the next change.
+size_t flow_graph_outputs(const flow_graph_t *graph, uint32_t node, const uint32_t **nodes);
+size_t flow_graph_inputs(const flow_graph_t *graph, uint32_t node, const uint32_t **nodes);
@@ -9,12 +9,33 @@
 
 #include "utils.h"
 #include "game_state.h"
+#include "shard.h"
+#include "page_alloc.h"
+#include "recipe.h"
+#include "item_trace.h"
+#include "metrics.h"
+#include "job_system.h"
 
 game_state_t *create_game_state() {
-    game_state_t *state = malloc(sizeof(game_state_t));
-    memset(state, 0, sizeof(game_state_t));
+    recipes_init();
+
+    // Zero and uncommitted until written. The entity arrays are swept by
+    // index, each is first touched in ranges like a parallel sweep.
+    game_state_t *state = page_alloc(PAGE_SUBSYSTEM_GAME_STATE, sizeof(game_state_t));
+    page_touch(state->buildings, sizeof(state->buildings));
+    page_touch(state->miners, sizeof(state->miners));
+    page_touch(state->factories, sizeof(state->factories));
+    page_touch(state->belts, sizeof(state->belts));
 
     state->quad_tree = quad_tree_create();
+    state->linear_quad_tree = linear_quad_tree_create(MAX_ENTITY_COUNT);
+
+    handle_table_init(&state->building_handles, MAX_ENTITY_COUNT);
+    handle_table_init(&state->miner_handles, MAX_ENTITY_COUNT);
+    handle_table_init(&state->factory_handles, MAX_ENTITY_COUNT);
+    handle_table_init(&state->belt_handles, MAX_ENTITY_COUNT);
+
+    flow_graph_init(&state->flow_graph);
 
     reset_game_state(state);
 
@@ -24,7 +45,13 @@ game_state_t *create_game_state() {
 void destroy_game_state(game_state_t *gs) {
     assert(gs);
     quad_tree_destroy(gs->quad_tree);
-    free(gs);
+    linear_quad_tree_destroy(gs->linear_quad_tree);
+    handle_table_free(&gs->building_handles);
+    handle_table_free(&gs->miner_handles);
+    handle_table_free(&gs->factory_handles);
+    handle_table_free(&gs->belt_handles);
+    flow_graph_free(&gs->flow_graph);
+    page_free(gs);
 }
 
 void reset_game_state(game_state_t *gs) {
@@ -36,7 +63,49 @@ void reset_game_state(game_state_t *gs) {
     gs->factory_count = 1;
     gs->belt_count = 1;
 
+    handle_table_reset(&gs->building_handles);
+    handle_table_reset(&gs->miner_handles);
+    handle_table_reset(&gs->factory_handles);
+    handle_table_reset(&gs->belt_handles);
+
+    clear_dirty_cells(gs);
+
     quad_tree_reset(gs->quad_tree);
+    linear_quad_tree_reset(gs->linear_quad_tree);
+}
+
+void clear_dirty_cells(game_state_t *gs) {
+    assert(gs);
+    gs->dirty_cell_count = 0;
+    gs->dirty_all = false;
+}
+
+void mark_all_dirty(game_state_t *gs) {
+    assert(gs);
+    gs->edit_version++;
+    gs->dirty_all = true;
+}
+
+static void mark_dirty(game_state_t *gs, coord_t pos) {
+    assert(gs);
+
+    gs->edit_version++;
+
+    if (gs->dirty_cell_count < MAX_DIRTY_CELLS) {
+        gs->dirty_cells[gs->dirty_cell_count++] = pos;
+    } else {
+        gs->dirty_all = true;
+    }
+}
+
+building_size_t get_building_size(uint32_t type) {
+    switch (type) {
+        case BUILDING_TYPE_MINER:   return (building_size_t) { 2, 1 };
+        case BUILDING_TYPE_FACTORY: return (building_size_t) { 2, 2 };
+        case BUILDING_TYPE_BELT:    return (building_size_t) { 1, 1 };
+    }
+    assert(0);
+    return (building_size_t) { 0, 0 };
 }
 
 bool coord_is_in_building(const building_t *b, coord_t pos) {
@@ -45,13 +114,48 @@ bool coord_is_in_building(const building_t *b, coord_t pos) {
            b->pos.y <= pos.y && pos.y < b->pos.y + b->size.h;
 }
 
-size_t get_building(game_state_t *gs, coord_t pos) {
+handle_t get_building(game_state_t *gs, coord_t pos) {
     for(uint32_t i=1; i<gs->building_count; i++) {
         building_t *b = &gs->buildings[i];
+        if (b->flags & ENTITY_FLAGS_DELETED)
+            continue;
         if (coord_is_in_building(b, pos))
-            return i;
+            return get_building_handle(gs, i);
     }
-    return 0;
+    return HANDLE_NONE;
+}
+
+size_t get_building_index(const game_state_t *gs, handle_t building) {
+    assert(gs);
+    // Buildings marked for deletion count as gone, their handle is released by the next update.
+    const size_t index = handle_table_lookup(&gs->building_handles, building);
+    return (gs->buildings[index].flags & ENTITY_FLAGS_DELETED) ? 0 : index;
+}
+
+handle_t get_building_handle(const game_state_t *gs, size_t building_index) {
+    assert(gs);
+    assert(building_index > 0 && building_index < gs->building_count);
+    return handle_table_get_handle(&gs->building_handles, gs->buildings[building_index].slot);
+}
+
+static handle_t add_building(game_state_t *gs, coord_t pos, building_size_t size, uint32_t type, handle_t data) {
+    assert(gs);
+
+    const size_t building_id = gs->building_count++;
+    const handle_t handle = handle_table_alloc(&gs->building_handles, building_id);
+
+    building_t *building = gs->buildings + building_id;
+    memset(building, 0, sizeof(building_t));
+    building->slot = handle.index;
+    building->pos = pos;
+    building->size = size;
+    building->type = type;
+    building->data = data;
+
+    mark_dirty(gs, pos);
+    flow_graph_touch(&gs->flow_graph, handle.index);
+
+    return handle;
 }
 
 bool space_is_free(game_state_t *gs, coord_t pos_min, coord_t pos_max) {
@@ -62,95 +166,89 @@ bool space_is_free(game_state_t *gs, coord_t pos_min, coord_t pos_max) {
 
     for (int32_t y=pos_min.y; y<=pos_max.y; y++) {
         for (int32_t x=pos_min.x; x<=pos_max.x; x++) {
-            if (get_building(gs, (coord_t) { x, y }))
+            if (!handle_is_none(get_building(gs, (coord_t) { x, y })))
                 return false;
         }
     }
     return true;
 }
 
-size_t spawn_miner(game_state_t *gs, coord_t pos) {
+handle_t spawn_miner(game_state_t *gs, coord_t pos) {
 
     assert(gs->building_count < MAX_ENTITY_COUNT); 
     assert(gs->miner_count < MAX_ENTITY_COUNT);
 
     if (!space_is_free(gs, pos, (coord_t) { pos.x+1, pos.y })) {
         printf("no free space for miner at %d,%d\n", pos.x, pos.y);
-        return 0;
+        return HANDLE_NONE;
     }
+    if (gs->regions) region_scheduler_sync(gs->regions, gs, pos);
 
-    size_t building_id = gs->building_count++;
-    size_t miner_id = gs->miner_count++;
+    const size_t miner_id = gs->miner_count++;
+    const handle_t miner_handle = handle_table_alloc(&gs->miner_handles, miner_id);
 
-    building_t *building = gs->buildings + building_id;
-    //miner_t *miner = gs->miners + miner_id;
+    miner_t *miner = gs->miners + miner_id;
+    memset(miner, 0, sizeof(miner_t));
+    miner->slot = miner_handle.index;
 
-    building->pos = pos;
-    building->size = (building_size_t){ 2, 1 };
-    building->type = BUILDING_TYPE_MINER;
-    building->data_index = miner_id;
-
-    return building_id;
+    return add_building(gs, pos, get_building_size(BUILDING_TYPE_MINER), BUILDING_TYPE_MINER, miner_handle);
 }
 
-size_t spawn_factory(game_state_t *gs, coord_t pos) {
+handle_t spawn_factory(game_state_t *gs, coord_t pos) {
 
     assert(gs->building_count < MAX_ENTITY_COUNT);
     assert(gs->factory_count < MAX_ENTITY_COUNT);
 
     if (!space_is_free(gs, pos, (coord_t) { pos.x+1, pos.y+1 })) {
         printf("no free space for factory at %d,%d\n", pos.x, pos.y);
-        return 0;
+        return HANDLE_NONE;
     }
+    if (gs->regions) region_scheduler_sync(gs->regions, gs, pos);
 
-    size_t building_id = gs->building_count++;
-    size_t factory_id = gs->factory_count++;
-
-    building_t *building = gs->buildings + building_id;
-    //factory_t *factory = gs->factories + factory_id;
+    const size_t factory_id = gs->factory_count++;
+    const handle_t factory_handle = handle_table_alloc(&gs->factory_handles, factory_id);
 
-    building->pos = pos;
-    building->size = (building_size_t){ 2, 2 };
-    building->type = BUILDING_TYPE_FACTORY;
-    building->data_index = factory_id;
+    factory_t *factory = gs->factories + factory_id;
+    memset(factory, 0, sizeof(factory_t));
+    factory->slot = factory_handle.index;
 
-    return building_id;
+    return add_building(gs, pos, get_building_size(BUILDING_TYPE_FACTORY), BUILDING_TYPE_FACTORY, factory_handle);
 }
 
-size_t spawn_belt(game_state_t *gs, coord_t pos) {
+handle_t spawn_belt(game_state_t *gs, coord_t pos) {
 
     assert(gs->building_count < MAX_ENTITY_COUNT);  
     assert(gs->belt_count < MAX_ENTITY_COUNT);
 
     if (!space_is_free(gs, pos, (coord_t) { pos.x, pos.y })) {
         printf("no free space for belt at %d,%d\n", pos.x, pos.y);
-        return 0;
+        return HANDLE_NONE;
     }
+    if (gs->regions) region_scheduler_sync(gs->regions, gs, pos);
 
-    size_t building_id = gs->building_count++;
-    size_t belt_id = gs->belt_count++;
-
-    building_t *building = gs->buildings + building_id;
-    //belt_t *belt = gs->belts + belt_id;
+    const size_t belt_id = gs->belt_count++;
+    const handle_t belt_handle = handle_table_alloc(&gs->belt_handles, belt_id);
 
-    building->pos = pos;
-    building->size = (building_size_t){ 1, 1 };
-    building->type = BUILDING_TYPE_BELT;
-    building->data_index = belt_id;
+    belt_t *belt = gs->belts + belt_id;
+    memset(belt, 0, sizeof(belt_t));
+    belt->slot = belt_handle.index;
 
-    return building_id;
+    return add_building(gs, pos, get_building_size(BUILDING_TYPE_BELT), BUILDING_TYPE_BELT, belt_handle);
 }
 
-static bool buildings_can_connect(game_state_t *gs, size_t source_id, size_t target_id, uint8_t *out_dir) {
+void query_buildings(const game_state_t *gs, quad_aabb_t bounds, quad_tree_query_result_t *result) {
     assert(gs);
-    assert(source_id > 0);
-    assert(target_id > 0);
-    assert(source_id < gs->building_count);
-    assert(target_id < gs->building_count);
-    assert(source_id != target_id);
+    assert(result);
 
-    building_t *source = gs->buildings + source_id;
-    building_t *target = gs->buildings + target_id;
+    switch (gs->spatial_index) {
+        case SPATIAL_INDEX_QUAD_TREE: quad_tree_query(gs->quad_tree, bounds, result); break;
+        case SPATIAL_INDEX_LINEAR: linear_quad_tree_query(gs->linear_quad_tree, bounds, result); break;
+    }
+}
+
+bool buildings_adjacent(const building_t *source, const building_t *target, uint8_t *out_dir) {
+    assert(source);
+    assert(target);
 
     // check left/right edge of source.
     for (int32_t y=source->pos.y; y<source->pos.y+source->size.h; y++) {
@@ -185,7 +283,7 @@ static bool buildings_can_connect(game_state_t *gs, size_t source_id, size_t tar
     return false;
 }
 
-void connect_buildings(game_state_t *gs, size_t source_id, size_t target_id) {
+static bool buildings_can_connect(game_state_t *gs, size_t source_id, size_t target_id, uint8_t *out_dir) {
     assert(gs);
     assert(source_id > 0);
     assert(target_id > 0);
@@ -193,6 +291,20 @@ void connect_buildings(game_state_t *gs, size_t source_id, size_t target_id) {
     assert(target_id < gs->building_count);
     assert(source_id != target_id);
 
+    return buildings_adjacent(gs->buildings + source_id, gs->buildings + target_id, out_dir);
+}
+
+void connect_buildings(game_state_t *gs, handle_t source_handle, handle_t target_handle) {
+    assert(gs);
+
+    const size_t source_id = get_building_index(gs, source_handle);
+    const size_t target_id = get_building_index(gs, target_handle);
+    if (!source_id || !target_id) {
+        printf("can't connect stale building handles\n");
+        return;
+    }
+    assert(source_id != target_id);
+
     uint8_t conn_dir = 0;
     if (!buildings_can_connect(gs, source_id, target_id, &conn_dir)) {
         printf("can't connect buildings %lu %lu\n", source_id, target_id);
@@ -202,52 +314,102 @@ void connect_buildings(game_state_t *gs, size_t source_id, size_t target_id) {
     building_t *source = gs->buildings + source_id;
     building_t *target = gs->buildings + target_id;
 
+    // Both sides run on the current tick from here on.
+    if (gs->regions) {
+        region_scheduler_sync(gs->regions, gs, source->pos);
+        region_scheduler_sync(gs->regions, gs, target->pos);
+    }
+
     const item_output_t output = {
         .type = target->type,
-        .index = target->data_index,
+        .handle = target->data,
     };
 
     switch(source->type) {
-        case BUILDING_TYPE_MINER:   (gs->miners +    source->data_index)->output = output; break;
-        case BUILDING_TYPE_FACTORY: (gs->factories + source->data_index)->output = output; break;
-        case BUILDING_TYPE_BELT:    (gs->belts +     source->data_index)->output = output; break;
+        case BUILDING_TYPE_MINER:   GET_MINER(gs, source->data)->output = output; break;
+        case BUILDING_TYPE_FACTORY: GET_FACTORY(gs, source->data)->output = output; break;
+        case BUILDING_TYPE_BELT:    GET_BELT(gs, source->data)->output = output; break;
     }
 
     if (source->type == BUILDING_TYPE_BELT) {
-        belt_t *source_belt = gs->belts + source->data_index;
+        belt_t *source_belt = GET_BELT(gs, source->data);
         source_belt->out_dir = conn_dir;
     }
     if (target->type == BUILDING_TYPE_BELT) {
-        belt_t *target_belt = gs->belts + target->data_index;
+        belt_t *target_belt = GET_BELT(gs, target->data);
         target_belt->in_dir = conn_dir;
     }
+
+    // A building has a single output, connecting replaces it.
+    flow_graph_clear_outputs(&gs->flow_graph, source->slot);
+    flow_graph_add_edge(&gs->flow_graph, source->slot, target->slot);
+
+    mark_dirty(gs, source->pos);
+    mark_dirty(gs, target->pos);
 }
 
-void delete_building(game_state_t *gs, size_t building_id) {
+void set_factory_recipe(game_state_t *gs, handle_t building_handle, uint32_t recipe) {
     assert(gs);
-    assert(building_id > 0);
-    assert(building_id < gs->building_count);
+    assert(recipe < recipe_count);
+
+    const size_t building_id = get_building_index(gs, building_handle);
+    if (!building_id || gs->buildings[building_id].type != BUILDING_TYPE_FACTORY) return;
+
+    const building_t *building = gs->buildings + building_id;
+    if (gs->regions) region_scheduler_sync(gs->regions, gs, building->pos);
+
+    factory_t *factory = GET_FACTORY(gs, building->data);
+    factory->recipe = recipe;
+    factory->state = FACTORY_STATE_WAIT_ITEMS;
+    factory->work = 0;
+    factory->pending = 0;
+    factory->counts = 0;
+
+    // Rates of its component change, like an edit of its edges.
+    mark_dirty(gs, building->pos);
+    flow_graph_touch(&gs->flow_graph, building->slot);
+}
+
+void delete_building(game_state_t *gs, handle_t building_handle) {
+    assert(gs);
+
+    const size_t building_id = get_building_index(gs, building_handle);
+    if (!building_id) return; // already gone
 
     building_t *building = gs->buildings + building_id;
+    if (gs->regions) region_scheduler_sync(gs->regions, gs, building->pos);
 
-    // Mark for deletion
+    // Mark for deletion, the next update frees the handles.
     building->flags |= ENTITY_FLAGS_DELETED;
+    trace_remove(building->type, building->data.index);
+    mark_dirty(gs, building->pos);
+    flow_graph_remove_node(&gs->flow_graph, building->slot);
+    flow_graph_touch(&gs->flow_graph, building->slot);
 
     switch (building->type) {
-    case BUILDING_TYPE_MINER: (gs->miners + building->data_index)->flags |= ENTITY_FLAGS_DELETED; break;
-    case BUILDING_TYPE_BELT: (gs->belts + building->data_index)->flags |= ENTITY_FLAGS_DELETED; break;
-    case BUILDING_TYPE_FACTORY: (gs->factories + building->data_index)->flags |= ENTITY_FLAGS_DELETED; break;
+    case BUILDING_TYPE_MINER: GET_MINER(gs, building->data)->flags |= ENTITY_FLAGS_DELETED; break;
+    case BUILDING_TYPE_BELT: GET_BELT(gs, building->data)->flags |= ENTITY_FLAGS_DELETED; break;
+    case BUILDING_TYPE_FACTORY: GET_FACTORY(gs, building->data)->flags |= ENTITY_FLAGS_DELETED; break;
     }
 }
 
-const bool try_put_item(game_state_t *gs, item_output_t output, uint8_t item) {
-    if (output.index == 0 || item == 0)
-        return false;
-
+// Index of an output's target in its array (port id for ports), 0 if none.
+// Outputs to deleted buildings hold stale handles and resolve to 0.
+static uint32_t resolve_output(const game_state_t *gs, item_output_t output) {
+    if (handle_is_none(output.handle)) return 0;
     switch (output.type) {
+        case BUILDING_TYPE_BELT: return handle_table_lookup(&gs->belt_handles, output.handle);
+        case BUILDING_TYPE_FACTORY: return handle_table_lookup(&gs->factory_handles, output.handle);
+        case ITEM_OUTPUT_PORT: return output.handle.index;
+    }
+    return 0;
+}
+
+bool put_item_at(game_state_t *gs, uint8_t type, uint32_t index, uint8_t item) {
+    switch (type) {
         case BUILDING_TYPE_BELT:
             {
-                belt_t *belt = gs->belts + output.index;
+                belt_t *belt = gs->belts + index;
                 if (belt->items[0] == 0) {
                     belt->items[0] = item;
                     belt->works[0] = 0;
@@ -258,21 +420,88 @@ const bool try_put_item(game_state_t *gs, item_output_t output, uint8_t item) {
 
         case BUILDING_TYPE_FACTORY:
             {
-                factory_t *factory = gs->factories + output.index;
-                for (size_t i=0; i<ARRAY_LENGTH(factory->items); i++) {
-                    if (factory->items[i] == 0) {
-                        factory->items[i] = item;
-                        return true;
-                    }
-                }
+                factory_t *factory = gs->factories + index;
+                return recipe_accept(recipes + factory->recipe, &factory->counts, item);
             }
-            break;
+
+        case ITEM_OUTPUT_PORT:
+            return gs->ports && shard_ports_put(gs->ports, index, item);
     }
 
     return false;
 }
 
-static void update_miner(game_state_t *gs, miner_t *miner) {
+bool try_put_item(game_state_t *gs, item_output_t output, uint8_t item) {
+    if (item == 0) return false;
+    const uint32_t index = resolve_output(gs, output);
+    return index && put_item_at(gs, output.type, index, item);
+}
+
+// try_put_item(), or with a transfer queue, queues the item and returns
+// false: transfer_queue_apply() finishes the unload if it gets accepted.
+static bool unload(game_state_t *gs, item_output_t output, uint8_t item, uint8_t source_type, uint32_t source) {
+    if (!gs->transfers) return try_put_item(gs, output, item);
+
+    const uint32_t index = resolve_output(gs, output);
+    if (index && item) transfer_queue_push(gs->transfers, output.type, index, item, source_type, source);
+    return false;
+}
+
+static void finish_miner_unload(miner_t *miner) {
+    metrics_add(METRIC_TRANSFERS, 1);
+    trace_hop(BUILDING_TYPE_MINER, miner->slot, miner->output.type, miner->output.handle.index, 1 + miner->next_item);
+    miner->state = MINER_STATE_MINING;
+    miner->next_item++;
+    if (miner->next_item >= MINER_ITEM_KINDS) miner->next_item = 0;
+}
+
+static void finish_factory_unload(factory_t *factory) {
+    metrics_add(METRIC_TRANSFERS, 1);
+    trace_hop(BUILDING_TYPE_FACTORY, factory->slot, factory->output.type, factory->output.handle.index,
+            recipes[factory->recipe].output_item);
+    if (--factory->pending == 0) factory->state = FACTORY_STATE_WAIT_ITEMS;
+}
+
+// Moves items that are done to the next free slot, one slot per call.
+static bool advance_belt_items(belt_t *belt) {
+    bool changed = false;
+    for (size_t slot=BELT_ITEM_COUNT - 1; slot>0; slot--) {
+        if (belt->items[slot] == 0 && 
+            belt->items[slot-1] != 0 &&
+            belt->works[slot-1] == BELT_WORK_PER_ITEM) {
+
+            belt->items[slot] = belt->items[slot-1];
+            belt->works[slot] = 0;
+            belt->items[slot-1] = 0;
+            belt->works[slot-1] = 0;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void finish_belt_unload(belt_t *belt) {
+    metrics_add(METRIC_TRANSFERS, 1);
+    trace_hop(BUILDING_TYPE_BELT, belt->slot, belt->output.type, belt->output.handle.index,
+            belt->items[BELT_ITEM_COUNT - 1]);
+    belt->items[BELT_ITEM_COUNT - 1] = 0;
+    belt->works[BELT_ITEM_COUNT - 1] = 0;
+}
+
+void finish_unload(game_state_t *gs, uint8_t source_type, uint32_t source) {
+    switch (source_type) {
+        case BUILDING_TYPE_MINER: finish_miner_unload(gs->miners + source); break;
+        case BUILDING_TYPE_FACTORY: finish_factory_unload(gs->factories + source); break;
+        case BUILDING_TYPE_BELT:
+            // The sweep already advanced the items behind, this moves the ones
+            // that were waiting for the last slot, as the sweep would have.
+            finish_belt_unload(gs->belts + source);
+            advance_belt_items(gs->belts + source);
+            break;
+    }
+}
+
+bool update_miner(game_state_t *gs, miner_t *miner) {
     assert(gs);
     assert(miner);
 
@@ -282,67 +511,69 @@ static void update_miner(game_state_t *gs, miner_t *miner) {
             if (miner->work >= MINER_WORK_PER_ITEM) {
                 miner->work = 0;
                 miner->state = MINER_STATE_UNLOAD;
+                trace_create(BUILDING_TYPE_MINER, miner->slot, 1 + miner->next_item, 1);
             }
-            break;
+            return true;
 
         case MINER_STATE_UNLOAD:
-            if (try_put_item(gs, miner->output, 1 + miner->next_item)) {
-                miner->state = MINER_STATE_MINING;
-                miner->next_item++;
-                if (miner->next_item >= 4) miner->next_item = 0;
+            if (unload(gs, miner->output, 1 + miner->next_item, BUILDING_TYPE_MINER, miner - gs->miners)) {
+                finish_miner_unload(miner);
+                return true;
             }
             break;
     }
+    return false;
 }
 
-void update_factory(game_state_t *gs, factory_t *factory) {
+bool update_factory(game_state_t *gs, factory_t *factory) {
     assert(gs);
     assert(factory);
 
+    const recipe_t *recipe = recipes + factory->recipe;
+
     switch (factory->state) {
         case FACTORY_STATE_WAIT_ITEMS:
-            {
-                bool has_all_items = true;
-                for(int factory_item=0; factory_item<4; factory_item++) {
-                    if (factory->items[factory_item] == 0) {
-                        has_all_items = false;
-                        break;
-                    }
-                }
-                if (has_all_items) {
-                    factory->state = FACTORY_STATE_PRODUCE;
-                    factory->work = 0;
-                }
+            if (recipe_ready(recipe, factory->counts)) {
+                factory->state = FACTORY_STATE_PRODUCE;
+                factory->work = 0;
+                return true;
             }
             break;
 
         case FACTORY_STATE_PRODUCE:
             factory->work++;
-            if (factory->work >= FACTORY_WORK_PER_ITEM) {
+            if (factory->work >= recipe->duration) {
                 factory->state = FACTORY_STATE_UNLOAD;
-                memset(factory->items, 0, sizeof(uint8_t) * 4);
+                factory->pending = recipe->output_count;
+                factory->counts = 0;
+                trace_create(BUILDING_TYPE_FACTORY, factory->slot, recipe->output_item, recipe->output_count);
             }
-            break;
+            return true;
 
         case FACTORY_STATE_UNLOAD:
-            if (try_put_item(gs, factory->output, 9)) {
-                factory->state = FACTORY_STATE_WAIT_ITEMS;
+            if (unload(gs, factory->output, recipe->output_item, BUILDING_TYPE_FACTORY, factory - gs->factories)) {
+                finish_factory_unload(factory);
+                return true;
             }
             break;
     }
+    return false;
 }
 
-void update_belt(game_state_t *gs, belt_t *belt) {
+bool update_belt(game_state_t *gs, belt_t *belt) {
     assert(gs);
     assert(belt);
 
     // TODO: Behaviour depends on order & items of adjacent buildings are not tightly packed.
     // Introduce early_update & late_update ?
 
+    bool changed = false;
+
     for (size_t slot=0; slot<BELT_ITEM_COUNT; slot++) {
         if (belt->items[slot] != 0) {
             if (belt->works[slot] < BELT_WORK_PER_ITEM) {
                 belt->works[slot]++;
+                changed = true;
             }
         }
     }
@@ -353,139 +584,403 @@ void update_belt(game_state_t *gs, belt_t *belt) {
     if (belt->items[last_item_index] != 0 &&
         belt->works[last_item_index] == BELT_WORK_PER_ITEM) {
 
-        if (try_put_item(gs, belt->output, belt->items[last_item_index])) {
-            belt->items[last_item_index] = 0;
-            belt->works[last_item_index] = 0;
+        if (unload(gs, belt->output, belt->items[last_item_index], BUILDING_TYPE_BELT, belt - gs->belts)) {
+            finish_belt_unload(belt);
+            changed = true;
         }
     }
 
-    for (size_t slot=last_item_index; slot>0; slot--) {
-        if (belt->items[slot] == 0 && 
-            belt->items[slot-1] != 0 &&
-            belt->works[slot-1] == BELT_WORK_PER_ITEM) {
+    changed |= advance_belt_items(belt);
 
-            belt->items[slot] = belt->items[slot-1];
-            belt->works[slot] = 0;
-            belt->items[slot-1] = 0;
-            belt->works[slot-1] = 0;
+    return changed;
+}
+
+// Step 1 on the job system: every array is compacted in chunks. A count
+// pass finds the survivors of each chunk, a serial pass turns the counts
+// into offsets and releases the slots of deleted entities in the order the
+// serial loop does (free lists must come out the same), and a move pass
+// copies the survivors and maps their slots. The arrays are independent.
+#define COMPACT_CHUNK (16384)
+#define COMPACT_MAX_CHUNKS (MAX_ENTITY_COUNT / COMPACT_CHUNK + 1)
+
+// Compacted by layout: all entity structs start with flags and slot.
+_Static_assert(offsetof(building_t, slot) == 4 && offsetof(miner_t, slot) == 4 &&
+        offsetof(factory_t, slot) == 4 && offsetof(belt_t, slot) == 4, "flags and slot lead every entity");
+
+typedef struct {
+    const char *src;
+    char *dst;
+    size_t entity_size;
+    size_t old_count;
+    size_t *new_count;
+    handle_table_t *handles;
+    const handle_table_t *old_handles;
+    uint32_t offsets[COMPACT_MAX_CHUNKS]; // survivors of a chunk, then where they go
+} compaction_t;
+
+static inline const uint32_t *compact_entity(const compaction_t *c, size_t id) {
+    return (const uint32_t *)(c->src + id * c->entity_size);
+}
+
+static void compact_count_job(void *ctx, size_t begin, size_t end, job_worker_t *worker) {
+    compaction_t *c = ctx;
+    for (size_t chunk=begin; chunk<end; chunk++) {
+        const size_t first = 1 + chunk * COMPACT_CHUNK;
+        const size_t last = (first + COMPACT_CHUNK < c->old_count) ? first + COMPACT_CHUNK : c->old_count;
+        uint32_t survivors = 0;
+        for (size_t id=first; id<last; id++) {
+            survivors += !(compact_entity(c, id)[0] & ENTITY_FLAGS_DELETED);
         }
+        c->offsets[chunk] = survivors;
     }
 }
 
-static void update_output_reference(item_output_t *output, size_t *miner_mappings,
-        size_t *belt_mappings, size_t *factory_mappings) {
-    assert(output);
-    assert(miner_mappings);
-    assert(belt_mappings);
-    assert(factory_mappings);
-
-    if (!output->type && !output->index) return;
+static void compact_offsets_job(void *ctx, size_t begin, size_t end, job_worker_t *worker) {
+    compaction_t *c = ctx;
+    handle_table_copy(c->handles, c->old_handles);
+
+    uint32_t offset = 1;
+    const size_t chunk_count = (c->old_count + COMPACT_CHUNK - 2) / COMPACT_CHUNK;
+    for (size_t chunk=0; chunk<chunk_count; chunk++) {
+        const size_t first = 1 + chunk * COMPACT_CHUNK;
+        const size_t last = (first + COMPACT_CHUNK < c->old_count) ? first + COMPACT_CHUNK : c->old_count;
+        if (c->offsets[chunk] < last - first) {
+            for (size_t id=first; id<last; id++) {
+                const uint32_t *e = compact_entity(c, id);
+                if (e[0] & ENTITY_FLAGS_DELETED) handle_table_release(c->handles, e[1]);
+            }
+        }
+        const uint32_t survivors = c->offsets[chunk];
+        c->offsets[chunk] = offset;
+        offset += survivors;
+    }
+    *c->new_count = offset;
+}
 
-    size_t *mapping = NULL;
-    switch (output->type) {
-        case BUILDING_TYPE_MINER: mapping = miner_mappings; break;
-        case BUILDING_TYPE_BELT: mapping = belt_mappings; break;
-        case BUILDING_TYPE_FACTORY: mapping = factory_mappings; break;
+static void compact_move_job(void *ctx, size_t begin, size_t end, job_worker_t *worker) {
+    compaction_t *c = ctx;
+    for (size_t chunk=begin; chunk<end; chunk++) {
+        const size_t first = 1 + chunk * COMPACT_CHUNK;
+        const size_t last = (first + COMPACT_CHUNK < c->old_count) ? first + COMPACT_CHUNK : c->old_count;
+        size_t new_id = c->offsets[chunk];
+
+        // Runs of survivors in one copy each.
+        size_t id = first;
+        while (id < last) {
+            if (compact_entity(c, id)[0] & ENTITY_FLAGS_DELETED) {
+                id++;
+                continue;
+            }
+            const size_t run_first = id;
+            while (id < last && !(compact_entity(c, id)[0] & ENTITY_FLAGS_DELETED)) id++;
+            memcpy(c->dst + new_id * c->entity_size, c->src + run_first * c->entity_size,
+                    (id - run_first) * c->entity_size);
+            for (size_t i=run_first; i<id; i++) {
+                handle_table_set_dense(c->handles, compact_entity(c, i)[1], new_id++);
+            }
+        }
     }
-    if (!mapping) return;
+}
 
-    output->index = mapping[output->index];
+static void copy_flow_graph_job(void *ctx, size_t begin, size_t end, job_worker_t *worker) {
+    const game_state_t *old = ((const game_state_t **)ctx)[0];
+    game_state_t *new = ((game_state_t **)ctx)[1];
+    if (new->flow_graph.version != old->flow_graph.version) {
+        flow_graph_copy(&new->flow_graph, &old->flow_graph);
+    }
+    new->flow_graph.touches = old->flow_graph.touches;
+    flow_graph_clear_touched(&new->flow_graph);
 }
 
-static size_t miner_mapping[MAX_ENTITY_COUNT];
-static size_t belt_mapping[MAX_ENTITY_COUNT];
-static size_t factory_mapping[MAX_ENTITY_COUNT];
+static void update_game_state_1_jobs(const game_state_t *old, game_state_t *new) {
+    job_system_t *js = new->jobs;
+
+    compaction_t compactions[] = {
+        { (const char *)old->buildings, (char *)new->buildings, sizeof(building_t), old->building_count,
+            &new->building_count, &new->building_handles, &old->building_handles },
+        { (const char *)old->miners, (char *)new->miners, sizeof(miner_t), old->miner_count,
+            &new->miner_count, &new->miner_handles, &old->miner_handles },
+        { (const char *)old->belts, (char *)new->belts, sizeof(belt_t), old->belt_count,
+            &new->belt_count, &new->belt_handles, &old->belt_handles },
+        { (const char *)old->factories, (char *)new->factories, sizeof(factory_t), old->factory_count,
+            &new->factory_count, &new->factory_handles, &old->factory_handles },
+    };
+
+    const game_state_t *states[2] = { old, new };
+    job_t *done = job_create(js, NULL, NULL, 0, 0, 0);
+    job_t *flow = job_create(js, copy_flow_graph_job, states, 0, 1, 0);
+    job_depends_on(done, flow);
+
+    job_t *counts[ARRAY_LENGTH(compactions)];
+    job_t *offsets[ARRAY_LENGTH(compactions)];
+    job_t *moves[ARRAY_LENGTH(compactions)];
+    for (size_t i=0; i<ARRAY_LENGTH(compactions); i++) {
+        compaction_t *c = compactions + i;
+        const size_t chunk_count = (c->old_count + COMPACT_CHUNK - 2) / COMPACT_CHUNK;
+        counts[i] = job_create(js, compact_count_job, c, 0, chunk_count, 1);
+        offsets[i] = job_create(js, compact_offsets_job, c, 0, 1, 0);
+        moves[i] = job_create(js, compact_move_job, c, 0, chunk_count, 1);
+        job_depends_on(offsets[i], counts[i]);
+        job_depends_on(moves[i], offsets[i]);
+        job_depends_on(done, moves[i]);
+    }
+
+    job_submit(js, done);
+    job_submit(js, flow);
+    for (size_t i=0; i<ARRAY_LENGTH(compactions); i++) {
+        job_submit(js, moves[i]);
+        job_submit(js, offsets[i]);
+        job_submit(js, counts[i]);
+    }
+    job_wait(js, done);
+}
 
 void update_game_state_1(const game_state_t *old, game_state_t *new) {
     // Step 1: copy belts/miners/factories to new arrays
 
+    if (new->jobs) {
+        update_game_state_1_jobs(old, new);
+        return;
+    }
+
     // TODO: bulk copy if nothing was deleted?
     // TODO: track bounds of modified region?
 
+    // References are handles: compaction only moves the slots of surviving
+    // entities and releases those of deleted ones, nothing else needs fixing.
+    handle_table_copy(&new->building_handles, &old->building_handles);
+    handle_table_copy(&new->miner_handles, &old->miner_handles);
+    handle_table_copy(&new->belt_handles, &old->belt_handles);
+    handle_table_copy(&new->factory_handles, &old->factory_handles);
+
+    // Only the active state is edited, so equal versions mean equal graphs.
+    if (new->flow_graph.version != old->flow_graph.version) {
+        flow_graph_copy(&new->flow_graph, &old->flow_graph);
+    }
+    new->flow_graph.touches = old->flow_graph.touches;
+    flow_graph_clear_touched(&new->flow_graph);
+
     for (size_t old_id=1; old_id<old->building_count; old_id++) {
         const building_t *old_building = old->buildings + old_id;
         if (old_building->flags & ENTITY_FLAGS_DELETED) {
+            handle_table_release(&new->building_handles, old_building->slot);
             continue;
         }
         const size_t new_id = new->building_count++;
         building_t *new_building = new->buildings + new_id;
         memcpy(new_building, old_building, sizeof(building_t));
+        handle_table_set_dense(&new->building_handles, new_building->slot, new_id);
     }
     for (size_t old_id=1; old_id<old->miner_count; old_id++) {
         const miner_t *old_miner = old->miners + old_id;
         if(old_miner->flags & ENTITY_FLAGS_DELETED) {
-            miner_mapping[old_id] = 0;
+            handle_table_release(&new->miner_handles, old_miner->slot);
             continue;
         }
         const size_t new_id = new->miner_count++;
-        miner_mapping[old_id] = new_id;
         miner_t *new_miner = new->miners + new_id;
         memcpy(new_miner, old_miner, sizeof(miner_t));
+        handle_table_set_dense(&new->miner_handles, new_miner->slot, new_id);
     }
     for (size_t old_id=1; old_id<old->belt_count; old_id++) {
         const belt_t *old_belt = old->belts + old_id;
         if(old_belt->flags & ENTITY_FLAGS_DELETED) {
-            belt_mapping[old_id] = 0;
+            handle_table_release(&new->belt_handles, old_belt->slot);
             continue;
         }
         const size_t new_id = new->belt_count++;
-        belt_mapping[old_id] = new_id;
         belt_t *new_belt = new->belts + new_id;
         memcpy(new_belt, old_belt, sizeof(belt_t));
+        handle_table_set_dense(&new->belt_handles, new_belt->slot, new_id);
     }
     for (size_t old_id=1; old_id<old->factory_count; old_id++) {
         const factory_t *old_factory = old->factories + old_id;
         if(old_factory->flags & ENTITY_FLAGS_DELETED) {
-            factory_mapping[old_id] = 0;
+            handle_table_release(&new->factory_handles, old_factory->slot);
             continue;
         }
         const size_t new_id = new->factory_count++;
-        factory_mapping[old_id] = new_id;
         factory_t *new_factory = new->factories + new_id;
         memcpy(new_factory, old_factory, sizeof(factory_t));
+        handle_table_set_dense(&new->factory_handles, new_factory->slot, new_id);
     }
 }
 
-void update_game_state_2(const game_state_t *old, game_state_t *new) {
-    // Step 2: fix references
+void update_game_state_3(const game_state_t *old, game_state_t *new) {
+    new->regions = old->regions;
+    new->ports = old->ports;
+    new->transfers = old->transfers;
+    if (new->transfers) transfer_queue_reset_stats(new->transfers);
+    trace_set_tick(new->tick);
+    if (new->regions) {
+        region_scheduler_update(new->regions, new);
+        return;
+    }
 
-    for (size_t i=1; i<new->building_count; i++) {
-        building_t *building = new->buildings + i;
-        switch (building->type) {
-            case BUILDING_TYPE_MINER: building->data_index = miner_mapping[building->data_index]; break;
-            case BUILDING_TYPE_BELT: building->data_index = belt_mapping[building->data_index]; break;
-            case BUILDING_TYPE_FACTORY: building->data_index = factory_mapping[building->data_index]; break;
-        }
-        assert(building->data_index);
+    for (size_t i=1; i<new->miner_count; i++) update_miner(new, new->miners + i);
+    for (size_t i=1; i<new->factory_count; i++) update_factory(new, new->factories + i);
+    for (size_t i=1; i<new->belt_count; i++) update_belt(new, new->belts + i);
+    if (new->transfers) transfer_queue_apply(new->transfers, new);
+}
+
+static quad_stats_t get_building_stats(const game_state_t *gs, const building_t *building) {
+    assert(gs);
+    assert(building);
+
+    quad_stats_t stats = {};
+    stats.type_counts[building->type] = 1;
+    stats.cell_count = building->size.w * building->size.h;
+
+    switch (building->type) {
+        case BUILDING_TYPE_MINER:
+            {
+                const miner_t *miner = GET_MINER(gs, building->data);
+                stats.active_count = miner->state == MINER_STATE_MINING;
+            }
+            break;
+
+        case BUILDING_TYPE_FACTORY:
+            {
+                const factory_t *factory = GET_FACTORY(gs, building->data);
+                stats.item_count = recipe_count_sum(factory->counts);
+                stats.item_capacity = recipe_count_sum(recipes[factory->recipe].input_counts);
+                stats.active_count = factory->state == FACTORY_STATE_PRODUCE;
+            }
+            break;
+
+        case BUILDING_TYPE_BELT:
+            {
+                const belt_t *belt = GET_BELT(gs, building->data);
+                for (size_t i=0; i<BELT_ITEM_COUNT; i++) {
+                    if (belt->items[i]) {
+                        stats.item_count++;
+                        if (belt->works[i] < BELT_WORK_PER_ITEM) stats.active_count = 1;
+                    }
+                }
+                stats.item_capacity = BELT_ITEM_COUNT;
+            }
+            break;
     }
-    for (size_t i=1; i<new->miner_count; i++) {
-        miner_t *miner = new->miners + i;
-        update_output_reference(&miner->output, miner_mapping, belt_mapping, factory_mapping);
+
+    return stats;
+}
+
+// Used parts of the page_alloc() blocks of a state.
+static void account_memory(const game_state_t *gs) {
+    const size_t arrays = sizeof(gs->buildings) + sizeof(gs->miners) + sizeof(gs->factories) + sizeof(gs->belts);
+    page_set_used(gs, sizeof(game_state_t) - arrays +
+            sizeof(building_t) * gs->building_count + sizeof(miner_t) * gs->miner_count +
+            sizeof(factory_t) * gs->factory_count + sizeof(belt_t) * gs->belt_count);
+    quad_tree_account_memory(gs->quad_tree);
+    page_set_used(gs->linear_quad_tree->entries, sizeof(uint64_t) * gs->linear_quad_tree->count);
+}
+
+// Step 4 on the job system: the items with their stats and the linear
+// index entries are computed in parallel, then both indexes are built in
+// one piece, the pointer quad tree with subtrees on the workers.
+#define INDEX_CHUNK (8192)
+
+typedef struct {
+    game_state_t *gs;
+    quad_build_item_t *items;
+} index_prep_t;
+
+static void building_items_job(void *ctx, size_t begin, size_t end, job_worker_t *worker) {
+    index_prep_t *prep = ctx;
+    const game_state_t *gs = prep->gs;
+    for (size_t i=begin; i<end; i++) {
+        const building_t *building = gs->buildings + i + 1;
+        prep->items[i] = (quad_build_item_t) { building->pos, i + 1, get_building_stats(gs, building) };
     }
-    for (size_t i=1; i<new->belt_count; i++) {
-        belt_t *belt = new->belts + i;
-        update_output_reference(&belt->output, miner_mapping, belt_mapping, factory_mapping);
+}
+
+static void linear_entries_job(void *ctx, size_t begin, size_t end, job_worker_t *worker) {
+    index_prep_t *prep = ctx;
+    const game_state_t *gs = prep->gs;
+    for (size_t i=begin; i<end; i++) {
+        gs->linear_quad_tree->entries[i] = linear_quad_tree_entry(gs->buildings[i + 1].pos, i + 1);
     }
 }
 
-void update_game_state_3(const game_state_t *old, game_state_t *new) {
-    for (size_t i=1; i<new->miner_count; i++) update_miner(new, new->miners + i);
-    for (size_t i=1; i<new->factory_count; i++) update_factory(new, new->factories + i);
-    for (size_t i=1; i<new->belt_count; i++) update_belt(new, new->belts + i);
+static void update_game_state_4_jobs(game_state_t *new) {
+    index_prep_t prep = { .gs = new };
+    const size_t count = new->building_count - 1;
+
+    switch (new->spatial_index) {
+        case SPATIAL_INDEX_QUAD_TREE:
+            prep.items = job_scratch(new->jobs->workers, sizeof(quad_build_item_t) * count);
+            parallel_for(new->jobs, count, INDEX_CHUNK, building_items_job, &prep);
+            quad_tree_build(new->quad_tree, prep.items, count, new->jobs);
+            break;
+
+        case SPATIAL_INDEX_LINEAR:
+            assert(count <= new->linear_quad_tree->capacity);
+            parallel_for(new->jobs, count, INDEX_CHUNK, linear_entries_job, &prep);
+            new->linear_quad_tree->count = count;
+            linear_quad_tree_build(new->linear_quad_tree);
+            break;
+    }
 }
 
 void update_game_state_4(const game_state_t *old, game_state_t *new) {
-    for (size_t i=1; i<new->building_count; i++) {
-        const building_t *building = new->buildings + i;
-        quad_tree_insert(new->quad_tree, building->pos, i);
+    // Step 4: rebuild spatial index (backend can be switched at runtime)
+
+    new->spatial_index = old->spatial_index;
+
+    if (new->jobs) {
+        update_game_state_4_jobs(new);
+        account_memory(new);
+        return;
     }
+
+    switch (new->spatial_index) {
+        case SPATIAL_INDEX_QUAD_TREE:
+            for (size_t i=1; i<new->building_count; i++) {
+                const building_t *building = new->buildings + i;
+                const quad_stats_t stats = get_building_stats(new, building);
+                quad_tree_insert(new->quad_tree, building->pos, i, &stats);
+            }
+            break;
+
+        case SPATIAL_INDEX_LINEAR:
+            for (size_t i=1; i<new->building_count; i++) {
+                const building_t *building = new->buildings + i;
+                linear_quad_tree_add(new->linear_quad_tree, building->pos, i);
+            }
+            linear_quad_tree_build(new->linear_quad_tree);
+            break;
+    }
+
+    account_memory(new);
+}
+
+void rebuild_spatial_index(game_state_t *gs) {
+    assert(gs);
+    quad_tree_reset(gs->quad_tree);
+    linear_quad_tree_reset(gs->linear_quad_tree);
+    if (gs->jobs) job_system_reset(gs->jobs);
+    update_game_state_4(gs, gs);
+    gs->index_version = gs->edit_version;
 }
 
 void update_game_state(const game_state_t *old, game_state_t *new) {
+    uint64_t phase_start = metrics_clock();
+    new->jobs = old->jobs;
+    if (new->jobs) job_system_reset(new->jobs);
     CHECK_TIME(reset_game_state(new));
+    phase_start = metrics_phase(METRIC_RESET_NS, phase_start);
+    new->tick = old->tick + 1;
+    new->edit_version = old->edit_version;
+    new->index_version = old->edit_version;
+    new->mirror = old->mirror;
     CHECK_TIME(update_game_state_1(old, new));
-    CHECK_TIME(update_game_state_2(old, new));
-    CHECK_TIME(update_game_state_3(old, new));
+    phase_start = metrics_phase(METRIC_STEP_1_NS, phase_start);
+    if (!new->mirror) {
+        CHECK_TIME(update_game_state_3(old, new));
+        phase_start = metrics_phase(METRIC_STEP_3_NS, phase_start);
+    }
     CHECK_TIME(update_game_state_4(old, new));
+    metrics_phase(METRIC_STEP_4_NS, phase_start);
+    metrics_add(METRIC_TICKS, 1);
 }
 
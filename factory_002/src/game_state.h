@@ -7,6 +7,11 @@
 
 #include "coord.h"
 #include "quad_tree.h"
+#include "linear_quad_tree.h"
+#include "handle_table.h"
+#include "flow_graph.h"
+#include "region_scheduler.h"
+#include "transfer_queue.h"
 
 #define DIR_NONE     (0)
 #define DIR_UP       (1)
@@ -15,13 +20,21 @@
 #define DIR_RIGHT    (5)
 
 #define MAX_ENTITY_COUNT          (1000 * 1000)
+#define MAX_DIRTY_CELLS           (1024)
 
 #define BUILDING_TYPE_MINER       (0)
 #define BUILDING_TYPE_FACTORY     (1)
 #define BUILDING_TYPE_BELT        (2)
+#define BUILDING_TYPE_COUNT       (3)
+
+// item_output_t.type of a link to another shard, handle.index is the port.
+#define ITEM_OUTPUT_PORT          (3)
 
 #define ENTITY_FLAGS_DELETED      (1)
 
+#define SPATIAL_INDEX_QUAD_TREE   (0)
+#define SPATIAL_INDEX_LINEAR      (1)
+
 #define MINER_STATE_MINING        (0)
 #define MINER_STATE_UNLOAD        (1)
 
@@ -30,8 +43,7 @@
 #define FACTORY_STATE_UNLOAD      (2)
 
 #define MINER_WORK_PER_ITEM       (40)
-
-#define FACTORY_WORK_PER_ITEM     (120)
+#define MINER_ITEM_KINDS          (4) // miners cycle through items 1..4
 
 #define BELT_ITEM_COUNT           (4)
 #define BELT_WORK_PER_ITEM        (10)
@@ -43,21 +55,23 @@ typedef struct {
 
 typedef struct {
     uint32_t flags;
+    uint32_t slot; // handle slot, see handle_table.h
     // ---
     coord_t pos;
     building_size_t size;
     // ---
     uint32_t type; // miner/belt/factory
-    uint32_t data_index; // index into miner/belt/factory-arrays
+    handle_t data; // into miner/belt/factory-handles
 } building_t;
 
 typedef struct {
-    uint8_t type; // miner/belt/factory
-    uint32_t index; // index into miner/belt/factory-arrays
+    uint8_t type; // miner/belt/factory or ITEM_OUTPUT_PORT
+    handle_t handle; // into miner/belt/factory-handles
 } item_output_t;
 
 typedef struct {
     uint32_t flags;
+    uint32_t slot;
     // ---
     uint32_t work;
     uint8_t state;
@@ -67,16 +81,19 @@ typedef struct {
 
 typedef struct {
     uint32_t flags;
+    uint32_t slot;
     // ---
     uint32_t work;
-    uint32_t recipe;
+    uint32_t recipe;  // see recipe.h
     uint8_t state;
-    uint8_t items[4];
+    uint8_t pending;  // outputs left to unload
+    uint32_t counts;  // held per recipe input slot, one byte each
     item_output_t output;
 } factory_t;
 
 typedef struct {
     uint32_t flags;
+    uint32_t slot;
     // ---
     uint8_t items[BELT_ITEM_COUNT];
     uint8_t works[BELT_ITEM_COUNT];
@@ -85,7 +102,7 @@ typedef struct {
     uint8_t out_dir;
 } belt_t;
 
-typedef struct {
+typedef struct game_state {
     building_t buildings[MAX_ENTITY_COUNT];
     miner_t miners[MAX_ENTITY_COUNT];
     factory_t factories[MAX_ENTITY_COUNT];
@@ -96,22 +113,87 @@ typedef struct {
     size_t factory_count;
     size_t belt_count;
 
+    // Entities are compacted every update, references between them and from
+    // outside the state use handles.
+    handle_table_t building_handles;
+    handle_table_t miner_handles;
+    handle_table_t factory_handles;
+    handle_table_t belt_handles;
+
+    // Connections by building slot, maintained by connect/delete. Only
+    // copied by an update when it changed.
+    flow_graph_t flow_graph;
+
+    uint64_t tick;
+    uint64_t edit_version;  // bumped by spawn/connect/delete
+    uint64_t index_version; // edit_version the spatial index was built from
+
+    // Cells touched by spawn/connect/delete since the last clear_dirty_cells().
+    // Lets caches derived from the world invalidate locally; overflow sets dirty_all.
+    size_t dirty_cell_count;
+    coord_t dirty_cells[MAX_DIRTY_CELLS];
+    bool dirty_all;
+
+    uint32_t spatial_index; // which index update_game_state_4 builds
+    bool mirror;            // of a remote simulation (net.h): updates don't simulate
+    region_scheduler_t *regions; // NULL runs every entity every tick
+    struct shard_ports *ports;   // of a shard worker, see shard.h
+    transfer_queue_t *transfers; // batches step 3 transfers, NULL writes them directly
+    struct job_system *jobs;     // runs steps 1 and 4 in parallel, NULL runs them serially
     quad_tree_t *quad_tree;
+    linear_quad_tree_t *linear_quad_tree;
 
 } game_state_t;
 
+// Data of a building, by handle. Stale handles resolve to the unused entry 0.
+#define GET_MINER(gs, handle)   ((gs)->miners + handle_table_lookup(&(gs)->miner_handles, (handle)))
+#define GET_FACTORY(gs, handle) ((gs)->factories + handle_table_lookup(&(gs)->factory_handles, (handle)))
+#define GET_BELT(gs, handle)    ((gs)->belts + handle_table_lookup(&(gs)->belt_handles, (handle)))
+
 game_state_t *create_game_state();
 void destroy_game_state(game_state_t *gs);
 
-size_t get_building(game_state_t *gs, coord_t pos);
+building_size_t get_building_size(uint32_t type);
+bool coord_is_in_building(const building_t *b, coord_t pos);
+// Whether target touches an edge of source, and on which side.
+bool buildings_adjacent(const building_t *source, const building_t *target, uint8_t *out_dir);
+
+handle_t get_building(game_state_t *gs, coord_t pos);
 bool space_is_free(game_state_t *gs, coord_t pos_min, coord_t pos_max);
 
-size_t spawn_miner(game_state_t *gs, coord_t pos);
-size_t spawn_factory(game_state_t *gs, coord_t pos);
-size_t spawn_belt(game_state_t *gs, coord_t pos);
+// Index into gs->buildings, 0 if the handle is stale or the building is marked
+// for deletion. Indices change with every update.
+size_t get_building_index(const game_state_t *gs, handle_t building);
+handle_t get_building_handle(const game_state_t *gs, size_t building_index);
+
+handle_t spawn_miner(game_state_t *gs, coord_t pos);
+handle_t spawn_factory(game_state_t *gs, coord_t pos);
+handle_t spawn_belt(game_state_t *gs, coord_t pos);
+
+void query_buildings(const game_state_t *gs, quad_aabb_t bounds, quad_tree_query_result_t *result);
+
+void connect_buildings(game_state_t *gs, handle_t source, handle_t target);
+// Switches a factory to another recipe, dropping what it holds.
+void set_factory_recipe(game_state_t *gs, handle_t building, uint32_t recipe);
+void delete_building(game_state_t *gs, handle_t building);
+
+// Step 4 on its own, for states written from outside (history.h).
+void rebuild_spatial_index(game_state_t *gs);
+
+void clear_dirty_cells(game_state_t *gs);
+void mark_all_dirty(game_state_t *gs); // for bulk edits
+
+// Step 3 per entity, true if anything changed. With gs->transfers set,
+// unloads are queued and changes from them show in transfer_queue_apply().
+bool update_miner(game_state_t *gs, miner_t *miner);
+bool update_factory(game_state_t *gs, factory_t *factory);
+bool update_belt(game_state_t *gs, belt_t *belt);
 
-void connect_buildings(game_state_t *gs, size_t source_id, size_t target_id); 
-void delete_building(game_state_t *gs, size_t building_id);
+bool try_put_item(game_state_t *gs, item_output_t output, uint8_t item);
+// try_put_item() to a resolved target: index into its array, port id for ports.
+bool put_item_at(game_state_t *gs, uint8_t type, uint32_t index, uint8_t item);
+// Second half of a queued unload that was accepted, source by index.
+void finish_unload(game_state_t *gs, uint8_t source_type, uint32_t source);
 
 void reset_game_state(game_state_t *gs);
 void update_game_state(const game_state_t *old, game_state_t *new);
@@ -0,0 +1,80 @@
+#include "handle_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+void handle_table_init(handle_table_t *table, size_t capacity) {
+    assert(table);
+    assert(capacity > 1);
+
+    memset(table, 0, sizeof(handle_table_t));
+    table->capacity = capacity;
+    table->slots = malloc(sizeof(handle_slot_t) * capacity);
+    assert(table->slots);
+
+    handle_table_reset(table);
+}
+
+void handle_table_free(handle_table_t *table) {
+    assert(table);
+    free(table->slots);
+    memset(table, 0, sizeof(handle_table_t));
+}
+
+void handle_table_reset(handle_table_t *table) {
+    assert(table);
+    table->slot_count = 1;
+    table->free_head = 0;
+    table->slots[0] = (handle_slot_t) { 0, 0 };
+}
+
+void handle_table_copy(handle_table_t *dst, const handle_table_t *src) {
+    assert(dst);
+    assert(src);
+    assert(dst->capacity >= src->slot_count);
+
+    memcpy(dst->slots, src->slots, sizeof(handle_slot_t) * src->slot_count);
+    dst->slot_count = src->slot_count;
+    dst->free_head = src->free_head;
+}
+
+handle_t handle_table_alloc(handle_table_t *table, uint32_t dense) {
+    assert(table);
+
+    uint32_t slot = table->free_head;
+    if (slot) {
+        table->free_head = table->slots[slot].dense;
+    } else {
+        assert(table->slot_count < table->capacity);
+        slot = table->slot_count++;
+        table->slots[slot].generation = 1;
+    }
+
+    table->slots[slot].dense = dense;
+    return handle_table_get_handle(table, slot);
+}
+
+uint32_t handle_table_alloc_range(handle_table_t *table, uint32_t first_dense, size_t count) {
+    assert(table);
+    assert(table->slot_count + count <= table->capacity);
+
+    const uint32_t first = table->slot_count;
+    for (size_t i=0; i<count; i++) {
+        table->slots[first + i] = (handle_slot_t) { .dense = first_dense + i, .generation = 1 };
+    }
+    table->slot_count += count;
+    return first;
+}
+
+void handle_table_release(handle_table_t *table, uint32_t slot) {
+    assert(table);
+    assert(slot > 0 && slot < table->slot_count);
+
+    handle_slot_t *s = table->slots + slot;
+    s->generation++;
+    if (s->generation == 0) s->generation = 1; // wrapped, 0 is reserved for HANDLE_NONE
+    s->dense = table->free_head;
+    table->free_head = slot;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Generational handles: a sparse set of slots in front of a dense array.
+// Each slot maps to the current dense index of its entity and carries a
+// generation, bumped when the slot is freed. Compacting the dense array
+// only rewrites the slots of moved entities, handles held elsewhere stay
+// valid, and a handle to a freed entity is detected by its generation.
+//
+// Slot 0 is never handed out, so the zero handle means "none".
+
+typedef struct {
+    uint32_t index; // slot
+    uint32_t generation;
+} handle_t;
+
+typedef struct {
+    uint32_t dense;      // dense index while alive, next free slot otherwise
+    uint32_t generation;
+} handle_slot_t;
+
+typedef struct {
+    size_t capacity;
+    size_t slot_count; // high-water mark
+    uint32_t free_head;
+    handle_slot_t *slots;
+} handle_table_t;
+
+#define HANDLE_NONE ((handle_t) { 0, 0 })
+
+void handle_table_init(handle_table_t *table, size_t capacity);
+void handle_table_free(handle_table_t *table);
+void handle_table_reset(handle_table_t *table);
+void handle_table_copy(handle_table_t *dst, const handle_table_t *src);
+
+handle_t handle_table_alloc(handle_table_t *table, uint32_t dense);
+void handle_table_release(handle_table_t *table, uint32_t slot);
+
+// Bulk: count fresh slots past the high-water mark, mapped to consecutive
+// dense indices from first_dense. Returns the first slot, all have generation 1.
+uint32_t handle_table_alloc_range(handle_table_t *table, uint32_t first_dense, size_t count);
+
+static inline bool handle_is_none(handle_t h) {
+    return h.index == 0;
+}
+
+static inline bool handle_equals(handle_t a, handle_t b) {
+    return a.index == b.index && a.generation == b.generation;
+}
+
+static inline handle_t handle_table_get_handle(const handle_table_t *table, uint32_t slot) {
+    return (handle_t) { slot, table->slots[slot].generation };
+}
+
+static inline void handle_table_set_dense(handle_table_t *table, uint32_t slot, uint32_t dense) {
+    table->slots[slot].dense = dense;
+}
+
+// Dense index of a live handle, 0 for none and stale handles.
+static inline uint32_t handle_table_lookup(const handle_table_t *table, handle_t h) {
+    if (h.index == 0 || h.index >= table->slot_count) return 0;
+    const handle_slot_t *slot = table->slots + h.index;
+    return (slot->generation == h.generation) ? slot->dense : 0;
+}
@@ -0,0 +1,513 @@
+#include "history.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define HISTORY_RUN_GAP  (8) // equal bytes that don't end a run, cheaper than a new run header
+
+enum {
+    SECTION_HEADER,
+    SECTION_BUILDINGS,
+    SECTION_MINERS,
+    SECTION_FACTORIES,
+    SECTION_BELTS,
+    SECTION_BUILDING_HANDLES,
+    SECTION_MINER_HANDLES,
+    SECTION_FACTORY_HANDLES,
+    SECTION_BELT_HANDLES,
+    SECTION_OUTPUT_ROWS,
+    SECTION_OUTPUT_EDGES,
+    SECTION_INPUT_ROWS,
+    SECTION_INPUT_EDGES,
+    SECTION_REGION_CLOCKS,
+};
+
+// Everything of a state that isn't an array.
+typedef struct {
+    uint64_t tick;
+    uint64_t counts[4];         // buildings, miners, factories, belts
+    uint64_t slot_counts[4];    // handle tables, same order
+    uint32_t free_heads[4];
+    uint64_t edge_counts[2];    // outputs, inputs
+    uint64_t edge_capacities[2];
+    uint32_t spatial_index;
+} history_header_t;
+
+typedef struct {
+    const void *data;
+    size_t size;
+} section_t;
+
+static bool section_is_layout(size_t s) {
+    return s == SECTION_BUILDINGS || (s >= SECTION_BUILDING_HANDLES && s <= SECTION_INPUT_EDGES);
+}
+
+static const uint8_t zeros[64];
+
+// -----
+
+static void block_resize(history_block_t *b, size_t size) {
+    if (size > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 256;
+        while (capacity < size) capacity *= 2;
+        b->data = realloc(b->data, capacity);
+        assert(b->data);
+        b->capacity = capacity;
+    }
+    if (size > b->size) memset(b->data + b->size, 0, size - b->size);
+    b->size = size;
+}
+
+static void block_free(history_block_t *b) {
+    free(b->data);
+    memset(b, 0, sizeof(history_block_t));
+}
+
+static void put_varint(history_block_t *b, uint64_t v) {
+    size_t size = b->size;
+    block_resize(b, size + 10);
+    while (v >= 0x80) {
+        b->data[size++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    b->data[size++] = (uint8_t)v;
+    b->size = size;
+}
+
+static void put_bytes(history_block_t *b, const void *data, size_t size) {
+    const size_t at = b->size;
+    block_resize(b, at + size);
+    memcpy(b->data + at, data, size);
+}
+
+static uint64_t get_varint(const uint8_t **p, const uint8_t *end) {
+    uint64_t v = 0;
+    for (int shift=0; ; shift+=7) {
+        assert(*p < end);
+        assert(shift < 64);
+        const uint8_t byte = *(*p)++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return v;
+    }
+}
+
+// -----
+
+// First byte at or after i where new differs from old, old zero-extended.
+static size_t next_diff(const uint8_t *old, size_t old_size, const uint8_t *new, size_t new_size, size_t i) {
+    const size_t common = old_size < new_size ? old_size : new_size;
+    while (i < common) {
+        if (i % 64 == 0 && i + 64 <= common && memcmp(old + i, new + i, 64) == 0) {
+            i += 64;
+            continue;
+        }
+        if (old[i] != new[i]) return i;
+        i++;
+    }
+    while (i < new_size) {
+        if (i % 64 == 0 && i + 64 <= new_size && memcmp(new + i, zeros, 64) == 0) {
+            i += 64;
+            continue;
+        }
+        if (new[i]) return i;
+        i++;
+    }
+    return new_size;
+}
+
+// Size and runs of a section against an image, which becomes the section.
+static void encode_section(history_block_t *out, history_block_t *image, section_t section) {
+    const uint8_t *new = section.data;
+    const size_t new_size = section.size;
+    const size_t old_size = image->size;
+
+    put_varint(out, new_size);
+
+    size_t pos = 0;
+    size_t i = next_diff(image->data, old_size, new, new_size, 0);
+    while (i < new_size) {
+        size_t end = i + 1;
+        size_t j;
+        while ((j = next_diff(image->data, old_size, new, new_size, end)) < new_size && j - end <= HISTORY_RUN_GAP) {
+            end = j + 1;
+        }
+
+        put_varint(out, i - pos);
+        put_varint(out, end - i);
+        put_bytes(out, new + i, end - i);
+        if (i < old_size) memcpy(image->data + i, new + i, (end < old_size ? end : old_size) - i);
+
+        pos = end;
+        i = j;
+    }
+    put_varint(out, 0);
+    put_varint(out, 0);
+
+    // Runs past the old size.
+    block_resize(image, new_size);
+    if (new_size > old_size) memcpy(image->data + old_size, new + old_size, new_size - old_size);
+}
+
+// A section that is known to equal its image: same size, no runs.
+static void keep_section(history_block_t *out, const history_block_t *image, section_t section) {
+    assert(section.size == image->size);
+    put_varint(out, image->size);
+    put_varint(out, 0);
+    put_varint(out, 0);
+}
+
+static const uint8_t *decode_section(history_block_t *block, const uint8_t *p, const uint8_t *end) {
+    const size_t size = get_varint(&p, end);
+    block_resize(block, size);
+
+    size_t pos = 0;
+    while (true) {
+        const size_t skip = get_varint(&p, end);
+        const size_t len = get_varint(&p, end);
+        if (!skip && !len) break;
+
+        pos += skip;
+        assert(pos + len <= size);
+        assert(p + len <= end);
+        memcpy(block->data + pos, p, len);
+        p += len;
+        pos += len;
+    }
+    return p;
+}
+
+static void decode_record(history_block_t *blocks, const history_record_t *record) {
+    const uint8_t *p = record->data;
+    const uint8_t *end = record->data + record->size;
+    for (size_t s=0; s<HISTORY_SECTION_COUNT; s++) {
+        p = decode_section(blocks + s, p, end);
+    }
+    assert(p == end);
+}
+
+// -----
+
+static history_record_t *record_at(const history_t *h, size_t i) {
+    assert(i < h->count);
+    return h->records + (h->first + i) % h->record_capacity;
+}
+
+static void drop_record(history_t *h, history_record_t *record) {
+    h->bytes -= record->size;
+    if (record->keyframe) h->keyframe_count--;
+    free(record->data);
+    memset(record, 0, sizeof(history_record_t));
+}
+
+static void drop_front(history_t *h) {
+    drop_record(h, record_at(h, 0));
+    h->first = (h->first + 1) % h->record_capacity;
+    h->first_number++;
+    h->count--;
+}
+
+static void drop_back(history_t *h) {
+    drop_record(h, record_at(h, h->count - 1));
+    h->count--;
+}
+
+static void grow_ring(history_t *h) {
+    const size_t capacity = h->record_capacity ? h->record_capacity * 2 : 1024;
+    history_record_t *records = calloc(capacity, sizeof(history_record_t));
+    assert(records);
+    for (size_t i=0; i<h->count; i++) {
+        records[i] = *record_at(h, i);
+    }
+    free(h->records);
+    h->records = records;
+    h->record_capacity = capacity;
+    h->first = 0;
+}
+
+void history_init(history_t *h, size_t window, size_t keyframe_interval, size_t max_bytes) {
+    assert(h);
+    assert(window > 0);
+    assert(keyframe_interval > 0);
+
+    memset(h, 0, sizeof(history_t));
+    h->window = window;
+    h->keyframe_interval = keyframe_interval;
+    h->max_bytes = max_bytes;
+}
+
+void history_clear(history_t *h) {
+    assert(h);
+    while (h->count) drop_front(h);
+    for (size_t s=0; s<HISTORY_SECTION_COUNT; s++) {
+        block_resize(h->image + s, 0);
+    }
+    h->since_keyframe = 0;
+    h->cursor_valid = false;
+}
+
+void history_free(history_t *h) {
+    assert(h);
+    history_clear(h);
+    free(h->records);
+    for (size_t s=0; s<HISTORY_SECTION_COUNT; s++) {
+        block_free(h->image + s);
+        block_free(h->cursor + s);
+    }
+    block_free(&h->scratch);
+    block_free(&h->encoded);
+    memset(h, 0, sizeof(history_t));
+}
+
+static void gather_sections(history_t *h, const game_state_t *gs, history_header_t *header, section_t *sections) {
+    memset(header, 0, sizeof(history_header_t));
+    header->tick = gs->tick;
+    header->counts[0] = gs->building_count;
+    header->counts[1] = gs->miner_count;
+    header->counts[2] = gs->factory_count;
+    header->counts[3] = gs->belt_count;
+
+    const handle_table_t *tables[4] = {
+        &gs->building_handles, &gs->miner_handles, &gs->factory_handles, &gs->belt_handles,
+    };
+    for (size_t i=0; i<4; i++) {
+        header->slot_counts[i] = tables[i]->slot_count;
+        header->free_heads[i] = tables[i]->free_head;
+        sections[SECTION_BUILDING_HANDLES + i] = (section_t) {
+            tables[i]->slots, sizeof(handle_slot_t) * tables[i]->slot_count,
+        };
+    }
+
+    const flow_adjacency_t *adjacencies[2] = { &gs->flow_graph.outputs, &gs->flow_graph.inputs };
+    for (size_t i=0; i<2; i++) {
+        const flow_adjacency_t *adj = adjacencies[i];
+        header->edge_counts[i] = adj->edge_count;
+        header->edge_capacities[i] = adj->edge_capacity;
+        sections[SECTION_OUTPUT_ROWS + 2*i] = (section_t) { adj->rows, sizeof(flow_row_t) * adj->row_capacity };
+        sections[SECTION_OUTPUT_EDGES + 2*i] = (section_t) { adj->edges, sizeof(uint32_t) * adj->edge_end };
+    }
+
+    header->spatial_index = gs->spatial_index;
+    sections[SECTION_HEADER] = (section_t) { header, sizeof(history_header_t) };
+
+    sections[SECTION_BUILDINGS] = (section_t) { gs->buildings, sizeof(building_t) * gs->building_count };
+    sections[SECTION_MINERS] = (section_t) { gs->miners, sizeof(miner_t) * gs->miner_count };
+    sections[SECTION_FACTORIES] = (section_t) { gs->factories, sizeof(factory_t) * gs->factory_count };
+    sections[SECTION_BELTS] = (section_t) { gs->belts, sizeof(belt_t) * gs->belt_count };
+
+    sections[SECTION_REGION_CLOCKS] = (section_t) { NULL, 0 };
+    if (gs->regions) {
+        block_resize(&h->scratch, sizeof(region_clock_t) * gs->regions->used_chunk_count);
+        const size_t count = region_scheduler_get_clocks(gs->regions, (region_clock_t *)h->scratch.data);
+        sections[SECTION_REGION_CLOCKS] = (section_t) { h->scratch.data, sizeof(region_clock_t) * count };
+    }
+}
+
+void history_record(history_t *h, const game_state_t *gs) {
+    assert(h);
+    assert(gs);
+    const double start = get_time_ms();
+
+    // A tick that was recorded before: simulating from a restored state.
+    while (h->count && record_at(h, h->count - 1)->tick >= gs->tick) {
+        drop_back(h);
+    }
+    if (h->cursor_valid && h->cursor_number >= h->first_number + h->count) {
+        h->cursor_valid = false;
+    }
+
+    // The image must be the newest record's state for a delta against it.
+    const bool image_current = h->count && h->image_number == h->first_number + h->count - 1;
+    h->since_keyframe = 0;
+    for (size_t i=h->count; i>0 && !record_at(h, i - 1)->keyframe; i--) {
+        h->since_keyframe++;
+    }
+    const bool keyframe = !image_current || h->since_keyframe + 1 >= h->keyframe_interval;
+
+    history_header_t header;
+    section_t sections[HISTORY_SECTION_COUNT];
+    gather_sections(h, gs, &header, sections);
+
+    h->encoded.size = 0;
+    if (keyframe) {
+        for (size_t s=0; s<HISTORY_SECTION_COUNT; s++) {
+            block_resize(h->image + s, 0);
+        }
+    }
+    // Buildings, handles and the flow graph only change with edits, which
+    // bump edit_version; the simulated sections are compared every time.
+    const bool layout_current = !keyframe && h->image_edit_version == gs->edit_version;
+    for (size_t s=0; s<HISTORY_SECTION_COUNT; s++) {
+        if (layout_current && section_is_layout(s)) {
+            keep_section(&h->encoded, h->image + s, sections[s]);
+        } else {
+            encode_section(&h->encoded, h->image + s, sections[s]);
+        }
+    }
+    h->image_edit_version = gs->edit_version;
+
+    if (h->count == h->record_capacity) grow_ring(h);
+    history_record_t *record = h->records + (h->first + h->count) % h->record_capacity;
+    *record = (history_record_t) {
+        .tick = gs->tick,
+        .keyframe = keyframe,
+        .size = h->encoded.size,
+        .data = malloc(h->encoded.size),
+    };
+    assert(record->data);
+    memcpy(record->data, h->encoded.data, h->encoded.size);
+    h->count++;
+    h->bytes += record->size;
+    if (keyframe) h->keyframe_count++;
+    h->image_number = h->first_number + h->count - 1;
+
+    // Whole intervals from the front, the newest one always stays.
+    while (h->keyframe_count > 1 && (h->count > h->window || h->bytes > h->max_bytes)) {
+        do {
+            drop_front(h);
+        } while (!record_at(h, 0)->keyframe);
+    }
+    if (h->cursor_valid && h->cursor_number < h->first_number) {
+        h->cursor_valid = false;
+    }
+
+    h->last_bytes = record->size;
+    h->last_record_ms = get_time_ms() - start;
+}
+
+bool history_first_tick(const history_t *h, uint64_t *tick) {
+    assert(h);
+    assert(tick);
+    if (!h->count) return false;
+    *tick = record_at(h, 0)->tick;
+    return true;
+}
+
+bool history_last_tick(const history_t *h, uint64_t *tick) {
+    assert(h);
+    assert(tick);
+    if (!h->count) return false;
+    *tick = record_at(h, h->count - 1)->tick;
+    return true;
+}
+
+static void restore_handles(handle_table_t *table, const history_block_t *block, uint64_t slot_count, uint32_t free_head) {
+    assert(block->size == sizeof(handle_slot_t) * slot_count);
+    const handle_table_t view = {
+        .capacity = slot_count,
+        .slot_count = slot_count,
+        .free_head = free_head,
+        .slots = (handle_slot_t *)block->data,
+    };
+    handle_table_copy(table, &view);
+}
+
+static flow_adjacency_t adjacency_view(const history_block_t *rows, const history_block_t *edges,
+        uint64_t edge_count, uint64_t edge_capacity) {
+    return (flow_adjacency_t) {
+        .row_capacity = rows->size / sizeof(flow_row_t),
+        .rows = (flow_row_t *)rows->data,
+        .edge_capacity = edge_capacity,
+        .edge_end = edges->size / sizeof(uint32_t),
+        .edge_count = edge_count,
+        .edges = (uint32_t *)edges->data,
+    };
+}
+
+bool history_restore(history_t *h, uint64_t tick, game_state_t *gs) {
+    assert(h);
+    assert(gs);
+
+    // Newest record at or before the tick, and the keyframe it builds on.
+    size_t target = h->count;
+    for (size_t i=h->count; i>0; i--) {
+        if (record_at(h, i - 1)->tick <= tick) {
+            target = i - 1;
+            break;
+        }
+    }
+    if (target == h->count) return false;
+    size_t keyframe = target;
+    while (!record_at(h, keyframe)->keyframe) keyframe--;
+
+    size_t next = keyframe;
+    if (h->cursor_valid) {
+        const size_t cursor = h->cursor_number - h->first_number;
+        if (cursor >= keyframe && cursor <= target) next = cursor + 1;
+    }
+    for (size_t i=next; i<=target; i++) {
+        if (i == keyframe) {
+            for (size_t s=0; s<HISTORY_SECTION_COUNT; s++) {
+                block_resize(h->cursor + s, 0);
+            }
+        }
+        decode_record(h->cursor, record_at(h, i));
+    }
+    h->cursor_valid = true;
+    h->cursor_number = h->first_number + target;
+
+    const history_block_t *c = h->cursor;
+    assert(c[SECTION_HEADER].size == sizeof(history_header_t));
+    history_header_t header;
+    memcpy(&header, c[SECTION_HEADER].data, sizeof(history_header_t));
+    for (size_t i=0; i<4; i++) {
+        assert(header.counts[i] <= MAX_ENTITY_COUNT);
+    }
+    assert(c[SECTION_BUILDINGS].size == sizeof(building_t) * header.counts[0]);
+    assert(c[SECTION_MINERS].size == sizeof(miner_t) * header.counts[1]);
+    assert(c[SECTION_FACTORIES].size == sizeof(factory_t) * header.counts[2]);
+    assert(c[SECTION_BELTS].size == sizeof(belt_t) * header.counts[3]);
+
+    gs->tick = header.tick;
+    gs->building_count = header.counts[0];
+    gs->miner_count = header.counts[1];
+    gs->factory_count = header.counts[2];
+    gs->belt_count = header.counts[3];
+    if (gs->building_count) memcpy(gs->buildings, c[SECTION_BUILDINGS].data, c[SECTION_BUILDINGS].size);
+    if (gs->miner_count) memcpy(gs->miners, c[SECTION_MINERS].data, c[SECTION_MINERS].size);
+    if (gs->factory_count) memcpy(gs->factories, c[SECTION_FACTORIES].data, c[SECTION_FACTORIES].size);
+    if (gs->belt_count) memcpy(gs->belts, c[SECTION_BELTS].data, c[SECTION_BELTS].size);
+
+    handle_table_t *tables[4] = {
+        &gs->building_handles, &gs->miner_handles, &gs->factory_handles, &gs->belt_handles,
+    };
+    for (size_t i=0; i<4; i++) {
+        restore_handles(tables[i], c + SECTION_BUILDING_HANDLES + i, header.slot_counts[i], header.free_heads[i]);
+    }
+
+    // Graph consumers see a new version and more touches than they have
+    // seen, so they rebuild instead of patching.
+    flow_graph_t *graph = &gs->flow_graph;
+    flow_graph_t view = {
+        .outputs = adjacency_view(c + SECTION_OUTPUT_ROWS, c + SECTION_OUTPUT_EDGES,
+                header.edge_counts[0], header.edge_capacities[0]),
+        .inputs = adjacency_view(c + SECTION_INPUT_ROWS, c + SECTION_INPUT_EDGES,
+                header.edge_counts[1], header.edge_capacities[1]),
+        .version = graph->version + 1,
+    };
+    flow_graph_copy(graph, &view);
+    graph->touches++;
+    flow_graph_clear_touched(graph);
+
+    gs->spatial_index = header.spatial_index;
+    if (gs->regions) {
+        const history_block_t *clocks = c + SECTION_REGION_CLOCKS;
+        region_scheduler_set_clocks(gs->regions, gs->tick, (const region_clock_t *)clocks->data,
+                clocks->size / sizeof(region_clock_t));
+    }
+
+    mark_all_dirty(gs);
+    rebuild_spatial_index(gs);
+
+    // Recording continues from here.
+    for (size_t s=0; s<HISTORY_SECTION_COUNT; s++) {
+        block_resize(h->image + s, 0);
+        block_resize(h->image + s, c[s].size);
+        if (c[s].size) memcpy(h->image[s].data, c[s].data, c[s].size);
+    }
+    h->image_number = h->cursor_number;
+    return true;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "game_state.h"
+#include "region_scheduler.h"
+
+// Rewind window: one record per tick, kept in a bounded ring.
+//
+// The recorder keeps an image of the last recorded state as byte sections
+// (a header with the counts, the entity arrays up to their counts, the used
+// handle slots, the flow graph rows and edges and the region clocks). A
+// record is, per section, its new size and the byte runs that differ from
+// the image (varint skip, varint length, bytes), so it stores what changed
+// that tick. Finding the runs still compares every simulated entity against
+// the image, O(entities) per tick; buildings, handles and the flow graph are
+// only compared after an edit (edit_version change). Every keyframe_interval
+// ticks the record is a keyframe instead: the same runs against an empty image.
+//
+// The window starts at a keyframe and drops whole keyframe intervals from the
+// front once it holds more than window ticks or max_bytes. Restoring a tick
+// decodes from the keyframe before it, or from the last restored tick when
+// scrubbing forward within an interval.
+//
+// Recording a tick at or before the last recorded one drops the records
+// after it first, so simulating from a restored tick branches the history.
+
+#define HISTORY_SECTION_COUNT (14)
+
+typedef struct {
+    uint64_t tick;
+    bool keyframe;
+    size_t size;
+    uint8_t *data;
+} history_record_t;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    uint8_t *data;
+} history_block_t;
+
+typedef struct {
+    size_t window;              // ticks
+    size_t keyframe_interval;   // ticks
+    size_t max_bytes;
+
+    // Ring of records, record i (from the front) is number first_number + i.
+    size_t record_capacity;
+    size_t first;
+    size_t count;
+    uint64_t first_number;
+    history_record_t *records;
+    size_t bytes;               // of all records
+    size_t keyframe_count;
+    size_t since_keyframe;      // records after the newest keyframe
+
+    history_block_t image[HISTORY_SECTION_COUNT];  // last recorded state
+    uint64_t image_number;
+    uint64_t image_edit_version;                   // of the last recorded state
+    history_block_t cursor[HISTORY_SECTION_COUNT]; // last restored state
+    bool cursor_valid;
+    uint64_t cursor_number;
+
+    history_block_t scratch;    // region clocks
+    history_block_t encoded;    // record being built
+
+    size_t last_bytes;          // of the newest record
+    double last_record_ms;
+} history_t;
+
+void history_init(history_t *h, size_t window, size_t keyframe_interval, size_t max_bytes);
+void history_free(history_t *h);
+void history_clear(history_t *h);
+
+// Call after every update.
+void history_record(history_t *h, const game_state_t *gs);
+
+bool history_first_tick(const history_t *h, uint64_t *tick);
+bool history_last_tick(const history_t *h, uint64_t *tick);
+
+// Writes the recorded state of a tick in the window into gs, including its
+// flow graph, spatial index and region clocks. Versions of gs only move
+// forward, so caches derived from it rebuild.
+bool history_restore(history_t *h, uint64_t tick, game_state_t *gs);
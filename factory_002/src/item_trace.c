@@ -0,0 +1,477 @@
+#include "item_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "game_state.h"
+
+#define TRACE_MAGIC        (0x43525446) // "FTRC"
+#define TRACE_VERSION      (1)
+#define TRACE_MAX_RINGS    (64)
+#define TRACE_REPORT_LINES (15)
+
+typedef struct {
+    trace_record_t *records;
+    size_t capacity;  // power of two
+    uint64_t written;
+} trace_ring_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t ring_count;
+    uint64_t building_count;
+    uint64_t lost;    // appends without a ring
+} trace_header_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t slot;
+    coord_t pos;
+} trace_building_t;
+
+bool trace_enabled;
+__thread uint32_t trace_tick;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t rings[TRACE_MAX_RINGS];
+static size_t ring_count;
+static size_t ring_records = TRACE_DEFAULT_RING_RECORDS;
+static uint64_t lost;
+static __thread trace_ring_t *thread_ring;
+
+void trace_start(size_t records) {
+    size_t capacity = 1;
+    while (capacity < records) capacity *= 2;
+
+    pthread_mutex_lock(&mutex);
+    ring_records = capacity;
+    for (size_t i=0; i<ring_count; i++) {
+        if (rings[i].capacity != capacity) {
+            rings[i].records = realloc(rings[i].records, sizeof(trace_record_t) * capacity);
+            assert(rings[i].records);
+            rings[i].capacity = capacity;
+        }
+        rings[i].written = 0;
+    }
+    lost = 0;
+    pthread_mutex_unlock(&mutex);
+
+    trace_enabled = true;
+}
+
+void trace_stop() {
+    trace_enabled = false;
+}
+
+void trace_append(const trace_record_t *record) {
+    trace_ring_t *ring = thread_ring;
+    if (!ring) {
+        // First record of this thread.
+        pthread_mutex_lock(&mutex);
+        if (ring_count < TRACE_MAX_RINGS) {
+            ring = rings + ring_count++;
+            ring->capacity = ring_records;
+            ring->records = malloc(sizeof(trace_record_t) * ring->capacity);
+            assert(ring->records);
+            ring->written = 0;
+            thread_ring = ring;
+        } else {
+            lost++;
+        }
+        pthread_mutex_unlock(&mutex);
+        if (!ring) return;
+    }
+    ring->records[ring->written & (ring->capacity - 1)] = *record;
+    ring->written++;
+}
+
+bool trace_write(const char *path, const game_state_t *gs) {
+    assert(path);
+    assert(gs);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("trace: can't write '%s'\n", path);
+        return false;
+    }
+
+    pthread_mutex_lock(&mutex);
+    const trace_header_t header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .record_size = sizeof(trace_record_t),
+        .ring_count = ring_count,
+        .building_count = gs->building_count - 1,
+        .lost = lost,
+    };
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    // Oldest record first, in up to two pieces.
+    for (size_t i=0; i<ring_count && ok; i++) {
+        const trace_ring_t *ring = rings + i;
+        const uint64_t count = ring->written < ring->capacity ? ring->written : ring->capacity;
+        const size_t first = (ring->written - count) & (ring->capacity - 1);
+        const size_t tail = (first + count <= ring->capacity) ? count : ring->capacity - first;
+        ok = fwrite(&ring->written, sizeof(uint64_t), 1, file) == 1 &&
+             fwrite(&count, sizeof(uint64_t), 1, file) == 1 &&
+             fwrite(ring->records + first, sizeof(trace_record_t), tail, file) == tail &&
+             fwrite(ring->records, sizeof(trace_record_t), count - tail, file) == count - tail;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    // Where the buildings are, for the report.
+    for (size_t i=1; i<gs->building_count && ok; i++) {
+        const building_t *b = gs->buildings + i;
+        const trace_building_t tb = { b->type, b->data.index, b->pos };
+        ok = fwrite(&tb, sizeof(tb), 1, file) == 1;
+    }
+
+    if (fclose(file) != 0) ok = false;
+    if (!ok) printf("trace: writing '%s' failed\n", path);
+    return ok;
+}
+
+// -----
+
+typedef struct {
+    uint32_t created;
+    uint32_t entered;   // the building it is in
+    uint32_t origin;    // slot
+    uint8_t origin_type;
+    bool known;         // created after the trace started
+} tag_t;
+
+// Items in a building, oldest first.
+typedef struct {
+    tag_t *tags;
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+    // waits of items that left it
+    uint64_t wait_sum;
+    uint64_t items;
+    uint32_t wait_max;
+    uint32_t wait_min;
+} node_t;
+
+typedef struct {
+    uint64_t path;      // see path_key()
+    uint32_t latency;
+} sample_t;
+
+typedef struct {
+    uint64_t path;
+    size_t count;
+    uint32_t p50, p90, p99, max;
+} path_stats_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t slot;
+    uint64_t excess;    // item-ticks beyond the fastest pass through this type
+} hot_node_t;
+
+static const char *type_name(uint32_t type) {
+    switch (type) {
+        case BUILDING_TYPE_MINER: return "miner";
+        case BUILDING_TYPE_FACTORY: return "factory";
+        case BUILDING_TYPE_BELT: return "belt";
+        case ITEM_OUTPUT_PORT: return "port";
+    }
+    return "?";
+}
+
+static uint64_t path_key(uint32_t origin_type, uint32_t origin, uint32_t target_type, uint32_t target) {
+    return ((uint64_t)origin_type << 56) | ((uint64_t)origin << 32) | ((uint64_t)target_type << 24) | target;
+}
+
+static void push_tag(node_t *node, tag_t tag) {
+    if (node->count == node->capacity) {
+        const uint32_t capacity = node->capacity ? node->capacity * 2 : 4;
+        tag_t *tags = malloc(sizeof(tag_t) * capacity);
+        assert(tags);
+        for (uint32_t i=0; i<node->count; i++) tags[i] = node->tags[(node->head + i) % node->capacity];
+        free(node->tags);
+        node->tags = tags;
+        node->head = 0;
+        node->capacity = capacity;
+    }
+    node->tags[(node->head + node->count++) % node->capacity] = tag;
+}
+
+static bool pop_tag(node_t *node, tag_t *tag) {
+    if (!node->count) return false;
+    *tag = node->tags[node->head];
+    node->head = (node->head + 1) % node->capacity;
+    node->count--;
+    return true;
+}
+
+// Records in recording order, regions catching up log earlier ticks late.
+typedef struct {
+    trace_record_t record;
+    uint64_t sequence;
+} sorted_record_t;
+
+static int compare_records(const void *a, const void *b) {
+    const sorted_record_t *x = a, *y = b;
+    if (x->record.tick != y->record.tick) return x->record.tick < y->record.tick ? -1 : 1;
+    return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+static int compare_samples(const void *a, const void *b) {
+    const sample_t *x = a, *y = b;
+    if (x->path != y->path) return x->path < y->path ? -1 : 1;
+    return (x->latency > y->latency) - (x->latency < y->latency);
+}
+
+static int compare_paths(const void *a, const void *b) {
+    const path_stats_t *x = a, *y = b;
+    if (x->p99 != y->p99) return x->p99 < y->p99 ? 1 : -1;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+static int compare_hot(const void *a, const void *b) {
+    const hot_node_t *x = a, *y = b;
+    return (x->excess < y->excess) - (x->excess > y->excess);
+}
+
+static uint32_t percentile(const sample_t *samples, size_t count, uint32_t percent) {
+    return samples[(count - 1) * percent / 100].latency;
+}
+
+static const char *where(const trace_building_t *buildings, size_t building_count, uint32_t type, uint32_t slot) {
+    static char text[64];
+    for (size_t i=0; i<building_count; i++) {
+        if (buildings[i].type == type && buildings[i].slot == slot) {
+            snprintf(text, sizeof(text), "%s %u at %d,%d", type_name(type), slot, buildings[i].pos.x, buildings[i].pos.y);
+            return text;
+        }
+    }
+    snprintf(text, sizeof(text), "%s %u (gone)", type_name(type), slot);
+    return text;
+}
+
+bool trace_report(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("trace: can't read '%s'\n", path);
+        return false;
+    }
+
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC ||
+            header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)) {
+        printf("trace: '%s' is not a trace of this version\n", path);
+        fclose(file);
+        return false;
+    }
+
+    size_t record_count = 0;
+    trace_record_t *records = NULL;
+    uint64_t overwritten = 0;
+    bool ok = true;
+    for (uint32_t i=0; i<header.ring_count && ok; i++) {
+        uint64_t written, count;
+        ok = fread(&written, sizeof(uint64_t), 1, file) == 1 && fread(&count, sizeof(uint64_t), 1, file) == 1;
+        if (!ok) break;
+        records = realloc(records, sizeof(trace_record_t) * (record_count + count + 1));
+        assert(records);
+        ok = fread(records + record_count, sizeof(trace_record_t), count, file) == count;
+        record_count += count;
+        overwritten += written - count;
+    }
+    trace_building_t *buildings = malloc(sizeof(trace_building_t) * (header.building_count + 1));
+    assert(buildings);
+    if (ok) ok = fread(buildings, sizeof(trace_building_t), header.building_count, file) == header.building_count;
+    fclose(file);
+    if (!ok) {
+        printf("trace: '%s' is truncated\n", path);
+        free(records);
+        free(buildings);
+        return false;
+    }
+
+    sorted_record_t *sorted = malloc(sizeof(sorted_record_t) * (record_count + 1));
+    assert(sorted);
+    for (size_t i=0; i<record_count; i++) sorted[i] = (sorted_record_t) { records[i], i };
+    qsort(sorted, record_count, sizeof(sorted_record_t), compare_records);
+    for (size_t i=0; i<record_count; i++) records[i] = sorted[i].record;
+    free(sorted);
+
+    // Nodes by type and slot.
+    uint32_t slot_counts[ITEM_OUTPUT_PORT + 1] = {};
+    for (size_t i=0; i<record_count; i++) {
+        const trace_record_t *r = records + i;
+        if (r->source >= slot_counts[r->source_type]) slot_counts[r->source_type] = r->source + 1;
+        if (r->kind == TRACE_HOP && r->target >= slot_counts[r->target_type]) slot_counts[r->target_type] = r->target + 1;
+    }
+    node_t *nodes[ITEM_OUTPUT_PORT + 1];
+    for (size_t type=0; type<=ITEM_OUTPUT_PORT; type++) {
+        nodes[type] = calloc(slot_counts[type] + 1, sizeof(node_t));
+        assert(nodes[type]);
+    }
+
+    size_t sample_count = 0;
+    sample_t *samples = malloc(sizeof(sample_t) * (record_count + 1));
+    assert(samples);
+    size_t created = 0, untracked = 0, removed = 0;
+
+    for (size_t i=0; i<record_count; i++) {
+        const trace_record_t *r = records + i;
+        node_t *source = nodes[r->source_type] + r->source;
+
+        switch (r->kind) {
+            case TRACE_CREATE:
+                for (uint32_t k=0; k<r->target; k++) {
+                    push_tag(source, (tag_t) { r->tick, r->tick, r->source, r->source_type, true });
+                }
+                created += r->target;
+                break;
+
+            case TRACE_REMOVE:
+                removed += source->count;
+                source->count = 0;
+                break;
+
+            case TRACE_HOP:
+                {
+                    tag_t tag;
+                    if (!pop_tag(source, &tag)) {
+                        // On its way since before the trace (or the ring) started.
+                        tag = (tag_t) { r->tick, r->tick, 0, 0, false };
+                        untracked++;
+                    } else {
+                        const uint32_t wait = r->tick - tag.entered;
+                        if (!source->items || wait < source->wait_min) source->wait_min = wait;
+                        if (wait > source->wait_max) source->wait_max = wait;
+                        source->wait_sum += wait;
+                        source->items++;
+                    }
+
+                    if (r->target_type == BUILDING_TYPE_BELT) {
+                        tag.entered = r->tick;
+                        push_tag(nodes[r->target_type] + r->target, tag);
+                    } else if (tag.known) {
+                        // Consumed by a factory or handed to another shard.
+                        samples[sample_count++] = (sample_t) {
+                            path_key(tag.origin_type, tag.origin, r->target_type, r->target),
+                            r->tick - tag.created,
+                        };
+                    }
+                }
+                break;
+        }
+    }
+
+    printf("trace: %lu records (%lu overwritten, %lu lost), ticks %u..%u\n", record_count, overwritten,
+            header.lost, record_count ? records[0].tick : 0, record_count ? records[record_count - 1].tick : 0);
+    printf("  %lu items created, %lu delivered, %lu already under way, %lu removed with buildings\n",
+            created, sample_count, untracked, removed);
+
+    // Latency histogram, power of two buckets.
+    if (sample_count) {
+        size_t buckets[33] = {};
+        for (size_t i=0; i<sample_count; i++) {
+            const uint32_t latency = samples[i].latency;
+            buckets[latency ? 32 - __builtin_clz(latency) : 0]++;
+        }
+        size_t max_bucket = 1;
+        for (size_t b=0; b<33; b++) if (buckets[b] > max_bucket) max_bucket = buckets[b];
+        printf("latency, ticks from creation to delivery:\n");
+        for (size_t b=0; b<33; b++) {
+            if (!buckets[b]) continue;
+            char bar[41];
+            const size_t length = buckets[b] * 40 / max_bucket;
+            memset(bar, '#', length);
+            bar[length] = 0;
+            printf("  %7u..%-7u %9lu %s\n", b ? 1u << (b - 1) : 0, b ? (1u << b) - 1 : 0, buckets[b], bar);
+        }
+    }
+
+    // Percentiles per path.
+    qsort(samples, sample_count, sizeof(sample_t), compare_samples);
+    size_t path_count = 0;
+    path_stats_t *paths = malloc(sizeof(path_stats_t) * (sample_count + 1));
+    assert(paths);
+    for (size_t i=0; i<sample_count; ) {
+        size_t j = i;
+        while (j < sample_count && samples[j].path == samples[i].path) j++;
+        paths[path_count++] = (path_stats_t) {
+            .path = samples[i].path,
+            .count = j - i,
+            .p50 = percentile(samples + i, j - i, 50),
+            .p90 = percentile(samples + i, j - i, 90),
+            .p99 = percentile(samples + i, j - i, 99),
+            .max = samples[j - 1].latency,
+        };
+        i = j;
+    }
+    if (sample_count) {
+        // All deliveries, sorted by latency.
+        sample_t *all = malloc(sizeof(sample_t) * sample_count);
+        assert(all);
+        for (size_t i=0; i<sample_count; i++) all[i] = (sample_t) { 0, samples[i].latency };
+        qsort(all, sample_count, sizeof(sample_t), compare_samples);
+        printf("%lu paths, all items: p50 %u, p90 %u, p99 %u, max %u ticks\n", path_count,
+                percentile(all, sample_count, 50), percentile(all, sample_count, 90),
+                percentile(all, sample_count, 99), all[sample_count - 1].latency);
+        free(all);
+    }
+    qsort(paths, path_count, sizeof(path_stats_t), compare_paths);
+    printf("slowest paths by p99:\n");
+    for (size_t i=0; i<path_count && i<TRACE_REPORT_LINES; i++) {
+        const path_stats_t *p = paths + i;
+        printf("  %8lu items, p50 %5u, p90 %5u, p99 %5u, max %5u: ", p->count, p->p50, p->p90, p->p99, p->max);
+        printf("%s -> ", where(buildings, header.building_count, p->path >> 56, (p->path >> 32) & 0xffffff));
+        printf("%s\n", where(buildings, header.building_count, (p->path >> 24) & 0xff, p->path & 0xffffff));
+    }
+
+    // Queueing: time spent in a building beyond the fastest pass through
+    // any building of its type (transit for belts, 0 or 1 otherwise).
+    uint32_t type_min[ITEM_OUTPUT_PORT + 1];
+    size_t hot_count = 0;
+    for (size_t type=0; type<=ITEM_OUTPUT_PORT; type++) {
+        type_min[type] = UINT32_MAX;
+        for (uint32_t slot=0; slot<slot_counts[type]; slot++) {
+            const node_t *node = nodes[type] + slot;
+            if (node->items && node->wait_min < type_min[type]) type_min[type] = node->wait_min;
+            if (node->items) hot_count++;
+        }
+    }
+    hot_node_t *hot = malloc(sizeof(hot_node_t) * (hot_count + 1));
+    assert(hot);
+    hot_count = 0;
+    for (size_t type=0; type<=ITEM_OUTPUT_PORT; type++) {
+        for (uint32_t slot=0; slot<slot_counts[type]; slot++) {
+            const node_t *node = nodes[type] + slot;
+            if (!node->items) continue;
+            const uint64_t excess = node->wait_sum - node->items * type_min[type];
+            if (excess) hot[hot_count++] = (hot_node_t) { type, slot, excess };
+        }
+    }
+    qsort(hot, hot_count, sizeof(hot_node_t), compare_hot);
+    printf("longest queueing (item-ticks beyond the fastest pass of the type):\n");
+    for (size_t i=0; i<hot_count && i<TRACE_REPORT_LINES; i++) {
+        const node_t *node = nodes[hot[i].type] + hot[i].slot;
+        printf("  %10lu: %lu items, mean %.1f, max %u ticks in %s\n", hot[i].excess, node->items,
+                (double)node->wait_sum / node->items, node->wait_max,
+                where(buildings, header.building_count, hot[i].type, hot[i].slot));
+    }
+
+    for (size_t type=0; type<=ITEM_OUTPUT_PORT; type++) {
+        for (uint32_t slot=0; slot<slot_counts[type]; slot++) free(nodes[type][slot].tags);
+        free(nodes[type]);
+    }
+    free(hot);
+    free(paths);
+    free(samples);
+    free(records);
+    free(buildings);
+    return true;
+}
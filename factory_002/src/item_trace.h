@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Item flow tracing. Items are plain bytes in belts and factories, so they
+// aren't tagged in the state; instead every item creation and every
+// transfer between buildings is logged, and the decoder follows items
+// through belts, which are first in first out:
+//
+// - CREATE: a miner mined an item or a factory produced count items,
+// - HOP: an item moved from source to target (buildings by type and
+//   handle slot, ports by id),
+// - REMOVE: a building was deleted with whatever it held.
+//
+// Records go into a ring buffer per thread and overwrite the oldest ones
+// when it is full. trace_write() dumps all rings, trace_report() decodes a
+// dump: latency from creation to arrival per path (origin to destination
+// building) with percentiles, and the buildings items wait in longest.
+//
+// Compiled in unless ITEM_TRACE is 0. While not started, each hook is a
+// load of trace_enabled and a not-taken branch.
+
+#ifndef ITEM_TRACE
+#define ITEM_TRACE 1
+#endif
+
+struct game_state;
+
+#define TRACE_CREATE  (0)
+#define TRACE_HOP     (1)
+#define TRACE_REMOVE  (2)
+
+#define TRACE_DEFAULT_RING_RECORDS (1 << 22) // 64 MiB per thread
+
+typedef struct {
+    uint32_t tick;
+    uint32_t source;      // slot of the building (CREATE, REMOVE) or item source
+    uint32_t target;      // HOP: slot or port of the target, CREATE: item count
+    uint8_t kind;         // TRACE_*
+    uint8_t item;
+    uint8_t source_type;  // BUILDING_TYPE_*
+    uint8_t target_type;  // BUILDING_TYPE_* or ITEM_OUTPUT_PORT
+} trace_record_t;
+
+extern bool trace_enabled;
+extern __thread uint32_t trace_tick; // simulated tick of this thread's updates
+
+// Starts tracing into empty rings of ring_records records each (rounded up
+// to a power of two); trace_stop() keeps what was recorded.
+void trace_start(size_t ring_records);
+void trace_stop();
+// Dumps the rings and where the buildings of gs are. Call between ticks;
+// false if the file can't be written.
+bool trace_write(const char *path, const struct game_state *gs);
+bool trace_report(const char *path);
+
+void trace_append(const trace_record_t *record);
+
+static inline void trace_set_tick(uint64_t tick) {
+#if ITEM_TRACE
+    trace_tick = tick;
+#endif
+}
+
+static inline void trace_create(uint8_t type, uint32_t slot, uint8_t item, uint32_t count) {
+#if ITEM_TRACE
+    if (__builtin_expect(trace_enabled, 0)) {
+        const trace_record_t r = { trace_tick, slot, count, TRACE_CREATE, item, type, 0 };
+        trace_append(&r);
+    }
+#endif
+}
+
+static inline void trace_hop(uint8_t source_type, uint32_t source, uint8_t target_type, uint32_t target, uint8_t item) {
+#if ITEM_TRACE
+    if (__builtin_expect(trace_enabled, 0)) {
+        const trace_record_t r = { trace_tick, source, target, TRACE_HOP, item, source_type, target_type };
+        trace_append(&r);
+    }
+#endif
+}
+
+static inline void trace_remove(uint8_t type, uint32_t slot) {
+#if ITEM_TRACE
+    if (__builtin_expect(trace_enabled, 0)) {
+        const trace_record_t r = { trace_tick, slot, 0, TRACE_REMOVE, 0, type, 0 };
+        trace_append(&r);
+    }
+#endif
+}
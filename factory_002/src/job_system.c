@@ -0,0 +1,358 @@
+#include "job_system.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#define DEQUE_MASK   (JOB_DEQUE_CAPACITY - 1)
+#define IDLE_SPINS   (64) // failed steals before yielding
+
+typedef struct {
+    job_system_t *js;
+    size_t worker_index;
+} worker_arg_t;
+
+static __thread job_worker_t *current_worker;
+
+static void push_job(job_worker_t *w, job_t *job) {
+    const int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    const int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    assert(b - t < JOB_DEQUE_CAPACITY);
+    __atomic_store_n(w->deque + (b & DEQUE_MASK), job, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+static job_t *pop_job(job_worker_t *w) {
+    const int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    job_t *job = __atomic_load_n(w->deque + (b & DEQUE_MASK), __ATOMIC_RELAXED);
+    if (t == b) {
+        // Last one, race the thieves for it.
+        if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            job = NULL;
+        }
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return job;
+}
+
+static job_t *steal_job(job_worker_t *victim) {
+    int64_t t = __atomic_load_n(&victim->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    const int64_t b = __atomic_load_n(&victim->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return NULL;
+
+    job_t *job = __atomic_load_n(victim->deque + (t & DEQUE_MASK), __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&victim->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return job;
+}
+
+static job_t *get_job(job_worker_t *w) {
+    job_t *job = pop_job(w);
+    if (job) return job;
+
+    const size_t worker_count = w->js->worker_count;
+    if (worker_count < 2) return NULL;
+
+    // xorshift, a random victim first so thieves spread out.
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    const size_t first = w->rng % worker_count;
+    for (size_t i=0; i<worker_count; i++) {
+        job_worker_t *victim = w->js->workers + (first + i) % worker_count;
+        if (victim == w) continue;
+        job = steal_job(victim);
+        if (job) {
+            w->stats.stolen++;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static job_t *alloc_job(job_worker_t *w) {
+    assert(w->pool_used < JOB_POOL_CAPACITY);
+    job_t *job = w->pool + w->pool_used++;
+    memset(job, 0, sizeof(job_t));
+    return job;
+}
+
+static void finish_job(job_worker_t *w, job_t *job) {
+    while (job && __atomic_sub_fetch(&job->unfinished, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (uint32_t i=0; i<job->dependent_count; i++) {
+            job_t *dependent = job->dependents[i];
+            if (__atomic_sub_fetch(&dependent->dependencies, 1, __ATOMIC_ACQ_REL) == 0) push_job(w, dependent);
+        }
+        // Nothing reads the job once done is set, its waiter may reset the pools.
+        job_t *parent = job->parent;
+        __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+        job = parent;
+    }
+}
+
+static void execute_job(job_worker_t *w, job_t *job) {
+    size_t end = job->end;
+
+    // Split off the upper halves, thieves take the largest ones first.
+    while (job->grain && end - job->begin > job->grain) {
+        const size_t mid = job->begin + (end - job->begin) / 2;
+        job_t *half = alloc_job(w);
+        half->fn = job->fn;
+        half->ctx = job->ctx;
+        half->begin = mid;
+        half->end = end;
+        half->grain = job->grain;
+        half->parent = job;
+        half->unfinished = 1;
+        __atomic_add_fetch(&job->unfinished, 1, __ATOMIC_RELAXED);
+        push_job(w, half);
+        w->stats.splits++;
+        end = mid;
+    }
+
+    if (job->fn && job->begin < end) job->fn(job->ctx, job->begin, end, w);
+    w->stats.executed++;
+    finish_job(w, job);
+}
+
+static void *worker_main(void *arg) {
+    worker_arg_t *wa = arg;
+    job_system_t *js = wa->js;
+    job_worker_t *w = js->workers + wa->worker_index;
+    free(wa);
+    current_worker = w;
+
+    size_t idle = 0;
+    while (1) {
+        if (!__atomic_load_n(&js->active, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_lock(&js->mutex);
+            while (!js->quit && !__atomic_load_n(&js->active, __ATOMIC_ACQUIRE)) {
+                pthread_cond_wait(&js->wake_cond, &js->mutex);
+            }
+            const bool quit = js->quit;
+            pthread_mutex_unlock(&js->mutex);
+            if (quit) break;
+        }
+
+        job_t *job = get_job(w);
+        if (job) {
+            idle = 0;
+            execute_job(w, job);
+        } else if (++idle > IDLE_SPINS) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+job_system_t *job_system_create(size_t worker_count) {
+    assert(worker_count >= 1);
+    if (worker_count > JOB_MAX_WORKERS) worker_count = JOB_MAX_WORKERS;
+
+    job_system_t *js = malloc(sizeof(job_system_t));
+    assert(js);
+    memset(js, 0, sizeof(job_system_t));
+
+    js->worker_count = worker_count;
+    int err = posix_memalign((void **)&js->workers, 64, sizeof(job_worker_t) * worker_count);
+    assert(!err);
+    memset(js->workers, 0, sizeof(job_worker_t) * worker_count);
+    for (size_t i=0; i<worker_count; i++) {
+        js->workers[i].js = js;
+        js->workers[i].index = i;
+        js->workers[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+    }
+
+    pthread_mutex_init(&js->mutex, NULL);
+    pthread_cond_init(&js->wake_cond, NULL);
+
+    // Worker 0 is the thread calling job_wait().
+    current_worker = js->workers;
+    for (size_t i=1; i<worker_count; i++) {
+        worker_arg_t *wa = malloc(sizeof(worker_arg_t));
+        wa->js = js;
+        wa->worker_index = i;
+        err = pthread_create(js->threads + i, NULL, worker_main, wa);
+        assert(!err);
+    }
+
+    return js;
+}
+
+void job_system_destroy(job_system_t *js) {
+    assert(js);
+
+    pthread_mutex_lock(&js->mutex);
+    js->quit = true;
+    pthread_cond_broadcast(&js->wake_cond);
+    pthread_mutex_unlock(&js->mutex);
+
+    for (size_t i=1; i<js->worker_count; i++) {
+        pthread_join(js->threads[i], NULL);
+    }
+    for (size_t i=0; i<js->worker_count; i++) {
+        for (size_t b=0; b<JOB_SCRATCH_MAX_BLOCKS; b++) free(js->workers[i].scratch[b].data);
+    }
+    if (current_worker && current_worker->js == js) current_worker = NULL;
+
+    pthread_mutex_destroy(&js->mutex);
+    pthread_cond_destroy(&js->wake_cond);
+    free(js->workers);
+    free(js);
+}
+
+size_t job_system_default_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > JOB_MAX_WORKERS) cpus = JOB_MAX_WORKERS;
+    return cpus;
+}
+
+void job_system_reset(job_system_t *js) {
+    assert(js);
+    assert(!__atomic_load_n(&js->active, __ATOMIC_RELAXED));
+
+    for (size_t i=0; i<js->worker_count; i++) {
+        job_worker_t *w = js->workers + i;
+        assert(__atomic_load_n(&w->top, __ATOMIC_RELAXED) >= __atomic_load_n(&w->bottom, __ATOMIC_RELAXED));
+        w->pool_used = 0;
+        w->scratch_block = 0;
+        w->scratch_used = 0;
+    }
+}
+
+void job_system_get_stats(const job_system_t *js, job_worker_stats_t *stats) {
+    assert(js);
+    assert(stats);
+
+    memset(stats, 0, sizeof(job_worker_stats_t));
+    for (size_t i=0; i<js->worker_count; i++) {
+        stats->executed += js->workers[i].stats.executed;
+        stats->stolen += js->workers[i].stats.stolen;
+        stats->splits += js->workers[i].stats.splits;
+    }
+}
+
+job_t *job_create(job_system_t *js, job_fn fn, void *ctx, size_t begin, size_t end, size_t grain) {
+    assert(js);
+    assert(current_worker && current_worker->js == js);
+    assert(begin <= end);
+
+    job_t *job = alloc_job(current_worker);
+    job->fn = fn;
+    job->ctx = ctx;
+    job->begin = begin;
+    job->end = end;
+    job->grain = grain;
+    job->unfinished = 1;
+    job->dependencies = 1;
+    return job;
+}
+
+void job_depends_on(job_t *job, job_t *dependency) {
+    assert(job);
+    assert(dependency);
+    assert(dependency->dependent_count < JOB_MAX_DEPENDENTS);
+    assert(!__atomic_load_n(&dependency->done, __ATOMIC_ACQUIRE));
+
+    job->dependencies++;
+    dependency->dependents[dependency->dependent_count++] = job;
+}
+
+void job_submit(job_system_t *js, job_t *job) {
+    assert(js);
+    assert(job);
+    assert(current_worker && current_worker->js == js);
+
+    if (__atomic_sub_fetch(&job->dependencies, 1, __ATOMIC_ACQ_REL) == 0) push_job(current_worker, job);
+}
+
+void job_wait(job_system_t *js, job_t *job) {
+    assert(js);
+    assert(job);
+    job_worker_t *w = current_worker;
+    assert(w && w->js == js);
+
+    // Worker 0 wakes the others for the outermost wait.
+    const bool outermost = w->index == 0 && !__atomic_load_n(&js->active, __ATOMIC_RELAXED);
+    if (outermost && js->worker_count > 1) {
+        pthread_mutex_lock(&js->mutex);
+        __atomic_store_n(&js->active, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&js->wake_cond);
+        pthread_mutex_unlock(&js->mutex);
+    }
+
+    size_t idle = 0;
+    while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+        job_t *next = get_job(w);
+        if (next) {
+            idle = 0;
+            execute_job(w, next);
+        } else if (++idle > IDLE_SPINS) {
+            sched_yield();
+        }
+    }
+
+    if (outermost && js->worker_count > 1) {
+        __atomic_store_n(&js->active, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void parallel_for(job_system_t *js, size_t count, size_t grain, job_fn fn, void *ctx) {
+    assert(fn);
+    if (!count) return;
+
+    if (!js) {
+        fn(ctx, 0, count, NULL);
+        return;
+    }
+
+    job_t *job = job_create(js, fn, ctx, 0, count, grain ? grain : 1);
+    job_submit(js, job);
+    job_wait(js, job);
+}
+
+void *job_scratch(job_worker_t *w, size_t size) {
+    assert(w);
+    size = (size + 15) & ~(size_t)15;
+
+    while (1) {
+        assert(w->scratch_block < JOB_SCRATCH_MAX_BLOCKS);
+        job_scratch_block_t *block = w->scratch + w->scratch_block;
+
+        if (!block->data) {
+            block->size = size > JOB_SCRATCH_BLOCK_SIZE ? size : JOB_SCRATCH_BLOCK_SIZE;
+            block->data = malloc(block->size); // 16 byte aligned
+            assert(block->data);
+        }
+        if (w->scratch_used + size <= block->size) {
+            void *ptr = (char *)block->data + w->scratch_used;
+            w->scratch_used += size;
+            return ptr;
+        }
+
+        // Blocks stay allocated across resets, a small one is replaced
+        // once it is empty.
+        if (w->scratch_used == 0) {
+            free(block->data);
+            block->data = NULL;
+            continue;
+        }
+        w->scratch_block++;
+        w->scratch_used = 0;
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+// Work-stealing job system for the tick phases. A job runs a function over
+// an index range [begin, end):
+//
+// - With a grain, the range is split in halves until at most grain indices
+//   are left; the halves go to the back of the running worker's deque.
+//   Workers take their own jobs from the back (last split, still in cache)
+//   and steal from the front of others' deques (the largest ranges left).
+// - A job is finished when its range and all jobs split off it are done.
+//   Jobs can depend on others: they are queued when the last one finishes.
+// - Every worker has a scratch arena for data jobs hand to later jobs,
+//   valid until job_system_reset().
+//
+// The thread that creates the system is worker 0 and the only one that
+// submits from outside jobs, one system per thread at a time. The others
+// only run jobs while it waits in job_wait(), and sleep otherwise.
+
+#define JOB_MAX_WORKERS        (16)
+#define JOB_DEQUE_CAPACITY     (4096) // per worker, power of two
+#define JOB_POOL_CAPACITY      (4096) // jobs per worker between resets
+#define JOB_MAX_DEPENDENTS     (8)
+#define JOB_SCRATCH_BLOCK_SIZE (1 << 20)
+#define JOB_SCRATCH_MAX_BLOCKS (64)
+
+struct job_worker;
+
+typedef void (*job_fn)(void *ctx, size_t begin, size_t end, struct job_worker *worker);
+
+typedef struct job {
+    job_fn fn;
+    void *ctx;
+    size_t begin;
+    size_t end;
+    size_t grain;             // 0: run [begin, end) in one call
+
+    struct job *parent;       // split off from
+    uint32_t unfinished;      // this range and split-off jobs not done yet
+    uint32_t dependencies;    // unfinished dependencies, + 1 until submitted
+    uint32_t done;
+    uint32_t dependent_count;
+    struct job *dependents[JOB_MAX_DEPENDENTS];
+} job_t;
+
+typedef struct {
+    void *data;
+    size_t size;
+} job_scratch_block_t;
+
+typedef struct {
+    uint64_t executed;
+    uint64_t stolen;
+    uint64_t splits;
+} job_worker_stats_t;
+
+typedef struct job_worker {
+    struct job_system *js;
+    size_t index;
+    uint64_t rng;
+
+    // Chase-Lev deque: the owner pushes and pops at bottom, thieves take top.
+    int64_t top;
+    int64_t bottom;
+    job_t *deque[JOB_DEQUE_CAPACITY];
+
+    size_t pool_used;
+    job_t pool[JOB_POOL_CAPACITY];
+
+    size_t scratch_block;     // current block
+    size_t scratch_used;      // in the current block
+    job_scratch_block_t scratch[JOB_SCRATCH_MAX_BLOCKS];
+
+    job_worker_stats_t stats;
+} __attribute__((aligned(64))) job_worker_t;
+
+typedef struct job_system {
+    size_t worker_count;
+    job_worker_t *workers;
+    pthread_t threads[JOB_MAX_WORKERS];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake_cond;
+    uint32_t active;          // worker 0 waits for jobs, the others look for work
+    bool quit;
+} job_system_t;
+
+job_system_t *job_system_create(size_t worker_count);
+void job_system_destroy(job_system_t *js);
+size_t job_system_default_count();
+
+// Reclaims all jobs and scratch memory, between runs only.
+void job_system_reset(job_system_t *js);
+void job_system_get_stats(const job_system_t *js, job_worker_stats_t *stats);
+
+// A job that isn't queued until job_submit(). Add dependencies before
+// submitting either side.
+job_t *job_create(job_system_t *js, job_fn fn, void *ctx, size_t begin, size_t end, size_t grain);
+void job_depends_on(job_t *job, job_t *dependency);
+void job_submit(job_system_t *js, job_t *job);
+// Runs jobs until job is finished.
+void job_wait(job_system_t *js, job_t *job);
+
+// fn over [0, count) in ranges of at most grain indices, returns when all
+// are done. Without a job system, one call on the calling thread.
+void parallel_for(job_system_t *js, size_t count, size_t grain, job_fn fn, void *ctx);
+
+// 16 byte aligned, not zeroed.
+void *job_scratch(job_worker_t *worker, size_t size);
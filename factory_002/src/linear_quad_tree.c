@@ -0,0 +1,297 @@
+#include "linear_quad_tree.h"
+#include "coord.h"
+#include "utils.h"
+#include "page_alloc.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+
+#define ITEM_MASK      ((((uint64_t)1) << LINEAR_QUAD_ITEM_BITS) - 1)
+#define COORD_MAX      ((1u << LINEAR_QUAD_COORD_BITS) - 1)
+
+#define KEY_BITS       (2 * LINEAR_QUAD_COORD_BITS + LINEAR_QUAD_ITEM_BITS)
+#define RADIX_BITS     (11)
+#define RADIX_BUCKETS  (1 << RADIX_BITS)
+#define RADIX_MASK     (RADIX_BUCKETS - 1)
+
+#define MAX_RANGES     (256)
+
+typedef struct {
+    uint64_t min;
+    uint64_t max;
+} morton_range_t;
+
+typedef struct {
+    size_t count;
+    morton_range_t ranges[MAX_RANGES];
+} morton_range_list_t;
+
+typedef struct {
+    uint32_t x_min;
+    uint32_t y_min;
+    uint32_t x_max;
+    uint32_t y_max;
+} cell_box_t;
+
+static uint64_t spread_bits(uint32_t v) {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x << 8))  & 0x00FF00FF00FF00FFull;
+    x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x << 2))  & 0x3333333333333333ull;
+    x = (x | (x << 1))  & 0x5555555555555555ull;
+    return x;
+}
+
+static uint32_t compact_bits(uint64_t x) {
+    x &= 0x5555555555555555ull;
+    x = (x | (x >> 1))  & 0x3333333333333333ull;
+    x = (x | (x >> 2))  & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x >> 4))  & 0x00FF00FF00FF00FFull;
+    x = (x | (x >> 8))  & 0x0000FFFF0000FFFFull;
+    x = (x | (x >> 16)) & 0x00000000FFFFFFFFull;
+    return (uint32_t)x;
+}
+
+static uint64_t morton_encode(uint32_t x, uint32_t y) {
+    // x in the even bits, y in the odd bits -> same child order as quad_tree_child_index().
+    return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+static uint32_t clamp_cell(int64_t v) {
+    if (v < 0) return 0;
+    if (v > COORD_MAX) return COORD_MAX;
+    return (uint32_t)v;
+}
+
+static void push_range(morton_range_list_t *list, uint64_t min, uint64_t max) {
+    assert(list);
+    assert(min <= max);
+
+    if (list->count) {
+        morton_range_t *last = list->ranges + list->count - 1;
+        assert(last->max < min);
+
+        // Adjacent or out of ranges: widen the previous one. The scan filters
+        // by position anyway, so a range may safely cover too much.
+        if (last->max + 1 == min || list->count == MAX_RANGES) {
+            last->max = max;
+            return;
+        }
+    }
+
+    list->ranges[list->count++] = (morton_range_t) { min, max };
+}
+
+static void collect_ranges(morton_range_list_t *list, cell_box_t box,
+        uint32_t cx, uint32_t cy, uint32_t level, uint32_t min_level) {
+
+    const uint32_t size = 1u << level;
+    const uint32_t cx_max = cx + size - 1;
+    const uint32_t cy_max = cy + size - 1;
+
+    if (cx_max < box.x_min || box.x_max < cx ||
+        cy_max < box.y_min || box.y_max < cy) {
+        return;
+    }
+
+    const bool inside = box.x_min <= cx && cx_max <= box.x_max &&
+                        box.y_min <= cy && cy_max <= box.y_max;
+
+    if (inside || level <= min_level) {
+        const uint64_t key = morton_encode(cx, cy);
+        push_range(list, key, key + ((((uint64_t)1) << (2 * level)) - 1));
+        return;
+    }
+
+    const uint32_t half = size / 2;
+    collect_ranges(list, box, cx,        cy,        level - 1, min_level);
+    collect_ranges(list, box, cx + half, cy,        level - 1, min_level);
+    collect_ranges(list, box, cx,        cy + half, level - 1, min_level);
+    collect_ranges(list, box, cx + half, cy + half, level - 1, min_level);
+}
+
+static size_t lower_bound(const uint64_t *entries, size_t begin, size_t end, uint64_t value) {
+    while (begin < end) {
+        size_t mid = begin + (end - begin) / 2;
+        if (entries[mid] < value) {
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return begin;
+}
+
+// -----
+
+linear_quad_tree_t *linear_quad_tree_create(size_t capacity) {
+    assert(capacity <= ITEM_MASK + 1);
+
+    linear_quad_tree_t *tree = malloc(sizeof(linear_quad_tree_t));
+    memset(tree, 0, sizeof(linear_quad_tree_t));
+
+    tree->capacity = capacity;
+    tree->count = 0;
+    tree->entries = page_alloc(PAGE_SUBSYSTEM_LINEAR_QUAD_TREE, sizeof(uint64_t) * capacity);
+    tree->scratch = page_alloc(PAGE_SUBSYSTEM_LINEAR_QUAD_TREE, sizeof(uint64_t) * capacity);
+    assert(tree->entries);
+    assert(tree->scratch);
+
+    return tree;
+}
+
+void linear_quad_tree_destroy(linear_quad_tree_t *tree) {
+    assert(tree);
+
+    page_free(tree->entries);
+    page_free(tree->scratch);
+    free(tree);
+}
+
+void linear_quad_tree_reset(linear_quad_tree_t *tree) {
+    assert(tree);
+    tree->count = 0;
+}
+
+void linear_quad_tree_add(linear_quad_tree_t *tree, coord_t pos, size_t item) {
+    assert(tree);
+    assert(item);
+    assert(item <= ITEM_MASK);
+
+    const int64_t x = (int64_t)pos.x + LINEAR_QUAD_COORD_OFFSET;
+    const int64_t y = (int64_t)pos.y + LINEAR_QUAD_COORD_OFFSET;
+
+    if (x < 0 || x > COORD_MAX || y < 0 || y > COORD_MAX) {
+        printf("outside bounds of root: %d %d\n", pos.x, pos.y);
+        assert(0);
+        return;
+    }
+
+    if (tree->count >= tree->capacity) {
+        printf("linear quad tree full\n");
+        assert(0);
+        return;
+    }
+
+    tree->entries[tree->count++] = linear_quad_tree_entry(pos, item);
+}
+
+uint64_t linear_quad_tree_entry(coord_t pos, size_t item) {
+    const int64_t x = (int64_t)pos.x + LINEAR_QUAD_COORD_OFFSET;
+    const int64_t y = (int64_t)pos.y + LINEAR_QUAD_COORD_OFFSET;
+    assert(x >= 0 && x <= COORD_MAX && y >= 0 && y <= COORD_MAX);
+    assert(item && item <= ITEM_MASK);
+    return (morton_encode((uint32_t)x, (uint32_t)y) << LINEAR_QUAD_ITEM_BITS) | item;
+}
+
+void linear_quad_tree_build(linear_quad_tree_t *tree) {
+    assert(tree);
+
+    // LSD radix sort over the used key bits. Passes where every entry has the
+    // same digit (typically the high bits of a compact world) are skipped.
+
+    size_t histogram[RADIX_BUCKETS];
+
+    uint64_t *src = tree->entries;
+    uint64_t *dst = tree->scratch;
+    const size_t count = tree->count;
+
+    if (count < 2) return;
+
+    for (uint32_t shift=0; shift<KEY_BITS; shift+=RADIX_BITS) {
+        memset(histogram, 0, sizeof(histogram));
+
+        for (size_t i=0; i<count; i++) {
+            histogram[(src[i] >> shift) & RADIX_MASK]++;
+        }
+        if (histogram[(src[0] >> shift) & RADIX_MASK] == count) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (size_t b=0; b<RADIX_BUCKETS; b++) {
+            size_t n = histogram[b];
+            histogram[b] = offset;
+            offset += n;
+        }
+
+        for (size_t i=0; i<count; i++) {
+            const uint64_t e = src[i];
+            dst[histogram[(e >> shift) & RADIX_MASK]++] = e;
+        }
+
+        uint64_t *temp = src;
+        src = dst;
+        dst = temp;
+    }
+
+    tree->entries = src;
+    tree->scratch = dst;
+}
+
+void linear_quad_tree_query(const linear_quad_tree_t *tree, quad_aabb_t bounds, quad_tree_query_result_t *query_result) {
+    assert(tree);
+    assert(query_result);
+
+    if (bounds.x_max < bounds.x_min || bounds.y_max < bounds.y_min) return;
+    if ((int64_t)bounds.x_max + LINEAR_QUAD_COORD_OFFSET < 0 ||
+        (int64_t)bounds.y_max + LINEAR_QUAD_COORD_OFFSET < 0 ||
+        (int64_t)bounds.x_min - 1 + LINEAR_QUAD_COORD_OFFSET > COORD_MAX ||
+        (int64_t)bounds.y_min - 1 + LINEAR_QUAD_COORD_OFFSET > COORD_MAX) {
+        return;
+    }
+
+    // Same semantics as quad_tree_query(): an item at pos covers the cell
+    // [pos, pos+1], and is returned if that cell touches the (closed) bounds.
+    const cell_box_t box = {
+        .x_min = clamp_cell((int64_t)bounds.x_min - 1 + LINEAR_QUAD_COORD_OFFSET),
+        .y_min = clamp_cell((int64_t)bounds.y_min - 1 + LINEAR_QUAD_COORD_OFFSET),
+        .x_max = clamp_cell((int64_t)bounds.x_max + LINEAR_QUAD_COORD_OFFSET),
+        .y_max = clamp_cell((int64_t)bounds.y_max + LINEAR_QUAD_COORD_OFFSET),
+    };
+
+    // Don't subdivide below ~1/8 of the query extent: keeps the range count
+    // small, the few extra entries are rejected by the position filter.
+    uint32_t extent = box.x_max - box.x_min + 1;
+    if (box.y_max - box.y_min + 1 > extent) extent = box.y_max - box.y_min + 1;
+    uint32_t min_level = 0;
+    while ((1u << (min_level + 3)) < extent) min_level++;
+
+    morton_range_list_t list;
+    list.count = 0;
+    collect_ranges(&list, box, 0, 0, LINEAR_QUAD_COORD_BITS, min_level);
+    // Ranges are what this index visits instead of nodes.
+    metrics_add(METRIC_QUAD_QUERIES, 1);
+    metrics_add(METRIC_QUAD_NODES, list.count);
+
+    size_t pos = 0;
+    for (size_t r=0; r<list.count; r++) {
+        const morton_range_t range = list.ranges[r];
+
+        pos = lower_bound(tree->entries, pos, tree->count, range.min << LINEAR_QUAD_ITEM_BITS);
+
+        for (; pos<tree->count; pos++) {
+            const uint64_t e = tree->entries[pos];
+            const uint64_t key = e >> LINEAR_QUAD_ITEM_BITS;
+            if (key > range.max) break;
+
+            const uint32_t x = compact_bits(key);
+            const uint32_t y = compact_bits(key >> 1);
+            if (x < box.x_min || box.x_max < x || y < box.y_min || box.y_max < y) {
+                continue;
+            }
+
+            if (query_result->count < query_result->capacity) {
+                query_result->items[query_result->count++] = e & ITEM_MASK;
+            } else {
+                printf("query result full\n");
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "coord.h"
+#include "quad_tree.h"
+
+// Linear (pointer-free) quad tree: all items live in one flat array, sorted by
+// the Z-order (morton) key of their position. Every quad tree node corresponds
+// to a contiguous key range, so a query becomes a few sequential scans.
+
+#define LINEAR_QUAD_COORD_BITS   (17)
+#define LINEAR_QUAD_COORD_OFFSET (1 << 16)
+#define LINEAR_QUAD_ITEM_BITS    (20)
+
+typedef struct {
+    size_t capacity;
+    size_t count;
+    uint64_t *entries; // morton key << ITEM_BITS | item
+    uint64_t *scratch; // radix sort ping-pong buffer
+} linear_quad_tree_t;
+
+linear_quad_tree_t *linear_quad_tree_create(size_t capacity);
+void linear_quad_tree_destroy(linear_quad_tree_t *tree);
+
+void linear_quad_tree_reset(linear_quad_tree_t *tree);
+void linear_quad_tree_add(linear_quad_tree_t *tree, coord_t pos, size_t item);
+// What linear_quad_tree_add() appends, for filling entries directly.
+uint64_t linear_quad_tree_entry(coord_t pos, size_t item);
+void linear_quad_tree_build(linear_quad_tree_t *tree);
+void linear_quad_tree_query(const linear_quad_tree_t *tree, quad_aabb_t bounds, quad_tree_query_result_t *result);
@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include <raylib.h>
 #include <raymath.h>
@@ -10,47 +14,119 @@
 #include "utils.h"
 #include "game_state.h"
 #include "renderer.h"
+#include "visible_set.h"
+#include "analysis.h"
+#include "blueprint.h"
+#include "shard.h"
+#include "net.h"
+#include "history.h"
+#include "page_alloc.h"
+#include "recipe.h"
+#include "diff_test.h"
+#include "item_trace.h"
+#include "metrics.h"
+#include "job_system.h"
+#include "world_store.h"
 
 static bool rectangle_contains(Rectangle r, Vector2 p) {
     return r.x <= p.x && p.x <= r.x + r.width &&
         r.y <= p.y && p.y <= r.y + r.height;
 }
 
-static void build_some_stuff(game_state_t *gs, int32_t x, int32_t y) {
-    size_t miner1a = spawn_miner(gs, (coord_t){x+1, y+1});
-    size_t belt1a = spawn_belt(gs, (coord_t){x+3, y+1});
-    size_t belt2a = spawn_belt(gs, (coord_t){x+4, y+1});
-    size_t factory1a = spawn_factory(gs, (coord_t){x+5, y+1});
-    size_t belt3a = spawn_belt(gs, (coord_t){x+7, y+1});
+// Latest value of each series with a sparkline of its history, scaled from
+// 0 to the largest value shown.
+static void draw_metrics(const metrics_t *m, int x, int y) {
+    const int row_height = 22;
+    const int label_width = 260;
+    const int step = 2;
+    const int spark_height = 16;
 
-    connect_buildings(gs, miner1a, belt1a);
-    connect_buildings(gs, belt1a, belt2a);
-    connect_buildings(gs, belt2a, factory1a);
-    connect_buildings(gs, factory1a, belt3a);
+    DrawRectangle(x - 5, y - 5, label_width + step * METRICS_HISTORY + 10,
+            METRIC_SERIES_COUNT * row_height + 10, Fade(BLACK, 0.6f));
+
+    for (size_t s=0; s<METRIC_SERIES_COUNT; s++) {
+        const int row_y = y + s * row_height;
+        DrawText(TextFormat("%s: %.*f", metrics_series_name(s), s <= METRIC_SERIES_STEP_4_MS ? 3 : 1,
+                    metrics_last(m, s)), x, row_y, 20, WHITE);
+
+        float max = 0.0f;
+        for (size_t i=0; i<m->count; i++) {
+            if (m->history[s][i] > max) max = m->history[s][i];
+        }
+
+        Vector2 prev = {};
+        for (size_t i=0; i<m->count; i++) {
+            const float v = m->history[s][(m->head + METRICS_HISTORY - m->count + i) % METRICS_HISTORY];
+            const Vector2 p = {
+                .x = x + label_width + step * i,
+                .y = row_y + spark_height - (max > 0.0f ? v / max * spark_height : 0.0f),
+            };
+            if (i) DrawLineV(prev, p, GREEN);
+            prev = p;
+        }
+    }
+}
+
+static void init_some_stuff_blueprint(blueprint_t *bp) {
+    blueprint_init(bp);
+
+    uint32_t miner1a = blueprint_add(bp, BUILDING_TYPE_MINER, (coord_t){1, 1});
+    uint32_t belt1a = blueprint_add(bp, BUILDING_TYPE_BELT, (coord_t){3, 1});
+    uint32_t belt2a = blueprint_add(bp, BUILDING_TYPE_BELT, (coord_t){4, 1});
+    uint32_t factory1a = blueprint_add(bp, BUILDING_TYPE_FACTORY, (coord_t){5, 1});
+    uint32_t belt3a = blueprint_add(bp, BUILDING_TYPE_BELT, (coord_t){7, 1});
+
+    blueprint_connect(bp, miner1a, belt1a);
+    blueprint_connect(bp, belt1a, belt2a);
+    blueprint_connect(bp, belt2a, factory1a);
+    blueprint_connect(bp, factory1a, belt3a);
 
     // Note: same as above but in reverse
-    size_t belt3b = spawn_belt(gs, (coord_t){x+7, y+4});
-    size_t factory1b = spawn_factory(gs, (coord_t){x+5, y+4});
-    size_t belt2b = spawn_belt(gs, (coord_t){x+4, y+4});
-    size_t belt1b = spawn_belt(gs, (coord_t){x+3, y+4});
-    size_t miner1b = spawn_miner(gs, (coord_t){x+1, y+4});
-
-    size_t belt4b = spawn_belt(gs, (coord_t){x+8, y+4});
-    size_t belt5b = spawn_belt(gs, (coord_t){x+8, y+3});
-
-    connect_buildings(gs, miner1b, belt1b);
-    connect_buildings(gs, belt1b, belt2b);
-    connect_buildings(gs, belt2b, factory1b);
-    connect_buildings(gs, factory1b, belt3b);
-    connect_buildings(gs, belt3b, belt4b);
-    connect_buildings(gs, belt4b, belt5b);
-
-    size_t factory2 = spawn_factory(gs, (coord_t){x+8, y+1});
-    size_t belt10 = spawn_belt(gs, (coord_t){x+10, y+2});
-
-    connect_buildings(gs, belt3a, factory2);
-    connect_buildings(gs, belt5b, factory2);
-    connect_buildings(gs, factory2, belt10);
+    uint32_t belt3b = blueprint_add(bp, BUILDING_TYPE_BELT, (coord_t){7, 4});
+    uint32_t factory1b = blueprint_add(bp, BUILDING_TYPE_FACTORY, (coord_t){5, 4});
+    uint32_t belt2b = blueprint_add(bp, BUILDING_TYPE_BELT, (coord_t){4, 4});
+    uint32_t belt1b = blueprint_add(bp, BUILDING_TYPE_BELT, (coord_t){3, 4});
+    uint32_t miner1b = blueprint_add(bp, BUILDING_TYPE_MINER, (coord_t){1, 4});
+
+    uint32_t belt4b = blueprint_add(bp, BUILDING_TYPE_BELT, (coord_t){8, 4});
+    uint32_t belt5b = blueprint_add(bp, BUILDING_TYPE_BELT, (coord_t){8, 3});
+
+    blueprint_connect(bp, miner1b, belt1b);
+    blueprint_connect(bp, belt1b, belt2b);
+    blueprint_connect(bp, belt2b, factory1b);
+    blueprint_connect(bp, factory1b, belt3b);
+    blueprint_connect(bp, belt3b, belt4b);
+    blueprint_connect(bp, belt4b, belt5b);
+
+    uint32_t factory2 = blueprint_add(bp, BUILDING_TYPE_FACTORY, (coord_t){8, 1});
+    blueprint_set_recipe(bp, factory2, RECIPE_PRESS); // takes what the assemblers make
+    uint32_t belt10 = blueprint_add(bp, BUILDING_TYPE_BELT, (coord_t){10, 2});
+
+    blueprint_connect(bp, belt3a, factory2);
+    blueprint_connect(bp, belt5b, factory2);
+    blueprint_connect(bp, factory2, belt10);
+}
+
+// Origins of a grid of columns x rows copies of the blueprint above.
+static coord_t *some_stuff_positions(int32_t columns, int32_t rows) {
+    coord_t *positions = malloc(sizeof(coord_t) * columns * rows);
+    assert(positions);
+    size_t n = 0;
+    for (int32_t xi=0; xi<columns; xi++) {
+        for (int32_t yi=0; yi<rows; yi++) {
+            positions[n++] = (coord_t){ xi * 12 + 10, yi * 8 };
+        }
+    }
+    return positions;
+}
+
+static void build_some_stuff(game_state_t *gs, int32_t columns, int32_t rows) {
+    blueprint_t bp;
+    init_some_stuff_blueprint(&bp);
+
+    coord_t *positions = some_stuff_positions(columns, rows);
+    stamp_blueprint(gs, &bp, positions, columns * rows);
+    free(positions);
 }
 
 static void build_some_more_stuff(game_state_t *gs) {
@@ -77,7 +153,555 @@ static void build_some_more_stuff(game_state_t *gs) {
     //connect_buildings(gs, belt5, belt6);
 }
 
-int main(void) {
+// Headless: renders a few worlds at several zoom levels through the null and
+// software backends and prints CPU cost per frame. Needs no window.
+static int run_render_benchmark(void) {
+    const int screen_width = 1600;
+    const int screen_height = 1200;
+    const int frame_count = 20;
+
+    const int32_t world_columns[] = { 10, 100, 712 };
+    const float zooms[] = { 1.0f, 0.5f, 0.2f, 0.1f, 0.04f, 0.01f };
+
+    render_null_backend_t null_backend;
+    render_null_backend_init(&null_backend);
+    render_software_backend_t software_backend;
+    render_software_backend_init(&software_backend, screen_width, screen_height);
+
+    render_backend_t *backends[] = { &null_backend.base, &software_backend.base };
+
+    static const quad_node_t *nodes[1000 * 10];
+
+    printf("%9s %6s %4s %8s %9s %9s %8s %8s %9s %7s %10s\n", "buildings", "zoom", "lod", "visible",
+            "backend", "ms/frame", "cmds", "batches", "vertices", "states", "pixels");
+
+    for (size_t wi=0; wi<ARRAY_LENGTH(world_columns); wi++) {
+        game_state_t *active_gs = create_game_state();
+        game_state_t *next_gs = create_game_state();
+
+        build_some_stuff(active_gs, world_columns[wi], 10);
+        // Some ticks, so belts carry items.
+        for (int i=0; i<20; i++) {
+            update_game_state(active_gs, next_gs);
+            game_state_t *temp = active_gs;
+            active_gs = next_gs;
+            next_gs = temp;
+        }
+
+        render_state_t render_state;
+        init_render_state(&render_state);
+        render_consume_edits(&render_state, active_gs);
+
+        visible_set_t visible_set;
+        visible_set_init(&visible_set, 1000 * 10);
+
+        for (size_t zi=0; zi<ARRAY_LENGTH(zooms); zi++) {
+            const Camera2D camera = {
+                .target = { 0.0f, -100.0f },
+                .offset = { 0.0f, 0.0f },
+                .rotation = 0.0f,
+                .zoom = zooms[zi],
+            };
+            const quad_aabb_t qb = {
+                .x_min = -2,
+                .y_min = -3,
+                .x_max = (int32_t)(screen_width / camera.zoom / WORLD_CELL_SIZE) + 2,
+                .y_max = (int32_t)(screen_height / camera.zoom / WORLD_CELL_SIZE) + 1,
+            };
+
+            const int32_t lod_node_size = get_lod_node_size(&render_state, camera.zoom, qb, ARRAY_LENGTH(nodes));
+            quad_tree_node_result_t nr = {
+                .capacity = ARRAY_LENGTH(nodes),
+                .count = 0,
+                .nodes = nodes,
+            };
+            size_t visible = 0;
+            if (lod_node_size > 1) {
+                quad_tree_query_nodes(active_gs->quad_tree, qb, lod_node_size, &nr);
+                visible = nr.count;
+            } else {
+                visible_set_update(&visible_set, active_gs, qb);
+                visible = visible_set.count;
+            }
+
+            software_backend.camera = camera;
+
+            for (size_t bi=0; bi<ARRAY_LENGTH(backends); bi++) {
+                render_state.backend = backends[bi];
+
+                double total_ms = 0.0;
+                for (int frame=-1; frame<frame_count; frame++) {
+                    render_null_backend_reset(&null_backend);
+                    render_software_backend_clear(&software_backend, BROWN);
+
+                    // frame -1 warms up the geometry cache
+                    const double start = get_time_ms();
+                    if (lod_node_size > 1) {
+                        render_world_lod(active_gs, &render_state, nr.count, nr.nodes);
+                    } else {
+                        render_world(active_gs, &render_state, visible_set.count, visible_set.items);
+                    }
+                    if (frame >= 0) total_ms += get_time_ms() - start;
+                }
+
+                printf("%9lu %6.2f %4d %8lu %9s %9.3f %8lu %8lu %9lu %7lu %10lu\n",
+                        active_gs->building_count, camera.zoom, lod_node_size, visible,
+                        backends[bi]->name, total_ms / frame_count,
+                        render_state.stats.commands, render_state.stats.batches, render_state.stats.vertices,
+                        null_backend.state_changes, software_backend.pixels_written);
+            }
+        }
+
+        free_render_state(&render_state);
+        visible_set_free(&visible_set);
+        destroy_game_state(active_gs);
+        destroy_game_state(next_gs);
+    }
+
+    render_software_backend_free(&software_backend);
+    return 0;
+}
+
+// Headless: runs one world on 1, 2, 4, ... worker processes up to
+// max_shards and prints the cost per tick. Needs no window.
+static int run_shard_benchmark(size_t max_shards, uint64_t ticks) {
+    const int32_t columns = 400;
+    const int32_t rows = 50;
+
+    blueprint_t bp;
+    init_some_stuff_blueprint(&bp);
+    coord_t *positions = some_stuff_positions(columns, rows);
+
+    shard_world_t world;
+    shard_world_init(&world);
+    shard_world_add_blueprint(&world, &bp, positions, columns * rows);
+    free(positions);
+
+    // Belt lines across the whole world, fed all along, so items cross every
+    // shard boundary.
+    for (int32_t line=0; line<16; line++) {
+        const int32_t y = -3 - line * 2;
+        uint32_t previous = shard_world_add_building(&world, BUILDING_TYPE_MINER, (coord_t){ 0, y });
+        for (int32_t x=2; x<columns * 12 + 10; x++) {
+            const uint32_t belt = shard_world_add_building(&world, BUILDING_TYPE_BELT, (coord_t){ x, y });
+            shard_world_connect(&world, previous, belt);
+            if (x % 4 == 0) {
+                const uint32_t miner = shard_world_add_building(&world, BUILDING_TYPE_MINER, (coord_t){ x, y - 1 });
+                shard_world_connect(&world, miner, belt);
+            }
+            previous = belt;
+        }
+    }
+
+    if (max_shards < 1) max_shards = 1;
+    if (max_shards > SHARD_MAX_COUNT) max_shards = SHARD_MAX_COUNT;
+
+    printf("%6s %9s %6s %9s %10s %10s %8s %18s\n", "shards", "buildings", "ticks",
+            "ms/tick", "max step", "transfers", "items", "digest");
+
+    for (size_t shards=1; shards<=max_shards; shards*=2) {
+        shard_stats_t stats;
+        if (!shard_run(&world, shards, ticks, &stats)) {
+            shard_world_free(&world);
+            return 1;
+        }
+        printf("%6lu %9lu %6lu %9.3f %10.3f %10.2f %8lu %18lx\n", shards, world.building_count, ticks,
+                stats.ms_per_tick, stats.max_step_ms, stats.transfers_per_tick, stats.items, stats.digest);
+    }
+
+    shard_world_free(&world);
+    return 0;
+}
+
+// Headless: runs the usual world serially, then with steps 1 and 4 on 1, 2,
+// 4, ... job workers up to max_workers, and prints the cost per tick and
+// phase. Phase times come from the metrics counters.
+static int run_job_benchmark(size_t max_workers, uint64_t ticks) {
+    if (max_workers < 1) max_workers = 1;
+    if (max_workers > JOB_MAX_WORKERS) max_workers = JOB_MAX_WORKERS;
+
+    metrics_t metrics;
+    metrics_init(&metrics);
+    metrics_set_enabled(&metrics, true);
+
+    const metric_counter_t phases[] = { METRIC_STEP_1_NS, METRIC_STEP_3_NS, METRIC_STEP_4_NS };
+    double serial_ms = 0.0;
+    size_t buildings = 0;
+    char report[4096];
+    size_t report_length = snprintf(report, sizeof(report), "%7s %9s %9s %9s %9s %8s %12s\n",
+            "workers", "ms/tick", "step 1", "step 3", "step 4", "speedup", "steals/tick");
+
+    // The update prints its phase times, not wanted between the lines.
+    fflush(stdout);
+    const int saved_stdout = dup(STDOUT_FILENO);
+    const int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    // 0 is the serial run, the last one has max_workers.
+    for (size_t workers=0; workers<=max_workers;
+            workers = (workers && workers < max_workers && workers * 2 > max_workers) ? max_workers : (workers ? workers * 2 : 1)) {
+        game_state_t *active_gs = create_game_state();
+        game_state_t *next_gs = create_game_state();
+        build_some_stuff(active_gs, 712, 10);
+        build_some_more_stuff(active_gs);
+        buildings = active_gs->building_count;
+
+        job_system_t *jobs = workers ? job_system_create(workers) : NULL;
+        active_gs->jobs = jobs;
+
+        uint64_t phase_ns[ARRAY_LENGTH(phases)];
+        for (size_t p=0; p<ARRAY_LENGTH(phases); p++) phase_ns[p] = metrics_total(phases[p]);
+        const double start = get_time_ms();
+        for (uint64_t tick=0; tick<ticks; tick++) {
+            update_game_state(active_gs, next_gs);
+            game_state_t *temp = active_gs;
+            active_gs = next_gs;
+            next_gs = temp;
+        }
+        const double ms_per_tick = (get_time_ms() - start) / ticks;
+        for (size_t p=0; p<ARRAY_LENGTH(phases); p++) phase_ns[p] = metrics_total(phases[p]) - phase_ns[p];
+        if (!workers) serial_ms = ms_per_tick;
+
+        job_worker_stats_t stats = {};
+        if (jobs) job_system_get_stats(jobs, &stats);
+        char name[16];
+        snprintf(name, sizeof(name), workers ? "%lu" : "serial", workers);
+        if (report_length < sizeof(report)) {
+            report_length += snprintf(report + report_length, sizeof(report) - report_length,
+                    "%7s %9.3f %9.3f %9.3f %9.3f %7.2fx %12.1f\n", name, ms_per_tick,
+                    phase_ns[0] / 1e6 / ticks, phase_ns[1] / 1e6 / ticks, phase_ns[2] / 1e6 / ticks,
+                    serial_ms / ms_per_tick, (double)stats.stolen / ticks);
+        }
+
+        if (jobs) job_system_destroy(jobs);
+        destroy_game_state(active_gs);
+        destroy_game_state(next_gs);
+    }
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(null_fd);
+
+    printf("%lu buildings, %lu ticks, %lu cpus\n%s", buildings, ticks, job_system_default_count(), report);
+    metrics_set_enabled(&metrics, false);
+    return 0;
+}
+
+// Copies of a blueprint through the edit functions, so they can go next to
+// anything (stamp_blueprint() only appends past the used handle slots).
+static void place_blueprint(game_state_t *gs, const blueprint_t *bp, const coord_t *positions, size_t n) {
+    handle_t handles[BLUEPRINT_MAX_BUILDINGS];
+    for (size_t i=0; i<n; i++) {
+        for (size_t k=0; k<bp->building_count; k++) {
+            const blueprint_building_t *b = bp->buildings + k;
+            const coord_t pos = { positions[i].x + b->offset.x, positions[i].y + b->offset.y };
+            switch (b->type) {
+                case BUILDING_TYPE_MINER: handles[k] = spawn_miner(gs, pos); break;
+                case BUILDING_TYPE_FACTORY: handles[k] = spawn_factory(gs, pos); break;
+                case BUILDING_TYPE_BELT: handles[k] = spawn_belt(gs, pos); break;
+            }
+            if (b->type == BUILDING_TYPE_FACTORY) set_factory_recipe(gs, handles[k], b->recipe);
+        }
+        for (size_t k=0; k<bp->building_count; k++) {
+            if (bp->buildings[k].target != BLUEPRINT_NONE) connect_buildings(gs, handles[k], handles[bp->buildings[k].target]);
+        }
+    }
+}
+
+static double resident_mib(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    unsigned long pages = 0, resident = 0;
+    if (f) {
+        if (fscanf(f, "%lu %lu", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (double)sysconf(_SC_PAGESIZE) / 1048576.0;
+}
+
+// Headless: fills path with side x side chunks of the usual blueprint if it
+// has no chunks yet, then flies a view across the world and back, with
+// prefetching and without, and prints what is resident and what it cost.
+static int run_stream_benchmark(const char *path, int32_t side, uint64_t frames) {
+    world_store_t store;
+    if (!world_store_open(&store, path)) return 1;
+
+    game_state_t *active_gs = create_game_state();
+    game_state_t *next_gs = create_game_state();
+    region_scheduler_t regions;
+    region_scheduler_init(&regions);
+    active_gs->regions = &regions;
+
+    // The update prints its phase times, not wanted between the lines.
+    fflush(stdout);
+    const int saved_stdout = dup(STDOUT_FILENO);
+    const int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    const int32_t origin = -(side * WORLD_CHUNK_SIZE) / 2;
+    size_t generated = 0;
+    double generate_ms = get_time_ms();
+    if (!store.opened_chunks) {
+        blueprint_t bp;
+        init_some_stuff_blueprint(&bp);
+        const int32_t columns = side * WORLD_CHUNK_SIZE / 12;
+        const int32_t rows = WORLD_CHUNK_SIZE / 8;
+        coord_t *positions = malloc(sizeof(coord_t) * columns * rows);
+        assert(positions);
+
+        // A strip of chunks at a time, written and evicted before the next.
+        for (int32_t strip=0; strip<side; strip++) {
+            size_t n = 0;
+            for (int32_t yi=0; yi<rows; yi++) {
+                for (int32_t xi=0; xi<columns; xi++) {
+                    positions[n++] = (coord_t) { origin + xi * 12, origin + strip * WORLD_CHUNK_SIZE + yi * 8 };
+                }
+            }
+            place_blueprint(active_gs, &bp, positions, n);
+            generated += n * bp.building_count;
+            world_store_evict_all(&store, active_gs);
+            update_game_state(active_gs, next_gs);
+            game_state_t *temp = active_gs;
+            active_gs = next_gs;
+            next_gs = temp;
+        }
+        free(positions);
+    }
+    generate_ms = get_time_ms() - generate_ms;
+
+    const int32_t view_w = 400;
+    const int32_t view_h = 300;
+    const float frames_per_second = 60.0f;
+    const float span = side * WORLD_CHUNK_SIZE + view_w;
+    const float speed = span / (frames - 1) * frames_per_second; // cells per second
+
+    char report[8192];
+    size_t report_length = snprintf(report, sizeof(report), "%9s %6s %9s %9s %7s %8s %8s %8s %9s %6s %9s %9s %9s\n",
+            "prefetch", "frame", "resident", "buildings", "mapped", "demand", "ahead", "evicted",
+            "suspended", "RSS", "store ms", "max ms", "tick ms");
+
+    for (int pass=0; pass<2; pass++) {
+        const bool prefetch = pass == 0;
+        const float direction = prefetch ? 1.0f : -1.0f;
+        const world_store_stats_t start = store.stats;
+        double store_ms = 0.0, max_store_ms = 0.0, tick_ms = 0.0;
+
+        for (uint64_t frame=0; frame<frames; frame++) {
+            // Across the world and a bit past its edges, east then west.
+            const float t = (float)frame / (frames - 1);
+            const int32_t x = origin - view_w + (int32_t)((prefetch ? t : 1.0f - t) * span);
+            const int32_t y = -view_h / 2;
+            const quad_aabb_t view = { x, y, x + view_w, y + view_h };
+            world_store_update(&store, active_gs, view, prefetch ? direction * speed : 0.0f, 0.0f);
+            store_ms += store.stats.update_ms;
+            if (store.stats.update_ms > max_store_ms) max_store_ms = store.stats.update_ms;
+
+            region_scheduler_set_view(&regions, view);
+            const double tick_start = get_time_ms();
+            update_game_state(active_gs, next_gs);
+            tick_ms += get_time_ms() - tick_start;
+            game_state_t *temp = active_gs;
+            active_gs = next_gs;
+            next_gs = temp;
+
+            const world_store_stats_t *s = &store.stats;
+            if (((frame + 1) % (frames / 8 ? frames / 8 : 1) == 0 || frame + 1 == frames) && report_length < sizeof(report)) {
+                report_length += snprintf(report + report_length, sizeof(report) - report_length,
+                        "%9s %6lu %9lu %9lu %7lu %8lu %8lu %8lu %9lu %6.0f %9.3f %9.3f %9.3f\n",
+                        prefetch ? "on" : "off", frame + 1, s->resident_chunks, s->resident_buildings, s->mapped,
+                        s->demand_loads - start.demand_loads, s->prefetch_loads - start.prefetch_loads,
+                        s->evictions - start.evictions, s->suspended_links, resident_mib(),
+                        store_ms / (frame + 1), max_store_ms, tick_ms / (frame + 1));
+            }
+        }
+    }
+
+    world_store_evict_all(&store, active_gs);
+    const uint64_t writes = store.stats.writes;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(null_fd);
+
+    if (generated) printf("generated %lu buildings in %d x %d chunks in %.0f ms\n", generated, side, side, generate_ms);
+    printf("%d x %d cell view at %.0f cells/s, %lu frames each way, %lu chunk writes\n%s", view_w, view_h,
+            speed, frames, writes, report);
+
+    world_store_close(&store);
+    destroy_game_state(active_gs);
+    destroy_game_state(next_gs);
+    region_scheduler_free(&regions);
+    return 0;
+}
+
+// Headless: traces the usual world for ticks ticks into path, then reports.
+static int run_trace(uint64_t ticks, const char *path) {
+    game_state_t *active_gs = create_game_state();
+    game_state_t *next_gs = create_game_state();
+
+    build_some_stuff(active_gs, 712, 10);
+    build_some_more_stuff(active_gs);
+    printf("entities: %lu | %lu %lu %lu\n", active_gs->building_count, active_gs->miner_count,
+            active_gs->belt_count, active_gs->factory_count);
+
+    // Untraced first, for comparison.
+    double untraced_ms = 0.0;
+    double traced_ms = 0.0;
+    for (uint64_t tick=0; tick<2*ticks; tick++) {
+        if (tick == ticks) trace_start(TRACE_DEFAULT_RING_RECORDS);
+        const double start = get_time_ms();
+        update_game_state(active_gs, next_gs);
+        *(tick < ticks ? &untraced_ms : &traced_ms) += get_time_ms() - start;
+        game_state_t *temp = active_gs;
+        active_gs = next_gs;
+        next_gs = temp;
+    }
+    trace_stop();
+
+    const bool ok = trace_write(path, active_gs) && trace_report(path);
+    printf("%.3f ms/tick untraced, %.3f ms/tick traced\n", untraced_ms / ticks, traced_ms / ticks);
+
+    destroy_game_state(active_gs);
+    destroy_game_state(next_gs);
+    return ok ? 0 : 1;
+}
+
+// Headless: simulates the usual world and streams it to viewers started
+// with --connect. Runs for ticks ticks, forever if 0.
+static int run_server(const char *path, uint64_t ticks) {
+    const int ticks_per_second = 60;
+
+    net_server_t server;
+    if (!net_server_init(&server, path)) return 1;
+
+    game_state_t *active_gs = create_game_state();
+    game_state_t *next_gs = create_game_state();
+
+    // Full rate where somebody watches.
+    region_scheduler_t regions;
+    region_scheduler_init(&regions);
+    active_gs->regions = &regions;
+
+    build_some_stuff(active_gs, 712, 10);
+    build_some_more_stuff(active_gs);
+    printf("entities: %lu | %lu %lu %lu\n", active_gs->building_count, active_gs->miner_count,
+            active_gs->belt_count, active_gs->factory_count);
+
+    double report_start = get_time_ms();
+    net_stats_t reported = {};
+    double sim_ms = 0.0;
+    uint64_t sim_ticks = 0;
+
+    for (uint64_t tick=0; ticks == 0 || tick < ticks; tick++) {
+        const double tick_start = get_time_ms();
+
+        net_server_poll(&server);
+        quad_aabb_t view;
+        if (net_server_view(&server, &view)) {
+            region_scheduler_set_view(&regions, (quad_aabb_t) {
+                .x_min = view.x_min - REGION_SIZE,
+                .y_min = view.y_min - REGION_SIZE,
+                .x_max = view.x_max + REGION_SIZE,
+                .y_max = view.y_max + REGION_SIZE,
+            });
+        } else {
+            region_scheduler_set_view(&regions, (quad_aabb_t) { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN });
+        }
+
+        update_game_state(active_gs, next_gs);
+        game_state_t *temp = active_gs;
+        active_gs = next_gs;
+        next_gs = temp;
+        sim_ms += get_time_ms() - tick_start;
+        sim_ticks++;
+
+        net_server_publish(&server, active_gs);
+
+        const double now = get_time_ms();
+        if (now - report_start >= 1000.0) {
+            const double seconds = (now - report_start) / 1000.0;
+            const net_stats_t *s = &server.stats;
+            printf("server: tick %lu, %lu viewers, %.0f frames/s, %.1f KiB/s, %.0f records/s, %.0f removes/s, %.2f ms/tick\n",
+                    active_gs->tick, server.viewer_count, (s->frames - reported.frames) / seconds,
+                    (s->bytes - reported.bytes) / seconds / 1024.0, (s->records - reported.records) / seconds,
+                    (s->removes - reported.removes) / seconds, sim_ms / sim_ticks);
+            reported = *s;
+            report_start = now;
+            sim_ms = 0.0;
+            sim_ticks = 0;
+        }
+
+        const double remaining = 1000.0 / ticks_per_second - (get_time_ms() - tick_start);
+        if (remaining > 0.0) usleep(remaining * 1000.0);
+    }
+
+    net_server_free(&server);
+    destroy_game_state(active_gs);
+    destroy_game_state(next_gs);
+    region_scheduler_free(&regions);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    page_policy_from_env();
+
+    if (argc > 1 && strcmp(argv[1], "--bench-render") == 0) {
+        return run_render_benchmark();
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-shards") == 0) {
+        const size_t max_shards = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+        const uint64_t ticks = argc > 3 ? strtoull(argv[3], NULL, 10) : 500;
+        return run_shard_benchmark(max_shards, ticks);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-jobs") == 0) {
+        const size_t max_workers = argc > 2 ? strtoul(argv[2], NULL, 10) : job_system_default_count();
+        const uint64_t ticks = argc > 3 ? strtoull(argv[3], NULL, 10) : 200;
+        return run_job_benchmark(max_workers, ticks);
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-stream") == 0) {
+        const char *path = argc > 2 ? argv[2] : "world_bench";
+        const int32_t side = argc > 3 ? atoi(argv[3]) : 16;
+        const uint64_t frames = argc > 4 ? strtoull(argv[4], NULL, 10) : 600;
+        if (side < 1 || side > WORLD_GRID || frames < 2) {
+            printf("usage: --bench-stream [path] [side in chunks, 1..%d] [frames, >= 2]\n", WORLD_GRID);
+            return 1;
+        }
+        return run_stream_benchmark(path, side, frames);
+    }
+    if (argc > 1 && strcmp(argv[1], "--diff-test") == 0) {
+        const size_t seeds = argc > 2 ? strtoul(argv[2], NULL, 10) : 20;
+        const uint64_t ticks = argc > 3 ? strtoull(argv[3], NULL, 10) : 400;
+        const uint64_t first_seed = argc > 4 ? strtoull(argv[4], NULL, 10) : 1;
+        return diff_test_run(first_seed, seeds, ticks) ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "--trace") == 0) {
+        const uint64_t ticks = argc > 2 ? strtoull(argv[2], NULL, 10) : 600;
+        return run_trace(ticks, argc > 3 ? argv[3] : "item_trace.bin");
+    }
+    if (argc > 1 && strcmp(argv[1], "--trace-report") == 0) {
+        return trace_report(argc > 2 ? argv[2] : "item_trace.bin") ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "--server") == 0) {
+        const char *path = argc > 2 ? argv[2] : NET_DEFAULT_PATH;
+        const uint64_t ticks = argc > 3 ? strtoull(argv[3], NULL, 10) : 0;
+        return run_server(path, ticks);
+    }
+
+    // Viewer of a --server: renders a mirror of what is in view, no local simulation.
+    const bool client_mode = argc > 1 && strcmp(argv[1], "--connect") == 0;
+    net_client_t client = {};
+    if (client_mode && !net_client_init(&client, argc > 2 ? argv[2] : NET_DEFAULT_PATH)) {
+        return 1;
+    }
+
+    // Streams the world from chunk files in a directory around the camera.
+    const bool world_mode = argc > 2 && strcmp(argv[1], "--world") == 0;
+    world_store_t world = {};
+    if (world_mode && !world_store_open(&world, argv[2])) {
+        return 1;
+    }
+
     InitWindow(1600, 1200, "bubu");
     SetTargetFPS(60);
 
@@ -94,9 +718,46 @@ int main(void) {
     game_state_t *active_gs = game_state_1;
     game_state_t *next_gs = game_state_2;
 
+    // Full rate near the camera only, updates pass it on to the next state.
+    region_scheduler_t regions;
+    region_scheduler_init(&regions);
+    active_gs->regions = client_mode ? NULL : &regions;
+    active_gs->mirror = client_mode;
+
+    // Off by default, B toggles batched transfers.
+    transfer_queue_t transfers;
+    transfer_queue_init(&transfers);
+
+    // Steps 1 and 4 and index rebuilds after restores run on the job
+    // workers when there is more than one core, J toggles.
+    job_system_t *jobs = job_system_create(job_system_default_count());
+    if (jobs->worker_count > 1) active_gs->jobs = jobs;
+
     render_state_t render_state = {};
+    init_render_state(&render_state);
+
+    visible_set_t visible_set;
+    visible_set_init(&visible_set, 1000 * 10);
+
+    analysis_t analysis;
+    analysis_init(&analysis);
+    bool analysis_enabled = !client_mode;
+
+    // A minute to rewind at 60 ticks/s, keyframes every 5 s. Off by default,
+    // H toggles: recording compares every entity every tick.
+    history_t history;
+    history_init(&history, 60 * 60, 60 * 5, 256 * 1024 * 1024);
+    bool history_enabled = false;
 
-    size_t selected_building = 0;
+    // Off by default, M toggles the overlay and the counters behind it.
+    metrics_t metrics;
+    metrics_init(&metrics);
+
+    // Walking the page tables is too slow for every frame.
+    page_stats_t page_stats[PAGE_SUBSYSTEM_COUNT] = {};
+    uint64_t frame = 0;
+
+    handle_t selected_building = HANDLE_NONE;
     size_t building_recipe = 0;
 
     bool game_update_enabled = true;
@@ -115,25 +776,40 @@ int main(void) {
         .height = ui_height,
     };
 
+    // Where the view was, for its velocity.
+    Vector2 world_view_center = {};
+    Vector2 world_view_velocity = {};
+    quad_aabb_t world_view = {};
+    bool world_view_known = false;
+
     // -----------------
+    // A world from disk is streamed in by the first frame instead.
+    if (!client_mode && !world.opened_chunks) {
 #if 1
-    for (int32_t xi=0; xi<712; xi++) {
-        for (int32_t yi=0; yi<10 /*100*/; yi++) {
-            int32_t x = xi * 12 + 10;
-            int32_t y = yi * 8;
-            build_some_stuff(active_gs, x, y);
-        }
-    }
+        const double build_start = get_time_ms();
+        build_some_stuff(active_gs, 712, 10 /*100*/);
+        printf("built in %.2f ms\n", get_time_ms() - build_start);
 #endif
-    build_some_more_stuff(active_gs);
-    printf("entities: %lu | %lu %lu %lu\n", active_gs->building_count, active_gs->miner_count,
-            active_gs->belt_count, active_gs->factory_count);
-    printf("game state: %lu MiB\n", sizeof(game_state_t)/1024/1024);
+        build_some_more_stuff(active_gs);
+        printf("entities: %lu | %lu %lu %lu\n", active_gs->building_count, active_gs->miner_count,
+                active_gs->belt_count, active_gs->factory_count);
+        printf("game state: %lu MiB\n", sizeof(game_state_t)/1024/1024);
+        analysis_run(&analysis, active_gs);
+        analysis_print(&analysis);
+    }
     // -----------------
 
     while (!WindowShouldClose()) {
 
-        if (game_update_enabled || game_update_once) {
+        if (client_mode) {
+            // The update only compacts and reindexes what the server sent.
+            net_client_poll(&client, active_gs);
+            CHECK_TIME(update_game_state(active_gs, next_gs));
+
+            game_state_t *temp = active_gs;
+            active_gs = next_gs;
+            next_gs = temp;
+        } else if (game_update_enabled || game_update_once) {
             game_update_once = false;
             
             CHECK_TIME(update_game_state(active_gs, next_gs));
@@ -141,6 +817,8 @@ int main(void) {
             game_state_t *temp = active_gs;
             active_gs = next_gs;
             next_gs = temp;
+
+            if (history_enabled) history_record(&history, active_gs);
         }
 
         Vector2 mouse_pos_screen = GetMousePosition();
@@ -166,24 +844,24 @@ int main(void) {
                 camera.zoom = powf(1.2f, zoom_level);
             }
 
-            // Building
+            // Building, the server owns the world of a viewer
             // if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
-            if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
-                size_t clicked_building = get_building(active_gs, mouse_coord);
-                if (clicked_building && selected_building &&
-                        clicked_building != selected_building) {
+            if (!client_mode && IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+                handle_t clicked_building = get_building(active_gs, mouse_coord);
+                if (!handle_is_none(clicked_building) && !handle_is_none(selected_building) &&
+                        !handle_equals(clicked_building, selected_building)) {
                     connect_buildings(active_gs, selected_building, clicked_building);
                 }
-                if (clicked_building) {
+                if (!handle_is_none(clicked_building)) {
                     selected_building = clicked_building;
                 } else {
-                    size_t new_building = 0;
+                    handle_t new_building = HANDLE_NONE;
                     switch (building_recipe) {
                         case 1: new_building = spawn_miner(active_gs, mouse_coord); break;
                         case 2: new_building = spawn_belt(active_gs, mouse_coord); break;
                         case 3: new_building = spawn_factory(active_gs, mouse_coord); break;
                     }
-                    if (selected_building && new_building) {
+                    if (!handle_is_none(selected_building) && !handle_is_none(new_building)) {
                         connect_buildings(active_gs, selected_building, new_building);
                     }
                     selected_building = new_building;
@@ -191,20 +869,89 @@ int main(void) {
             }
 
             if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) {
-                selected_building = 0;
+                selected_building = HANDLE_NONE;
             }
         }
 
-        if (IsKeyPressed(KEY_DELETE)) {
-            if (selected_building) {
+        if (!client_mode && IsKeyPressed(KEY_DELETE)) {
+            if (!handle_is_none(selected_building)) {
                 delete_building(active_gs, selected_building);
-                selected_building = 0;
+                selected_building = HANDLE_NONE;
+            }
+        }
+
+        if (!client_mode && IsKeyPressed(KEY_E)) {
+            const size_t building_id = get_building_index(active_gs, selected_building);
+            if (building_id && active_gs->buildings[building_id].type == BUILDING_TYPE_FACTORY) {
+                const factory_t *factory = GET_FACTORY(active_gs, active_gs->buildings[building_id].data);
+                set_factory_recipe(active_gs, selected_building, (factory->recipe + 1) % recipe_count);
             }
         }
 
         if (IsKeyPressed(KEY_U)) game_update_enabled = !game_update_enabled;
         if (IsKeyPressed(KEY_T)) game_update_once = true;
         if (IsKeyPressed(KEY_Q)) render_quad_tree = !render_quad_tree;
+        if (IsKeyPressed(KEY_C)) render_state.cache_enabled = !render_state.cache_enabled;
+        if (IsKeyPressed(KEY_P)) render_state.parallel_enabled = !render_state.parallel_enabled;
+        if (IsKeyPressed(KEY_A)) analysis_enabled = !analysis_enabled;
+        if (IsKeyPressed(KEY_R)) regions.lod_enabled = !regions.lod_enabled;
+        if (!client_mode && IsKeyPressed(KEY_B)) active_gs->transfers = active_gs->transfers ? NULL : &transfers;
+        if (IsKeyPressed(KEY_J)) active_gs->jobs = active_gs->jobs ? NULL : jobs;
+        if (!client_mode && IsKeyPressed(KEY_F)) {
+            // Starts tracing, the next press writes and reports the trace.
+            if (!trace_enabled) {
+                trace_start(TRACE_DEFAULT_RING_RECORDS);
+            } else {
+                trace_stop();
+                if (trace_write("item_trace.bin", active_gs)) trace_report("item_trace.bin");
+            }
+        }
+        if (!client_mode && IsKeyPressed(KEY_H)) {
+            // A gap in the records can't be restored across.
+            history_enabled = !history_enabled;
+            if (!history_enabled) history_clear(&history);
+        }
+        if (!client_mode && (IsKeyPressed(KEY_LEFT) || IsKeyPressed(KEY_RIGHT))) {
+            // Pauses and scrubs through the rewind window, updating again
+            // continues from the shown tick.
+            const uint64_t step = IsKeyDown(KEY_LEFT_SHIFT) ? 60 : 1;
+            uint64_t first_tick, last_tick;
+            if (history_first_tick(&history, &first_tick) && history_last_tick(&history, &last_tick)) {
+                uint64_t tick = active_gs->tick;
+                if (IsKeyPressed(KEY_LEFT)) tick = (tick > first_tick + step) ? tick - step : first_tick;
+                else tick = (tick + step < last_tick) ? tick + step : last_tick;
+                game_update_enabled = false;
+                history_restore(&history, tick, active_gs);
+            }
+        }
+        if (IsKeyPressed(KEY_M)) metrics_set_enabled(&metrics, !metrics_enabled);
+        if (IsKeyPressed(KEY_L)) {
+            // Rebuilt right away, queries for the rest of the frame use the new one.
+            // Updates pass the choice on to the next state.
+            active_gs->spatial_index = (active_gs->spatial_index == SPATIAL_INDEX_QUAD_TREE) ?
+                SPATIAL_INDEX_LINEAR : SPATIAL_INDEX_QUAD_TREE;
+            rebuild_spatial_index(active_gs);
+        }
+
+        if (world_mode && world_view_known) {
+            // Streaming edits, with the view of the last frame.
+            const uint64_t loads = world.stats.demand_loads + world.stats.prefetch_loads;
+            const uint64_t evictions = world.stats.evictions;
+            world_store_update(&world, active_gs, world_view, world_view_velocity.x, world_view_velocity.y);
+            // The history can't restore buildings that came and went with their chunks.
+            if (loads != world.stats.demand_loads + world.stats.prefetch_loads || evictions != world.stats.evictions) {
+                history_clear(&history);
+                if (!get_building_index(active_gs, selected_building)) selected_building = HANDLE_NONE;
+            }
+        }
+
+        render_consume_edits(&render_state, active_gs);
+        metrics_sample(&metrics, active_gs);
+
+        // Static analysis only depends on the layout, redo the edited parts.
+        if (analysis_enabled && analysis.edit_version != active_gs->edit_version) {
+            analysis_update(&analysis, active_gs);
+        }
 
         // -----
         Vector2 visible_world_min = GetScreenToWorld2D((Vector2){ 0, 0 }, camera);
@@ -223,17 +970,49 @@ int main(void) {
             .y_max = mouse_coord.y + 5,*/
         };
 
-        size_t qt_qr_items[1000 * 10];
-        quad_tree_query_result_t qt_qr = {
-            .capacity = ARRAY_LENGTH(qt_qr_items),
+        if (client_mode) net_client_set_view(&client, qb);
+
+        // Groups just outside the view already run at full rate when they scroll in.
+        region_scheduler_set_view(&regions, (quad_aabb_t) {
+            .x_min = qb.x_min - REGION_SIZE,
+            .y_min = qb.y_min - REGION_SIZE,
+            .x_max = qb.x_max + REGION_SIZE,
+            .y_max = qb.y_max + REGION_SIZE,
+        });
+
+        if (world_mode) {
+            // In cells per second, smoothed over a few frames.
+            const Vector2 center = { (qb.x_min + qb.x_max) * 0.5f, (qb.y_min + qb.y_max) * 0.5f };
+            const float dt = GetFrameTime();
+            if (world_view_known && dt > 0.0f) {
+                const Vector2 velocity = Vector2Scale(Vector2Subtract(center, world_view_center), 1.0f / dt);
+                world_view_velocity = Vector2Add(Vector2Scale(world_view_velocity, 0.75f), Vector2Scale(velocity, 0.25f));
+            }
+            world_view_center = center;
+            world_view = qb;
+            world_view_known = true;
+        }
+
+        // Level of detail: at low zoom draw aggregated quad tree nodes instead
+        // of buildings. Only the pointer quad tree carries node aggregates.
+        static const quad_node_t *qt_nr_nodes[1000 * 10];
+        quad_tree_node_result_t qt_nr = {
+            .capacity = ARRAY_LENGTH(qt_nr_nodes),
             .count = 0,
-            .items = qt_qr_items,
+            .nodes = qt_nr_nodes,
         };
-        quad_tree_query(active_gs->quad_tree, qb, &qt_qr);
+        int32_t lod_node_size = get_lod_node_size(&render_state, camera.zoom, qb, qt_nr.capacity);
+        if (active_gs->spatial_index != SPATIAL_INDEX_QUAD_TREE) lod_node_size = 1;
+
+        if (lod_node_size > 1) {
+            quad_tree_query_nodes(active_gs->quad_tree, qb, lod_node_size, &qt_nr);
+        } else {
+            visible_set_update(&visible_set, active_gs, qb);
+        }
 
-        //printf("query result: %lu\n", qt_qr.count);
-        //for (size_t i=0; i<qt_qr.count; i++) {
-        //    printf("> %lu\n", qt_qr.items[i]);
+        //printf("query result: %lu\n", visible_set.count);
+        //for (size_t i=0; i<visible_set.count; i++) {
+        //    printf("> %lu\n", visible_set.items[i]);
         //}
         // -----
 
@@ -251,13 +1030,17 @@ int main(void) {
                 DrawLine(-WORLD_CELL_SIZE, -1000, -WORLD_CELL_SIZE, 1000, BLACK);
                 DrawLine(WORLD_CELL_SIZE, -1000, WORLD_CELL_SIZE, 1000, BLACK);
 
-                if (render_quad_tree) {
+                if (render_quad_tree && active_gs->spatial_index == SPATIAL_INDEX_QUAD_TREE) {
                     //quad_tree_dump(active_gs->quad_tree);
                     quad_tree_render(active_gs->quad_tree);
                 }
 
                 // World
-                render_world(active_gs, &render_state, qt_qr.count, qt_qr.items);
+                if (lod_node_size > 1) {
+                    render_world_lod(active_gs, &render_state, qt_nr.count, qt_nr.nodes);
+                } else {
+                    render_world(active_gs, &render_state, visible_set.count, visible_set.items);
+                }
 
                 // Mouse
                 if (!mouse_is_over_ui) {
@@ -272,8 +1055,9 @@ int main(void) {
                 }
 
                 // Selection
-                if (selected_building != 0) {
-                    building_t *sb = active_gs->buildings + selected_building;
+                const size_t selected_index = get_building_index(active_gs, selected_building);
+                if (selected_index != 0) {
+                    building_t *sb = active_gs->buildings + selected_index;
                     Vector2 wp = coord_to_world_position(sb->pos);
                     Rectangle r = {
                         .x = wp.x,
@@ -326,19 +1110,122 @@ int main(void) {
             DrawText(TextFormat("total buildings: %lu (%lu, %lu, %lu)", active_gs->building_count,
                         active_gs->miner_count, active_gs->belt_count, active_gs->factory_count), 
                     10, next_text_y+=20, 20, WHITE);
-            DrawText(TextFormat("rendered: %lu", qt_qr.count), 10, next_text_y+=20, 20, WHITE);
+            const char *visible_update_names[] = { "reused", "incremental", "full" };
+            DrawText(TextFormat("rendered: %lu (%s, +%lu -%lu)", visible_set.count,
+                        visible_update_names[visible_set.last_update], visible_set.added, visible_set.dropped),
+                    10, next_text_y+=20, 20, WHITE);
+            DrawText(TextFormat("lod: %d (%lu nodes)", lod_node_size, qt_nr.count), 10, next_text_y+=20, 20, WHITE);
+            DrawText(TextFormat("cache: %s, %lu chunks, %lu rebuilds", render_state.cache_enabled ? "on" : "off",
+                        render_state.cache.cached_chunks, render_state.cache.rebuilds), 10, next_text_y+=20, 20, WHITE);
+            DrawText(TextFormat("draw: %lu cmds, %lu batches, %lu prep threads", render_state.stats.commands,
+                        render_state.stats.batches, render_state.prep_worker_count), 10, next_text_y+=20, 20, WHITE);
             DrawText(TextFormat("zoom %d %.2f", zoom_level, camera.zoom), 10, next_text_y+=20, 20, WHITE);
+            DrawText(TextFormat("index: %s", (active_gs->spatial_index == SPATIAL_INDEX_LINEAR) ?
+                        "linear" : "quad tree"), 10, next_text_y+=20, 20, WHITE);
+            const quad_arena_stats_t *qs = &active_gs->quad_tree->arena_stats;
+            DrawText(TextFormat("quad tree: %lu nodes (max %lu), %.1f MiB used (max %.1f), %.1f MiB free listed, %lu chunks (max %lu)",
+                        qs->node_count, qs->node_high_water, qs->used / 1048576.0, qs->used_high_water / 1048576.0,
+                        qs->free_listed / 1048576.0, active_gs->quad_tree->chunk_count, qs->chunk_high_water),
+                    10, next_text_y+=20, 20, WHITE);
+            DrawText(TextFormat("regions%s: %lu groups, %lu active, %lu dormant, %lu stepped, %lu settled, %lu updates",
+                        regions.lod_enabled ? "" : " (lod off)", regions.stats.groups, regions.stats.active,
+                        regions.stats.dormant, regions.stats.steps, regions.stats.settled, regions.stats.updates),
+                    10, next_text_y+=20, 20, WHITE);
+            if (active_gs->transfers) {
+                DrawText(TextFormat("transfers: %lu queued, %lu accepted in %lu batches, %.3f ms",
+                            transfers.stats.pushed, transfers.stats.accepted, transfers.stats.applies,
+                            transfers.stats.apply_ms), 10, next_text_y+=20, 20, WHITE);
+            }
+            if (active_gs->jobs) {
+                job_worker_stats_t job_stats;
+                job_system_get_stats(jobs, &job_stats);
+                DrawText(TextFormat("jobs: %lu workers, %lu run, %lu stolen, %lu splits", jobs->worker_count,
+                            job_stats.executed, job_stats.stolen, job_stats.splits), 10, next_text_y+=20, 20, WHITE);
+            }
+            if (trace_enabled) DrawText("tracing items, F writes item_trace.bin", 10, next_text_y+=20, 20, YELLOW);
+            if (client_mode) {
+                DrawText(TextFormat("net%s: tick %lu, %lu frames, %.2f KiB/frame, %.1f records/frame",
+                            client.connected ? "" : " (disconnected)", client.tick, client.stats.frames,
+                            client.stats.frames ? client.stats.bytes / 1024.0 / client.stats.frames : 0.0,
+                            client.stats.frames ? (double)client.stats.records / client.stats.frames : 0.0),
+                        10, next_text_y+=20, 20, WHITE);
+            }
+            if (frame++ % 60 == 0) {
+                for (size_t i=0; i<PAGE_SUBSYSTEM_COUNT; i++) page_get_stats(i, page_stats + i);
+            }
+            for (size_t i=0; i<PAGE_SUBSYSTEM_COUNT; i++) {
+                const page_stats_t *ps = page_stats + i;
+                DrawText(TextFormat("memory %s: %.1f used, %.1f committed, %.1f reserved MiB, %s",
+                            page_subsystem_name(i), ps->used / 1048576.0, ps->committed / 1048576.0,
+                            ps->reserved / 1048576.0, ps->huge ? "huge pages" : (ps->huge_advised ? "thp" : "4k pages")),
+                        10, next_text_y+=20, 20, WHITE);
+            }
+            if (world_mode) {
+                const world_store_stats_t *ws = &world.stats;
+                DrawText(TextFormat("world: %lu chunks, %lu buildings, %lu mapped, %lu suspended links, %lu + %lu ahead loads, %lu evictions, %.2f ms",
+                            ws->resident_chunks, ws->resident_buildings, ws->mapped, ws->suspended_links,
+                            ws->demand_loads, ws->prefetch_loads, ws->evictions, ws->update_ms), 10, next_text_y+=20, 20, WHITE);
+            }
+            if (history_enabled) {
+                uint64_t first_tick = 0, last_tick = 0;
+                history_first_tick(&history, &first_tick);
+                history_last_tick(&history, &last_tick);
+                DrawText(TextFormat("history: ticks %lu..%lu, %lu keyframes, %.1f MiB, %.1f KiB/tick, last %.2f KiB in %.2f ms",
+                            first_tick, last_tick, history.keyframe_count, history.bytes / 1024.0 / 1024.0,
+                            history.count ? history.bytes / 1024.0 / history.count : 0.0,
+                            history.last_bytes / 1024.0, history.last_record_ms), 10, next_text_y+=20, 20, WHITE);
+            }
+            if (analysis_enabled) {
+                DrawText(TextFormat("analysis: %.2f ms (%lu redone), %lu saturated, %lu starved, %lu idle, %lu dead ends, %lu loops, %lu mismatched, %lu stall",
+                            analysis.time_ms, analysis.updated, analysis.saturated, analysis.starved_factories, analysis.idle_factories,
+                            analysis.dead_ends, analysis.loops, analysis.mismatched, analysis.stalled), 10, next_text_y+=20, 20, WHITE);
+            }
+
+            if (metrics_enabled) {
+                draw_metrics(&metrics, screen_width - 260 - 2 * METRICS_HISTORY - 15, 20);
+            }
 
-            if (selected_building != 0) {
-                DrawText(TextFormat("sel: %u", selected_building), 10,
+            if (!handle_is_none(selected_building)) {
+                const uint32_t *neighbors;
+                const size_t input_count = flow_graph_inputs(&active_gs->flow_graph, selected_building.index, &neighbors);
+                const size_t output_count = flow_graph_outputs(&active_gs->flow_graph, selected_building.index, &neighbors);
+                const size_t building_id = get_building_index(active_gs, selected_building);
+                const building_t *building = active_gs->buildings + building_id;
+                DrawText(TextFormat("sel: %u:%u%s, %lu in, %lu out%s%s", selected_building.index, selected_building.generation,
+                            building_id ? "" : " (stale)", input_count, output_count,
+                            (building_id && building->type == BUILDING_TYPE_FACTORY) ? ", recipe " : "",
+                            (building_id && building->type == BUILDING_TYPE_FACTORY) ?
+                                recipe_defs[GET_FACTORY(active_gs, building->data)->recipe].name : ""), 10,
                         next_text_y += 20, 20, WHITE);
+                const analysis_node_t *node = analysis_get_node(&analysis, selected_building);
+                if (analysis_enabled && node) {
+                    DrawText(TextFormat("flow: %.3f in, %.3f out, %.3f sustained /tick%s%s%s%s", node->offered_in,
+                                node->offered, node->sustained,
+                                (node->flags & ANALYSIS_SATURATED) ? ", saturated" : "",
+                                (node->flags & (ANALYSIS_STARVED | ANALYSIS_IDLE)) ? ", starved" : "",
+                                (node->flags & ANALYSIS_MISMATCH) ? ", wrong items" : "",
+                                (node->flags & ANALYSIS_STALLED) ? ", stalls" : ""), 10, next_text_y += 20, 20, WHITE);
+                }
             }
         }
     EndDrawing();
     }
 
+    if (world_mode) {
+        world_store_save(&world, active_gs);
+        world_store_close(&world);
+    }
+
     destroy_game_state(game_state_1);
     destroy_game_state(game_state_2);
+    free_render_state(&render_state);
+    visible_set_free(&visible_set);
+    analysis_free(&analysis);
+    history_free(&history);
+    region_scheduler_free(&regions);
+    transfer_queue_free(&transfers);
+    job_system_destroy(jobs);
+    if (client_mode) net_client_free(&client);
 
     CloseWindow();
 
@@ -0,0 +1,150 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "game_state.h"
+#include "utils.h"
+
+// A block per thread, aligned so no two threads write the same cache line.
+// Threads past the limit share the last block and add atomically.
+typedef struct {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+} __attribute__((aligned(64))) metrics_block_t;
+
+bool metrics_enabled;
+
+static metrics_block_t blocks[METRICS_MAX_THREADS + 1];
+static size_t block_count;
+static __thread metrics_block_t *thread_block;
+
+static const char *series_names[METRIC_SERIES_COUNT] = {
+    [METRIC_SERIES_TICK_MS] = "tick ms",
+    [METRIC_SERIES_RESET_MS] = "reset ms",
+    [METRIC_SERIES_STEP_1_MS] = "step 1 ms",
+    [METRIC_SERIES_STEP_3_MS] = "step 3 ms",
+    [METRIC_SERIES_STEP_4_MS] = "step 4 ms",
+    [METRIC_SERIES_TICKS_PER_SECOND] = "ticks/s",
+    [METRIC_SERIES_TRANSFERS_PER_TICK] = "transfers/tick",
+    [METRIC_SERIES_QUAD_NODES_PER_QUERY] = "quad nodes/query",
+    [METRIC_SERIES_DRAW_BATCHES] = "draw batches",
+    [METRIC_SERIES_MINING] = "mining",
+    [METRIC_SERIES_BLOCKED] = "blocked",
+    [METRIC_SERIES_PRODUCING] = "producing",
+    [METRIC_SERIES_IDLE] = "idle",
+};
+
+void metrics_add_slow(metric_counter_t counter, uint64_t value) {
+    metrics_block_t *block = thread_block;
+    if (!block) {
+        const size_t i = __atomic_fetch_add(&block_count, 1, __ATOMIC_RELAXED);
+        block = thread_block = blocks + (i < METRICS_MAX_THREADS ? i : METRICS_MAX_THREADS);
+    }
+
+    uint64_t *c = block->counters + counter;
+    if (block == blocks + METRICS_MAX_THREADS) {
+        __atomic_fetch_add(c, value, __ATOMIC_RELAXED);
+    } else {
+        // Only this thread writes the block, the reader only needs untorn values.
+        __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t metrics_total(metric_counter_t counter) {
+    size_t n = __atomic_load_n(&block_count, __ATOMIC_RELAXED);
+    if (n > METRICS_MAX_THREADS + 1) n = METRICS_MAX_THREADS + 1;
+
+    uint64_t total = 0;
+    for (size_t i=0; i<n; i++) total += __atomic_load_n(blocks[i].counters + counter, __ATOMIC_RELAXED);
+    return total;
+}
+
+void metrics_init(metrics_t *m) {
+    assert(m);
+    memset(m, 0, sizeof(metrics_t));
+}
+
+void metrics_set_enabled(metrics_t *m, bool enabled) {
+    assert(m);
+    if (enabled && !metrics_enabled) {
+        for (size_t c=0; c<METRIC_COUNTER_COUNT; c++) m->totals[c] = metrics_total(c);
+        m->sample_time_ms = get_time_ms();
+        m->frames = 0;
+    }
+    metrics_enabled = enabled;
+}
+
+// Adds the miners and factories of gs by state to values.
+static void take_census(const game_state_t *gs, float *values) {
+    for (size_t i=1; i<gs->miner_count; i++) {
+        const miner_t *miner = gs->miners + i;
+        if (miner->flags & ENTITY_FLAGS_DELETED) continue;
+        values[miner->state == MINER_STATE_MINING ? METRIC_SERIES_MINING : METRIC_SERIES_BLOCKED]++;
+    }
+    for (size_t i=1; i<gs->factory_count; i++) {
+        const factory_t *factory = gs->factories + i;
+        if (factory->flags & ENTITY_FLAGS_DELETED) continue;
+        switch (factory->state) {
+            case FACTORY_STATE_WAIT_ITEMS: values[METRIC_SERIES_IDLE]++; break;
+            case FACTORY_STATE_PRODUCE: values[METRIC_SERIES_PRODUCING]++; break;
+            case FACTORY_STATE_UNLOAD: values[METRIC_SERIES_BLOCKED]++; break;
+        }
+    }
+}
+
+void metrics_sample(metrics_t *m, const game_state_t *gs) {
+    assert(m);
+    assert(gs);
+    if (!metrics_enabled) return;
+
+    m->frames++;
+    const double now = get_time_ms();
+    const double elapsed_ms = now - m->sample_time_ms;
+    if (elapsed_ms < METRICS_SAMPLE_MS) return;
+
+    uint64_t delta[METRIC_COUNTER_COUNT];
+    for (size_t c=0; c<METRIC_COUNTER_COUNT; c++) {
+        const uint64_t total = metrics_total(c);
+        delta[c] = total - m->totals[c];
+        m->totals[c] = total;
+    }
+
+    float values[METRIC_SERIES_COUNT] = {};
+    const double ticks = delta[METRIC_TICKS];
+    if (ticks) {
+        values[METRIC_SERIES_RESET_MS] = delta[METRIC_RESET_NS] / 1e6 / ticks;
+        values[METRIC_SERIES_STEP_1_MS] = delta[METRIC_STEP_1_NS] / 1e6 / ticks;
+        values[METRIC_SERIES_STEP_3_MS] = delta[METRIC_STEP_3_NS] / 1e6 / ticks;
+        values[METRIC_SERIES_STEP_4_MS] = delta[METRIC_STEP_4_NS] / 1e6 / ticks;
+        values[METRIC_SERIES_TICK_MS] = values[METRIC_SERIES_RESET_MS] + values[METRIC_SERIES_STEP_1_MS] +
+            values[METRIC_SERIES_STEP_3_MS] + values[METRIC_SERIES_STEP_4_MS];
+        values[METRIC_SERIES_TRANSFERS_PER_TICK] = delta[METRIC_TRANSFERS] / ticks;
+    }
+    values[METRIC_SERIES_TICKS_PER_SECOND] = ticks * 1000.0 / elapsed_ms;
+    if (delta[METRIC_QUAD_QUERIES]) {
+        values[METRIC_SERIES_QUAD_NODES_PER_QUERY] = (double)delta[METRIC_QUAD_NODES] / delta[METRIC_QUAD_QUERIES];
+    }
+    values[METRIC_SERIES_DRAW_BATCHES] = (double)delta[METRIC_DRAW_BATCHES] / m->frames;
+    take_census(gs, values);
+
+    for (size_t s=0; s<METRIC_SERIES_COUNT; s++) m->history[s][m->head] = values[s];
+    m->head = (m->head + 1) % METRICS_HISTORY;
+    if (m->count < METRICS_HISTORY) m->count++;
+
+    m->frames = 0;
+    m->sample_time_ms = now;
+}
+
+float metrics_last(const metrics_t *m, metric_series_t series) {
+    assert(m);
+    assert(series < METRIC_SERIES_COUNT);
+    if (!m->count) return 0;
+    return m->history[series][(m->head + METRICS_HISTORY - 1) % METRICS_HISTORY];
+}
+
+const char *metrics_series_name(metric_series_t series) {
+    assert(series < METRIC_SERIES_COUNT);
+    return series_names[series];
+}
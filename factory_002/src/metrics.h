@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Performance counters for the metrics overlay. Every thread counts into a
+// block of its own, which only that thread writes (relaxed atomic loads and
+// stores, no locked instructions, no shared cache lines), and the overlay
+// sums the blocks from the main thread a few times per second:
+//
+// - phase times of update_game_state() and ticks,
+// - transfers: items handed from one building to the next,
+// - quad tree queries and the nodes they visit,
+// - draw batches.
+//
+// Entity states are not counted, metrics_sample() takes a census of the
+// state instead: dormant regions don't update their entities every tick.
+//
+// Off by default. While off, each hook is a load of metrics_enabled and a
+// not-taken branch, and nothing is sampled.
+
+struct game_state;
+
+typedef enum {
+    METRIC_TICKS,
+    METRIC_RESET_NS,
+    METRIC_STEP_1_NS,
+    METRIC_STEP_3_NS,
+    METRIC_STEP_4_NS,
+    METRIC_TRANSFERS,
+    METRIC_QUAD_QUERIES,
+    METRIC_QUAD_NODES,
+    METRIC_DRAW_BATCHES,
+    METRIC_COUNTER_COUNT,
+} metric_counter_t;
+
+// What the overlay shows, one value per sample.
+typedef enum {
+    METRIC_SERIES_TICK_MS,
+    METRIC_SERIES_RESET_MS,
+    METRIC_SERIES_STEP_1_MS,
+    METRIC_SERIES_STEP_3_MS,
+    METRIC_SERIES_STEP_4_MS,
+    METRIC_SERIES_TICKS_PER_SECOND,
+    METRIC_SERIES_TRANSFERS_PER_TICK,
+    METRIC_SERIES_QUAD_NODES_PER_QUERY,
+    METRIC_SERIES_DRAW_BATCHES,
+    METRIC_SERIES_MINING,
+    METRIC_SERIES_BLOCKED,
+    METRIC_SERIES_PRODUCING,
+    METRIC_SERIES_IDLE,
+    METRIC_SERIES_COUNT,
+} metric_series_t;
+
+#define METRICS_MAX_THREADS  (64)
+#define METRICS_HISTORY      (120)
+#define METRICS_SAMPLE_MS    (250.0) // 30 s of history
+
+typedef struct {
+    uint64_t totals[METRIC_COUNTER_COUNT]; // at the last sample
+    double sample_time_ms;
+    uint64_t frames;                       // since the last sample
+
+    float history[METRIC_SERIES_COUNT][METRICS_HISTORY];
+    size_t head;   // next sample goes here
+    size_t count;
+} metrics_t;
+
+extern bool metrics_enabled;
+
+void metrics_init(metrics_t *m);
+// Turning the counters on starts a new interval, the history is kept.
+void metrics_set_enabled(metrics_t *m, bool enabled);
+// Call once per frame: counts the frame, and every METRICS_SAMPLE_MS sums
+// the counters, takes the census of gs and appends a sample.
+void metrics_sample(metrics_t *m, const struct game_state *gs);
+// Latest sample, 0 without one.
+float metrics_last(const metrics_t *m, metric_series_t series);
+const char *metrics_series_name(metric_series_t series);
+
+// Sum over all threads.
+uint64_t metrics_total(metric_counter_t counter);
+
+void metrics_add_slow(metric_counter_t counter, uint64_t value);
+
+static inline void metrics_add(metric_counter_t counter, uint64_t value) {
+    if (__builtin_expect(metrics_enabled, 0)) metrics_add_slow(counter, value);
+}
+
+// Phase timing: start with metrics_clock(), end each phase with
+// metrics_phase(), which returns the start of the next one.
+static inline uint64_t metrics_clock() {
+    if (__builtin_expect(!metrics_enabled, 1)) return 0;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static inline uint64_t metrics_phase(metric_counter_t counter, uint64_t start) {
+    const uint64_t now = metrics_clock();
+    // Enabled during the phase: no start to measure from.
+    if (start && now) metrics_add_slow(counter, now - start);
+    return now;
+}
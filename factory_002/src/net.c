@@ -0,0 +1,665 @@
+#include "net.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utils.h"
+#include "recipe.h"
+
+#define NET_MSG_SUBSCRIBE    (1)
+#define NET_MAX_FRAME        (256 * 1024 * 1024)
+
+// Viewer to server, fixed size.
+typedef struct {
+    uint32_t kind;
+    quad_aabb_t view;
+} net_subscribe_t;
+
+// -----
+
+static void buffer_reserve(net_buffer_t *b, size_t additional) {
+    if (b->size + additional <= b->capacity) return;
+    size_t capacity = b->capacity ? b->capacity : 4096;
+    while (capacity < b->size + additional) capacity *= 2;
+    b->data = realloc(b->data, capacity);
+    assert(b->data);
+    b->capacity = capacity;
+}
+
+static void buffer_free(net_buffer_t *b) {
+    free(b->data);
+    memset(b, 0, sizeof(net_buffer_t));
+}
+
+static void buffer_consume(net_buffer_t *b, size_t size) {
+    assert(size <= b->size);
+    memmove(b->data, b->data + size, b->size - size);
+    b->size -= size;
+}
+
+static void put_u8(net_buffer_t *b, uint8_t v) {
+    buffer_reserve(b, 1);
+    b->data[b->size++] = v;
+}
+
+static void put_bytes(net_buffer_t *b, const uint8_t *data, size_t size) {
+    buffer_reserve(b, size);
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+// LEB128: 7 bits per byte, high bit set on all but the last.
+static void put_varint(net_buffer_t *b, uint64_t v) {
+    buffer_reserve(b, 10);
+    while (v >= 0x80) {
+        b->data[b->size++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    b->data[b->size++] = (uint8_t)v;
+}
+
+// Small magnitudes of either sign get short varints.
+static void put_zigzag(net_buffer_t *b, int32_t v) {
+    put_varint(b, ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool ok; // false once anything was read past the end
+} net_reader_t;
+
+static uint8_t get_u8(net_reader_t *r) {
+    if (r->p >= r->end) { r->ok = false; return 0; }
+    return *r->p++;
+}
+
+static void get_bytes(net_reader_t *r, uint8_t *data, size_t size) {
+    if ((size_t)(r->end - r->p) < size) { r->ok = false; memset(data, 0, size); return; }
+    memcpy(data, r->p, size);
+    r->p += size;
+}
+
+static uint64_t get_varint(net_reader_t *r) {
+    uint64_t v = 0;
+    for (uint32_t shift=0; shift<64; shift+=7) {
+        const uint8_t byte = get_u8(r);
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return v;
+    }
+    r->ok = false;
+    return 0;
+}
+
+static int32_t get_zigzag(net_reader_t *r) {
+    const uint32_t v = get_varint(r);
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static void set_nonblocking(int fd) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Sends what the socket takes right now, false if the peer is gone.
+static bool flush_buffer(int fd, net_buffer_t *b) {
+    size_t sent = 0;
+    while (sent < b->size) {
+        const ssize_t n = send(fd, b->data + sent, b->size - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    buffer_consume(b, sent);
+    return true;
+}
+
+// Reads what has arrived, false if the peer is gone.
+static bool fill_buffer(int fd, net_buffer_t *b) {
+    for (;;) {
+        buffer_reserve(b, 64 * 1024);
+        const ssize_t n = recv(fd, b->data + b->size, b->capacity - b->size, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n <= 0) return false;
+        b->size += n;
+    }
+}
+
+// -----
+
+static uint8_t type_fields(uint8_t type) {
+    switch (type) {
+        case BUILDING_TYPE_MINER:   return NET_FIELD_LAYOUT | NET_FIELD_STATE;
+        case BUILDING_TYPE_FACTORY: return NET_FIELD_LAYOUT | NET_FIELD_STATE | NET_FIELD_ITEMS;
+        case BUILDING_TYPE_BELT:    return NET_FIELD_LAYOUT | NET_FIELD_ITEMS | NET_FIELD_DIRS;
+    }
+    return NET_FIELD_LAYOUT;
+}
+
+static net_entity_t get_entity(const game_state_t *gs, const building_t *b) {
+    net_entity_t e = {
+        .generation = gs->building_handles.slots[b->slot].generation,
+        .pos = b->pos,
+        .type = b->type,
+    };
+
+    switch (b->type) {
+        case BUILDING_TYPE_MINER:
+            {
+                const miner_t *miner = GET_MINER(gs, b->data);
+                e.state = miner->state;
+                e.work = miner->work;
+            }
+            break;
+
+        case BUILDING_TYPE_FACTORY:
+            {
+                const factory_t *factory = GET_FACTORY(gs, b->data);
+                e.state = factory->state;
+                e.work = factory->work;
+                e.recipe = factory->recipe;
+                memcpy(e.items, &factory->counts, sizeof(e.items));
+            }
+            break;
+
+        case BUILDING_TYPE_BELT:
+            {
+                const belt_t *belt = GET_BELT(gs, b->data);
+                memcpy(e.items, belt->items, sizeof(belt->items));
+                memcpy(e.works, belt->works, sizeof(belt->works));
+                e.dirs = belt->in_dir << 4 | belt->out_dir;
+            }
+            break;
+    }
+    return e;
+}
+
+static uint8_t changed_fields(const net_entity_t *known, const net_entity_t *e) {
+    if (known->generation != e->generation) return type_fields(e->type);
+
+    uint8_t fields = 0;
+    if (known->state != e->state || known->work != e->work || known->recipe != e->recipe) fields |= NET_FIELD_STATE;
+    if (memcmp(known->items, e->items, sizeof(e->items)) || memcmp(known->works, e->works, sizeof(e->works))) {
+        fields |= NET_FIELD_ITEMS;
+    }
+    if (known->dirs != e->dirs) fields |= NET_FIELD_DIRS;
+    return fields & type_fields(e->type);
+}
+
+static void put_entity(net_buffer_t *b, const net_entity_t *e, uint8_t fields) {
+    put_u8(b, fields);
+    if (fields & NET_FIELD_LAYOUT) {
+        put_varint(b, e->generation);
+        put_zigzag(b, e->pos.x);
+        put_zigzag(b, e->pos.y);
+        put_u8(b, e->type);
+    }
+    if (fields & NET_FIELD_STATE) {
+        put_u8(b, e->state);
+        put_varint(b, e->work);
+        if (e->type == BUILDING_TYPE_FACTORY) put_varint(b, e->recipe);
+    }
+    if (fields & NET_FIELD_ITEMS) {
+        put_bytes(b, e->items, sizeof(e->items));
+        if (e->type == BUILDING_TYPE_BELT) put_bytes(b, e->works, sizeof(e->works));
+    }
+    if (fields & NET_FIELD_DIRS) {
+        put_u8(b, e->dirs);
+    }
+}
+
+// -----
+
+bool net_server_init(net_server_t *server, const char *path) {
+    assert(server);
+    assert(path);
+
+    memset(server, 0, sizeof(net_server_t));
+    server->listen_fd = -1;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("net: socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(server->path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("net: socket");
+        return false;
+    }
+    unlink(path); // left over by a server that didn't shut down
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, NET_MAX_VIEWERS) != 0) {
+        perror("net: bind");
+        close(fd);
+        return false;
+    }
+    set_nonblocking(fd);
+    server->listen_fd = fd;
+
+    server->query.capacity = MAX_ENTITY_COUNT;
+    server->query.items = malloc(sizeof(size_t) * MAX_ENTITY_COUNT);
+    server->changes = malloc(sizeof(uint64_t) * MAX_ENTITY_COUNT);
+    server->removes = malloc(sizeof(uint32_t) * MAX_ENTITY_COUNT);
+    assert(server->query.items && server->changes && server->removes);
+
+    printf("net: serving on %s\n", path);
+    return true;
+}
+
+static void drop_viewer(net_server_t *server, size_t v) {
+    net_viewer_t *viewer = server->viewers + v;
+    close(viewer->fd);
+    free(viewer->known);
+    free(viewer->seen);
+    free(viewer->known_slots);
+    buffer_free(&viewer->in);
+    buffer_free(&viewer->out);
+
+    server->viewers[v] = server->viewers[--server->viewer_count];
+    printf("net: viewer left, %lu watching\n", server->viewer_count);
+}
+
+void net_server_free(net_server_t *server) {
+    assert(server);
+    while (server->viewer_count > 0) drop_viewer(server, 0);
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+        unlink(server->path);
+    }
+    free(server->query.items);
+    free(server->changes);
+    free(server->removes);
+    buffer_free(&server->frame);
+}
+
+void net_server_poll(net_server_t *server) {
+    assert(server);
+
+    for (;;) {
+        const int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) break;
+        if (server->viewer_count == NET_MAX_VIEWERS) {
+            printf("net: too many viewers\n");
+            close(fd);
+            continue;
+        }
+        set_nonblocking(fd);
+
+        // Slot arrays are touched only where buildings were in view.
+        net_viewer_t *viewer = server->viewers + server->viewer_count++;
+        *viewer = (net_viewer_t) {
+            .fd = fd,
+            .known = calloc(MAX_ENTITY_COUNT, sizeof(net_entity_t)),
+            .seen = calloc(MAX_ENTITY_COUNT, sizeof(uint64_t)),
+            .known_slots = malloc(sizeof(uint32_t) * MAX_ENTITY_COUNT),
+        };
+        assert(viewer->known && viewer->seen && viewer->known_slots);
+        printf("net: viewer joined, %lu watching\n", server->viewer_count);
+    }
+
+    for (size_t v=0; v<server->viewer_count; v++) {
+        net_viewer_t *viewer = server->viewers + v;
+        if (!fill_buffer(viewer->fd, &viewer->in)) {
+            drop_viewer(server, v--);
+            continue;
+        }
+
+        // The last subscription wins.
+        size_t offset = 0;
+        while (viewer->in.size - offset >= sizeof(net_subscribe_t)) {
+            net_subscribe_t msg;
+            memcpy(&msg, viewer->in.data + offset, sizeof(msg));
+            offset += sizeof(msg);
+            if (msg.kind == NET_MSG_SUBSCRIBE) {
+                viewer->view = msg.view;
+                viewer->subscribed = true;
+            }
+        }
+        buffer_consume(&viewer->in, offset);
+    }
+}
+
+bool net_server_view(const net_server_t *server, quad_aabb_t *view) {
+    assert(server);
+    assert(view);
+
+    bool any = false;
+    for (size_t v=0; v<server->viewer_count; v++) {
+        const net_viewer_t *viewer = server->viewers + v;
+        if (!viewer->subscribed) continue;
+        if (!any) {
+            *view = viewer->view;
+            any = true;
+            continue;
+        }
+        if (viewer->view.x_min < view->x_min) view->x_min = viewer->view.x_min;
+        if (viewer->view.y_min < view->y_min) view->y_min = viewer->view.y_min;
+        if (viewer->view.x_max > view->x_max) view->x_max = viewer->view.x_max;
+        if (viewer->view.y_max > view->y_max) view->y_max = viewer->view.y_max;
+    }
+    return any;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void encode_frame(net_server_t *server, net_viewer_t *viewer, const game_state_t *gs) {
+    viewer->frame++;
+    server->change_count = 0;
+    server->remove_count = 0;
+
+    server->query.count = 0;
+    query_buildings(gs, viewer->view, &server->query);
+
+    for (size_t i=0; i<server->query.count; i++) {
+        const building_t *b = gs->buildings + server->query.items[i];
+        if (b->flags & ENTITY_FLAGS_DELETED) continue;
+
+        const uint32_t slot = b->slot;
+        const net_entity_t e = get_entity(gs, b);
+        net_entity_t *known = viewer->known + slot;
+
+        uint8_t fields = type_fields(e.type);
+        if (viewer->seen[slot]) {
+            fields = changed_fields(known, &e);
+        } else {
+            viewer->known_slots[viewer->known_count++] = slot;
+        }
+        viewer->seen[slot] = viewer->frame;
+        *known = e;
+
+        if (fields) server->changes[server->change_count++] = (uint64_t)slot << 8 | fields;
+    }
+
+    // Whatever wasn't in view this frame is gone for the viewer.
+    for (size_t i=0; i<viewer->known_count; i++) {
+        const uint32_t slot = viewer->known_slots[i];
+        if (viewer->seen[slot] == viewer->frame) continue;
+        viewer->seen[slot] = 0;
+        server->removes[server->remove_count++] = slot;
+        viewer->known_slots[i--] = viewer->known_slots[--viewer->known_count];
+    }
+
+    // Ascending slots keep the deltas small.
+    qsort(server->changes, server->change_count, sizeof(uint64_t), compare_u64);
+    qsort(server->removes, server->remove_count, sizeof(uint32_t), compare_u32);
+
+    net_buffer_t *b = &server->frame;
+    b->size = 0;
+    buffer_reserve(b, sizeof(uint32_t));
+    b->size = sizeof(uint32_t); // length, below
+
+    put_varint(b, gs->tick);
+    put_varint(b, server->change_count);
+    put_varint(b, server->remove_count);
+
+    uint32_t previous = 0;
+    for (size_t i=0; i<server->change_count; i++) {
+        const uint32_t slot = server->changes[i] >> 8;
+        put_varint(b, slot - previous);
+        put_entity(b, viewer->known + slot, server->changes[i] & 0xff);
+        previous = slot;
+    }
+    previous = 0;
+    for (size_t i=0; i<server->remove_count; i++) {
+        put_varint(b, server->removes[i] - previous);
+        previous = server->removes[i];
+    }
+
+    const uint32_t length = b->size - sizeof(uint32_t);
+    memcpy(b->data, &length, sizeof(length));
+
+    net_stats_t *stats[2] = { &viewer->stats, &server->stats };
+    for (size_t i=0; i<ARRAY_LENGTH(stats); i++) {
+        stats[i]->frames++;
+        stats[i]->records += server->change_count;
+        stats[i]->removes += server->remove_count;
+        stats[i]->bytes += b->size;
+    }
+}
+
+void net_server_publish(net_server_t *server, const game_state_t *gs) {
+    assert(server);
+    assert(gs);
+
+    for (size_t v=0; v<server->viewer_count; v++) {
+        net_viewer_t *viewer = server->viewers + v;
+        if (!viewer->subscribed) continue;
+
+        encode_frame(server, viewer, gs);
+        put_bytes(&viewer->out, server->frame.data, server->frame.size);
+
+        if (!flush_buffer(viewer->fd, &viewer->out)) {
+            drop_viewer(server, v--);
+        } else if (viewer->out.size > NET_MAX_PENDING) {
+            printf("net: viewer doesn't keep up\n");
+            drop_viewer(server, v--);
+        }
+    }
+}
+
+// -----
+
+bool net_client_init(net_client_t *client, const char *path) {
+    assert(client);
+    assert(path);
+
+    memset(client, 0, sizeof(net_client_t));
+    client->fd = -1;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("net: socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("net: socket");
+        return false;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("net: connect");
+        close(fd);
+        return false;
+    }
+    set_nonblocking(fd);
+
+    client->fd = fd;
+    client->connected = true;
+    client->slot_capacity = MAX_ENTITY_COUNT;
+    client->slots = calloc(MAX_ENTITY_COUNT, sizeof(net_client_slot_t));
+    assert(client->slots);
+    return true;
+}
+
+void net_client_free(net_client_t *client) {
+    assert(client);
+    if (client->fd >= 0) close(client->fd);
+    free(client->slots);
+    buffer_free(&client->in);
+}
+
+void net_client_set_view(net_client_t *client, quad_aabb_t view) {
+    assert(client);
+    if (!client->connected) return;
+    if (client->view_sent && memcmp(&client->view, &view, sizeof(view)) == 0) return;
+
+    const net_subscribe_t msg = { .kind = NET_MSG_SUBSCRIBE, .view = view };
+    const ssize_t n = send(client->fd, &msg, sizeof(msg), MSG_NOSIGNAL);
+    if (n != sizeof(msg)) {
+        printf("net: lost the server\n");
+        client->connected = false;
+        return;
+    }
+    client->view = view;
+    client->view_sent = true;
+}
+
+static void set_entity(game_state_t *gs, handle_t building, uint8_t fields, const net_entity_t *e) {
+    const size_t index = get_building_index(gs, building);
+    if (!index) return;
+    const building_t *b = gs->buildings + index;
+
+    switch (b->type) {
+        case BUILDING_TYPE_MINER:
+            {
+                miner_t *miner = GET_MINER(gs, b->data);
+                if (fields & NET_FIELD_STATE) {
+                    miner->state = e->state;
+                    miner->work = e->work;
+                }
+            }
+            break;
+
+        case BUILDING_TYPE_FACTORY:
+            {
+                factory_t *factory = GET_FACTORY(gs, b->data);
+                if (fields & NET_FIELD_STATE) {
+                    factory->state = e->state;
+                    factory->work = e->work;
+                    if (e->recipe < recipe_count) factory->recipe = e->recipe;
+                }
+                if (fields & NET_FIELD_ITEMS) memcpy(&factory->counts, e->items, sizeof(factory->counts));
+            }
+            break;
+
+        case BUILDING_TYPE_BELT:
+            {
+                belt_t *belt = GET_BELT(gs, b->data);
+                if (fields & NET_FIELD_ITEMS) {
+                    memcpy(belt->items, e->items, sizeof(belt->items));
+                    memcpy(belt->works, e->works, sizeof(belt->works));
+                }
+                if (fields & NET_FIELD_DIRS) {
+                    belt->in_dir = e->dirs >> 4;
+                    belt->out_dir = e->dirs & 0xf;
+                }
+            }
+            break;
+    }
+}
+
+static bool apply_frame(net_client_t *client, game_state_t *mirror, net_reader_t *r) {
+    const uint64_t tick = get_varint(r);
+    const uint64_t change_count = get_varint(r);
+    const uint64_t remove_count = get_varint(r);
+
+    uint64_t slot = 0;
+    for (uint64_t i=0; r->ok && i<change_count; i++) {
+        slot += get_varint(r);
+        if (slot >= client->slot_capacity) return false;
+        net_client_slot_t *s = client->slots + slot;
+
+        net_entity_t e = {};
+        const uint8_t fields = get_u8(r);
+        if (fields & NET_FIELD_LAYOUT) {
+            e.generation = get_varint(r);
+            e.pos.x = get_zigzag(r);
+            e.pos.y = get_zigzag(r);
+            e.type = get_u8(r);
+            if (e.type >= BUILDING_TYPE_COUNT) return false;
+        }
+        // The layout comes first, so the type is known by now.
+        const size_t index = get_building_index(mirror, s->building);
+        const uint32_t type = (fields & NET_FIELD_LAYOUT) ? e.type :
+            index ? mirror->buildings[index].type : BUILDING_TYPE_COUNT;
+        if (fields & NET_FIELD_STATE) {
+            e.state = get_u8(r);
+            e.work = get_varint(r);
+            if (type == BUILDING_TYPE_FACTORY) e.recipe = get_varint(r);
+        }
+        if (fields & NET_FIELD_ITEMS) {
+            get_bytes(r, e.items, sizeof(e.items));
+            if (type == BUILDING_TYPE_BELT) get_bytes(r, e.works, sizeof(e.works));
+        }
+        if (fields & NET_FIELD_DIRS) {
+            e.dirs = get_u8(r);
+        }
+        if (!r->ok) return false;
+
+        if (fields & NET_FIELD_LAYOUT) {
+            if (!handle_is_none(s->building)) delete_building(mirror, s->building);
+            switch (e.type) {
+                case BUILDING_TYPE_MINER:   s->building = spawn_miner(mirror, e.pos); break;
+                case BUILDING_TYPE_FACTORY: s->building = spawn_factory(mirror, e.pos); break;
+                case BUILDING_TYPE_BELT:    s->building = spawn_belt(mirror, e.pos); break;
+            }
+            s->generation = e.generation;
+        }
+        set_entity(mirror, s->building, fields, &e);
+    }
+
+    slot = 0;
+    for (uint64_t i=0; r->ok && i<remove_count; i++) {
+        slot += get_varint(r);
+        if (slot >= client->slot_capacity) return false;
+        net_client_slot_t *s = client->slots + slot;
+        if (!handle_is_none(s->building)) delete_building(mirror, s->building);
+        *s = (net_client_slot_t) {};
+    }
+
+    if (!r->ok || r->p != r->end) return false;
+
+    client->tick = tick;
+    client->stats.frames++;
+    client->stats.records += change_count;
+    client->stats.removes += remove_count;
+    return true;
+}
+
+void net_client_poll(net_client_t *client, game_state_t *mirror) {
+    assert(client);
+    assert(mirror);
+    if (!client->connected) return;
+
+    if (!fill_buffer(client->fd, &client->in)) {
+        printf("net: lost the server\n");
+        client->connected = false;
+    }
+
+    size_t offset = 0;
+    while (client->in.size - offset >= sizeof(uint32_t)) {
+        uint32_t length;
+        memcpy(&length, client->in.data + offset, sizeof(length));
+        if (length > NET_MAX_FRAME) {
+            printf("net: bad frame\n");
+            client->connected = false;
+            break;
+        }
+        if (client->in.size - offset - sizeof(uint32_t) < length) break;
+
+        const uint8_t *frame = client->in.data + offset + sizeof(uint32_t);
+        net_reader_t r = { .p = frame, .end = frame + length, .ok = true };
+        if (!apply_frame(client, mirror, &r)) {
+            printf("net: bad frame\n");
+            client->connected = false;
+            break;
+        }
+        offset += sizeof(uint32_t) + length;
+        client->stats.bytes += sizeof(uint32_t) + length;
+    }
+    buffer_consume(&client->in, offset);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "game_state.h"
+
+// Streaming a headless simulation to viewers over a Unix socket.
+//
+// A viewer subscribes to a rectangle of cells. After every tick the server
+// sends it one frame with the buildings in that rectangle that changed since
+// the last frame, and the ones that left it. Per viewer, the server keeps a
+// copy of what the viewer was sent last, by building slot, so a frame costs
+// the buildings in view and its size follows what changes in view, not the
+// size of the world.
+//
+// Frames are a length followed by varints: the tick, the record count, the
+// records by ascending slot (slot delta, field mask, fields) and then the
+// removed slots (deltas). The viewer spawns, deletes and updates buildings of
+// a local mirror state, which updates without simulating (game_state_t.mirror).
+
+#define NET_DEFAULT_PATH     "/tmp/factory_002.sock"
+#define NET_MAX_VIEWERS      (8)
+#define NET_MAX_PENDING      (64 * 1024 * 1024) // unsent bytes before a viewer is dropped
+
+#define NET_FIELD_LAYOUT     (1) // generation, position, type: the building is new
+#define NET_FIELD_STATE      (2) // state and work of miners and factories, recipe of factories
+#define NET_FIELD_ITEMS      (4) // items (factories, belts) and item works (belts)
+#define NET_FIELD_DIRS       (8) // belt directions
+
+// What a viewer knows about a building.
+typedef struct {
+    uint32_t generation; // 0: unknown
+    coord_t pos;
+    uint8_t type;
+    uint8_t state;
+    uint8_t dirs;        // in_dir << 4 | out_dir
+    uint32_t work;
+    uint32_t recipe;
+    uint8_t items[4];    // factories: held counts
+    uint8_t works[BELT_ITEM_COUNT];
+} net_entity_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} net_buffer_t;
+
+typedef struct {
+    size_t frames;
+    size_t records;
+    size_t removes;
+    size_t bytes;
+} net_stats_t;
+
+typedef struct {
+    int fd;
+    bool subscribed;
+    quad_aabb_t view;
+
+    uint64_t frame;
+    size_t slot_capacity;
+    net_entity_t *known;    // by building slot
+    uint64_t *seen;         // frame a slot was last in view, 0 = unknown
+
+    size_t known_count;
+    uint32_t *known_slots;  // slots with seen != 0
+
+    net_buffer_t in;        // partial subscriptions
+    net_buffer_t out;       // unsent frames
+
+    net_stats_t stats;
+} net_viewer_t;
+
+typedef struct {
+    int listen_fd;
+    char path[108];
+
+    size_t viewer_count;
+    net_viewer_t viewers[NET_MAX_VIEWERS];
+
+    quad_tree_query_result_t query;
+
+    // One frame's changes.
+    size_t change_count;
+    uint64_t *changes;      // slot << 8 | field mask
+    size_t remove_count;
+    uint32_t *removes;
+    net_buffer_t frame;
+
+    net_stats_t stats;      // all viewers, since the start
+} net_server_t;
+
+bool net_server_init(net_server_t *server, const char *path);
+void net_server_free(net_server_t *server);
+
+// Accepts viewers and reads their subscriptions, never blocks.
+void net_server_poll(net_server_t *server);
+// Bounds of all subscribed views, false if nobody watches.
+bool net_server_view(const net_server_t *server, quad_aabb_t *view);
+// Sends every viewer the frame for the state's tick.
+void net_server_publish(net_server_t *server, const game_state_t *gs);
+
+typedef struct {
+    uint32_t generation;
+    handle_t building;      // in the mirror
+} net_client_slot_t;
+
+typedef struct {
+    int fd;
+    bool connected;
+
+    bool view_sent;
+    quad_aabb_t view;
+
+    size_t slot_capacity;
+    net_client_slot_t *slots; // by server building slot
+
+    net_buffer_t in;
+    uint64_t tick;          // of the last frame
+
+    net_stats_t stats;
+} net_client_t;
+
+bool net_client_init(net_client_t *client, const char *path);
+void net_client_free(net_client_t *client);
+
+// Subscribes to a new view, if it differs from the last one.
+void net_client_set_view(net_client_t *client, quad_aabb_t view);
+// Applies the frames received so far to the mirror, never blocks.
+void net_client_poll(net_client_t *client, game_state_t *mirror);
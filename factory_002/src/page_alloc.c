@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include "page_alloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct {
+    void *ptr;
+    size_t size;        // requested
+    size_t mapped;
+    size_t used;
+    page_subsystem_t subsystem;
+    uint32_t huge_pages;
+} page_block_t;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static page_policy_t policy = { .huge_pages = PAGE_HUGE_TRANSPARENT, .touch_threads = 0 };
+static size_t block_count;    // high-water mark, freed blocks leave holes
+static size_t block_capacity;
+static page_block_t *blocks;
+
+static const char *subsystem_names[PAGE_SUBSYSTEM_COUNT] = {
+    [PAGE_SUBSYSTEM_GAME_STATE] = "game state",
+    [PAGE_SUBSYSTEM_QUAD_TREE] = "quad tree",
+    [PAGE_SUBSYSTEM_LINEAR_QUAD_TREE] = "linear quad tree",
+};
+
+void page_set_policy(page_policy_t new_policy) {
+    pthread_mutex_lock(&mutex);
+    policy = new_policy;
+    pthread_mutex_unlock(&mutex);
+}
+
+page_policy_t page_get_policy() {
+    pthread_mutex_lock(&mutex);
+    const page_policy_t p = policy;
+    pthread_mutex_unlock(&mutex);
+    return p;
+}
+
+void page_policy_from_env() {
+    page_policy_t p = page_get_policy();
+
+    const char *huge = getenv("FACTORY_HUGE_PAGES");
+    if (huge) {
+        if (strcmp(huge, "off") == 0) p.huge_pages = PAGE_HUGE_OFF;
+        else if (strcmp(huge, "transparent") == 0) p.huge_pages = PAGE_HUGE_TRANSPARENT;
+        else if (strcmp(huge, "explicit") == 0) p.huge_pages = PAGE_HUGE_EXPLICIT;
+        else printf("FACTORY_HUGE_PAGES: unknown mode '%s'\n", huge);
+    }
+    const char *threads = getenv("FACTORY_TOUCH_THREADS");
+    if (threads) p.touch_threads = strtoul(threads, NULL, 10);
+
+    page_set_policy(p);
+}
+
+const char *page_subsystem_name(page_subsystem_t subsystem) {
+    assert(subsystem < PAGE_SUBSYSTEM_COUNT);
+    return subsystem_names[subsystem];
+}
+
+// -----
+
+static page_block_t *find_block(const void *ptr) {
+    for (size_t i=0; i<block_count; i++) {
+        if (blocks[i].ptr == ptr) return blocks + i;
+    }
+    return NULL;
+}
+
+// A hole or a new entry at the end, the table grows as needed.
+static page_block_t *add_block() {
+    page_block_t *block = find_block(NULL);
+    if (block) return block;
+    if (block_count == block_capacity) {
+        block_capacity = block_capacity ? block_capacity * 2 : 64;
+        blocks = realloc(blocks, sizeof(page_block_t) * block_capacity);
+        assert(blocks);
+    }
+    return blocks + block_count++;
+}
+
+void *page_alloc(page_subsystem_t subsystem, size_t size) {
+    assert(subsystem < PAGE_SUBSYSTEM_COUNT);
+    assert(size > 0);
+    const page_policy_t p = page_get_policy();
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t mapped = (size + page_size - 1) / page_size * page_size;
+    uint32_t huge_pages = p.huge_pages;
+
+    void *ptr = MAP_FAILED;
+    if (huge_pages == PAGE_HUGE_EXPLICIT) {
+        const size_t huge_mapped = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        ptr = mmap(NULL, huge_mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            mapped = huge_mapped;
+        } else {
+            printf("page_alloc: no explicit huge pages for %s (%lu MiB), using transparent ones\n",
+                    page_subsystem_name(subsystem), huge_mapped / 1024 / 1024);
+            huge_pages = PAGE_HUGE_TRANSPARENT;
+        }
+    }
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(ptr != MAP_FAILED);
+        if (huge_pages == PAGE_HUGE_TRANSPARENT && madvise(ptr, mapped, MADV_HUGEPAGE) != 0) {
+            huge_pages = PAGE_HUGE_OFF;
+        }
+    }
+
+    pthread_mutex_lock(&mutex);
+    page_block_t *block = add_block();
+    *block = (page_block_t) {
+        .ptr = ptr,
+        .size = size,
+        .mapped = mapped,
+        .subsystem = subsystem,
+        .huge_pages = huge_pages,
+    };
+    pthread_mutex_unlock(&mutex);
+
+    return ptr;
+}
+
+void page_free(void *ptr) {
+    if (!ptr) return;
+
+    pthread_mutex_lock(&mutex);
+    page_block_t *block = find_block(ptr);
+    assert(block);
+    const size_t mapped = block->mapped;
+    memset(block, 0, sizeof(page_block_t));
+    pthread_mutex_unlock(&mutex);
+
+    munmap(ptr, mapped);
+}
+
+void page_set_used(const void *ptr, size_t used) {
+    pthread_mutex_lock(&mutex);
+    page_block_t *block = find_block(ptr);
+    assert(block);
+    block->used = used;
+    pthread_mutex_unlock(&mutex);
+}
+
+// -----
+
+typedef struct {
+    uint8_t *begin;
+    uint8_t *end;
+    size_t cpu;
+} touch_range_t;
+
+static void *touch_main(void *arg) {
+    const touch_range_t *range = arg;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(range->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+
+    // Rewrites what is there, so ranges in use keep their data.
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    for (volatile uint8_t *p = range->begin; p < range->end; p += page_size) {
+        *p = *p;
+    }
+    return NULL;
+}
+
+void page_touch(void *ptr, size_t size) {
+    assert(ptr || size == 0);
+    const page_policy_t p = page_get_policy();
+    if (!p.touch_threads || !size) return;
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    const size_t thread_count = p.touch_threads;
+
+    touch_range_t *ranges = malloc(sizeof(touch_range_t) * thread_count);
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    assert(ranges);
+    assert(threads);
+
+    // Page aligned starts, a page shared by two ranges goes to the first.
+    uint8_t *base = ptr;
+    uint8_t *aligned = (uint8_t *)((uintptr_t)base / page_size * page_size);
+    for (size_t i=0; i<thread_count; i++) {
+        uint8_t *begin = base + size * i / thread_count;
+        uint8_t *end = base + size * (i + 1) / thread_count;
+        begin = (i == 0) ? aligned : aligned + (begin - aligned + page_size - 1) / page_size * page_size;
+        ranges[i] = (touch_range_t) {
+            .begin = begin,
+            .end = end,
+            .cpu = i * cpu_count / thread_count,
+        };
+        pthread_create(threads + i, NULL, touch_main, ranges + i);
+    }
+    for (size_t i=0; i<thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(ranges);
+    free(threads);
+}
+
+// -----
+
+void page_get_stats(page_subsystem_t subsystem, page_stats_t *stats) {
+    assert(subsystem < PAGE_SUBSYSTEM_COUNT);
+    assert(stats);
+    memset(stats, 0, sizeof(page_stats_t));
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t vector_size = 0;
+    unsigned char *vector = NULL;
+
+    pthread_mutex_lock(&mutex);
+    for (size_t i=0; i<block_count; i++) {
+        const page_block_t *block = blocks + i;
+        if (!block->ptr || block->subsystem != subsystem) continue;
+
+        stats->blocks++;
+        stats->reserved += block->mapped;
+        stats->used += block->used;
+        if (block->huge_pages == PAGE_HUGE_EXPLICIT) stats->huge += block->mapped;
+        if (block->huge_pages == PAGE_HUGE_TRANSPARENT) stats->huge_advised += block->mapped;
+
+        // Explicit huge pages are committed when mapped.
+        if (block->huge_pages == PAGE_HUGE_EXPLICIT) {
+            stats->committed += block->mapped;
+            continue;
+        }
+        const size_t pages = block->mapped / page_size;
+        if (pages > vector_size) {
+            vector = realloc(vector, pages);
+            assert(vector);
+            vector_size = pages;
+        }
+        if (mincore(block->ptr, block->mapped, vector) != 0) continue;
+        for (size_t j=0; j<pages; j++) {
+            if (vector[j] & 1) stats->committed += page_size;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    free(vector);
+}
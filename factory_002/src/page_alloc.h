@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Large long-lived buffers (game states, spatial indices) on their own page
+// mappings instead of malloc, with accounting per subsystem.
+//
+// - Huge pages: transparent ones are requested with madvise, explicit ones
+//   come from the hugetlbfs pool (vm.nr_hugepages) and fall back to
+//   transparent ones when the pool is empty.
+// - Placement: pages are zero and uncommitted until first written, and the
+//   kernel puts a page on the NUMA node of the thread that writes it first.
+//   With touch_threads set, page_touch() writes every page of a range from
+//   that many threads, each taking the contiguous part a parallel sweep over
+//   the range would give it, pinned to a CPU.
+// - Accounting: reserved is the mapped size, committed the resident part
+//   (mincore), used what the owner reports with page_set_used().
+//
+// The policy applies to allocations after it is set. page_policy_from_env()
+// reads FACTORY_HUGE_PAGES=off|transparent|explicit and FACTORY_TOUCH_THREADS=n.
+
+typedef enum {
+    PAGE_SUBSYSTEM_GAME_STATE,
+    PAGE_SUBSYSTEM_QUAD_TREE,
+    PAGE_SUBSYSTEM_LINEAR_QUAD_TREE,
+    PAGE_SUBSYSTEM_COUNT,
+} page_subsystem_t;
+
+#define PAGE_HUGE_OFF          (0)
+#define PAGE_HUGE_TRANSPARENT  (1)
+#define PAGE_HUGE_EXPLICIT     (2)
+
+typedef struct {
+    uint32_t huge_pages;
+    size_t touch_threads; // 0: whoever writes a page first places it
+} page_policy_t;
+
+void page_set_policy(page_policy_t policy);
+page_policy_t page_get_policy();
+void page_policy_from_env();
+
+// Zeroed, page aligned.
+void *page_alloc(page_subsystem_t subsystem, size_t size);
+void page_free(void *ptr);
+
+// Bytes of the block at ptr in use by its owner.
+void page_set_used(const void *ptr, size_t used);
+// First touch of [ptr, ptr + size) as described above, nothing without touch_threads.
+void page_touch(void *ptr, size_t size);
+
+typedef struct {
+    size_t blocks;
+    size_t reserved;
+    size_t committed;
+    size_t used;
+    size_t huge;        // reserved on explicit huge pages
+    size_t huge_advised; // reserved with transparent huge pages requested
+} page_stats_t;
+
+// Walks the page tables of the subsystem's blocks, not for every frame.
+void page_get_stats(page_subsystem_t subsystem, page_stats_t *stats);
+const char *page_subsystem_name(page_subsystem_t subsystem);
@@ -1,6 +1,9 @@
 #include "quad_tree.h"
 #include "coord.h"
 #include "utils.h"
+#include "page_alloc.h"
+#include "metrics.h"
+#include "job_system.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,26 +39,95 @@ static bool aabb_overlaps(quad_aabb_t a, quad_aabb_t b) {
     return x_overlap && y_overlap;
 }
 
+static void arena_count_used(quad_tree_t *tree, ptrdiff_t size) {
+    quad_arena_stats_t *stats = &tree->arena_stats;
+    stats->used += size;
+    if (stats->used > stats->used_high_water) stats->used_high_water = stats->used;
+}
+
 static void *arena_alloc(quad_tree_t *tree, size_t size) {
     assert(tree);
     assert(size);
+    size = (size + 7) & ~(size_t)7;
+
+    while (tree->chunk_index < tree->chunk_count) {
+        const quad_arena_chunk_t *chunk = tree->chunks + tree->chunk_index;
+        if (tree->chunk_pos + size <= chunk->size) {
+            void *ptr = (uint8_t *)chunk->data + tree->chunk_pos;
+            tree->chunk_pos += size;
+            arena_count_used(tree, size);
+            return ptr;
+        }
+        if (tree->chunk_index + 1 == tree->chunk_count) break;
+        tree->chunk_index++;
+        tree->chunk_pos = 0;
+    }
 
-    if (tree->arena_pos + size >= tree->arena_size) {
-        printf("arena full\n");
-        assert(0);
-        return NULL;
+    if (tree->chunk_count == tree->chunk_capacity) {
+        tree->chunk_capacity = tree->chunk_capacity ? tree->chunk_capacity * 2 : 16;
+        tree->chunks = realloc(tree->chunks, sizeof(quad_arena_chunk_t) * tree->chunk_capacity);
+        assert(tree->chunks);
     }
+    const size_t chunk_size = size > tree->chunk_size ? size : tree->chunk_size;
+    quad_arena_chunk_t *chunk = tree->chunks + tree->chunk_count;
+    chunk->data = page_alloc(PAGE_SUBSYSTEM_QUAD_TREE, chunk_size);
+    chunk->size = chunk_size;
+    tree->chunk_index = tree->chunk_count++;
+    tree->chunk_pos = size;
+
+    quad_arena_stats_t *stats = &tree->arena_stats;
+    stats->reserved += chunk_size;
+    if (tree->chunk_count > stats->chunk_high_water) stats->chunk_high_water = tree->chunk_count;
+
+    arena_count_used(tree, size);
+    return chunk->data;
+}
 
-    void *ptr = tree->arena_buffer + tree->arena_pos;
-    tree->arena_pos += size;
+// Free lists are linked through the first word of the freed block.
+static void *free_list_pop(quad_tree_t *tree, void **list, size_t size) {
+    void *ptr = *list;
+    if (!ptr) return NULL;
+    *list = *(void **)ptr;
+    tree->arena_stats.free_listed -= size;
+    arena_count_used(tree, size);
     return ptr;
 }
 
+static void free_list_push(quad_tree_t *tree, void **list, void *ptr, size_t size) {
+    *(void **)ptr = *list;
+    *list = ptr;
+    tree->arena_stats.free_listed += size;
+    arena_count_used(tree, -(ptrdiff_t)size);
+}
+
+static size_t item_class(size_t capacity) {
+    size_t c = 0;
+    while (((size_t)1 << c) < capacity) c++;
+    assert(((size_t)1 << c) == capacity);
+    assert(c < QUAD_ITEM_CLASS_COUNT);
+    return c;
+}
+
+static size_t *alloc_items(quad_tree_t *tree, size_t capacity) {
+    const size_t size = sizeof(size_t) * capacity;
+    size_t *items = free_list_pop(tree, tree->free_items + item_class(capacity), size);
+    return items ? items : arena_alloc(tree, size);
+}
+
+static void free_items(quad_tree_t *tree, size_t *items, size_t capacity) {
+    if (!items) return;
+    free_list_push(tree, tree->free_items + item_class(capacity), items, sizeof(size_t) * capacity);
+}
+
 static quad_node_t *create_quad_node(quad_tree_t *tree) {
     assert(tree);
 
     quad_node_t *node = arena_alloc(tree, sizeof(quad_node_t));
     memset(node, 0, sizeof(quad_node_t));
+
+    quad_arena_stats_t *stats = &tree->arena_stats;
+    stats->node_count++;
+    if (stats->node_count > stats->node_high_water) stats->node_high_water = stats->node_count;
     return node;
 }
 
@@ -64,18 +136,16 @@ static void quad_node_add_item(quad_tree_t *tree, quad_node_t *node, size_t item
     assert(node);
     assert(item);
 
-    size_t old_count = node->item_count;
-    size_t *old_items = node->items;
-
-    size_t new_count = node->item_count + 1;
-    size_t *new_items = arena_alloc(tree, sizeof(size_t) * new_count);
-
-    if (old_count && old_items)
-        memcpy(new_items, old_items, sizeof(size_t) * old_count);
-    new_items[new_count-1] = item;
+    if (node->item_count == node->item_capacity) {
+        const size_t new_capacity = node->item_capacity ? node->item_capacity * 2 : 1;
+        size_t *new_items = alloc_items(tree, new_capacity);
+        if (node->item_count) memcpy(new_items, node->items, sizeof(size_t) * node->item_count);
+        free_items(tree, node->items, node->item_capacity);
 
-    node->item_count = new_count;
-    node->items = new_items;
+        node->items = new_items;
+        node->item_capacity = new_capacity;
+    }
+    node->items[node->item_count++] = item;
 }
 
 // -----
@@ -84,11 +154,8 @@ quad_tree_t *quad_tree_create() {
 
     quad_tree_t *tree = malloc(sizeof(quad_tree_t));
     memset(tree, 0, sizeof(quad_tree_t));
-
-    tree->arena_size = 1024 * 1024 * 100;
-    tree->arena_pos = 0;
-    tree->arena_buffer = malloc(tree->arena_size);
-    assert(tree->arena_buffer);
+    tree->chunk_size = QUAD_ARENA_CHUNK_SIZE;
+    pthread_mutex_init(&tree->arena_mutex, NULL);
 
     return tree;
 }
@@ -96,7 +163,15 @@ quad_tree_t *quad_tree_create() {
 void quad_tree_destroy(quad_tree_t *tree) {
     assert(tree);
 
-    free(tree->arena_buffer);
+    for (size_t i=0; i<tree->chunk_count; i++) {
+        page_free(tree->chunks[i].data);
+    }
+    free(tree->chunks);
+    free(tree->build_keys);
+    free(tree->build_scratch);
+    free(tree->build_tasks);
+    free(tree->build_top_nodes);
+    pthread_mutex_destroy(&tree->arena_mutex);
     free(tree);
 }
 
@@ -104,7 +179,19 @@ void quad_tree_reset(quad_tree_t *tree) {
     assert(tree);
     //memset(tree, 0, sizeof(quad_tree_t));
 
-    tree->arena_pos = 0;
+    // Chunks the last build didn't reach aren't needed for a map this size.
+    quad_arena_stats_t *stats = &tree->arena_stats;
+    while (tree->chunk_count > tree->chunk_index + 1) {
+        quad_arena_chunk_t *chunk = tree->chunks + --tree->chunk_count;
+        page_free(chunk->data);
+        stats->reserved -= chunk->size;
+    }
+    tree->chunk_index = 0;
+    tree->chunk_pos = 0;
+    memset(tree->free_items, 0, sizeof(tree->free_items));
+    stats->used = 0;
+    stats->free_listed = 0;
+    stats->node_count = 0;
 
     const int32_t s = 1 << 16;
     tree->root = create_quad_node(tree);
@@ -115,6 +202,14 @@ void quad_tree_reset(quad_tree_t *tree) {
     // - pos describes entire cell
 }
 
+void quad_tree_account_memory(const quad_tree_t *tree) {
+    assert(tree);
+    for (size_t i=0; i<tree->chunk_count; i++) {
+        const size_t used = (i < tree->chunk_index) ? tree->chunks[i].size : (i == tree->chunk_index) ? tree->chunk_pos : 0;
+        page_set_used(tree->chunks[i].data, used);
+    }
+}
+
 static uint32_t quad_tree_child_index(int32_t row, int32_t col) {
     assert(row >= 0 && row <= 1);
     assert(col >= 0 && col <= 1);
@@ -122,7 +217,17 @@ static uint32_t quad_tree_child_index(int32_t row, int32_t col) {
     return row*2 + col;
 }
 
-void quad_tree_insert(quad_tree_t *tree, coord_t pos, size_t item) {
+static void quad_stats_add(quad_stats_t *stats, const quad_stats_t *other) {
+    for (size_t i=0; i<QUAD_STATS_TYPE_COUNT; i++) {
+        stats->type_counts[i] += other->type_counts[i];
+    }
+    stats->cell_count += other->cell_count;
+    stats->item_count += other->item_count;
+    stats->item_capacity += other->item_capacity;
+    stats->active_count += other->active_count;
+}
+
+void quad_tree_insert(quad_tree_t *tree, coord_t pos, size_t item, const quad_stats_t *stats) {
     //printf("insert (%d,%d) -> %lu\n", pos.x, pos.y, item);
 
     if (!aabb_contains(tree->root->bounds, pos)) { // ~3 ms ???
@@ -134,6 +239,8 @@ void quad_tree_insert(quad_tree_t *tree, coord_t pos, size_t item) {
     quad_node_t *current_node = tree->root;
 
     while (1) {
+        if (stats) quad_stats_add(&current_node->stats, stats);
+
         quad_aabb_t b = current_node->bounds;
         int32_t w = b.x_max - b.x_min;
         int32_t h = b.y_max - b.y_min;
@@ -163,10 +270,236 @@ void quad_tree_insert(quad_tree_t *tree, coord_t pos, size_t item) {
     }
 }
 
+// -----
+// Bulk build. Keys are the Morton code of the cell relative to the root,
+// two bits per level with the child index of that level, above the index
+// of the item in the input.
+
+#define QUAD_LEVELS       (17) // below the root, down to single cells
+#define BUILD_INDEX_BITS  (24)
+#define BUILD_KEY_BITS    (2 * QUAD_LEVELS)
+#define BUILD_RADIX_BITS  (11)
+#define BUILD_RADIX_MASK  ((1 << BUILD_RADIX_BITS) - 1)
+
+typedef struct {
+    uint8_t *pos;
+    uint8_t *end;
+    size_t node_count;
+} quad_arena_slice_t;
+
+typedef struct {
+    quad_tree_t *tree;
+    const quad_build_item_t *items;
+    const uint64_t *keys;
+    quad_arena_slice_t slices[JOB_MAX_WORKERS];
+} quad_build_t;
+
+static uint64_t spread_bits(uint32_t v) {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x << 8))  & 0x00FF00FF00FF00FFull;
+    x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x << 2))  & 0x3333333333333333ull;
+    x = (x | (x << 1))  & 0x5555555555555555ull;
+    return x;
+}
+
+static inline uint32_t key_digit(uint64_t key, uint32_t depth) {
+    return (key >> (BUILD_INDEX_BITS + 2 * (QUAD_LEVELS - 1 - depth))) & 3;
+}
+
+static void *slice_alloc(quad_tree_t *tree, quad_arena_slice_t *slice, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (slice->pos + size > slice->end) {
+        // The rest of the old slice stays unused until the next reset.
+        const size_t slice_size = size > QUAD_ARENA_SLICE_SIZE ? size : QUAD_ARENA_SLICE_SIZE;
+        pthread_mutex_lock(&tree->arena_mutex);
+        arena_count_used(tree, -(slice->end - slice->pos));
+        slice->pos = arena_alloc(tree, slice_size);
+        pthread_mutex_unlock(&tree->arena_mutex);
+        slice->end = slice->pos + slice_size;
+    }
+    void *ptr = slice->pos;
+    slice->pos += size;
+    return ptr;
+}
+
+static quad_node_t *build_child(quad_tree_t *tree, quad_arena_slice_t *slice, quad_node_t *node, uint32_t idx) {
+    quad_node_t *child;
+    if (slice) {
+        child = slice_alloc(tree, slice, sizeof(quad_node_t));
+        memset(child, 0, sizeof(quad_node_t));
+        slice->node_count++;
+    } else {
+        child = create_quad_node(tree);
+    }
+
+    // As in quad_tree_insert().
+    const quad_aabb_t b = node->bounds;
+    const int32_t w = b.x_max - b.x_min;
+    const int32_t h = b.y_max - b.y_min;
+    const int32_t x_min = b.x_min + (idx % 2) * w/2;
+    const int32_t y_min = b.y_min + (idx / 2) * h/2;
+    child->bounds = (quad_aabb_t) { x_min, y_min, x_min + w/2, y_min + h/2 };
+
+    node->children[idx] = child;
+    return child;
+}
+
+// End of the keys in [begin, end) with a digit at depth up to digit.
+static size_t digit_end(const uint64_t *keys, size_t begin, size_t end, uint32_t depth, uint32_t digit) {
+    while (begin < end) {
+        const size_t mid = begin + (end - begin) / 2;
+        if (key_digit(keys[mid], depth) <= digit) begin = mid + 1;
+        else end = mid;
+    }
+    return begin;
+}
+
+static void build_subtree(quad_build_t *b, quad_arena_slice_t *slice, quad_node_t *node,
+        size_t begin, size_t end, uint32_t depth) {
+    if (depth == QUAD_LEVELS) {
+        size_t capacity = 1;
+        while (capacity < end - begin) capacity *= 2;
+        node->items = slice_alloc(b->tree, slice, sizeof(size_t) * capacity);
+        node->item_capacity = capacity;
+        for (size_t i=begin; i<end; i++) {
+            const quad_build_item_t *item = b->items + (b->keys[i] & ((1ull << BUILD_INDEX_BITS) - 1));
+            node->items[node->item_count++] = item->item;
+            quad_stats_add(&node->stats, &item->stats);
+        }
+        return;
+    }
+
+    for (uint32_t digit=0; digit<4; digit++) {
+        const size_t child_end = digit_end(b->keys, begin, end, depth, digit);
+        if (child_end == begin) continue;
+        quad_node_t *child = build_child(b->tree, slice, node, digit);
+        build_subtree(b, slice, child, begin, child_end, depth + 1);
+        quad_stats_add(&node->stats, &child->stats);
+        begin = child_end;
+    }
+}
+
+// Splits the top levels serially, nodes above the subtrees go to the top list.
+static void plan_subtree(quad_tree_t *tree, const uint64_t *keys, quad_node_t *node,
+        size_t begin, size_t end, uint32_t depth) {
+    if (end - begin <= QUAD_BUILD_GRAIN || depth == QUAD_LEVELS) {
+        if (tree->build_task_count == tree->build_task_capacity) {
+            tree->build_task_capacity = tree->build_task_capacity ? tree->build_task_capacity * 2 : 256;
+            tree->build_tasks = realloc(tree->build_tasks, sizeof(quad_build_task_t) * tree->build_task_capacity);
+            assert(tree->build_tasks);
+        }
+        tree->build_tasks[tree->build_task_count++] = (quad_build_task_t) { node, depth, begin, end };
+        return;
+    }
+
+    if (tree->build_top_count == tree->build_top_capacity) {
+        tree->build_top_capacity = tree->build_top_capacity ? tree->build_top_capacity * 2 : 256;
+        tree->build_top_nodes = realloc(tree->build_top_nodes, sizeof(quad_node_t *) * tree->build_top_capacity);
+        assert(tree->build_top_nodes);
+    }
+    tree->build_top_nodes[tree->build_top_count++] = node;
+
+    for (uint32_t digit=0; digit<4; digit++) {
+        const size_t child_end = digit_end(keys, begin, end, depth, digit);
+        if (child_end == begin) continue;
+        quad_node_t *child = build_child(tree, NULL, node, digit);
+        plan_subtree(tree, keys, child, begin, child_end, depth + 1);
+        begin = child_end;
+    }
+}
+
+static void build_tasks_job(void *ctx, size_t begin, size_t end, job_worker_t *worker) {
+    quad_build_t *b = ctx;
+    quad_arena_slice_t *slice = b->slices + (worker ? worker->index : 0);
+    for (size_t t=begin; t<end; t++) {
+        const quad_build_task_t *task = b->tree->build_tasks + t;
+        build_subtree(b, slice, task->node, task->begin, task->end, task->depth);
+    }
+}
+
+// Stable LSD radix sort of the keys over the key bits, skipping passes
+// where all keys share the digit. Returns the sorted array.
+static uint64_t *sort_keys(uint64_t *keys, uint64_t *scratch, size_t count) {
+    size_t histogram[1 << BUILD_RADIX_BITS];
+
+    for (uint32_t shift=BUILD_INDEX_BITS; shift<BUILD_INDEX_BITS + BUILD_KEY_BITS; shift+=BUILD_RADIX_BITS) {
+        memset(histogram, 0, sizeof(histogram));
+        for (size_t i=0; i<count; i++) histogram[(keys[i] >> shift) & BUILD_RADIX_MASK]++;
+        if (histogram[(keys[0] >> shift) & BUILD_RADIX_MASK] == count) continue;
+
+        size_t offset = 0;
+        for (size_t d=0; d<ARRAY_LENGTH(histogram); d++) {
+            const size_t n = histogram[d];
+            histogram[d] = offset;
+            offset += n;
+        }
+        for (size_t i=0; i<count; i++) scratch[histogram[(keys[i] >> shift) & BUILD_RADIX_MASK]++] = keys[i];
+
+        uint64_t *t = keys;
+        keys = scratch;
+        scratch = t;
+    }
+    return keys;
+}
+
+void quad_tree_build(quad_tree_t *tree, const quad_build_item_t *items, size_t count, job_system_t *jobs) {
+    assert(tree);
+    assert(tree->root);
+    assert(count < (1ull << BUILD_INDEX_BITS));
+    const quad_node_t *root = tree->root;
+    assert(!root->item_count && !root->children[0] && !root->children[1] && !root->children[2] && !root->children[3]);
+    assert(root->bounds.x_max - root->bounds.x_min == 1 << QUAD_LEVELS);
+    if (!count) return;
+
+    if (count > tree->build_capacity) {
+        tree->build_capacity = count;
+        tree->build_keys = realloc(tree->build_keys, sizeof(uint64_t) * count);
+        tree->build_scratch = realloc(tree->build_scratch, sizeof(uint64_t) * count);
+        assert(tree->build_keys && tree->build_scratch);
+    }
+
+    for (size_t i=0; i<count; i++) {
+        const coord_t pos = items[i].pos;
+        if (!aabb_contains(root->bounds, pos)) {
+            printf("outside bounds of root: %d %d\n", pos.x, pos.y);
+            assert(0);
+        }
+        const uint32_t x = pos.x - root->bounds.x_min;
+        const uint32_t y = pos.y - root->bounds.y_min;
+        tree->build_keys[i] = ((spread_bits(x) | (spread_bits(y) << 1)) << BUILD_INDEX_BITS) | i;
+    }
+    const uint64_t *keys = sort_keys(tree->build_keys, tree->build_scratch, count);
+
+    tree->build_task_count = 0;
+    tree->build_top_count = 0;
+    plan_subtree(tree, keys, tree->root, 0, count, 0);
+
+    quad_build_t build = { .tree = tree, .items = items, .keys = keys };
+    parallel_for(jobs, tree->build_task_count, 1, build_tasks_job, &build);
+
+    // Children come after their parents in the top list.
+    for (size_t t=tree->build_top_count; t-->0;) {
+        quad_node_t *node = tree->build_top_nodes[t];
+        for (size_t c=0; c<4; c++) {
+            if (node->children[c]) quad_stats_add(&node->stats, &node->children[c]->stats);
+        }
+    }
+
+    quad_arena_stats_t *stats = &tree->arena_stats;
+    for (size_t w=0; w<JOB_MAX_WORKERS; w++) {
+        arena_count_used(tree, -(build.slices[w].end - build.slices[w].pos));
+        stats->node_count += build.slices[w].node_count;
+    }
+    if (stats->node_count > stats->node_high_water) stats->node_high_water = stats->node_count;
+}
+
 void quad_node_query(quad_node_t *node, quad_aabb_t bounds, quad_tree_query_result_t *query_result) {
     assert(node);
     assert(query_result);
 
+    metrics_add(METRIC_QUAD_NODES, 1);
     for (size_t i=0; i<node->item_count; i++) {
         if (query_result->count < query_result->capacity) {
             query_result->items[query_result->count++] = node->items[i];
@@ -188,9 +521,46 @@ void quad_tree_query(const quad_tree_t *tree, quad_aabb_t bounds, quad_tree_quer
     assert(tree);
     assert(query_result);
 
+    metrics_add(METRIC_QUAD_QUERIES, 1);
     quad_node_query(tree->root, bounds, query_result);
 }
 
+static void quad_node_query_nodes(const quad_node_t *node, quad_aabb_t bounds, int32_t node_size,
+        quad_tree_node_result_t *node_result) {
+    assert(node);
+    assert(node_result);
+
+    metrics_add(METRIC_QUAD_NODES, 1);
+    if (node->bounds.x_max - node->bounds.x_min <= node_size) {
+        if (node_result->count < node_result->capacity) {
+            node_result->nodes[node_result->count++] = node;
+        } else {
+            printf("node query result full\n");
+        }
+        return;
+    }
+
+    for (size_t i=0; i<ARRAY_LENGTH(node->children); i++) {
+        quad_node_t *c = node->children[i];
+
+        if (c && aabb_overlaps(c->bounds, bounds)) {
+            quad_node_query_nodes(c, bounds, node_size, node_result);
+        }
+    }
+}
+
+void quad_tree_query_nodes(const quad_tree_t *tree, quad_aabb_t bounds, int32_t node_size,
+        quad_tree_node_result_t *node_result) {
+    assert(tree);
+    assert(node_result);
+    assert(node_size >= 1);
+
+    // Returns the (non-empty) nodes of the given size that overlap bounds,
+    // instead of the items below them.
+    metrics_add(METRIC_QUAD_QUERIES, 1);
+    quad_node_query_nodes(tree->root, bounds, node_size, node_result);
+}
+
 static void print_pad(int pad) {
     for (int i=0; i<pad; i++) {
         printf(" ");
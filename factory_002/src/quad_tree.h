@@ -2,9 +2,14 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
 
 #include "coord.h"
 
+struct job_system;
+
 typedef struct {
     int32_t x_min;
     int32_t y_min;
@@ -12,19 +17,93 @@ typedef struct {
     int32_t y_max;
 } quad_aabb_t;
 
+#define QUAD_STATS_TYPE_COUNT (4)
+
+// Aggregates over everything below a node, accumulated on insert.
+// Used for level-of-detail rendering at low zoom.
+typedef struct {
+    uint32_t type_counts[QUAD_STATS_TYPE_COUNT];
+    uint32_t cell_count; // occupied cells
+    uint32_t item_count;
+    uint32_t item_capacity;
+    uint32_t active_count;
+} quad_stats_t;
+
 typedef struct quad_node {
     quad_aabb_t bounds;
     struct quad_node *children[4];
 
     size_t item_count;
+    size_t item_capacity; // of items, a power of two
     size_t *items;
 
+    quad_stats_t stats;
+
 } quad_node_t;
 
+// Nodes and item arrays come from an arena of page_alloc() chunks that grows
+// on demand. Item arrays a node outgrew go to free lists, one per capacity,
+// and are reused before the arena grows. Nodes are only freed all at once:
+// the index is rebuilt every update, and a reset keeps the chunks the last
+// build used and releases the rest, so the arena follows the size of the map.
+
+#define QUAD_ARENA_CHUNK_SIZE (16 * 1024 * 1024)
+#define QUAD_ARENA_SLICE_SIZE (256 * 1024) // taken from the arena by a bulk build job
+#define QUAD_ITEM_CLASS_COUNT (32) // item arrays of 1 << class items
+#define QUAD_BUILD_GRAIN (2048) // most items in a subtree of a bulk build job
+
+typedef struct {
+    void *data;
+    size_t size;
+} quad_arena_chunk_t;
+
+typedef struct {
+    size_t reserved;        // in chunks
+    size_t used;            // handed out, not on a free list
+    size_t free_listed;
+    size_t node_count;
+    // Since creation.
+    size_t used_high_water;
+    size_t node_high_water;
+    size_t chunk_high_water;
+} quad_arena_stats_t;
+
 typedef struct {
-    size_t arena_size;
-    size_t arena_pos;
-    void *arena_buffer;
+    coord_t pos;
+    size_t item;
+    quad_stats_t stats;
+} quad_build_item_t;
+
+typedef struct {
+    struct quad_node *node;
+    uint32_t depth;
+    size_t begin;    // into the sorted keys
+    size_t end;
+} quad_build_task_t;
+
+typedef struct {
+    size_t chunk_size;      // of new chunks, QUAD_ARENA_CHUNK_SIZE
+    size_t chunk_count;
+    size_t chunk_capacity;
+    quad_arena_chunk_t *chunks;
+    size_t chunk_index;     // bump allocation in chunks[chunk_index]
+    size_t chunk_pos;
+
+    void *free_items[QUAD_ITEM_CLASS_COUNT];
+
+    quad_arena_stats_t arena_stats;
+    pthread_mutex_t arena_mutex; // bulk build jobs taking slices
+
+    // Bulk build scratch, kept between builds.
+    size_t build_capacity;
+    uint64_t *build_keys;
+    uint64_t *build_scratch;
+    size_t build_task_count;
+    size_t build_task_capacity;
+    quad_build_task_t *build_tasks;
+    size_t build_top_count;
+    size_t build_top_capacity;
+    quad_node_t **build_top_nodes;
 
     quad_node_t *root;
 } quad_tree_t;
@@ -35,12 +114,28 @@ typedef struct {
     size_t *items;
 } quad_tree_query_result_t;
 
+typedef struct {
+    size_t capacity;
+    size_t count;
+    const quad_node_t **nodes;
+} quad_tree_node_result_t;
+
 quad_tree_t *quad_tree_create();
 void quad_tree_destroy(quad_tree_t *tree);
 
 void quad_tree_reset(quad_tree_t *tree);
-void quad_tree_insert(quad_tree_t *tree, coord_t pos, size_t item);
+void quad_tree_insert(quad_tree_t *tree, coord_t pos, size_t item, const quad_stats_t *stats);
+// Fills a reset tree with count items at once, the same tree as inserting
+// them in order. Items are sorted by cell in Morton order, the top levels
+// are split serially down to subtrees of at most QUAD_BUILD_GRAIN items,
+// and the subtrees are built as jobs, each worker allocating from its own
+// slices of the arena. Without jobs the subtrees are built in turn.
+void quad_tree_build(quad_tree_t *tree, const quad_build_item_t *items, size_t count, struct job_system *jobs);
 void quad_tree_query(const quad_tree_t *tree, quad_aabb_t bounds, quad_tree_query_result_t *result);
+void quad_tree_query_nodes(const quad_tree_t *tree, quad_aabb_t bounds, int32_t node_size, quad_tree_node_result_t *result);
+
+// Reports the used part of every chunk to page_alloc.h.
+void quad_tree_account_memory(const quad_tree_t *tree);
 
 void quad_tree_dump(const quad_tree_t *tree);
 void quad_tree_render(const quad_tree_t *tree);
@@ -0,0 +1,60 @@
+#include "recipe.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "utils.h"
+
+size_t recipe_count;
+recipe_t recipes[RECIPE_MAX_COUNT];
+recipe_def_t recipe_defs[RECIPE_MAX_COUNT];
+
+// Miners emit items 1 to 4, factories 9 and up.
+static const recipe_def_t builtin_recipes[] = {
+    [RECIPE_ASSEMBLER] = { "assembler", { 1, 2, 3, 4 }, { 1, 1, 1, 1 }, 9, 1, 120 },
+    [RECIPE_PRESS]     = { "press", { 9 }, { 4 }, 10, 1, 120 },
+    [RECIPE_SMELTER]   = { "smelter", { 1 }, { 2 }, 11, 1, 60 },
+    [RECIPE_MIXER]     = { "mixer", { 2, 3 }, { 1, 1 }, 12, 2, 80 },
+};
+
+void recipes_init() {
+    if (recipe_count) return;
+    for (size_t i=0; i<ARRAY_LENGTH(builtin_recipes); i++) {
+        const uint32_t id = recipe_add(builtin_recipes + i);
+        assert(id == i);
+    }
+}
+
+uint32_t recipe_add(const recipe_def_t *def) {
+    assert(def);
+    assert(recipe_count < RECIPE_MAX_COUNT);
+    assert(def->output_item != 0);
+    assert(def->output_count > 0);
+
+    recipe_t recipe = {
+        .output_item = def->output_item,
+        .output_count = def->output_count,
+        .duration = def->duration,
+    };
+    for (size_t i=0; i<RECIPE_MAX_INPUTS; i++) {
+        const uint8_t item = def->input_items[i];
+        if (!item) {
+            assert(def->input_counts[i] == 0);
+            continue;
+        }
+        assert(def->input_counts[i] > 0);
+        assert(!(recipe.accept_mask & recipe_item_bit(item)) || item >= 63); // distinct
+
+        recipe.input_items |= (uint32_t)item << (8 * i);
+        recipe.input_counts |= (uint32_t)def->input_counts[i] << (8 * i);
+        recipe.accept_mask |= recipe_item_bit(item);
+    }
+    assert(recipe.input_items != 0);
+
+    const uint32_t id = recipe_count++;
+    recipes[id] = recipe;
+    recipe_defs[id] = *def;
+    return id;
+}
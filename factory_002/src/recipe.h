@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// What factories take and make. Recipes are defined as up to four inputs
+// (item, count), an output (item, count) and a duration, and compiled into a
+// flat form the per-factory path reads without looping over inputs:
+//
+// - input_items packs the item of each input slot into one byte of a word,
+//   finding the slot of an item is a SWAR byte compare,
+// - input_counts packs the needed counts the same way a factory packs what it
+//   holds (factory_t.counts), so room for an item is a byte compare and
+//   readiness is one compare of two words,
+// - accept_mask has a bit per accepted item, for the analysis.
+//
+// A factory indexes the table by its recipe id, the number of recipes
+// doesn't matter to it.
+
+#define RECIPE_MAX_COUNT    (4096)
+#define RECIPE_MAX_INPUTS   (4)
+#define RECIPE_NAME_LENGTH  (32)
+
+#define RECIPE_ASSEMBLER    (0) // the default: one of each mined item
+#define RECIPE_PRESS        (1)
+#define RECIPE_SMELTER      (2)
+#define RECIPE_MIXER        (3)
+
+typedef struct {
+    char name[RECIPE_NAME_LENGTH];
+    uint8_t input_items[RECIPE_MAX_INPUTS];  // distinct, 0 = unused
+    uint8_t input_counts[RECIPE_MAX_INPUTS];
+    uint8_t output_item;
+    uint8_t output_count;
+    uint16_t duration;                       // ticks of production
+} recipe_def_t;
+
+typedef struct {
+    uint32_t input_items;
+    uint32_t input_counts;
+    uint64_t accept_mask;   // recipe_item_bit() of the inputs
+    uint8_t output_item;
+    uint8_t output_count;
+    uint16_t duration;
+} recipe_t;
+
+extern size_t recipe_count;
+extern recipe_t recipes[RECIPE_MAX_COUNT];
+extern recipe_def_t recipe_defs[RECIPE_MAX_COUNT];
+
+// Compiles the built-in recipes, once.
+void recipes_init();
+// Compiles a new recipe, returns its id.
+uint32_t recipe_add(const recipe_def_t *def);
+
+// Items past 62 share the last bit.
+static inline uint64_t recipe_item_bit(uint8_t item) {
+    return (uint64_t)1 << (item < 63 ? item : 63);
+}
+
+// Input slot of a nonzero item, -1 if the recipe doesn't take it.
+static inline int recipe_input_slot(const recipe_t *recipe, uint8_t item) {
+    const uint32_t x = recipe->input_items ^ (0x01010101u * item);
+    const uint32_t zero_bytes = (x - 0x01010101u) & ~x & 0x80808080u;
+    return zero_bytes ? __builtin_ctz(zero_bytes) / 8 : -1;
+}
+
+// Adds an item to the packed counts of a factory, false if the recipe
+// doesn't take it or has enough of it.
+static inline bool recipe_accept(const recipe_t *recipe, uint32_t *counts, uint8_t item) {
+    const int slot = recipe_input_slot(recipe, item);
+    if (slot < 0) return false;
+    const uint32_t shift = 8 * slot;
+    if (((*counts >> shift) & 0xff) >= ((recipe->input_counts >> shift) & 0xff)) return false;
+    *counts += 1u << shift;
+    return true;
+}
+
+static inline bool recipe_ready(const recipe_t *recipe, uint32_t counts) {
+    return counts == recipe->input_counts;
+}
+
+// Sum of the packed per-slot counts.
+static inline uint32_t recipe_count_sum(uint32_t counts) {
+    return (counts & 0xff) + ((counts >> 8) & 0xff) + ((counts >> 16) & 0xff) + (counts >> 24);
+}
@@ -0,0 +1,151 @@
+#include "reference.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "recipe.h"
+
+static bool put_item(game_state_t *gs, item_output_t output, uint8_t item) {
+    if (handle_is_none(output.handle) || item == 0) return false;
+
+    switch (output.type) {
+        case BUILDING_TYPE_BELT:
+            {
+                const uint32_t index = handle_table_lookup(&gs->belt_handles, output.handle);
+                if (!index) return false;
+                belt_t *belt = gs->belts + index;
+                if (belt->items[0] == 0) {
+                    belt->items[0] = item;
+                    belt->works[0] = 0;
+                    return true;
+                }
+            }
+            break;
+
+        case BUILDING_TYPE_FACTORY:
+            {
+                const uint32_t index = handle_table_lookup(&gs->factory_handles, output.handle);
+                if (!index) return false;
+                factory_t *factory = gs->factories + index;
+                return recipe_accept(recipes + factory->recipe, &factory->counts, item);
+            }
+    }
+    return false;
+}
+
+static void update_miner_ref(game_state_t *gs, miner_t *miner) {
+    switch (miner->state) {
+        case MINER_STATE_MINING:
+            miner->work++;
+            if (miner->work >= MINER_WORK_PER_ITEM) {
+                miner->work = 0;
+                miner->state = MINER_STATE_UNLOAD;
+            }
+            break;
+
+        case MINER_STATE_UNLOAD:
+            if (put_item(gs, miner->output, 1 + miner->next_item)) {
+                miner->state = MINER_STATE_MINING;
+                miner->next_item++;
+                if (miner->next_item >= MINER_ITEM_KINDS) miner->next_item = 0;
+            }
+            break;
+    }
+}
+
+static void update_factory_ref(game_state_t *gs, factory_t *factory) {
+    const recipe_t *recipe = recipes + factory->recipe;
+
+    switch (factory->state) {
+        case FACTORY_STATE_WAIT_ITEMS:
+            if (recipe_ready(recipe, factory->counts)) {
+                factory->state = FACTORY_STATE_PRODUCE;
+                factory->work = 0;
+            }
+            break;
+
+        case FACTORY_STATE_PRODUCE:
+            factory->work++;
+            if (factory->work >= recipe->duration) {
+                factory->state = FACTORY_STATE_UNLOAD;
+                factory->pending = recipe->output_count;
+                factory->counts = 0;
+            }
+            break;
+
+        case FACTORY_STATE_UNLOAD:
+            if (put_item(gs, factory->output, recipe->output_item)) {
+                if (--factory->pending == 0) factory->state = FACTORY_STATE_WAIT_ITEMS;
+            }
+            break;
+    }
+}
+
+static void update_belt_ref(game_state_t *gs, belt_t *belt) {
+    for (size_t slot=0; slot<BELT_ITEM_COUNT; slot++) {
+        if (belt->items[slot] != 0 && belt->works[slot] < BELT_WORK_PER_ITEM) belt->works[slot]++;
+    }
+
+    const size_t last = BELT_ITEM_COUNT - 1;
+    if (belt->items[last] != 0 && belt->works[last] == BELT_WORK_PER_ITEM) {
+        if (put_item(gs, belt->output, belt->items[last])) {
+            belt->items[last] = 0;
+            belt->works[last] = 0;
+        }
+    }
+
+    for (size_t slot=last; slot>0; slot--) {
+        if (belt->items[slot] == 0 && belt->items[slot-1] != 0 && belt->works[slot-1] == BELT_WORK_PER_ITEM) {
+            belt->items[slot] = belt->items[slot-1];
+            belt->works[slot] = 0;
+            belt->items[slot-1] = 0;
+            belt->works[slot-1] = 0;
+        }
+    }
+}
+
+// Copies the live entities of one type, in order, releasing the slots of deleted ones.
+#define COMPACT(old, new, array, count, handles) \
+    for (size_t old_id=1; old_id<(old)->count; old_id++) { \
+        if ((old)->array[old_id].flags & ENTITY_FLAGS_DELETED) { \
+            handle_table_release(&(new)->handles, (old)->array[old_id].slot); \
+            continue; \
+        } \
+        const size_t new_id = (new)->count++; \
+        (new)->array[new_id] = (old)->array[old_id]; \
+        handle_table_set_dense(&(new)->handles, (new)->array[new_id].slot, new_id); \
+    }
+
+void reference_update(const game_state_t *old, game_state_t *new) {
+    assert(old);
+    assert(new);
+    assert(old != new);
+
+    reset_game_state(new);
+    new->tick = old->tick + 1;
+    new->edit_version = old->edit_version;
+    new->index_version = old->edit_version;
+    new->spatial_index = old->spatial_index;
+
+    handle_table_copy(&new->building_handles, &old->building_handles);
+    handle_table_copy(&new->miner_handles, &old->miner_handles);
+    handle_table_copy(&new->belt_handles, &old->belt_handles);
+    handle_table_copy(&new->factory_handles, &old->factory_handles);
+    flow_graph_copy(&new->flow_graph, &old->flow_graph);
+    new->flow_graph.touches = old->flow_graph.touches;
+    flow_graph_clear_touched(&new->flow_graph);
+
+    COMPACT(old, new, buildings, building_count, building_handles);
+    COMPACT(old, new, miners, miner_count, miner_handles);
+    COMPACT(old, new, belts, belt_count, belt_handles);
+    COMPACT(old, new, factories, factory_count, factory_handles);
+
+    for (size_t i=1; i<new->miner_count; i++) update_miner_ref(new, new->miners + i);
+    for (size_t i=1; i<new->factory_count; i++) update_factory_ref(new, new->factories + i);
+    for (size_t i=1; i<new->belt_count; i++) update_belt_ref(new, new->belts + i);
+
+    rebuild_spatial_index(new);
+    new->index_version = new->edit_version;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "game_state.h"
+
+// Frozen copy of the plain update: compact every entity, then update all
+// miners, factories and belts in index order with items written straight
+// into their targets, then rebuild the spatial index.
+//
+// It is the oracle for faster engines (diff_test.h) and must keep today's
+// behavior: don't optimize it, and only change it along with a deliberate
+// change of the simulation rules. Ignores regions, ports and transfer queues.
+void reference_update(const game_state_t *old, game_state_t *new);
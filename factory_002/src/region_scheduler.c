@@ -0,0 +1,355 @@
+#include "region_scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "utils.h"
+#include "game_state.h"
+#include "item_trace.h"
+
+static uint32_t chunk_of(coord_t pos) {
+    int32_t x = (pos.x + (REGION_GRID / 2) * REGION_SIZE) >> REGION_SIZE_SHIFT;
+    int32_t y = (pos.y + (REGION_GRID / 2) * REGION_SIZE) >> REGION_SIZE_SHIFT;
+    x = (x < 0) ? 0 : (x >= REGION_GRID) ? REGION_GRID - 1 : x;
+    y = (y < 0) ? 0 : (y >= REGION_GRID) ? REGION_GRID - 1 : y;
+    return y * REGION_GRID + x;
+}
+
+static bool chunk_in_view(const region_scheduler_t *sched, uint32_t chunk) {
+    const int32_t x = (int32_t)(chunk % REGION_GRID) * REGION_SIZE - (REGION_GRID / 2) * REGION_SIZE;
+    const int32_t y = (int32_t)(chunk / REGION_GRID) * REGION_SIZE - (REGION_GRID / 2) * REGION_SIZE;
+    const quad_aabb_t v = sched->view;
+    return x <= v.x_max && v.x_min < x + REGION_SIZE &&
+           y <= v.y_max && v.y_min < y + REGION_SIZE;
+}
+
+void region_scheduler_init(region_scheduler_t *sched) {
+    assert(sched);
+    memset(sched, 0, sizeof(region_scheduler_t));
+
+    sched->lod_enabled = true;
+    sched->chunk_modes = calloc(REGION_CHUNK_COUNT, sizeof(uint8_t));
+    sched->chunk_settled = calloc(REGION_CHUNK_COUNT, sizeof(uint8_t));
+    sched->chunk_groups = malloc(sizeof(uint32_t) * REGION_CHUNK_COUNT);
+    sched->chunk_parents = malloc(sizeof(uint32_t) * REGION_CHUNK_COUNT);
+    sched->chunk_sim_ticks = calloc(REGION_CHUNK_COUNT, sizeof(uint64_t));
+    assert(sched->chunk_modes);
+    assert(sched->chunk_settled);
+    assert(sched->chunk_groups);
+    assert(sched->chunk_parents);
+    assert(sched->chunk_sim_ticks);
+    memset(sched->chunk_groups, 0xff, sizeof(uint32_t) * REGION_CHUNK_COUNT);
+}
+
+void region_scheduler_free(region_scheduler_t *sched) {
+    assert(sched);
+    free(sched->chunk_modes);
+    free(sched->chunk_settled);
+    free(sched->chunk_groups);
+    free(sched->chunk_parents);
+    free(sched->chunk_sim_ticks);
+    free(sched->used_chunks);
+    free(sched->groups);
+    for (size_t type=0; type<BUILDING_TYPE_COUNT; type++) {
+        free(sched->group_offsets[type]);
+        free(sched->entities[type]);
+        free(sched->scratch[type]);
+    }
+    memset(sched, 0, sizeof(region_scheduler_t));
+}
+
+void region_scheduler_set_view(region_scheduler_t *sched, quad_aabb_t view) {
+    assert(sched);
+    sched->view = view;
+}
+
+void region_scheduler_set_mode(region_scheduler_t *sched, coord_t pos, uint8_t mode) {
+    assert(sched);
+    assert(mode <= REGION_MODE_INACTIVE);
+    sched->chunk_modes[chunk_of(pos)] = mode;
+}
+
+// -----
+
+static uint32_t find_root(uint32_t *parents, uint32_t chunk) {
+    while (parents[chunk] != chunk) {
+        parents[chunk] = parents[parents[chunk]];
+        chunk = parents[chunk];
+    }
+    return chunk;
+}
+
+static void reserve_entities(region_scheduler_t *sched, size_t count) {
+    if (sched->entity_capacity >= count) return;
+
+    size_t capacity = sched->entity_capacity ? sched->entity_capacity : 1024;
+    while (capacity < count) capacity *= 2;
+
+    for (size_t type=0; type<BUILDING_TYPE_COUNT; type++) {
+        sched->entities[type] = realloc(sched->entities[type], sizeof(uint32_t) * capacity);
+        sched->scratch[type] = realloc(sched->scratch[type], sizeof(uint32_t) * capacity);
+        assert(sched->entities[type]);
+        assert(sched->scratch[type]);
+    }
+    sched->entity_capacity = capacity;
+}
+
+static void reserve_groups(region_scheduler_t *sched, size_t count) {
+    if (sched->group_capacity >= count) return;
+
+    size_t capacity = sched->group_capacity ? sched->group_capacity : 256;
+    while (capacity < count) capacity *= 2;
+
+    sched->groups = realloc(sched->groups, sizeof(region_group_t) * capacity);
+    assert(sched->groups);
+    for (size_t type=0; type<BUILDING_TYPE_COUNT; type++) {
+        sched->group_offsets[type] = realloc(sched->group_offsets[type], sizeof(uint32_t) * (capacity + 1));
+        assert(sched->group_offsets[type]);
+    }
+    sched->group_capacity = capacity;
+}
+
+static void add_used_chunk(region_scheduler_t *sched, uint32_t chunk) {
+    if (sched->used_chunk_count == sched->used_chunk_capacity) {
+        sched->used_chunk_capacity = sched->used_chunk_capacity ? sched->used_chunk_capacity * 2 : 1024;
+        sched->used_chunks = realloc(sched->used_chunks, sizeof(uint32_t) * sched->used_chunk_capacity);
+        assert(sched->used_chunks);
+    }
+    sched->used_chunks[sched->used_chunk_count++] = chunk;
+}
+
+// Regroups chunks and sorts the entities of gs into per-group lists.
+static void rebuild(region_scheduler_t *sched, const game_state_t *gs) {
+    const double start = get_time_ms();
+
+    uint32_t *chunk_groups = sched->chunk_groups;
+    uint32_t *parents = sched->chunk_parents;
+
+    // Groups are about to change, park their clocks in their chunks.
+    for (size_t i=0; i<sched->used_chunk_count; i++) {
+        const uint32_t chunk = sched->used_chunks[i];
+        const region_group_t *group = sched->groups + chunk_groups[chunk];
+        sched->chunk_sim_ticks[chunk] = group->sim_tick;
+        sched->chunk_settled[chunk] = (group->flags & REGION_GROUP_SETTLED) != 0;
+        chunk_groups[chunk] = REGION_NO_GROUP;
+    }
+    sched->used_chunk_count = 0;
+
+    for (size_t i=1; i<gs->building_count; i++) {
+        const uint32_t chunk = chunk_of(gs->buildings[i].pos);
+        if (chunk_groups[chunk] == REGION_NO_GROUP) {
+            chunk_groups[chunk] = 0;
+            parents[chunk] = chunk;
+            add_used_chunk(sched, chunk);
+        }
+    }
+
+    // Join the chunks at both ends of every edge.
+    for (size_t i=1; i<gs->building_count; i++) {
+        const building_t *b = gs->buildings + i;
+        const uint32_t *targets;
+        if (!flow_graph_outputs(&gs->flow_graph, b->slot, &targets)) continue;
+
+        const size_t target_id = get_building_index(gs, handle_table_get_handle(&gs->building_handles, targets[0]));
+        assert(target_id);
+        const uint32_t a = find_root(parents, chunk_of(b->pos));
+        const uint32_t t = find_root(parents, chunk_of(gs->buildings[target_id].pos));
+        if (a != t) parents[t] = a;
+    }
+
+    size_t group_count = 0;
+    for (size_t i=0; i<sched->used_chunk_count; i++) {
+        const uint32_t chunk = sched->used_chunks[i];
+        if (find_root(parents, chunk) != chunk) continue;
+        reserve_groups(sched, group_count + 1);
+        sched->groups[group_count] = (region_group_t) {
+            .root_chunk = chunk,
+            .flags = sched->chunk_settled[chunk] ? REGION_GROUP_SETTLED : 0,
+            .sim_tick = sched->chunk_sim_ticks[chunk],
+        };
+        chunk_groups[chunk] = group_count++;
+    }
+    for (size_t i=0; i<sched->used_chunk_count; i++) {
+        const uint32_t chunk = sched->used_chunks[i];
+        const uint32_t group = chunk_groups[find_root(parents, chunk)];
+        chunk_groups[chunk] = group;
+
+        // Edits sync the groups they join, so merged chunks agree on the tick.
+        assert(sched->groups[group].sim_tick == sched->chunk_sim_ticks[chunk]);
+        if (!sched->chunk_settled[chunk]) sched->groups[group].flags &= ~REGION_GROUP_SETTLED;
+    }
+    sched->group_count = group_count;
+
+    // Group of every entity, then a stable counting sort by group keeps the
+    // dense (update) order within each group.
+    const size_t entity_counts[BUILDING_TYPE_COUNT] = { gs->miner_count, gs->factory_count, gs->belt_count };
+    const handle_table_t *tables[BUILDING_TYPE_COUNT] = { &gs->miner_handles, &gs->factory_handles, &gs->belt_handles };
+    for (size_t type=0; type<BUILDING_TYPE_COUNT; type++) reserve_entities(sched, entity_counts[type]);
+    reserve_groups(sched, group_count + 1);
+
+    for (size_t i=1; i<gs->building_count; i++) {
+        const building_t *b = gs->buildings + i;
+        const uint32_t index = handle_table_lookup(tables[b->type], b->data);
+        sched->scratch[b->type][index] = chunk_groups[chunk_of(b->pos)];
+    }
+
+    for (size_t type=0; type<BUILDING_TYPE_COUNT; type++) {
+        uint32_t *offsets = sched->group_offsets[type];
+        const uint32_t *groups = sched->scratch[type];
+        memset(offsets, 0, sizeof(uint32_t) * (group_count + 1));
+
+        for (size_t i=1; i<entity_counts[type]; i++) offsets[groups[i] + 1]++;
+        for (size_t g=0; g<group_count; g++) offsets[g + 1] += offsets[g];
+
+        // offsets[g] serves as the insert position, shifted back afterwards.
+        for (size_t i=1; i<entity_counts[type]; i++) sched->entities[type][offsets[groups[i]]++] = i;
+        for (size_t g=group_count; g>0; g--) offsets[g] = offsets[g - 1];
+        offsets[0] = 0;
+    }
+
+    sched->layout_valid = true;
+    sched->layout_version = gs->edit_version;
+    sched->stats.rebuild_ms = get_time_ms() - start;
+}
+
+// Runs up to tick_count ticks of one group, stops early once it settles.
+static void run_group(region_scheduler_t *sched, game_state_t *gs, uint32_t group_index, uint64_t tick_count) {
+    region_group_t *group = sched->groups + group_index;
+    if (group->flags & REGION_GROUP_SETTLED) tick_count = 0;
+
+    const uint32_t *miners = sched->entities[BUILDING_TYPE_MINER];
+    const uint32_t *factories = sched->entities[BUILDING_TYPE_FACTORY];
+    const uint32_t *belts = sched->entities[BUILDING_TYPE_BELT];
+    const uint32_t m0 = sched->group_offsets[BUILDING_TYPE_MINER][group_index];
+    const uint32_t m1 = sched->group_offsets[BUILDING_TYPE_MINER][group_index + 1];
+    const uint32_t f0 = sched->group_offsets[BUILDING_TYPE_FACTORY][group_index];
+    const uint32_t f1 = sched->group_offsets[BUILDING_TYPE_FACTORY][group_index + 1];
+    const uint32_t b0 = sched->group_offsets[BUILDING_TYPE_BELT][group_index];
+    const uint32_t b1 = sched->group_offsets[BUILDING_TYPE_BELT][group_index + 1];
+
+    for (uint64_t t=0; t<tick_count; t++) {
+        trace_set_tick(group->sim_tick + 1 + t);
+        bool changed = false;
+        for (uint32_t i=m0; i<m1; i++) changed |= update_miner(gs, gs->miners + miners[i]);
+        for (uint32_t i=f0; i<f1; i++) changed |= update_factory(gs, gs->factories + factories[i]);
+        for (uint32_t i=b0; i<b1; i++) changed |= update_belt(gs, gs->belts + belts[i]);
+        if (gs->transfers) changed |= transfer_queue_apply(gs->transfers, gs);
+        sched->stats.updates += (m1 - m0) + (f1 - f0) + (b1 - b0);
+
+        // Nothing moved, so nothing ever will until an edit.
+        if (!changed) {
+            group->flags |= REGION_GROUP_SETTLED;
+            break;
+        }
+    }
+    group->sim_tick = gs->tick;
+}
+
+void region_scheduler_sync(region_scheduler_t *sched, game_state_t *gs, coord_t pos) {
+    assert(sched);
+    assert(gs);
+
+    const uint32_t chunk = chunk_of(pos);
+    const uint32_t group_index = sched->layout_valid ? sched->chunk_groups[chunk] : REGION_NO_GROUP;
+    if (group_index == REGION_NO_GROUP) {
+        // Nothing to simulate here yet.
+        sched->chunk_sim_ticks[chunk] = gs->tick;
+        sched->chunk_settled[chunk] = 0;
+        return;
+    }
+
+    // Entities spawned since the lists were built are not in them, but their
+    // group was synced before they were added, so there is nothing to replay.
+    region_group_t *group = sched->groups + group_index;
+    run_group(sched, gs, group_index, gs->tick - group->sim_tick);
+    group->flags &= ~REGION_GROUP_SETTLED;
+}
+
+void region_scheduler_update(region_scheduler_t *sched, game_state_t *gs) {
+    assert(sched);
+    assert(gs);
+
+    if (!sched->layout_valid || sched->layout_version != gs->edit_version) {
+        rebuild(sched, gs);
+    }
+
+    const double rebuild_ms = sched->stats.rebuild_ms;
+    sched->stats = (region_stats_t) { .groups = sched->group_count, .rebuild_ms = rebuild_ms };
+
+    for (size_t g=0; g<sched->group_count; g++) {
+        sched->groups[g].flags &= ~REGION_GROUP_ACTIVE;
+    }
+    for (size_t i=0; i<sched->used_chunk_count; i++) {
+        const uint32_t chunk = sched->used_chunks[i];
+        const uint8_t mode = sched->chunk_modes[chunk];
+        if (mode == REGION_MODE_ACTIVE ||
+                (mode == REGION_MODE_AUTO && (!sched->lod_enabled || chunk_in_view(sched, chunk)))) {
+            sched->groups[sched->chunk_groups[chunk]].flags |= REGION_GROUP_ACTIVE;
+        }
+    }
+
+    const uint64_t tick = gs->tick;
+    for (size_t g=0; g<sched->group_count; g++) {
+        region_group_t *group = sched->groups + g;
+
+        if (group->flags & REGION_GROUP_SETTLED) {
+            group->sim_tick = tick;
+            sched->stats.settled++;
+            continue;
+        }
+        if (group->flags & REGION_GROUP_ACTIVE) {
+            sched->stats.active++;
+        } else if ((tick + group->root_chunk) % REGION_DORMANT_INTERVAL) {
+            sched->stats.dormant++;
+            continue;
+        } else {
+            sched->stats.steps++;
+        }
+
+        // Every tick while active; after entering the view this also replays
+        // whatever it skipped while dormant.
+        run_group(sched, gs, g, tick - group->sim_tick);
+    }
+}
+
+size_t region_scheduler_get_clocks(const region_scheduler_t *sched, region_clock_t *clocks) {
+    assert(sched);
+    assert(clocks);
+    if (!sched->layout_valid) return 0;
+
+    for (size_t i=0; i<sched->used_chunk_count; i++) {
+        const uint32_t chunk = sched->used_chunks[i];
+        const region_group_t *group = sched->groups + sched->chunk_groups[chunk];
+        clocks[i] = (region_clock_t) {
+            .chunk = chunk,
+            .settled = (group->flags & REGION_GROUP_SETTLED) != 0,
+            .sim_tick = group->sim_tick,
+        };
+    }
+    return sched->used_chunk_count;
+}
+
+void region_scheduler_set_clocks(region_scheduler_t *sched, uint64_t tick, const region_clock_t *clocks, size_t count) {
+    assert(sched);
+    assert(clocks || count == 0);
+
+    // Drop the groups without parking their clocks, the next update regroups.
+    for (size_t i=0; i<sched->used_chunk_count; i++) {
+        sched->chunk_groups[sched->used_chunks[i]] = REGION_NO_GROUP;
+    }
+    sched->used_chunk_count = 0;
+    sched->group_count = 0;
+    sched->layout_valid = false;
+
+    for (size_t chunk=0; chunk<REGION_CHUNK_COUNT; chunk++) {
+        sched->chunk_sim_ticks[chunk] = tick;
+        sched->chunk_settled[chunk] = 0;
+    }
+    for (size_t i=0; i<count; i++) {
+        assert(clocks[i].chunk < REGION_CHUNK_COUNT);
+        sched->chunk_sim_ticks[clocks[i].chunk] = clocks[i].sim_tick;
+        sched->chunk_settled[clocks[i].chunk] = clocks[i].settled != 0;
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "quad_tree.h"
+
+struct game_state;
+
+// Simulation level of detail by region. The world is split into chunks of
+// REGION_SIZE cells; chunks joined by item-flow edges form groups that never
+// affect each other, so every group can run on its own clock:
+//
+// - groups with a chunk in view (or pinned active) run every tick,
+// - other groups run in multi-tick steps every REGION_DORMANT_INTERVAL ticks,
+//   staggered so the steps spread over the interval,
+// - a group whose last tick changed nothing has settled: it won't change
+//   until it is edited, so it costs nothing until then.
+//
+// A group catches up by replaying the ticks it skipped, with the same update
+// order within the group, so it ends up exactly as if it had run every tick.
+// Edits sync the groups they touch first, and a group entering the view is
+// synced in the same tick.
+//
+// One scheduler serves both game states of the double buffer; its entity
+// lists are rebuilt after every edit (edit_version change).
+
+#define REGION_SIZE_SHIFT        (7)  // 128 cells
+#define REGION_SIZE              (1 << REGION_SIZE_SHIFT)
+#define REGION_GRID              (1024) // chunks per side, covers the quad tree's root bounds
+#define REGION_CHUNK_COUNT       (REGION_GRID * REGION_GRID)
+#define REGION_DORMANT_INTERVAL  (32)
+
+#define REGION_MODE_AUTO         (0) // active while in view
+#define REGION_MODE_ACTIVE       (1) // always full rate
+#define REGION_MODE_INACTIVE     (2) // reduced rate even in view
+
+#define REGION_NO_GROUP          (UINT32_MAX)
+
+#define REGION_GROUP_ACTIVE      (1)
+#define REGION_GROUP_SETTLED     (2)
+
+typedef struct {
+    uint32_t root_chunk;
+    uint32_t flags;     // REGION_GROUP_*
+    uint64_t sim_tick;  // last tick simulated
+} region_group_t;
+
+// Clock of a chunk with buildings, for saving and restoring the scheduler
+// along with a game state.
+typedef struct {
+    uint32_t chunk;
+    uint32_t settled;
+    uint64_t sim_tick;
+} region_clock_t;
+
+typedef struct {
+    size_t groups;
+    size_t active;
+    size_t dormant;     // waiting for their next step
+    size_t settled;
+    size_t steps;       // dormant groups stepped this tick
+    size_t updates;     // entity updates this tick
+    double rebuild_ms;  // of the last list rebuild
+} region_stats_t;
+
+typedef struct region_scheduler {
+    bool lod_enabled;   // false: everything not pinned inactive runs every tick
+    quad_aabb_t view;   // cells
+
+    // By chunk.
+    uint8_t *chunk_modes;
+    uint8_t *chunk_settled;     // while not in a group
+    uint32_t *chunk_groups;     // REGION_NO_GROUP unless it holds buildings
+    uint32_t *chunk_parents;    // scratch
+    uint64_t *chunk_sim_ticks;  // while not in a group
+
+    size_t used_chunk_count;
+    size_t used_chunk_capacity;
+    uint32_t *used_chunks;
+
+    bool layout_valid;
+    uint64_t layout_version;    // edit_version the lists were built for
+
+    size_t group_count;
+    size_t group_capacity;
+    region_group_t *groups;
+    uint32_t *group_offsets[3]; // by building type, group_count + 1 entries
+
+    size_t entity_capacity;
+    uint32_t *entities[3];      // dense indices by type, grouped, in update order
+    uint32_t *scratch[3];
+
+    region_stats_t stats;
+} region_scheduler_t;
+
+void region_scheduler_init(region_scheduler_t *sched);
+void region_scheduler_free(region_scheduler_t *sched);
+
+void region_scheduler_set_view(region_scheduler_t *sched, quad_aabb_t view);
+void region_scheduler_set_mode(region_scheduler_t *sched, coord_t pos, uint8_t mode);
+
+// Brings the group around pos up to gs->tick. Call before editing there.
+void region_scheduler_sync(region_scheduler_t *sched, struct game_state *gs, coord_t pos);
+
+// Step 3 of the update for gs->regions.
+void region_scheduler_update(region_scheduler_t *sched, struct game_state *gs);
+
+// Clocks of the used chunks, as of the last update; clocks needs room for
+// used_chunk_count entries. Returns the count.
+size_t region_scheduler_get_clocks(const region_scheduler_t *sched, region_clock_t *clocks);
+// For a restored state of the given tick: chunks not in clocks are on that tick.
+void region_scheduler_set_clocks(region_scheduler_t *sched, uint64_t tick, const region_clock_t *clocks, size_t count);
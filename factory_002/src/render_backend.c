@@ -0,0 +1,152 @@
+#include "render_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#include <raylib.h>
+#include <rlgl.h>
+#include <raymath.h>
+
+int render_primitive_mode(uint32_t primitive) {
+    switch (primitive) {
+        case RENDER_PRIMITIVE_RECT:
+        case RENDER_PRIMITIVE_RECT_LINES: return RENDER_MODE_QUADS;
+        case RENDER_PRIMITIVE_CIRCLE:
+        case RENDER_PRIMITIVE_CIRCLE_SECTOR: return RENDER_MODE_TRIANGLES;
+        case RENDER_PRIMITIVE_CIRCLE_LINES: return RENDER_MODE_LINES;
+        default: return RENDER_MODE_TEXT;
+    }
+}
+
+// ----- raylib
+
+static int raylib_mode = RENDER_MODE_TEXT;
+
+static void raylib_begin(render_backend_t *backend, int mode) {
+    raylib_mode = mode;
+    switch (mode) {
+        case RENDER_MODE_QUADS: rlBegin(RL_QUADS); break;
+        case RENDER_MODE_TRIANGLES: rlBegin(RL_TRIANGLES); break;
+        case RENDER_MODE_LINES: rlBegin(RL_LINES); break;
+        default: break; // text, drawn through raylib's font path
+    }
+}
+
+static void raylib_end(render_backend_t *backend) {
+    if (raylib_mode != RENDER_MODE_TEXT) rlEnd();
+    raylib_mode = RENDER_MODE_TEXT;
+}
+
+static void emit_quad(float x, float y, float w, float h) {
+    rlVertex2f(x, y);
+    rlVertex2f(x, y + h);
+    rlVertex2f(x + w, y + h);
+    rlVertex2f(x + w, y);
+}
+
+static void raylib_draw(render_backend_t *backend, const render_command_t *cmd) {
+    const Color c = cmd->color;
+
+    const int vertex_count = render_command_vertex_count(cmd);
+    if (vertex_count) rlCheckRenderBatchLimit(vertex_count);
+
+    switch (cmd->primitive) {
+        case RENDER_PRIMITIVE_RECT:
+            rlColor4ub(c.r, c.g, c.b, c.a);
+            emit_quad(cmd->x, cmd->y, cmd->w, cmd->h);
+            break;
+
+        case RENDER_PRIMITIVE_RECT_LINES:
+            {
+                const float t = cmd->param;
+                rlColor4ub(c.r, c.g, c.b, c.a);
+                emit_quad(cmd->x, cmd->y, cmd->w, t);
+                emit_quad(cmd->x, cmd->y + cmd->h - t, cmd->w, t);
+                emit_quad(cmd->x, cmd->y + t, t, cmd->h - 2*t);
+                emit_quad(cmd->x + cmd->w - t, cmd->y + t, t, cmd->h - 2*t);
+            }
+            break;
+
+        case RENDER_PRIMITIVE_CIRCLE:
+        case RENDER_PRIMITIVE_CIRCLE_SECTOR:
+            {
+                const float step = (cmd->param - cmd->h) / (float)cmd->segments;
+                float angle = cmd->h;
+                rlColor4ub(c.r, c.g, c.b, c.a);
+                for (int i=0; i<cmd->segments; i++) {
+                    rlVertex2f(cmd->x, cmd->y);
+                    rlVertex2f(cmd->x + cosf(DEG2RAD*(angle + step))*cmd->w, cmd->y + sinf(DEG2RAD*(angle + step))*cmd->w);
+                    rlVertex2f(cmd->x + cosf(DEG2RAD*angle)*cmd->w, cmd->y + sinf(DEG2RAD*angle)*cmd->w);
+                    angle += step;
+                }
+            }
+            break;
+
+        case RENDER_PRIMITIVE_CIRCLE_LINES:
+            {
+                const float step = 360.0f / (float)cmd->segments;
+                float angle = 0.0f;
+                rlColor4ub(c.r, c.g, c.b, c.a);
+                for (int i=0; i<cmd->segments; i++) {
+                    rlVertex2f(cmd->x + cosf(DEG2RAD*angle)*cmd->w, cmd->y + sinf(DEG2RAD*angle)*cmd->w);
+                    rlVertex2f(cmd->x + cosf(DEG2RAD*(angle + step))*cmd->w, cmd->y + sinf(DEG2RAD*(angle + step))*cmd->w);
+                    angle += step;
+                }
+            }
+            break;
+
+        case RENDER_PRIMITIVE_TEXT:
+            DrawText(cmd->text, cmd->x, cmd->y, cmd->font_size, c);
+            break;
+    }
+}
+
+render_backend_t *render_backend_raylib() {
+    static render_backend_t backend = {
+        .name = "raylib",
+        .begin = raylib_begin,
+        .end = raylib_end,
+        .draw = raylib_draw,
+    };
+    return &backend;
+}
+
+// ----- null
+
+static void null_begin(render_backend_t *backend, int mode) {
+    render_null_backend_t *nb = (render_null_backend_t *)backend;
+    if (mode != nb->mode) {
+        nb->state_changes++;
+        nb->mode = mode;
+    }
+}
+
+static void null_end(render_backend_t *backend) {
+}
+
+static void null_draw(render_backend_t *backend, const render_command_t *cmd) {
+    render_null_backend_t *nb = (render_null_backend_t *)backend;
+    nb->primitives++;
+    nb->vertices += render_command_vertex_count(cmd);
+}
+
+void render_null_backend_init(render_null_backend_t *nb) {
+    assert(nb);
+    memset(nb, 0, sizeof(render_null_backend_t));
+    nb->base.name = "null";
+    nb->base.begin = null_begin;
+    nb->base.end = null_end;
+    nb->base.draw = null_draw;
+    nb->mode = -1;
+}
+
+void render_null_backend_reset(render_null_backend_t *nb) {
+    assert(nb);
+    nb->mode = -1;
+    nb->primitives = 0;
+    nb->vertices = 0;
+    nb->state_changes = 0;
+}
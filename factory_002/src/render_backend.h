@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <raylib.h>
+
+#include "render_commands.h"
+
+// Where flushed draw commands end up. The raylib backend draws through rlgl
+// and needs a window. The null and software backends run without a GL
+// context, for headless benchmarking of the render path.
+
+#define RENDER_MODE_TEXT       (0) // font texture
+#define RENDER_MODE_QUADS      (1)
+#define RENDER_MODE_TRIANGLES  (2)
+#define RENDER_MODE_LINES      (3)
+
+typedef struct render_backend {
+    const char *name;
+    // begin/end bracket a run of commands that share a mode
+    void (*begin)(struct render_backend *backend, int mode);
+    void (*end)(struct render_backend *backend);
+    void (*draw)(struct render_backend *backend, const render_command_t *cmd);
+} render_backend_t;
+
+// Counts what would have been sent to the GPU.
+typedef struct {
+    render_backend_t base;
+    int mode;
+    size_t primitives;
+    size_t vertices;
+    size_t state_changes; // mode switches, including binding the font texture
+} render_null_backend_t;
+
+// Rasterizes into an RGBA8 framebuffer, no antialiasing. Text is drawn as one
+// box per glyph, there is no font.
+typedef struct {
+    render_backend_t base;
+    Camera2D camera; // rotation is ignored
+    int width;
+    int height;
+    uint32_t *pixels;
+    size_t pixels_written;
+} render_software_backend_t;
+
+int render_primitive_mode(uint32_t primitive);
+
+render_backend_t *render_backend_raylib();
+
+void render_null_backend_init(render_null_backend_t *nb);
+void render_null_backend_reset(render_null_backend_t *nb);
+
+void render_software_backend_init(render_software_backend_t *sb, int width, int height);
+void render_software_backend_free(render_software_backend_t *sb);
+void render_software_backend_clear(render_software_backend_t *sb, Color color);
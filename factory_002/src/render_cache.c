@@ -0,0 +1,131 @@
+#include "render_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+static int32_t floor_div(int32_t v, int32_t d) {
+    return (v >= 0) ? (v / d) : -((-v + d - 1) / d);
+}
+
+static uint32_t chunk_hash(coord_t chunk) {
+    uint32_t h = (uint32_t)chunk.x * 73856093u ^ (uint32_t)chunk.y * 19349663u;
+    return h & (RENDER_CACHE_SLOT_COUNT - 1);
+}
+
+static void evict_all(render_cache_t *cache) {
+    assert(cache);
+
+    // Evicted chunks forget their stale state, so keep the latest one globally.
+    for (size_t i=0; i<RENDER_CACHE_SLOT_COUNT; i++) {
+        render_chunk_t *chunk = cache->chunks + i;
+        if (chunk->used && chunk->stale_until_tick > cache->stale_all_until_tick) {
+            cache->stale_all_until_tick = chunk->stale_until_tick;
+        }
+        render_commands_free(&chunk->commands);
+    }
+    memset(cache->chunks, 0, sizeof(render_chunk_t) * RENDER_CACHE_SLOT_COUNT);
+    cache->chunk_count = 0;
+}
+
+void render_cache_free(render_cache_t *cache) {
+    assert(cache);
+
+    if (cache->chunks) {
+        evict_all(cache);
+        free(cache->chunks);
+    }
+    memset(cache, 0, sizeof(render_cache_t));
+}
+
+void render_cache_begin_frame(render_cache_t *cache) {
+    assert(cache);
+
+    if (!cache->chunks) {
+        cache->chunks = calloc(RENDER_CACHE_SLOT_COUNT, sizeof(render_chunk_t));
+        assert(cache->chunks);
+    }
+
+    // Keep probe sequences short. Dropping everything is crude, but only
+    // happens after a lot of panning, and chunks rebuild lazily.
+    if (cache->chunk_count > RENDER_CACHE_SLOT_COUNT / 2) {
+        evict_all(cache);
+    }
+
+    cache->frame++;
+    cache->rebuilds = 0;
+    cache->cached_chunks = 0;
+}
+
+coord_t render_cache_chunk_of(coord_t pos) {
+    return (coord_t) {
+        floor_div(pos.x, RENDER_CACHE_CHUNK_SIZE),
+        floor_div(pos.y, RENDER_CACHE_CHUNK_SIZE),
+    };
+}
+
+render_chunk_t *render_cache_get_chunk(render_cache_t *cache, coord_t chunk) {
+    assert(cache);
+    assert(cache->chunks);
+
+    uint32_t slot = chunk_hash(chunk);
+    for (size_t probe=0; probe<RENDER_CACHE_SLOT_COUNT; probe++) {
+        render_chunk_t *c = cache->chunks + slot;
+
+        if (!c->used) {
+            if (cache->chunk_count >= RENDER_CACHE_SLOT_COUNT - 1) {
+                return NULL;
+            }
+            c->used = true;
+            c->built = false;
+            c->chunk = chunk;
+            c->stale_until_tick = 0;
+            c->last_frame = 0;
+            cache->chunk_count++;
+            return c;
+        }
+        if (coord_equals(c->chunk, chunk)) {
+            return c;
+        }
+
+        slot = (slot + 1) & (RENDER_CACHE_SLOT_COUNT - 1);
+    }
+
+    return NULL;
+}
+
+bool render_cache_chunk_is_stale(const render_cache_t *cache, const render_chunk_t *chunk, uint64_t tick) {
+    assert(cache);
+    assert(chunk);
+    return tick < chunk->stale_until_tick || tick < cache->stale_all_until_tick;
+}
+
+void render_cache_invalidate(render_cache_t *cache, coord_t pos, uint64_t tick) {
+    assert(cache);
+
+    if (!cache->chunks) {
+        // Nothing cached yet, but chunks created before the next tick must not be trusted.
+        cache->stale_all_until_tick = tick + 1;
+        return;
+    }
+
+    render_chunk_t *chunk = render_cache_get_chunk(cache, render_cache_chunk_of(pos));
+    if (!chunk) {
+        render_cache_invalidate_all(cache, tick);
+        return;
+    }
+
+    chunk->built = false;
+    chunk->stale_until_tick = tick + 1;
+    render_commands_clear(&chunk->commands);
+}
+
+void render_cache_invalidate_all(render_cache_t *cache, uint64_t tick) {
+    assert(cache);
+
+    if (cache->chunks) {
+        evict_all(cache);
+    }
+    cache->stale_all_until_tick = tick + 1;
+}
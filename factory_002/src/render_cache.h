@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "coord.h"
+#include "render_commands.h"
+
+// Cache of static geometry (building bodies, frames, labels, belt lanes),
+// recorded per chunk of the world and reused until an edit touches the chunk.
+//
+// Rebuilding uses the spatial index, which only picks up edits with the next
+// update. An invalidated chunk is therefore stale until that tick and is drawn
+// uncached in the meantime.
+
+#define RENDER_CACHE_CHUNK_SIZE  (16)   // cells
+#define RENDER_CACHE_SLOT_COUNT  (4096) // power of two, open addressing
+
+typedef struct {
+    coord_t chunk;
+    bool used;
+    bool built;
+    uint64_t stale_until_tick;
+    uint32_t last_frame; // frame the chunk was last queued for drawing
+    render_command_buffer_t commands; // sorted
+} render_chunk_t;
+
+typedef struct {
+    render_chunk_t *chunks;
+    size_t chunk_count;
+    uint64_t stale_all_until_tick;
+    uint32_t frame;
+
+    // stats, this frame
+    size_t rebuilds;
+    size_t cached_chunks;
+} render_cache_t;
+
+void render_cache_free(render_cache_t *cache);
+void render_cache_begin_frame(render_cache_t *cache);
+
+coord_t render_cache_chunk_of(coord_t pos);
+render_chunk_t *render_cache_get_chunk(render_cache_t *cache, coord_t chunk);
+bool render_cache_chunk_is_stale(const render_cache_t *cache, const render_chunk_t *chunk, uint64_t tick);
+
+void render_cache_invalidate(render_cache_t *cache, coord_t pos, uint64_t tick);
+void render_cache_invalidate_all(render_cache_t *cache, uint64_t tick);
@@ -0,0 +1,198 @@
+#include "render_commands.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#include <raylib.h>
+
+#include "render_backend.h"
+#include "metrics.h"
+
+#define CIRCLE_SEGMENTS (36)
+
+#define SORT_KEY(cmd) ((cmd)->layer * RENDER_PRIMITIVE_COUNT + (cmd)->primitive)
+
+static render_command_t *push_command(render_command_buffer_t *buffer, uint8_t layer, uint8_t primitive, Color color) {
+    assert(buffer);
+    assert(layer < RENDER_LAYER_COUNT);
+    assert(primitive < RENDER_PRIMITIVE_COUNT);
+
+    if (buffer->count == buffer->capacity) {
+        size_t new_capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        buffer->commands = realloc(buffer->commands, sizeof(render_command_t) * new_capacity);
+        buffer->scratch = realloc(buffer->scratch, sizeof(render_command_t) * new_capacity);
+        assert(buffer->commands);
+        assert(buffer->scratch);
+        buffer->capacity = new_capacity;
+    }
+
+    render_command_t *cmd = buffer->commands + buffer->count++;
+    cmd->layer = layer;
+    cmd->primitive = primitive;
+    cmd->color = color;
+    return cmd;
+}
+
+void render_commands_free(render_command_buffer_t *buffer) {
+    assert(buffer);
+    free(buffer->commands);
+    free(buffer->scratch);
+    memset(buffer, 0, sizeof(render_command_buffer_t));
+}
+
+void render_commands_clear(render_command_buffer_t *buffer) {
+    assert(buffer);
+    buffer->count = 0;
+    memset(buffer->key_offsets, 0, sizeof(buffer->key_offsets));
+}
+
+void render_commands_rect(render_command_buffer_t *buffer, uint8_t layer, Rectangle r, Color color) {
+    render_command_t *cmd = push_command(buffer, layer, RENDER_PRIMITIVE_RECT, color);
+    cmd->x = r.x;
+    cmd->y = r.y;
+    cmd->w = r.width;
+    cmd->h = r.height;
+}
+
+void render_commands_rect_lines(render_command_buffer_t *buffer, uint8_t layer, Rectangle r, float thickness, Color color) {
+    render_command_t *cmd = push_command(buffer, layer, RENDER_PRIMITIVE_RECT_LINES, color);
+    cmd->x = r.x;
+    cmd->y = r.y;
+    cmd->w = r.width;
+    cmd->h = r.height;
+    cmd->param = thickness;
+}
+
+void render_commands_circle(render_command_buffer_t *buffer, uint8_t layer, Vector2 center, float radius, Color color) {
+    render_command_t *cmd = push_command(buffer, layer, RENDER_PRIMITIVE_CIRCLE, color);
+    cmd->x = center.x;
+    cmd->y = center.y;
+    cmd->w = radius;
+    cmd->h = 0.0f;
+    cmd->param = 360.0f;
+    cmd->segments = CIRCLE_SEGMENTS;
+}
+
+void render_commands_circle_sector(render_command_buffer_t *buffer, uint8_t layer, Vector2 center, float radius,
+        float start_angle, float end_angle, int segments, Color color) {
+    if (segments < 4) segments = 4;
+    if (segments > 255) segments = 255;
+
+    render_command_t *cmd = push_command(buffer, layer, RENDER_PRIMITIVE_CIRCLE_SECTOR, color);
+    cmd->x = center.x;
+    cmd->y = center.y;
+    cmd->w = radius;
+    cmd->h = start_angle;
+    cmd->param = end_angle;
+    cmd->segments = segments;
+}
+
+void render_commands_circle_lines(render_command_buffer_t *buffer, uint8_t layer, Vector2 center, float radius, Color color) {
+    render_command_t *cmd = push_command(buffer, layer, RENDER_PRIMITIVE_CIRCLE_LINES, color);
+    cmd->x = center.x;
+    cmd->y = center.y;
+    cmd->w = radius;
+    cmd->h = 0.0f;
+    cmd->param = 360.0f;
+    cmd->segments = CIRCLE_SEGMENTS;
+}
+
+void render_commands_text(render_command_buffer_t *buffer, uint8_t layer, const char *text,
+        float x, float y, int font_size, Color color) {
+    assert(text);
+
+    render_command_t *cmd = push_command(buffer, layer, RENDER_PRIMITIVE_TEXT, color);
+    cmd->x = x;
+    cmd->y = y;
+    cmd->font_size = font_size;
+    strncpy(cmd->text, text, RENDER_TEXT_LENGTH - 1);
+    cmd->text[RENDER_TEXT_LENGTH - 1] = 0;
+}
+
+void render_commands_sort(render_command_buffer_t *buffer) {
+    assert(buffer);
+
+    // Stable counting sort: keeps submission order within a (layer, primitive)
+    // bucket, so overlapping primitives still draw in painter's order.
+
+    size_t offsets[RENDER_SORT_KEY_COUNT] = {};
+
+    for (size_t i=0; i<buffer->count; i++) {
+        offsets[SORT_KEY(buffer->commands + i)]++;
+    }
+
+    size_t offset = 0;
+    for (size_t k=0; k<RENDER_SORT_KEY_COUNT; k++) {
+        size_t n = offsets[k];
+        offsets[k] = offset;
+        buffer->key_offsets[k] = offset;
+        offset += n;
+    }
+    buffer->key_offsets[RENDER_SORT_KEY_COUNT] = offset;
+
+    for (size_t i=0; i<buffer->count; i++) {
+        const render_command_t *cmd = buffer->commands + i;
+        buffer->scratch[offsets[SORT_KEY(cmd)]++] = *cmd;
+    }
+
+    render_command_t *temp = buffer->commands;
+    buffer->commands = buffer->scratch;
+    buffer->scratch = temp;
+}
+
+// -----
+
+int render_command_vertex_count(const render_command_t *cmd) {
+    switch (cmd->primitive) {
+        case RENDER_PRIMITIVE_RECT: return 4;
+        case RENDER_PRIMITIVE_RECT_LINES: return 16;
+        case RENDER_PRIMITIVE_CIRCLE:
+        case RENDER_PRIMITIVE_CIRCLE_SECTOR: return cmd->segments * 3;
+        case RENDER_PRIMITIVE_CIRCLE_LINES: return cmd->segments * 2;
+        default: return 0;
+    }
+}
+
+void render_commands_flush(const render_command_buffer_t **buffers, size_t buffer_count,
+        render_backend_t *backend, render_stats_t *stats) {
+    assert(buffers);
+    assert(backend);
+    assert(stats);
+
+    // Consecutive commands with the same mode share one begin/end, regardless
+    // of layer or buffer: the key order already is the draw order.
+
+    int open_mode = -1;
+
+    for (uint32_t key=0; key<RENDER_SORT_KEY_COUNT; key++) {
+        const int mode = render_primitive_mode(key % RENDER_PRIMITIVE_COUNT);
+
+        for (size_t b=0; b<buffer_count; b++) {
+            const render_command_buffer_t *buffer = buffers[b];
+            const size_t begin = buffer->key_offsets[key];
+            const size_t end = buffer->key_offsets[key + 1];
+            if (begin == end) continue;
+
+            if (mode != open_mode) {
+                if (open_mode >= 0) backend->end(backend);
+                backend->begin(backend, mode);
+                stats->batches++;
+                metrics_add(METRIC_DRAW_BATCHES, 1);
+                open_mode = mode;
+            }
+
+            for (size_t i=begin; i<end; i++) {
+                const render_command_t *cmd = buffer->commands + i;
+                backend->draw(backend, cmd);
+                stats->vertices += render_command_vertex_count(cmd);
+            }
+            stats->commands += end - begin;
+        }
+    }
+
+    if (open_mode >= 0) backend->end(backend);
+}
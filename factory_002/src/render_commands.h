@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <raylib.h>
+
+// Draw-command buffer: renderers record primitives instead of drawing
+// immediately. The buffer is sorted by (layer, primitive) and flushed as a
+// few large batches, each issued with a single begin/end on the backend.
+
+#define RENDER_PRIMITIVE_RECT           (0)
+#define RENDER_PRIMITIVE_RECT_LINES     (1)
+#define RENDER_PRIMITIVE_CIRCLE         (2)
+#define RENDER_PRIMITIVE_CIRCLE_SECTOR  (3)
+#define RENDER_PRIMITIVE_CIRCLE_LINES   (4)
+#define RENDER_PRIMITIVE_TEXT           (5) // font texture, everything else is untextured
+#define RENDER_PRIMITIVE_COUNT          (6)
+
+#define RENDER_LAYER_UNDERLAY           (0) // belt borders
+#define RENDER_LAYER_BASE               (1) // belt lanes, building bodies
+#define RENDER_LAYER_FRAME              (2) // building outlines
+#define RENDER_LAYER_DETAIL             (3) // progress, factory slots
+#define RENDER_LAYER_ITEMS              (4) // belt items
+#define RENDER_LAYER_TEXT               (5)
+#define RENDER_LAYER_COUNT              (6)
+
+#define RENDER_TEXT_LENGTH              (12)
+
+#define RENDER_SORT_KEY_COUNT           (RENDER_LAYER_COUNT * RENDER_PRIMITIVE_COUNT)
+
+typedef struct {
+    uint8_t layer;
+    uint8_t primitive;
+    uint8_t segments;
+    uint8_t font_size;
+    Color color;
+    // rect: x/y/w/h
+    // circle*: x/y center, w radius, h start angle, param end angle
+    // rect lines: param thickness
+    float x;
+    float y;
+    float w;
+    float h;
+    float param;
+    char text[RENDER_TEXT_LENGTH];
+} render_command_t;
+
+typedef struct {
+    size_t capacity;
+    size_t count;
+    render_command_t *commands;
+    render_command_t *scratch;
+    size_t key_offsets[RENDER_SORT_KEY_COUNT + 1]; // valid after sort
+} render_command_buffer_t;
+
+typedef struct {
+    size_t commands;
+    size_t batches;
+    size_t vertices;
+} render_stats_t;
+
+void render_commands_free(render_command_buffer_t *buffer);
+void render_commands_clear(render_command_buffer_t *buffer);
+
+void render_commands_rect(render_command_buffer_t *buffer, uint8_t layer, Rectangle r, Color color);
+void render_commands_rect_lines(render_command_buffer_t *buffer, uint8_t layer, Rectangle r, float thickness, Color color);
+void render_commands_circle(render_command_buffer_t *buffer, uint8_t layer, Vector2 center, float radius, Color color);
+void render_commands_circle_sector(render_command_buffer_t *buffer, uint8_t layer, Vector2 center, float radius,
+        float start_angle, float end_angle, int segments, Color color);
+void render_commands_circle_lines(render_command_buffer_t *buffer, uint8_t layer, Vector2 center, float radius, Color color);
+void render_commands_text(render_command_buffer_t *buffer, uint8_t layer, const char *text,
+        float x, float y, int font_size, Color color);
+
+void render_commands_sort(render_command_buffer_t *buffer);
+
+int render_command_vertex_count(const render_command_t *cmd);
+
+struct render_backend;
+
+// Flushes several sorted buffers as if they were one: for each (layer, primitive)
+// key the matching range of every buffer is emitted, in buffer order.
+void render_commands_flush(const render_command_buffer_t **buffers, size_t buffer_count,
+        struct render_backend *backend, render_stats_t *stats);
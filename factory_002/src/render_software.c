@@ -0,0 +1,236 @@
+#include "render_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#include <raymath.h>
+
+// Pixel centers are at +0.5, a pixel is covered when its center is inside.
+
+static uint32_t pack_color(Color c) {
+    return (uint32_t)c.r | (uint32_t)c.g << 8 | (uint32_t)c.b << 16 | (uint32_t)c.a << 24;
+}
+
+static uint32_t blend(uint32_t dst, Color c) {
+    const uint32_t a = c.a;
+    const uint32_t ia = 255 - a;
+    const uint32_t r = (c.r * a + (dst & 0xff) * ia) / 255;
+    const uint32_t g = (c.g * a + ((dst >> 8) & 0xff) * ia) / 255;
+    const uint32_t b = (c.b * a + ((dst >> 16) & 0xff) * ia) / 255;
+    return r | g << 8 | b << 16 | 0xffu << 24;
+}
+
+static Vector2 to_screen(const render_software_backend_t *sb, float x, float y) {
+    const Camera2D *cam = &sb->camera;
+    return (Vector2) {
+        (x - cam->target.x) * cam->zoom + cam->offset.x,
+        (y - cam->target.y) * cam->zoom + cam->offset.y,
+    };
+}
+
+static void span(render_software_backend_t *sb, int y, int x0, int x1, Color c) {
+    uint32_t *row = sb->pixels + (size_t)y * sb->width;
+    if (c.a == 255) {
+        const uint32_t packed = pack_color(c);
+        for (int x=x0; x<x1; x++) row[x] = packed;
+    } else if (c.a) {
+        for (int x=x0; x<x1; x++) row[x] = blend(row[x], c);
+    }
+    sb->pixels_written += x1 - x0;
+}
+
+static void fill_rect(render_software_backend_t *sb, float x, float y, float w, float h, Color c) {
+    const Vector2 a = to_screen(sb, x, y);
+    const Vector2 b = to_screen(sb, x + w, y + h);
+
+    int x0 = (int)ceilf(fminf(a.x, b.x) - 0.5f);
+    int x1 = (int)ceilf(fmaxf(a.x, b.x) - 0.5f);
+    int y0 = (int)ceilf(fminf(a.y, b.y) - 0.5f);
+    int y1 = (int)ceilf(fmaxf(a.y, b.y) - 0.5f);
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > sb->width) x1 = sb->width;
+    if (y1 > sb->height) y1 = sb->height;
+    if (x0 >= x1) return;
+
+    for (int py=y0; py<y1; py++) {
+        span(sb, py, x0, x1, c);
+    }
+}
+
+static float edge(Vector2 a, Vector2 b, float px, float py) {
+    return (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+}
+
+static void fill_triangle(render_software_backend_t *sb, Vector2 a, Vector2 b, Vector2 c, Color color) {
+    // Either winding: flip to counter-clockwise in screen space.
+    if (edge(a, b, c.x, c.y) < 0.0f) {
+        Vector2 t = b;
+        b = c;
+        c = t;
+    }
+
+    int x0 = (int)floorf(fminf(a.x, fminf(b.x, c.x)));
+    int x1 = (int)ceilf(fmaxf(a.x, fmaxf(b.x, c.x)));
+    int y0 = (int)floorf(fminf(a.y, fminf(b.y, c.y)));
+    int y1 = (int)ceilf(fmaxf(a.y, fmaxf(b.y, c.y)));
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > sb->width) x1 = sb->width;
+    if (y1 > sb->height) y1 = sb->height;
+
+    for (int py=y0; py<y1; py++) {
+        // Covered pixels of a row form one span.
+        int first = -1, last = -1;
+        for (int px=x0; px<x1; px++) {
+            const float fx = px + 0.5f, fy = py + 0.5f;
+            if (edge(a, b, fx, fy) >= 0.0f && edge(b, c, fx, fy) >= 0.0f && edge(c, a, fx, fy) >= 0.0f) {
+                if (first < 0) first = px;
+                last = px;
+            } else if (first >= 0) {
+                break;
+            }
+        }
+        if (first >= 0) span(sb, py, first, last + 1, color);
+    }
+}
+
+static void plot(render_software_backend_t *sb, int x, int y, Color c) {
+    if (x < 0 || y < 0 || x >= sb->width || y >= sb->height) return;
+    uint32_t *p = sb->pixels + (size_t)y * sb->width + x;
+    *p = (c.a == 255) ? pack_color(c) : blend(*p, c);
+    sb->pixels_written++;
+}
+
+static void draw_line(render_software_backend_t *sb, Vector2 a, Vector2 b, Color c) {
+    const float dx = b.x - a.x;
+    const float dy = b.y - a.y;
+    int steps = (int)ceilf(fmaxf(fabsf(dx), fabsf(dy)));
+    if (steps < 1) steps = 1;
+
+    // Skip lines that are entirely off screen before stepping them.
+    if (fmaxf(a.x, b.x) < 0 || fmaxf(a.y, b.y) < 0 ||
+            fminf(a.x, b.x) >= sb->width || fminf(a.y, b.y) >= sb->height) {
+        return;
+    }
+
+    for (int i=0; i<=steps; i++) {
+        const float t = (float)i / steps;
+        plot(sb, (int)floorf(a.x + dx * t), (int)floorf(a.y + dy * t), c);
+    }
+}
+
+static bool circle_is_visible(const render_software_backend_t *sb, const render_command_t *cmd) {
+    const Vector2 center = to_screen(sb, cmd->x, cmd->y);
+    const float r = cmd->w * sb->camera.zoom;
+    return center.x + r >= 0 && center.y + r >= 0 && center.x - r < sb->width && center.y - r < sb->height;
+}
+
+static void software_begin(render_backend_t *backend, int mode) {
+}
+
+static void software_end(render_backend_t *backend) {
+}
+
+static void software_draw(render_backend_t *backend, const render_command_t *cmd) {
+    render_software_backend_t *sb = (render_software_backend_t *)backend;
+    const Color c = cmd->color;
+
+    switch (cmd->primitive) {
+        case RENDER_PRIMITIVE_RECT:
+            fill_rect(sb, cmd->x, cmd->y, cmd->w, cmd->h, c);
+            break;
+
+        case RENDER_PRIMITIVE_RECT_LINES:
+            {
+                const float t = cmd->param;
+                fill_rect(sb, cmd->x, cmd->y, cmd->w, t, c);
+                fill_rect(sb, cmd->x, cmd->y + cmd->h - t, cmd->w, t, c);
+                fill_rect(sb, cmd->x, cmd->y + t, t, cmd->h - 2*t, c);
+                fill_rect(sb, cmd->x + cmd->w - t, cmd->y + t, t, cmd->h - 2*t, c);
+            }
+            break;
+
+        case RENDER_PRIMITIVE_CIRCLE:
+        case RENDER_PRIMITIVE_CIRCLE_SECTOR:
+            {
+                if (!circle_is_visible(sb, cmd)) break;
+                const float step = (cmd->param - cmd->h) / (float)cmd->segments;
+                float angle = cmd->h;
+                const Vector2 center = to_screen(sb, cmd->x, cmd->y);
+                Vector2 prev = to_screen(sb, cmd->x + cosf(DEG2RAD*angle)*cmd->w, cmd->y + sinf(DEG2RAD*angle)*cmd->w);
+                for (int i=0; i<cmd->segments; i++) {
+                    angle += step;
+                    const Vector2 next = to_screen(sb, cmd->x + cosf(DEG2RAD*angle)*cmd->w, cmd->y + sinf(DEG2RAD*angle)*cmd->w);
+                    fill_triangle(sb, center, prev, next, c);
+                    prev = next;
+                }
+            }
+            break;
+
+        case RENDER_PRIMITIVE_CIRCLE_LINES:
+            {
+                if (!circle_is_visible(sb, cmd)) break;
+                const float step = 360.0f / (float)cmd->segments;
+                float angle = 0.0f;
+                Vector2 prev = to_screen(sb, cmd->x + cmd->w, cmd->y);
+                for (int i=0; i<cmd->segments; i++) {
+                    angle += step;
+                    const Vector2 next = to_screen(sb, cmd->x + cosf(DEG2RAD*angle)*cmd->w, cmd->y + sinf(DEG2RAD*angle)*cmd->w);
+                    draw_line(sb, prev, next, c);
+                    prev = next;
+                }
+            }
+            break;
+
+        case RENDER_PRIMITIVE_TEXT:
+            {
+                // Roughly the metrics of raylib's default font: glyphs are
+                // about half as wide as the font size, with a 1/10 spacing.
+                const float size = cmd->font_size;
+                const float advance = size * 0.6f;
+                Color glyph = c;
+                glyph.a /= 2;
+                for (size_t i=0; i<RENDER_TEXT_LENGTH && cmd->text[i]; i++) {
+                    if (cmd->text[i] == ' ') continue;
+                    fill_rect(sb, cmd->x + i * advance, cmd->y, size * 0.5f, size, glyph);
+                }
+            }
+            break;
+    }
+}
+
+void render_software_backend_init(render_software_backend_t *sb, int width, int height) {
+    assert(sb);
+    assert(width > 0 && height > 0);
+
+    memset(sb, 0, sizeof(render_software_backend_t));
+    sb->base.name = "software";
+    sb->base.begin = software_begin;
+    sb->base.end = software_end;
+    sb->base.draw = software_draw;
+
+    sb->camera.zoom = 1.0f;
+    sb->width = width;
+    sb->height = height;
+    sb->pixels = malloc(sizeof(uint32_t) * (size_t)width * height);
+    assert(sb->pixels);
+}
+
+void render_software_backend_free(render_software_backend_t *sb) {
+    assert(sb);
+    free(sb->pixels);
+    memset(sb, 0, sizeof(render_software_backend_t));
+}
+
+void render_software_backend_clear(render_software_backend_t *sb, Color color) {
+    assert(sb);
+
+    const uint32_t packed = pack_color(color);
+    const size_t n = (size_t)sb->width * sb->height;
+    for (size_t i=0; i<n; i++) sb->pixels[i] = packed;
+    sb->pixels_written = 0;
+}
@@ -0,0 +1,121 @@
+#include "render_workers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    render_workers_t *workers;
+    size_t worker_index;
+} worker_arg_t;
+
+static void *worker_main(void *arg) {
+    worker_arg_t *wa = arg;
+    render_workers_t *workers = wa->workers;
+    const size_t worker_index = wa->worker_index;
+    free(wa);
+
+    uint64_t seen_generation = 0;
+
+    while (1) {
+        pthread_mutex_lock(&workers->mutex);
+        while (!workers->quit && workers->generation == seen_generation) {
+            pthread_cond_wait(&workers->start_cond, &workers->mutex);
+        }
+        if (workers->quit) {
+            pthread_mutex_unlock(&workers->mutex);
+            break;
+        }
+        seen_generation = workers->generation;
+        render_task_fn task = workers->task;
+        void *task_ctx = workers->task_ctx;
+        pthread_mutex_unlock(&workers->mutex);
+
+        task(task_ctx, worker_index, workers->worker_count);
+
+        pthread_mutex_lock(&workers->mutex);
+        if (--workers->pending == 0) {
+            pthread_cond_signal(&workers->done_cond);
+        }
+        pthread_mutex_unlock(&workers->mutex);
+    }
+
+    return NULL;
+}
+
+render_workers_t *render_workers_create(size_t worker_count) {
+    assert(worker_count >= 1);
+    if (worker_count > RENDER_MAX_WORKERS) worker_count = RENDER_MAX_WORKERS;
+
+    render_workers_t *workers = malloc(sizeof(render_workers_t));
+    memset(workers, 0, sizeof(render_workers_t));
+
+    workers->worker_count = worker_count;
+    pthread_mutex_init(&workers->mutex, NULL);
+    pthread_cond_init(&workers->start_cond, NULL);
+    pthread_cond_init(&workers->done_cond, NULL);
+
+    // Worker 0 is the thread calling render_workers_run().
+    for (size_t i=1; i<worker_count; i++) {
+        worker_arg_t *wa = malloc(sizeof(worker_arg_t));
+        wa->workers = workers;
+        wa->worker_index = i;
+        int err = pthread_create(workers->threads + i, NULL, worker_main, wa);
+        assert(!err);
+    }
+
+    return workers;
+}
+
+void render_workers_destroy(render_workers_t *workers) {
+    assert(workers);
+
+    pthread_mutex_lock(&workers->mutex);
+    workers->quit = true;
+    pthread_cond_broadcast(&workers->start_cond);
+    pthread_mutex_unlock(&workers->mutex);
+
+    for (size_t i=1; i<workers->worker_count; i++) {
+        pthread_join(workers->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&workers->mutex);
+    pthread_cond_destroy(&workers->start_cond);
+    pthread_cond_destroy(&workers->done_cond);
+    free(workers);
+}
+
+size_t render_workers_default_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > RENDER_MAX_WORKERS) cpus = RENDER_MAX_WORKERS;
+    return cpus;
+}
+
+void render_workers_run(render_workers_t *workers, render_task_fn task, void *ctx) {
+    assert(workers);
+    assert(task);
+
+    if (workers->worker_count == 1) {
+        task(ctx, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&workers->mutex);
+    workers->task = task;
+    workers->task_ctx = ctx;
+    workers->pending = workers->worker_count - 1;
+    workers->generation++;
+    pthread_cond_broadcast(&workers->start_cond);
+    pthread_mutex_unlock(&workers->mutex);
+
+    task(ctx, 0, workers->worker_count);
+
+    pthread_mutex_lock(&workers->mutex);
+    while (workers->pending) {
+        pthread_cond_wait(&workers->done_cond, &workers->mutex);
+    }
+    pthread_mutex_unlock(&workers->mutex);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+// Small fixed pool of threads for render preparation. render_workers_run()
+// calls the task once per worker (the calling thread acts as worker 0) and
+// returns when all of them are done.
+
+#define RENDER_MAX_WORKERS (8)
+
+typedef void (*render_task_fn)(void *ctx, size_t worker_index, size_t worker_count);
+
+typedef struct {
+    size_t worker_count;
+    pthread_t threads[RENDER_MAX_WORKERS];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+
+    uint64_t generation;
+    size_t pending;
+    bool quit;
+
+    render_task_fn task;
+    void *task_ctx;
+} render_workers_t;
+
+render_workers_t *render_workers_create(size_t worker_count);
+void render_workers_destroy(render_workers_t *workers);
+
+size_t render_workers_default_count();
+void render_workers_run(render_workers_t *workers, render_task_fn task, void *ctx);
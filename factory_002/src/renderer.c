@@ -1,12 +1,18 @@
 #include "renderer.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <math.h>
 
 #include <raylib.h>
 #include <rlgl.h>
 #include <raymath.h>
 
+#include "utils.h"
+#include "recipe.h"
+
 coord_t world_position_to_coord(Vector2 world_position) {
     int32_t x = world_position.x / WORLD_CELL_SIZE;
     int32_t y = world_position.y / WORLD_CELL_SIZE;
@@ -31,7 +37,65 @@ Color get_item_color(uint8_t item) {
     }
 }
 
-void render_miner(render_state_t *rs, const miner_t *miner, Rectangle r) {
+void init_render_state(render_state_t *rs) {
+    assert(rs);
+    memset(rs, 0, sizeof(render_state_t));
+
+    rs->lod_tiers[0] = (render_lod_tier_t) { 0.2f,    1 };
+    rs->lod_tiers[1] = (render_lod_tier_t) { 0.05f,   4 };
+    rs->lod_tiers[2] = (render_lod_tier_t) { 0.0125f, 16 };
+    rs->lod_tiers[3] = (render_lod_tier_t) { 0.0f,    64 };
+
+    rs->cache_enabled = true;
+    rs->parallel_enabled = true;
+}
+
+void free_render_state(render_state_t *rs) {
+    assert(rs);
+    render_commands_free(&rs->commands);
+    render_cache_free(&rs->cache);
+
+    if (rs->workers) {
+        render_workers_destroy(rs->workers);
+    }
+    for (size_t i=0; i<RENDER_MAX_WORKERS; i++) {
+        render_commands_free(rs->worker_commands + i);
+    }
+    free(rs->static_cached);
+}
+
+static render_backend_t *get_backend(render_state_t *rs) {
+    return rs->backend ? rs->backend : render_backend_raylib();
+}
+
+int32_t get_lod_node_size(const render_state_t *rs, float zoom, quad_aabb_t view, size_t max_nodes) {
+    assert(rs);
+
+    int32_t node_size = rs->lod_tiers[RENDER_LOD_TIER_COUNT-1].node_size;
+    for (size_t i=0; i<RENDER_LOD_TIER_COUNT; i++) {
+        if (zoom >= rs->lod_tiers[i].min_zoom) {
+            node_size = rs->lod_tiers[i].node_size;
+            break;
+        }
+    }
+    if (node_size == 1) return node_size;
+
+    // Nodes touching the closed bounds, up to one more per axis than fit.
+    const int64_t w = (int64_t)view.x_max - view.x_min;
+    const int64_t h = (int64_t)view.y_max - view.y_min;
+    while (node_size < (1 << 17) && (w / node_size + 2) * (h / node_size + 2) > (int64_t)max_nodes) {
+        node_size *= 2;
+    }
+    return node_size;
+}
+
+void render_miner_static(render_command_buffer_t *cb, Rectangle r) {
+    render_commands_rect(cb, RENDER_LAYER_BASE, r, GRAY);
+    render_commands_rect_lines(cb, RENDER_LAYER_FRAME, r, 2.0f, BLACK);
+    render_commands_text(cb, RENDER_LAYER_TEXT, "Miner", r.x+5, r.y+5, 20, BLACK);
+}
+
+void render_miner(render_command_buffer_t *cb, const miner_t *miner, Rectangle r) {
 
     const Vector2 center = (Vector2) {
         .x = r.x + r.width * 0.5f,
@@ -41,72 +105,84 @@ void render_miner(render_state_t *rs, const miner_t *miner, Rectangle r) {
     const float progress = (float)miner->work / (float)MINER_WORK_PER_ITEM;
     const float radius = WORLD_CELL_SIZE / 3.0f;
 
-    DrawRectangleRec(r, GRAY);
-    DrawRectangleLinesEx(r, 2.0f, BLACK);
-    DrawText("Miner", r.x+5, r.y+5, 20, BLACK);
-
     switch (miner->state) {
         case MINER_STATE_MINING:
-            {
+            if (miner->work) {
                 float end_angle = progress * 360.0f;
                 int segments = progress * 24.0f;
-                DrawCircleSector(center, radius, 0.0f, end_angle, segments, WHITE);
+                render_commands_circle_sector(cb, RENDER_LAYER_DETAIL, center, radius, 0.0f, end_angle, segments, WHITE);
             }
             break;
         case MINER_STATE_UNLOAD:
-            DrawCircleV(center, radius, LIGHTGRAY);
+            render_commands_circle(cb, RENDER_LAYER_DETAIL, center, radius, LIGHTGRAY);
             break;
     }
 
 }
 
-void render_factory(render_state_t *rs, const factory_t *factory, Rectangle r) {
+static Rectangle get_factory_slot_rect(Rectangle r, int item) {
+    return (Rectangle) {
+        .x = r.x + 20,
+        .y = r.y + 40 + item * 30,
+        .width = 20,
+        .height = 20,
+    };
+}
+
+void render_factory_static(render_command_buffer_t *cb, Rectangle r) {
+    render_commands_rect(cb, RENDER_LAYER_BASE, r, GRAY);
+    render_commands_rect_lines(cb, RENDER_LAYER_FRAME, r, 2.0f, BLACK);
+    render_commands_text(cb, RENDER_LAYER_TEXT, "Factory", r.x+5, r.y+5, 20, BLACK);
+
+    for(int item=0; item<4; item++) {
+        render_commands_rect_lines(cb, RENDER_LAYER_DETAIL, get_factory_slot_rect(r, item), 2.0f, WHITE);
+    }
+}
+
+void render_factory(render_command_buffer_t *cb, const factory_t *factory, Rectangle r) {
 
     const Vector2 center = (Vector2) {
         .x = r.x + r.width * 0.5f,
         .y = r.y + r.height * 0.5f,
     };
 
-    const float progress = (float)factory->work / (float)FACTORY_WORK_PER_ITEM;
+    const recipe_t *recipe = recipes + factory->recipe;
+    const float progress = (float)factory->work / (float)recipe->duration;
     const float radius = WORLD_CELL_SIZE / 3.0f;
 
-    DrawRectangleRec(r, GRAY);
-    DrawRectangleLinesEx(r, 2.0f, BLACK);
-    DrawText("Factory", r.x+5, r.y+5, 20, BLACK);
     //DrawText(TextFormat("Factory %u %u", factory->state, factory->work), r.x+10, r.y+20, 10, BLACK);
 
-    for(int item=0; item<4; item++) {
-        DrawText(TextFormat("%u", factory->items[item]), r.x+10, r.y+30 + item*10, 10, BLACK);
-        const Rectangle item_rect = {
-            .x = r.x + 20,
-            .y = r.y + 40 + item * 30,
-            .width = 20,
-            .height = 20,
-        };
-        if (factory->items[item] != 0) {
-            DrawRectangleRec(item_rect, get_item_color(factory->items[item]));
+    // Held and needed count of each recipe input.
+    for(int slot=0; slot<RECIPE_MAX_INPUTS; slot++) {
+        const uint8_t item = recipe->input_items >> (8 * slot);
+        if (!item) continue;
+        const uint8_t count = factory->counts >> (8 * slot);
+        char label[RENDER_TEXT_LENGTH];
+        snprintf(label, sizeof(label), "%u/%u", count, (uint8_t)(recipe->input_counts >> (8 * slot)));
+        render_commands_text(cb, RENDER_LAYER_TEXT, label, r.x+10, r.y+30 + slot*10, 10, BLACK);
+        if (count != 0) {
+            render_commands_rect(cb, RENDER_LAYER_DETAIL, get_factory_slot_rect(r, slot), get_item_color(item));
         }
-        DrawRectangleLinesEx(item_rect, 2.0f, WHITE);
     }
 
     switch (factory->state) {
         case FACTORY_STATE_WAIT_ITEMS:
-            DrawCircleLines(center.x, center.y, radius, WHITE);
+            render_commands_circle_lines(cb, RENDER_LAYER_DETAIL, center, radius, WHITE);
             break;
         case FACTORY_STATE_PRODUCE:
-            {
+            if (factory->work) {
                 float end_angle = progress * 360.0f;
                 int segments = progress * 24.0f;
-                DrawCircleSector(center, radius, 0.0f, end_angle, segments, WHITE);
+                render_commands_circle_sector(cb, RENDER_LAYER_DETAIL, center, radius, 0.0f, end_angle, segments, WHITE);
             }
             break;
         case FACTORY_STATE_UNLOAD:
-            DrawCircleV(center, radius, LIGHTGRAY);
+            render_commands_circle(cb, RENDER_LAYER_DETAIL, center, radius, LIGHTGRAY);
             break;
     }
 }
 
-void render_belt(render_state_t *rs, const belt_t *belt, Rectangle r) {
+void render_belt(render_command_buffer_t *cb, const belt_t *belt, Rectangle r) {
 
     //size_t total_belt_work = BELT_WORK_PER_ITEM * BELT_ITEM_COUNT;
     //float anim_progress = (float)(rs->ticks % total_belt_work) / (float)total_belt_work;
@@ -206,11 +282,11 @@ void render_belt(render_state_t *rs, const belt_t *belt, Rectangle r) {
     out_rect_border.width += 4;
     out_rect_border.height += 4;
 
-    DrawRectangleRec(in_rect_border, BLACK); // super ugly&hackish border
-    DrawRectangleRec(out_rect_border, BLACK);
+    render_commands_rect(cb, RENDER_LAYER_UNDERLAY, in_rect_border, BLACK); // super ugly&hackish border
+    render_commands_rect(cb, RENDER_LAYER_UNDERLAY, out_rect_border, BLACK);
 
-    DrawRectangleRec(in_rect, GRAY);
-    DrawRectangleRec(out_rect, GRAY);
+    render_commands_rect(cb, RENDER_LAYER_BASE, in_rect, GRAY);
+    render_commands_rect(cb, RENDER_LAYER_BASE, out_rect, GRAY);
 
     if (belt->in_dir != belt->out_dir || belt->in_dir == DIR_NONE || belt->out_dir == DIR_NONE) {
         Vector2 joint_pos = (Vector2) {
@@ -218,14 +294,14 @@ void render_belt(render_state_t *rs, const belt_t *belt, Rectangle r) {
             .y = r.y + r.height * 0.5f,
         };
         float joint_radius = lane_size * 0.5f;
-        DrawCircleV(joint_pos, joint_radius, GRAY);
+        render_commands_circle(cb, RENDER_LAYER_BASE, joint_pos, joint_radius, GRAY);
     }
 
     // Debug
     //DrawText(TextFormat("%u/%u", belt->in_dir, belt->out_dir), r.x, r.y, 10, WHITE);
 }
 
-void render_belt_items(render_state_t *rs, const belt_t *belt, Rectangle r) {
+void render_belt_items(render_command_buffer_t *cb, const belt_t *belt, Rectangle r) {
 
     const float item_w = (float)WORLD_CELL_SIZE / (float)BELT_ITEM_COUNT;
     const float item_h = item_w;
@@ -270,10 +346,114 @@ void render_belt_items(render_state_t *rs, const belt_t *belt, Rectangle r) {
         };
 
         if (belt->items[item]) {
-            DrawRectangleRec(item_rect, get_item_color(belt->items[item]));
+            render_commands_rect(cb, RENDER_LAYER_ITEMS, item_rect, get_item_color(belt->items[item]));
+        }
+    }
+
+}
+
+static Rectangle get_building_rect(const building_t *b) {
+    const Vector2 world_pos = coord_to_world_position(b->pos);
+    return (Rectangle) {
+        .x = world_pos.x,
+        .y = world_pos.y,
+        .width = b->size.w * WORLD_CELL_SIZE,
+        .height = b->size.h * WORLD_CELL_SIZE,
+    };
+}
+
+static void render_building_static(render_command_buffer_t *cb, const game_state_t *gs, const building_t *b) {
+    const Rectangle r = get_building_rect(b);
+
+    switch (b->type) {
+        case BUILDING_TYPE_MINER: render_miner_static(cb, r); break;
+        case BUILDING_TYPE_FACTORY: render_factory_static(cb, r); break;
+        case BUILDING_TYPE_BELT: render_belt(cb, GET_BELT(gs, b->data), r); break;
+    }
+}
+
+static void render_building_dynamic(render_command_buffer_t *cb, const game_state_t *gs, const building_t *b) {
+    const Rectangle r = get_building_rect(b);
+
+    switch (b->type) {
+        case BUILDING_TYPE_MINER: render_miner(cb, GET_MINER(gs, b->data), r); break;
+        case BUILDING_TYPE_FACTORY: render_factory(cb, GET_FACTORY(gs, b->data), r); break;
+        case BUILDING_TYPE_BELT: render_belt_items(cb, GET_BELT(gs, b->data), r); break;
+    }
+}
+
+static void build_chunk(const game_state_t *gs, render_chunk_t *chunk) {
+    assert(gs);
+    assert(chunk);
+
+    const int32_t x_min = chunk->chunk.x * RENDER_CACHE_CHUNK_SIZE;
+    const int32_t y_min = chunk->chunk.y * RENDER_CACHE_CHUNK_SIZE;
+    const int32_t x_max = x_min + RENDER_CACHE_CHUNK_SIZE - 1;
+    const int32_t y_max = y_min + RENDER_CACHE_CHUNK_SIZE - 1;
+
+    size_t items[RENDER_CACHE_CHUNK_SIZE * RENDER_CACHE_CHUNK_SIZE * 2];
+    quad_tree_query_result_t result = {
+        .capacity = ARRAY_LENGTH(items),
+        .count = 0,
+        .items = items,
+    };
+    query_buildings(gs, (quad_aabb_t) { x_min, y_min, x_max, y_max }, &result);
+
+    render_commands_clear(&chunk->commands);
+    for (size_t i=0; i<result.count; i++) {
+        const building_t *b = gs->buildings + items[i];
+        // The query also returns direct neighbours, a building belongs to the chunk of its pos.
+        if (b->pos.x < x_min || b->pos.x > x_max || b->pos.y < y_min || b->pos.y > y_max) {
+            continue;
+        }
+        render_building_static(&chunk->commands, gs, b);
+    }
+    render_commands_sort(&chunk->commands);
+
+    chunk->built = true;
+}
+
+void render_consume_edits(render_state_t *rs, game_state_t *gs) {
+    assert(rs);
+    assert(gs);
+
+    if (gs->dirty_all) {
+        render_cache_invalidate_all(&rs->cache, gs->tick);
+    } else {
+        for (size_t i=0; i<gs->dirty_cell_count; i++) {
+            render_cache_invalidate(&rs->cache, gs->dirty_cells[i], gs->tick);
         }
     }
+    clear_dirty_cells(gs);
+}
 
+typedef struct {
+    const game_state_t *gs;
+    render_state_t *rs;
+    size_t building_count;
+    const size_t *building_ids;
+    const uint8_t *static_cached;
+} render_prep_task_t;
+
+static void render_prep_task(void *ctx, size_t worker_index, size_t worker_count) {
+    const render_prep_task_t *task = ctx;
+    const game_state_t *gs = task->gs;
+    render_command_buffer_t *cb = task->rs->worker_commands + worker_index;
+
+    // Contiguous slices, so concatenating the worker buffers in worker order
+    // gives exactly the single-threaded command order.
+    const size_t begin = task->building_count * worker_index / worker_count;
+    const size_t end = task->building_count * (worker_index + 1) / worker_count;
+
+    render_commands_clear(cb);
+    for (size_t i=begin; i<end; i++) {
+        const building_t *b = gs->buildings + task->building_ids[i];
+        if (!task->static_cached[i]) {
+            render_building_static(cb, gs, b);
+        }
+        render_building_dynamic(cb, gs, b);
+    }
+    render_commands_sort(cb);
 }
 
 void render_world(const game_state_t *gs, render_state_t *rs,
@@ -283,36 +463,156 @@ void render_world(const game_state_t *gs, render_state_t *rs,
 
     rs->ticks++;
 
+    memset(&rs->stats, 0, sizeof(render_stats_t));
+
+    render_cache_t *cache = &rs->cache;
+    render_cache_begin_frame(cache);
+
+    if (rs->static_cached_capacity < building_count) {
+        rs->static_cached_capacity = building_count;
+        rs->static_cached = realloc(rs->static_cached, rs->static_cached_capacity);
+        assert(rs->static_cached);
+    }
+
+    // Static geometry of up-to-date chunks comes from the cache. Lookups and
+    // rebuilds mutate the cache and stay on this thread.
+    static const render_command_buffer_t *buffers[RENDER_CACHE_SLOT_COUNT + RENDER_MAX_WORKERS];
+    size_t buffer_count = 0;
+
     for(uint32_t i=0; i<building_count; i++) {
         const building_t *b = gs->buildings + building_ids[i];
-        const Vector2 world_pos = coord_to_world_position(b->pos);
-        const Rectangle r = {
-            .x = world_pos.x,
-            .y = world_pos.y,
-            .width = b->size.w * WORLD_CELL_SIZE,
-            .height = b->size.h * WORLD_CELL_SIZE,
-        };
 
-        switch (b->type) {
-            case BUILDING_TYPE_MINER: render_miner(rs, gs->miners + b->data_index, r); break;
-            case BUILDING_TYPE_FACTORY: render_factory(rs, gs->factories + b->data_index, r); break;
-            case BUILDING_TYPE_BELT: render_belt(rs, gs->belts + b->data_index, r); break;
+        render_chunk_t *chunk = NULL;
+        if (rs->cache_enabled) {
+            chunk = render_cache_get_chunk(cache, render_cache_chunk_of(b->pos));
+            if (chunk && render_cache_chunk_is_stale(cache, chunk, gs->tick)) {
+                chunk = NULL;
+            }
         }
+
+        if (chunk) {
+            if (!chunk->built) {
+                build_chunk(gs, chunk);
+                cache->rebuilds++;
+            }
+            if (chunk->last_frame != cache->frame) {
+                chunk->last_frame = cache->frame;
+                buffers[buffer_count++] = &chunk->commands;
+                cache->cached_chunks++;
+            }
+        }
+        rs->static_cached[i] = chunk != NULL;
     }
 
-    for(uint32_t i=0; i<building_count; i++) {
-        const building_t *b = gs->buildings + building_ids[i];
-        const Vector2 world_pos = coord_to_world_position(b->pos);
-        const Rectangle r = {
-            .x = world_pos.x,
-            .y = world_pos.y,
-            .width = b->size.w * WORLD_CELL_SIZE,
-            .height = b->size.h * WORLD_CELL_SIZE,
-        };
+    // Geometry for everything else is built in parallel, into per-worker buffers.
+    const render_prep_task_t task = {
+        .gs = gs,
+        .rs = rs,
+        .building_count = building_count,
+        .building_ids = building_ids,
+        .static_cached = rs->static_cached,
+    };
 
-        switch (b->type) {
-            case BUILDING_TYPE_BELT: render_belt_items(rs, gs->belts + b->data_index, r); break;
+    size_t worker_count = 1;
+    if (rs->parallel_enabled && building_count >= RENDER_PARALLEL_MIN_BUILDINGS) {
+        if (!rs->workers) {
+            rs->workers = render_workers_create(render_workers_default_count());
         }
+        worker_count = rs->workers->worker_count;
+        render_workers_run(rs->workers, render_prep_task, (void *)&task);
+    } else {
+        render_prep_task((void *)&task, 0, 1);
     }
+    rs->prep_worker_count = worker_count;
+
+    for (size_t w=0; w<worker_count; w++) {
+        buffers[buffer_count++] = rs->worker_commands + w;
+    }
+
+    // This thread only issues the draws.
+    render_commands_flush(buffers, buffer_count, get_backend(rs), &rs->stats);
 }
 
+static Color lerp_color(Color a, Color b, float t) {
+    return (Color) {
+        .r = a.r + (b.r - a.r) * t,
+        .g = a.g + (b.g - a.g) * t,
+        .b = a.b + (b.b - a.b) * t,
+        .a = a.a + (b.a - a.a) * t,
+    };
+}
+
+void render_node_aggregate(render_state_t *rs, const quad_node_t *node) {
+    assert(rs);
+    assert(node);
+
+    const Color type_colors[QUAD_STATS_TYPE_COUNT] = {
+        [BUILDING_TYPE_MINER] = DARKGRAY,
+        [BUILDING_TYPE_FACTORY] = DARKBLUE,
+        [BUILDING_TYPE_BELT] = GRAY,
+    };
+
+    const quad_stats_t *stats = &node->stats;
+    const quad_aabb_t b = node->bounds;
+
+    uint32_t building_count = 0;
+    float cr = 0.0f, cg = 0.0f, cb = 0.0f;
+    for (size_t i=0; i<QUAD_STATS_TYPE_COUNT; i++) {
+        building_count += stats->type_counts[i];
+        cr += type_colors[i].r * (float)stats->type_counts[i];
+        cg += type_colors[i].g * (float)stats->type_counts[i];
+        cb += type_colors[i].b * (float)stats->type_counts[i];
+    }
+    if (!building_count) return;
+
+    const float area = (float)(b.x_max - b.x_min) * (float)(b.y_max - b.y_min);
+    float coverage = (float)stats->cell_count / area;
+    if (coverage > 1.0f) coverage = 1.0f;
+    if (coverage < 0.3f) coverage = 0.3f;
+
+    const Rectangle r = {
+        .x = b.x_min * WORLD_CELL_SIZE,
+        .y = b.y_min * WORLD_CELL_SIZE,
+        .width = (b.x_max - b.x_min) * WORLD_CELL_SIZE,
+        .height = (b.y_max - b.y_min) * WORLD_CELL_SIZE,
+    };
+    const Color type_mix = {
+        .r = cr / building_count,
+        .g = cg / building_count,
+        .b = cb / building_count,
+        .a = 255 * coverage,
+    };
+    render_commands_rect(&rs->commands, RENDER_LAYER_BASE, r, type_mix);
+
+    // Item density as the size of an inner square, activity as its color.
+    if (stats->item_count && stats->item_capacity) {
+        const float density = sqrtf((float)stats->item_count / (float)stats->item_capacity);
+        const float activity = (float)stats->active_count / (float)building_count;
+        const Rectangle ir = {
+            .x = r.x + r.width * (1.0f - density) * 0.5f,
+            .y = r.y + r.height * (1.0f - density) * 0.5f,
+            .width = r.width * density,
+            .height = r.height * density,
+        };
+        render_commands_rect(&rs->commands, RENDER_LAYER_ITEMS, ir, lerp_color(ORANGE, GREEN, activity));
+    }
+}
+
+void render_world_lod(const game_state_t *gs, render_state_t *rs,
+        size_t node_count, const quad_node_t **nodes) {
+    assert(gs);
+    assert(rs);
+
+    rs->ticks++;
+
+    render_commands_clear(&rs->commands);
+    memset(&rs->stats, 0, sizeof(render_stats_t));
+
+    for (size_t i=0; i<node_count; i++) {
+        render_node_aggregate(rs, nodes[i]);
+    }
+
+    const render_command_buffer_t *buffer = &rs->commands;
+    render_commands_sort(&rs->commands);
+    render_commands_flush(&buffer, 1, get_backend(rs), &rs->stats);
+}
@@ -1,16 +1,59 @@
 #pragma once
 
 #include "game_state.h"
+#include "render_commands.h"
+#include "render_backend.h"
+#include "render_cache.h"
+#include "render_workers.h"
 
 #define WORLD_CELL_SIZE (100.0f)
 
+#define RENDER_LOD_TIER_COUNT (4)
+
+#define RENDER_PARALLEL_MIN_BUILDINGS (2048)
+
+typedef struct {
+    float min_zoom;    // tier applies while camera zoom >= min_zoom
+    int32_t node_size; // cells per aggregated quad tree node, 1 = individual buildings
+} render_lod_tier_t;
+
 typedef struct {
     uint32_t ticks;
+
+    render_backend_t *backend; // NULL draws through raylib
+    render_command_buffer_t commands;
+    render_stats_t stats; // last frame
+
+    render_lod_tier_t lod_tiers[RENDER_LOD_TIER_COUNT]; // sorted by descending min_zoom
+
+    bool cache_enabled;
+    render_cache_t cache;
+
+    // Render prep: visible buildings are split across workers, each recording
+    // into its own buffer.
+    bool parallel_enabled;
+    render_workers_t *workers;
+    render_command_buffer_t worker_commands[RENDER_MAX_WORKERS];
+    uint8_t *static_cached; // per visible building: static geometry comes from the cache
+    size_t static_cached_capacity;
+    size_t prep_worker_count; // last frame
 } render_state_t;
 
+void init_render_state(render_state_t *rs);
+void free_render_state(render_state_t *rs);
+
+// Node size of the tier for zoom, doubled while more than max_nodes nodes of
+// that size could overlap view, so a node query of view never overflows.
+int32_t get_lod_node_size(const render_state_t *rs, float zoom, quad_aabb_t view, size_t max_nodes);
+
+// Invalidates cached geometry touched by edits on gs and clears its dirty cells.
+void render_consume_edits(render_state_t *rs, game_state_t *gs);
+
 coord_t world_position_to_coord(Vector2 world_position);
 Vector2 coord_to_world_position(coord_t coord); 
 
 void render_world(const game_state_t *gs, render_state_t *rs,
         size_t building_count, size_t *building_ids);
+void render_world_lod(const game_state_t *gs, render_state_t *rs,
+        size_t node_count, const quad_node_t **nodes);
 
@@ -0,0 +1,550 @@
+#include "shard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+#include "recipe.h"
+
+#define SHARD_MSG_TICK  (0) // coordinator: run a tick, then transfers and credits follow
+#define SHARD_MSG_DONE  (1) // worker: tick done, then transfers and credits follow
+#define SHARD_MSG_QUIT  (2) // coordinator: stop, the worker answers with a summary
+
+typedef struct {
+    uint32_t kind;
+    uint32_t transfer_count;
+    uint32_t credit_count;
+    uint32_t pad;
+    double step_ms;
+    uint64_t items;
+    uint64_t digest;
+} shard_msg_t;
+
+void shard_world_init(shard_world_t *world) {
+    assert(world);
+    memset(world, 0, sizeof(shard_world_t));
+}
+
+void shard_world_free(shard_world_t *world) {
+    assert(world);
+    free(world->buildings);
+    free(world->links);
+    memset(world, 0, sizeof(shard_world_t));
+}
+
+uint32_t shard_world_add_building(shard_world_t *world, uint32_t type, coord_t pos) {
+    assert(world);
+    assert(type < BUILDING_TYPE_COUNT);
+
+    if (world->building_count == world->building_capacity) {
+        world->building_capacity = world->building_capacity ? world->building_capacity * 2 : 1024;
+        world->buildings = realloc(world->buildings, sizeof(shard_building_t) * world->building_capacity);
+        assert(world->buildings);
+    }
+    world->buildings[world->building_count] = (shard_building_t) { type, pos };
+    return world->building_count++;
+}
+
+void shard_world_connect(shard_world_t *world, uint32_t source, uint32_t target) {
+    assert(world);
+    assert(source < world->building_count);
+    assert(target < world->building_count);
+
+    if (world->link_count == world->link_capacity) {
+        world->link_capacity = world->link_capacity ? world->link_capacity * 2 : 1024;
+        world->links = realloc(world->links, sizeof(shard_link_t) * world->link_capacity);
+        assert(world->links);
+    }
+    world->links[world->link_count++] = (shard_link_t) { source, target };
+}
+
+void shard_world_add_blueprint(shard_world_t *world, const blueprint_t *bp, const coord_t *positions, size_t n) {
+    assert(world);
+    assert(bp);
+
+    for (size_t i=0; i<n; i++) {
+        const uint32_t base = world->building_count;
+        for (size_t k=0; k<bp->building_count; k++) {
+            const blueprint_building_t *bb = bp->buildings + k;
+            const uint32_t index = shard_world_add_building(world, bb->type,
+                    (coord_t) { positions[i].x + bb->offset.x, positions[i].y + bb->offset.y });
+            world->buildings[index].recipe = bb->recipe;
+        }
+        for (size_t k=0; k<bp->building_count; k++) {
+            const uint32_t target = bp->buildings[k].target;
+            if (target != BLUEPRINT_NONE) shard_world_connect(world, base + k, base + target);
+        }
+    }
+}
+
+// -----
+
+static int compare_int32(const void *a, const void *b) {
+    const int32_t x = *(const int32_t *)a;
+    const int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+void shard_layout_balance(shard_layout_t *layout, const shard_world_t *world, size_t shard_count) {
+    assert(layout);
+    assert(world);
+    assert(shard_count >= 1 && shard_count <= SHARD_MAX_COUNT);
+
+    layout->shard_count = shard_count;
+    layout->x_splits[0] = INT32_MIN;
+    layout->x_splits[shard_count] = INT32_MAX;
+
+    const size_t n = world->building_count;
+    int32_t *xs = malloc(sizeof(int32_t) * (n + 1));
+    assert(xs);
+    for (size_t i=0; i<n; i++) xs[i] = world->buildings[i].pos.x;
+    qsort(xs, n, sizeof(int32_t), compare_int32);
+
+    for (size_t i=1; i<shard_count; i++) {
+        layout->x_splits[i] = n ? xs[n * i / shard_count] : 0;
+    }
+    free(xs);
+}
+
+uint32_t shard_of(const shard_layout_t *layout, coord_t pos) {
+    assert(layout);
+    for (size_t i=1; i<layout->shard_count; i++) {
+        if (pos.x < layout->x_splits[i]) return i - 1;
+    }
+    return layout->shard_count - 1;
+}
+
+bool shard_ports_put(shard_ports_t *ports, uint32_t port, uint8_t item) {
+    assert(ports);
+    assert(port > 0 && port < ports->port_count);
+
+    shard_port_t *p = ports->ports + port;
+    if (!p->credit) return false;
+
+    p->credit = 0;
+    ports->sent[ports->sent_count++] = (shard_transfer_t) { port, item };
+    return true;
+}
+
+// -----
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        const ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t size) {
+    uint8_t *p = data;
+    while (size > 0) {
+        const ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool send_msg(int fd, const shard_msg_t *msg, const shard_transfer_t *transfers, const uint32_t *credits) {
+    return write_all(fd, msg, sizeof(shard_msg_t)) &&
+        write_all(fd, transfers, sizeof(shard_transfer_t) * msg->transfer_count) &&
+        write_all(fd, credits, sizeof(uint32_t) * msg->credit_count);
+}
+
+// Transfers and credits must have room for one per port.
+static bool recv_msg(int fd, shard_msg_t *msg, shard_transfer_t *transfers, uint32_t *credits, size_t port_count) {
+    if (!read_all(fd, msg, sizeof(shard_msg_t))) return false;
+    if (msg->transfer_count > port_count || msg->credit_count > port_count) return false;
+    return read_all(fd, transfers, sizeof(shard_transfer_t) * msg->transfer_count) &&
+        read_all(fd, credits, sizeof(uint32_t) * msg->credit_count);
+}
+
+// -----
+
+typedef struct {
+    const shard_world_t *world;
+    const shard_layout_t *layout;
+    const uint32_t *link_ports; // port id by link, 0 for links within a shard
+    size_t port_count;          // including the unused 0
+    uint32_t shard;
+    int fd;
+} shard_worker_t;
+
+static void set_output(game_state_t *gs, handle_t source_handle, item_output_t output, uint8_t conn_dir) {
+    const building_t *source = gs->buildings + get_building_index(gs, source_handle);
+    switch (source->type) {
+        case BUILDING_TYPE_MINER:   GET_MINER(gs, source->data)->output = output; break;
+        case BUILDING_TYPE_FACTORY: GET_FACTORY(gs, source->data)->output = output; break;
+        case BUILDING_TYPE_BELT:
+            GET_BELT(gs, source->data)->output = output;
+            GET_BELT(gs, source->data)->out_dir = conn_dir;
+            break;
+    }
+}
+
+// Spawns the shard's buildings, connects them and sets up the ports of the
+// links that leave or enter the shard.
+static void build_shard(const shard_worker_t *w, game_state_t *gs, shard_ports_t *ports) {
+    const shard_world_t *world = w->world;
+
+    handle_t *handles = calloc(world->building_count, sizeof(handle_t));
+    assert(handles);
+
+    for (size_t i=0; i<world->building_count; i++) {
+        const shard_building_t *b = world->buildings + i;
+        if (shard_of(w->layout, b->pos) != w->shard) continue;
+        switch (b->type) {
+            case BUILDING_TYPE_MINER:   handles[i] = spawn_miner(gs, b->pos); break;
+            case BUILDING_TYPE_FACTORY:
+                handles[i] = spawn_factory(gs, b->pos);
+                set_factory_recipe(gs, handles[i], b->recipe);
+                break;
+            case BUILDING_TYPE_BELT:    handles[i] = spawn_belt(gs, b->pos); break;
+        }
+    }
+
+    for (size_t l=0; l<world->link_count; l++) {
+        const shard_link_t *link = world->links + l;
+        const handle_t source = handles[link->source];
+        const handle_t target = handles[link->target];
+        const uint32_t port = w->link_ports[l];
+
+        if (!port) {
+            if (!handle_is_none(source)) connect_buildings(gs, source, target);
+            continue;
+        }
+        if (handle_is_none(source) && handle_is_none(target)) continue;
+
+        // Same check as connect_buildings(), done alike on both sides.
+        const shard_building_t *s = world->buildings + link->source;
+        const shard_building_t *t = world->buildings + link->target;
+        const building_t source_building = { .pos = s->pos, .size = get_building_size(s->type) };
+        const building_t target_building = { .pos = t->pos, .size = get_building_size(t->type) };
+        uint8_t conn_dir = 0;
+        if (!buildings_adjacent(&source_building, &target_building, &conn_dir)) {
+            printf("can't connect buildings %u %u\n", link->source, link->target);
+            continue;
+        }
+
+        if (!handle_is_none(source)) {
+            set_output(gs, source, (item_output_t) { .type = ITEM_OUTPUT_PORT, .handle = { port, 1 } }, conn_dir);
+            ports->ports[port].credit = 1;
+        } else {
+            const building_t *b = gs->buildings + get_building_index(gs, target);
+            ports->ports[port].target = (item_output_t) { .type = b->type, .handle = b->data };
+            if (b->type == BUILDING_TYPE_BELT) GET_BELT(gs, b->data)->in_dir = conn_dir;
+            ports->inbound[ports->inbound_count++] = port;
+        }
+    }
+
+    mark_all_dirty(gs);
+    free(handles);
+}
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+    const uint8_t *p = data;
+    for (size_t i=0; i<size; i++) {
+        h = (h ^ p[i]) * 1099511628211ull; // FNV-1a
+    }
+    return h;
+}
+
+// Items held and a digest of the simulated fields, for the final summary.
+// The digest sums per entity hashes, so it doesn't depend on dense order and
+// shards that never transfer anything add up to the single process digest.
+static void summarize_shard(const game_state_t *gs, const shard_ports_t *ports, shard_msg_t *msg) {
+    const uint64_t seed = 14695981039346656037ull;
+    uint64_t items = 0;
+    uint64_t digest = 0;
+
+    for (size_t i=1; i<gs->miner_count; i++) {
+        const miner_t *m = gs->miners + i;
+        uint64_t h = hash_bytes(seed, &m->work, sizeof(m->work));
+        h = hash_bytes(h, &m->state, sizeof(m->state));
+        digest += hash_bytes(h, &m->next_item, sizeof(m->next_item));
+    }
+    for (size_t i=1; i<gs->factory_count; i++) {
+        const factory_t *f = gs->factories + i;
+        items += recipe_count_sum(f->counts) + (f->state == FACTORY_STATE_UNLOAD ? f->pending : 0);
+        uint64_t h = hash_bytes(seed + 1, &f->work, sizeof(f->work));
+        h = hash_bytes(h, &f->state, sizeof(f->state));
+        h = hash_bytes(h, &f->pending, sizeof(f->pending));
+        digest += hash_bytes(h, &f->counts, sizeof(f->counts));
+    }
+    for (size_t i=1; i<gs->belt_count; i++) {
+        const belt_t *b = gs->belts + i;
+        for (size_t k=0; k<BELT_ITEM_COUNT; k++) items += b->items[k] != 0;
+        const uint64_t h = hash_bytes(seed + 2, b->items, sizeof(b->items));
+        digest += hash_bytes(h, b->works, sizeof(b->works));
+    }
+    for (size_t i=0; i<ports->inbound_count; i++) {
+        const shard_port_t *p = ports->ports + ports->inbound[i];
+        items += p->item != 0;
+    }
+
+    msg->items = items;
+    msg->digest = digest;
+}
+
+static void run_worker(const shard_worker_t *w) {
+    game_state_t *active_gs = create_game_state();
+    game_state_t *next_gs = create_game_state();
+
+    shard_ports_t ports = {
+        .port_count = w->port_count,
+        .ports = calloc(w->port_count, sizeof(shard_port_t)),
+        .inbound = malloc(sizeof(uint32_t) * w->port_count),
+        .sent = malloc(sizeof(shard_transfer_t) * w->port_count),
+        .credits = malloc(sizeof(uint32_t) * w->port_count),
+    };
+    assert(ports.ports && ports.inbound && ports.sent && ports.credits);
+
+    build_shard(w, active_gs, &ports);
+    active_gs->ports = &ports;
+
+    shard_transfer_t *transfers = malloc(sizeof(shard_transfer_t) * w->port_count);
+    uint32_t *credits = malloc(sizeof(uint32_t) * w->port_count);
+    assert(transfers && credits);
+
+    for (;;) {
+        shard_msg_t msg;
+        if (!recv_msg(w->fd, &msg, transfers, credits, w->port_count)) {
+            printf("shard %u: lost the coordinator\n", w->shard);
+            break;
+        }
+
+        if (msg.kind == SHARD_MSG_QUIT) {
+            shard_msg_t summary = { .kind = SHARD_MSG_DONE };
+            summarize_shard(active_gs, &ports, &summary);
+            send_msg(w->fd, &summary, NULL, NULL);
+            break;
+        }
+
+        for (size_t i=0; i<msg.transfer_count; i++) {
+            shard_port_t *p = ports.ports + transfers[i].port;
+            assert(p->item == 0);
+            p->item = transfers[i].item;
+        }
+        for (size_t i=0; i<msg.credit_count; i++) {
+            ports.ports[credits[i]].credit = 1;
+        }
+
+        // Hand over what arrived, before the tick like a put from the last one.
+        ports.sent_count = 0;
+        ports.credit_count = 0;
+        for (size_t i=0; i<ports.inbound_count; i++) {
+            shard_port_t *p = ports.ports + ports.inbound[i];
+            if (p->item && try_put_item(active_gs, p->target, p->item)) {
+                p->item = 0;
+                ports.credits[ports.credit_count++] = ports.inbound[i];
+            }
+        }
+
+        const double start = get_time_ms();
+        update_game_state(active_gs, next_gs);
+        game_state_t *temp = active_gs;
+        active_gs = next_gs;
+        next_gs = temp;
+
+        const shard_msg_t done = {
+            .kind = SHARD_MSG_DONE,
+            .transfer_count = ports.sent_count,
+            .credit_count = ports.credit_count,
+            .step_ms = get_time_ms() - start,
+        };
+        if (!send_msg(w->fd, &done, ports.sent, ports.credits)) {
+            printf("shard %u: lost the coordinator\n", w->shard);
+            break;
+        }
+    }
+
+    free(transfers);
+    free(credits);
+    free(ports.ports);
+    free(ports.inbound);
+    free(ports.sent);
+    free(ports.credits);
+    destroy_game_state(active_gs);
+    destroy_game_state(next_gs);
+}
+
+// -----
+
+typedef struct {
+    size_t transfer_count;
+    shard_transfer_t *transfers;
+    size_t credit_count;
+    uint32_t *credits;
+} shard_inbox_t;
+
+bool shard_run(const shard_world_t *world, size_t shard_count, uint64_t ticks, shard_stats_t *stats) {
+    assert(world);
+    assert(stats);
+    assert(shard_count >= 1 && shard_count <= SHARD_MAX_COUNT);
+
+    shard_layout_t layout;
+    shard_layout_balance(&layout, world, shard_count);
+
+    // A port for every link between two shards, and where its ends are.
+    uint32_t *link_ports = calloc(world->link_count + 1, sizeof(uint32_t));
+    uint8_t *port_sources = malloc(world->link_count + 1);
+    uint8_t *port_targets = malloc(world->link_count + 1);
+    assert(link_ports && port_sources && port_targets);
+
+    size_t port_count = 1;
+    for (size_t l=0; l<world->link_count; l++) {
+        const uint32_t source = shard_of(&layout, world->buildings[world->links[l].source].pos);
+        const uint32_t target = shard_of(&layout, world->buildings[world->links[l].target].pos);
+        if (source == target) continue;
+        port_sources[port_count] = source;
+        port_targets[port_count] = target;
+        link_ports[l] = port_count++;
+    }
+
+    int fds[SHARD_MAX_COUNT];
+    pid_t pids[SHARD_MAX_COUNT];
+    size_t started = 0;
+    bool ok = true;
+
+    // Workers are forked, so they share the world description copy-on-write.
+    fflush(stdout);
+    for (; started<shard_count; started++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+            perror("socketpair");
+            ok = false;
+            break;
+        }
+
+        const pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            close(pair[0]);
+            close(pair[1]);
+            ok = false;
+            break;
+        }
+
+        if (pid == 0) {
+            // Whole lines, so the output of the workers doesn't interleave mid-line.
+            setvbuf(stdout, NULL, _IOLBF, 0);
+            close(pair[0]);
+            for (size_t i=0; i<started; i++) close(fds[i]);
+
+            const shard_worker_t worker = {
+                .world = world,
+                .layout = &layout,
+                .link_ports = link_ports,
+                .port_count = port_count,
+                .shard = started,
+                .fd = pair[1],
+            };
+            run_worker(&worker);
+            fflush(stdout);
+            _exit(0);
+        }
+
+        close(pair[1]);
+        fds[started] = pair[0];
+        pids[started] = pid;
+    }
+
+    shard_inbox_t inboxes[SHARD_MAX_COUNT] = {};
+    for (size_t s=0; s<shard_count; s++) {
+        inboxes[s].transfers = malloc(sizeof(shard_transfer_t) * port_count);
+        inboxes[s].credits = malloc(sizeof(uint32_t) * port_count);
+        assert(inboxes[s].transfers && inboxes[s].credits);
+    }
+    shard_transfer_t *transfers = malloc(sizeof(shard_transfer_t) * port_count);
+    uint32_t *credits = malloc(sizeof(uint32_t) * port_count);
+    assert(transfers && credits);
+
+    memset(stats, 0, sizeof(shard_stats_t));
+    const double start = get_time_ms();
+    uint64_t tick = 0;
+    size_t transfer_total = 0;
+    double max_step_total = 0.0;
+
+    for (; ok && tick<ticks; tick++) {
+        for (size_t s=0; ok && s<shard_count; s++) {
+            const shard_msg_t msg = {
+                .kind = SHARD_MSG_TICK,
+                .transfer_count = inboxes[s].transfer_count,
+                .credit_count = inboxes[s].credit_count,
+            };
+            ok = send_msg(fds[s], &msg, inboxes[s].transfers, inboxes[s].credits);
+            inboxes[s].transfer_count = 0;
+            inboxes[s].credit_count = 0;
+        }
+
+        // Lockstep: the tick ends when every shard is done with it.
+        double max_step_ms = 0.0;
+        for (size_t s=0; ok && s<shard_count; s++) {
+            shard_msg_t msg;
+            ok = recv_msg(fds[s], &msg, transfers, credits, port_count) && msg.kind == SHARD_MSG_DONE;
+            if (!ok) break;
+
+            if (msg.step_ms > max_step_ms) max_step_ms = msg.step_ms;
+            for (size_t i=0; i<msg.transfer_count; i++) {
+                shard_inbox_t *inbox = inboxes + port_targets[transfers[i].port];
+                inbox->transfers[inbox->transfer_count++] = transfers[i];
+            }
+            for (size_t i=0; i<msg.credit_count; i++) {
+                shard_inbox_t *inbox = inboxes + port_sources[credits[i]];
+                inbox->credits[inbox->credit_count++] = credits[i];
+            }
+            transfer_total += msg.transfer_count;
+        }
+        max_step_total += max_step_ms;
+    }
+
+    if (ok && tick > 0) {
+        stats->ms_per_tick = (get_time_ms() - start) / tick;
+        stats->max_step_ms = max_step_total / tick;
+        stats->transfers_per_tick = (double)transfer_total / tick;
+    }
+
+    // Transfers still in the inboxes are lost with the workers, count them.
+    for (size_t s=0; s<shard_count; s++) stats->items += inboxes[s].transfer_count;
+
+    for (size_t s=0; s<started; s++) {
+        const shard_msg_t quit = { .kind = SHARD_MSG_QUIT };
+        shard_msg_t summary;
+        if (ok && send_msg(fds[s], &quit, NULL, NULL) && recv_msg(fds[s], &summary, NULL, NULL, 0)) {
+            stats->items += summary.items;
+            stats->digest += summary.digest;
+        } else {
+            ok = false;
+        }
+        close(fds[s]);
+    }
+    for (size_t s=0; s<started; s++) {
+        waitpid(pids[s], NULL, 0);
+    }
+
+    if (!ok) printf("sharded run failed after %lu ticks\n", tick);
+
+    for (size_t s=0; s<shard_count; s++) {
+        free(inboxes[s].transfers);
+        free(inboxes[s].credits);
+    }
+    free(transfers);
+    free(credits);
+    free(link_ports);
+    free(port_sources);
+    free(port_targets);
+    return ok;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "game_state.h"
+#include "blueprint.h"
+
+// Sharded simulation: the world is split into strips by x, each simulated by
+// a worker process with its own pair of game states. A link whose target is
+// in another strip becomes a pair of ports with the same id:
+//
+// - the source's output is an outbound port (ITEM_OUTPUT_PORT), it takes an
+//   item when it holds the port's credit and sends it at the end of the tick,
+// - the target's shard holds the item in the inbound port and hands it to
+//   the target at the start of the next tick, then returns the credit.
+//
+// With a single credit per port a transfer never waits for room on the far
+// side. An item crossing a boundary arrives a tick later than over a local
+// link and a port carries at most one item per two ticks, so a sharded run
+// drifts from a single process run wherever items cross.
+//
+// A coordinator keeps the workers in lockstep over Unix sockets: each tick
+// it sends every worker the transfers and credits addressed to it, waits for
+// all of them to finish the tick and routes what they sent.
+
+#define SHARD_MAX_COUNT  (16)
+
+// The world as a list of buildings and links, the same for all processes.
+typedef struct {
+    uint32_t type;
+    coord_t pos;
+    uint32_t recipe; // for factories
+} shard_building_t;
+
+typedef struct {
+    uint32_t source; // building indices
+    uint32_t target;
+} shard_link_t;
+
+typedef struct {
+    size_t building_count;
+    size_t building_capacity;
+    shard_building_t *buildings;
+
+    size_t link_count;
+    size_t link_capacity;
+    shard_link_t *links;
+} shard_world_t;
+
+void shard_world_init(shard_world_t *world);
+void shard_world_free(shard_world_t *world);
+
+uint32_t shard_world_add_building(shard_world_t *world, uint32_t type, coord_t pos);
+void shard_world_connect(shard_world_t *world, uint32_t source, uint32_t target);
+// n copies, like stamp_blueprint().
+void shard_world_add_blueprint(shard_world_t *world, const blueprint_t *bp, const coord_t *positions, size_t n);
+
+// Strips by building origin, shard i owns x_splits[i] <= x < x_splits[i+1].
+typedef struct {
+    size_t shard_count;
+    int32_t x_splits[SHARD_MAX_COUNT + 1];
+} shard_layout_t;
+
+// Splits so that every shard gets about the same number of buildings.
+void shard_layout_balance(shard_layout_t *layout, const shard_world_t *world, size_t shard_count);
+uint32_t shard_of(const shard_layout_t *layout, coord_t pos);
+
+typedef struct {
+    uint32_t port;
+    uint32_t item;
+} shard_transfer_t;
+
+// Ports of one worker, by port id (0 is unused).
+typedef struct {
+    uint8_t item;           // inbound: waiting for the target
+    uint8_t credit;         // outbound: may take an item
+    item_output_t target;   // inbound
+} shard_port_t;
+
+typedef struct shard_ports {
+    size_t port_count;
+    shard_port_t *ports;
+
+    size_t inbound_count;
+    uint32_t *inbound;      // port ids
+
+    // Filled during the tick, sent at its end.
+    size_t sent_count;
+    shard_transfer_t *sent;
+    size_t credit_count;
+    uint32_t *credits;
+} shard_ports_t;
+
+// try_put_item() for ITEM_OUTPUT_PORT outputs.
+bool shard_ports_put(shard_ports_t *ports, uint32_t port, uint8_t item);
+
+typedef struct {
+    double ms_per_tick;
+    double max_step_ms;     // slowest worker, averaged over ticks
+    double transfers_per_tick;
+    uint64_t items;         // held by all shards at the end
+    uint64_t digest;        // of the final states, independent of entity order
+} shard_stats_t;
+
+// Forks one worker per shard and runs them ticks ticks in lockstep.
+bool shard_run(const shard_world_t *world, size_t shard_count, uint64_t ticks, shard_stats_t *stats);
@@ -0,0 +1,152 @@
+#include "transfer_queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "utils.h"
+#include "game_state.h"
+
+#define RADIX_BITS        (10)
+#define RADIX_BUCKETS     (1 << RADIX_BITS)
+#define INSERTION_SORT_MAX (32)
+
+_Static_assert(MAX_ENTITY_COUNT <= (1 << (2 * RADIX_BITS)), "two radix passes cover every index");
+
+void transfer_queue_init(transfer_queue_t *q) {
+    assert(q);
+    memset(q, 0, sizeof(transfer_queue_t));
+}
+
+void transfer_queue_free(transfer_queue_t *q) {
+    assert(q);
+    for (size_t type=0; type<TRANSFER_TARGET_TYPES; type++) {
+        free(q->lists[type].transfers);
+        free(q->lists[type].order);
+        free(q->lists[type].scratch);
+    }
+    memset(q, 0, sizeof(transfer_queue_t));
+}
+
+void transfer_queue_reset_stats(transfer_queue_t *q) {
+    assert(q);
+    memset(&q->stats, 0, sizeof(transfer_stats_t));
+}
+
+void transfer_queue_push(transfer_queue_t *q, uint8_t target_type, uint32_t target, uint8_t item,
+        uint8_t source_type, uint32_t source) {
+    assert(q);
+    assert(target_type < TRANSFER_TARGET_TYPES);
+
+    transfer_list_t *list = q->lists + target_type;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->transfers = realloc(list->transfers, sizeof(transfer_t) * list->capacity);
+        list->order = realloc(list->order, sizeof(uint32_t) * list->capacity);
+        list->scratch = realloc(list->scratch, sizeof(uint32_t) * list->capacity);
+        assert(list->transfers);
+        assert(list->order);
+        assert(list->scratch);
+    }
+    if (list->count && target < list->transfers[list->count - 1].target) list->unsorted = true;
+    list->transfers[list->count++] = (transfer_t) {
+        .target = target,
+        .source = source,
+        .source_type = source_type,
+        .item = item,
+    };
+}
+
+// Fills list->order with the push indices, stably sorted by target.
+static void sort_list(transfer_list_t *list) {
+    const transfer_t *transfers = list->transfers;
+    uint32_t *order = list->order;
+    const size_t count = list->count;
+
+    if (count <= INSERTION_SORT_MAX) {
+        for (size_t i=0; i<count; i++) {
+            size_t j = i;
+            while (j > 0 && transfers[order[j - 1]].target > transfers[i].target) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+        return;
+    }
+
+    // LSD radix sort, low digit into scratch, high digit back into order.
+    uint32_t offsets[RADIX_BUCKETS];
+    uint32_t *from = NULL;
+    uint32_t *to = list->scratch;
+    for (size_t pass=0; pass<2; pass++) {
+        const uint32_t shift = pass * RADIX_BITS;
+        memset(offsets, 0, sizeof(offsets));
+        for (size_t i=0; i<count; i++) {
+            const uint32_t t = from ? from[i] : i;
+            offsets[(transfers[t].target >> shift) & (RADIX_BUCKETS - 1)]++;
+        }
+        uint32_t sum = 0;
+        for (size_t b=0; b<RADIX_BUCKETS; b++) {
+            const uint32_t n = offsets[b];
+            offsets[b] = sum;
+            sum += n;
+        }
+        for (size_t i=0; i<count; i++) {
+            const uint32_t t = from ? from[i] : i;
+            to[offsets[(transfers[t].target >> shift) & (RADIX_BUCKETS - 1)]++] = t;
+        }
+        from = to;
+        to = order;
+    }
+}
+
+bool transfer_queue_apply(transfer_queue_t *q, game_state_t *gs) {
+    assert(q);
+    assert(gs);
+
+    size_t pushed = 0;
+    for (size_t type=0; type<TRANSFER_TARGET_TYPES; type++) pushed += q->lists[type].count;
+    if (!pushed) return false;
+
+    const double start = get_time_ms();
+
+    // Deliver in target order. Ports aren't in the state, they keep push order.
+    for (size_t type=0; type<TRANSFER_TARGET_TYPES; type++) {
+        transfer_list_t *list = q->lists + type;
+        if (!list->count) continue;
+
+        // Sources next to each other mostly feed targets next to each other.
+        if (type == ITEM_OUTPUT_PORT || !list->unsorted) {
+            for (size_t i=0; i<list->count; i++) list->order[i] = i;
+        } else {
+            sort_list(list);
+        }
+        for (size_t i=0; i<list->count; i++) {
+            transfer_t *t = list->transfers + list->order[i];
+            t->accepted = put_item_at(gs, type, t->target, t->item);
+        }
+    }
+
+    // Finish the unloads in source order, after all deliveries so that a
+    // belt moving on doesn't free room a later delivery would see.
+    size_t accepted = 0;
+    for (size_t type=0; type<TRANSFER_TARGET_TYPES; type++) {
+        transfer_list_t *list = q->lists + type;
+        for (size_t i=0; i<list->count; i++) {
+            const transfer_t *t = list->transfers + i;
+            if (!t->accepted) continue;
+            finish_unload(gs, t->source_type, t->source);
+            accepted++;
+        }
+        list->count = 0;
+        list->unsorted = false;
+    }
+
+    q->stats.pushed += pushed;
+    q->stats.accepted += accepted;
+    q->stats.applies++;
+    q->stats.apply_ms += get_time_ms() - start;
+    return accepted > 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct game_state;
+
+// Batched item transfers for step 3. Without it, every unload writes into
+// its target belt or factory right away, a random write in the middle of
+// the sweep. With a queue set on the game state (game_state_t.transfers):
+//
+// - the sweep only appends (target, item, source) records, one list per
+//   target type, and leaves the source waiting to unload,
+// - transfer_queue_apply() sorts each list by target index (stable radix
+//   sort) and offers the items in memory order, then finishes the unloads
+//   of the accepted records in source order.
+//
+// Targets see the state after the whole sweep instead of whatever part of
+// it ran before the source, so the outcome no longer depends on the update
+// order. Items competing for the same target are offered in push order:
+// miners, factories, then belts, each by index. Belts that got to unload
+// advance their items again after the unload, so a belt still moves as far
+// per tick as with direct writes.
+
+#define TRANSFER_TARGET_TYPES (4) // by item_output_t.type, miners take nothing
+
+typedef struct {
+    uint32_t target;      // index into the target's array, port id for ports
+    uint32_t source;      // index into the source's array
+    uint8_t source_type;  // BUILDING_TYPE_*
+    uint8_t item;
+    uint8_t accepted;
+} transfer_t;
+
+typedef struct {
+    size_t capacity;
+    size_t count;
+    transfer_t *transfers; // in push order
+    uint32_t *order;       // sorted by target
+    uint32_t *scratch;
+    bool unsorted;         // a push went below the previous target
+} transfer_list_t;
+
+typedef struct {
+    size_t pushed;
+    size_t accepted;
+    size_t applies;
+    double apply_ms;
+} transfer_stats_t;
+
+typedef struct transfer_queue {
+    transfer_list_t lists[TRANSFER_TARGET_TYPES];
+    transfer_stats_t stats; // since the last transfer_queue_reset_stats()
+} transfer_queue_t;
+
+void transfer_queue_init(transfer_queue_t *q);
+void transfer_queue_free(transfer_queue_t *q);
+void transfer_queue_reset_stats(transfer_queue_t *q);
+
+void transfer_queue_push(transfer_queue_t *q, uint8_t target_type, uint32_t target, uint8_t item,
+        uint8_t source_type, uint32_t source);
+// Delivers and empties the queue, true if any item moved.
+bool transfer_queue_apply(transfer_queue_t *q, struct game_state *gs);
@@ -0,0 +1,147 @@
+#include "visible_set.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+// Cells an item can occupy to be part of a query result for some bounds,
+// see quad_tree_query(): the item's cell [pos, pos+1] touches the bounds.
+typedef struct {
+    int32_t x_min;
+    int32_t y_min;
+    int32_t x_max;
+    int32_t y_max;
+} cell_range_t;
+
+static cell_range_t get_cell_range(quad_aabb_t bounds) {
+    return (cell_range_t) {
+        bounds.x_min - 1, bounds.y_min - 1,
+        bounds.x_max, bounds.y_max,
+    };
+}
+
+static bool cell_range_contains(cell_range_t r, coord_t pos) {
+    return r.x_min <= pos.x && pos.x <= r.x_max &&
+           r.y_min <= pos.y && pos.y <= r.y_max;
+}
+
+static bool cell_ranges_overlap(cell_range_t a, cell_range_t b) {
+    return a.x_min <= b.x_max && b.x_min <= a.x_max &&
+           a.y_min <= b.y_max && b.y_min <= a.y_max;
+}
+
+static void query_cell_range(visible_set_t *vs, const game_state_t *gs, cell_range_t r) {
+    assert(vs);
+    assert(gs);
+
+    if (r.x_min > r.x_max || r.y_min > r.y_max) return;
+
+    // Query into the free tail of the item array, then keep exactly the items
+    // of the range: strips must not overlap or items would show up twice.
+    // A full tail may have cut the result short, grow it and query again.
+    quad_tree_query_result_t result;
+    while (true) {
+        result = (quad_tree_query_result_t) {
+            .capacity = vs->capacity - vs->count,
+            .count = 0,
+            .items = vs->items + vs->count,
+        };
+        query_buildings(gs, (quad_aabb_t) { r.x_min, r.y_min, r.x_max, r.y_max }, &result);
+        if (result.count < result.capacity) break;
+
+        vs->capacity = vs->capacity ? vs->capacity * 2 : 1024;
+        vs->items = realloc(vs->items, sizeof(size_t) * vs->capacity);
+        assert(vs->items);
+    }
+
+    size_t kept = 0;
+    for (size_t i=0; i<result.count; i++) {
+        const size_t id = result.items[i];
+        if (cell_range_contains(r, gs->buildings[id].pos)) {
+            result.items[kept++] = id;
+        }
+    }
+
+    vs->count += kept;
+    vs->added += kept;
+    vs->strips++;
+}
+
+void visible_set_init(visible_set_t *vs, size_t capacity) {
+    assert(vs);
+    memset(vs, 0, sizeof(visible_set_t));
+
+    vs->capacity = capacity;
+    vs->items = malloc(sizeof(size_t) * capacity);
+    assert(vs->items);
+}
+
+void visible_set_free(visible_set_t *vs) {
+    assert(vs);
+    free(vs->items);
+    memset(vs, 0, sizeof(visible_set_t));
+}
+
+void visible_set_invalidate(visible_set_t *vs) {
+    assert(vs);
+    vs->valid = false;
+}
+
+void visible_set_update(visible_set_t *vs, const game_state_t *gs, quad_aabb_t bounds) {
+    assert(vs);
+    assert(gs);
+
+    vs->strips = 0;
+    vs->added = 0;
+    vs->dropped = 0;
+
+    // Ids are only stable while the index is built from the same edits:
+    // compaction renumbers buildings after deletions.
+    const bool same_world = vs->valid &&
+        vs->index_version == gs->index_version &&
+        vs->spatial_index == gs->spatial_index;
+
+    const cell_range_t old_r = get_cell_range(vs->bounds);
+    const cell_range_t new_r = get_cell_range(bounds);
+
+    if (same_world && memcmp(&vs->bounds, &bounds, sizeof(quad_aabb_t)) == 0) {
+        vs->last_update = VISIBLE_SET_REUSED;
+        return;
+    }
+
+    if (!same_world || !cell_ranges_overlap(old_r, new_r)) {
+        vs->count = 0;
+        query_cell_range(vs, gs, new_r);
+        vs->last_update = VISIBLE_SET_FULL;
+    } else {
+        // Drop what scrolled out.
+        size_t kept = 0;
+        for (size_t i=0; i<vs->count; i++) {
+            const size_t id = vs->items[i];
+            if (cell_range_contains(new_r, gs->buildings[id].pos)) {
+                vs->items[kept++] = id;
+            }
+        }
+        vs->dropped = vs->count - kept;
+        vs->count = kept;
+
+        // Add the newly exposed strips: full-height columns left/right of the
+        // old range, rows above/below it within the old columns.
+        const int32_t mid_x_min = (new_r.x_min > old_r.x_min) ? new_r.x_min : old_r.x_min;
+        const int32_t mid_x_max = (new_r.x_max < old_r.x_max) ? new_r.x_max : old_r.x_max;
+
+        query_cell_range(vs, gs, (cell_range_t) { new_r.x_min, new_r.y_min, old_r.x_min - 1, new_r.y_max });
+        query_cell_range(vs, gs, (cell_range_t) { old_r.x_max + 1, new_r.y_min, new_r.x_max, new_r.y_max });
+        query_cell_range(vs, gs, (cell_range_t) { mid_x_min, new_r.y_min, mid_x_max, old_r.y_min - 1 });
+        query_cell_range(vs, gs, (cell_range_t) { mid_x_min, old_r.y_max + 1, mid_x_max, new_r.y_max });
+
+        vs->last_update = VISIBLE_SET_INCREMENTAL;
+    }
+
+    vs->valid = true;
+    vs->bounds = bounds;
+    vs->index_version = gs->index_version;
+    vs->spatial_index = gs->spatial_index;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "game_state.h"
+
+// Keeps the result of the viewport query across frames. A static camera
+// reuses it as is, a moving camera only queries the strips that became
+// visible and drops what left the view. Any change to the spatial index
+// (edits applied by a tick, backend switch) forces a full query. The item
+// array starts at the given capacity and grows when a query fills it.
+
+#define VISIBLE_SET_REUSED       (0)
+#define VISIBLE_SET_INCREMENTAL  (1)
+#define VISIBLE_SET_FULL         (2)
+
+typedef struct {
+    bool valid;
+    quad_aabb_t bounds;
+    uint64_t index_version;
+    uint32_t spatial_index;
+
+    size_t capacity;
+    size_t count;
+    size_t *items;
+
+    // stats, last update
+    uint32_t last_update;
+    size_t strips;
+    size_t added;
+    size_t dropped;
+} visible_set_t;
+
+void visible_set_init(visible_set_t *vs, size_t capacity);
+void visible_set_free(visible_set_t *vs);
+
+void visible_set_invalidate(visible_set_t *vs);
+void visible_set_update(visible_set_t *vs, const game_state_t *gs, quad_aabb_t bounds);
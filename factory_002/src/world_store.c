@@ -0,0 +1,853 @@
+#include "world_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+
+#define WORLD_MAGIC          (0x4b484346) // "FCHK"
+#define WORLD_VERSION        (1)
+#define WORLD_PATH_SIZE      (4096)
+#define WORLD_MAX_CANDIDATES (256)
+
+#define WORLD_TARGET_NONE    (UINT32_MAX)
+#define WORLD_TARGET_REMOTE  (UINT32_MAX - 1) // in another chunk, at target_pos
+
+#define WORLD_CHUNK_UNMERGED (64)  // chunk flag, merge_adopted() failed and said so
+#define WORLD_CHUNK_EVICTING (128) // chunk flag during evict_chunks()
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk;
+    uint32_t record_count;
+    uint64_t tick;        // when written, for inspection
+} world_chunk_header_t;
+
+// A building with the state of its entity.
+typedef struct {
+    uint8_t type;
+    uint8_t state;        // miners, factories
+    uint8_t next_item;    // miners
+    uint8_t pending;      // factories
+    uint8_t in_dir;       // belts
+    uint8_t out_dir;
+    uint8_t items[BELT_ITEM_COUNT];
+    uint8_t works[BELT_ITEM_COUNT];
+    uint32_t work;
+    uint32_t recipe;
+    uint32_t counts;
+    uint32_t target;      // record index, WORLD_TARGET_*
+    coord_t pos;
+    coord_t target_pos;
+} world_record_t;
+
+// Chunk coordinates of a rectangle of cells, inclusive.
+typedef struct {
+    int32_t x_min;
+    int32_t y_min;
+    int32_t x_max;
+    int32_t y_max;
+} chunk_rect_t;
+
+static int32_t chunk_coord(int32_t v) {
+    const int32_t c = (int32_t)(((int64_t)v + (WORLD_GRID / 2) * WORLD_CHUNK_SIZE) >> WORLD_CHUNK_SHIFT);
+    return (c < 0) ? 0 : (c >= WORLD_GRID) ? WORLD_GRID - 1 : c;
+}
+
+static uint32_t chunk_of(coord_t pos) {
+    return chunk_coord(pos.y) * WORLD_GRID + chunk_coord(pos.x);
+}
+
+static chunk_rect_t chunk_rect(quad_aabb_t cells) {
+    return (chunk_rect_t) {
+        chunk_coord(cells.x_min), chunk_coord(cells.y_min),
+        chunk_coord(cells.x_max), chunk_coord(cells.y_max),
+    };
+}
+
+static bool rect_contains(chunk_rect_t r, uint32_t chunk) {
+    const int32_t x = chunk % WORLD_GRID;
+    const int32_t y = chunk / WORLD_GRID;
+    return r.x_min <= x && x <= r.x_max && r.y_min <= y && y <= r.y_max;
+}
+
+static void chunk_path(const world_store_t *store, uint32_t chunk, const char *suffix, char *path) {
+    snprintf(path, WORLD_PATH_SIZE, "%s/c_%u_%u.chunk%s", store->path, chunk % WORLD_GRID, chunk / WORLD_GRID, suffix);
+}
+
+static uint64_t hash_bytes(const void *data, size_t size) {
+    const uint8_t *p = data;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i=0; i<size; i++) {
+        h = (h ^ p[i]) * 1099511628211ull; // FNV-1a
+    }
+    return h;
+}
+
+// Of the records of a chunk file, the header's tick changes on every write.
+static uint64_t records_digest(const void *data, size_t size) {
+    assert(size >= sizeof(world_chunk_header_t));
+    return hash_bytes((const uint8_t *)data + sizeof(world_chunk_header_t), size - sizeof(world_chunk_header_t));
+}
+
+// -----
+
+bool world_store_open(world_store_t *store, const char *path) {
+    assert(store);
+    assert(path);
+    memset(store, 0, sizeof(world_store_t));
+
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        printf("world: can't create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) {
+        printf("world: can't open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    store->path = strdup(path);
+    store->max_resident_buildings = MAX_ENTITY_COUNT / 2;
+    store->chunk_flags = calloc(WORLD_CHUNK_COUNT, sizeof(uint8_t));
+    store->chunk_resident = calloc(WORLD_CHUNK_COUNT, sizeof(uint32_t));
+    assert(store->path && store->chunk_flags && store->chunk_resident);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        uint32_t x, y;
+        char end;
+        if (sscanf(entry->d_name, "c_%u_%u.chunk%c", &x, &y, &end) == 2 && x < WORLD_GRID && y < WORLD_GRID) {
+            store->chunk_flags[y * WORLD_GRID + x] |= WORLD_CHUNK_ON_DISK;
+            store->opened_chunks++;
+        }
+    }
+    closedir(dir);
+
+    printf("world: %s, %lu chunks on disk\n", path, store->opened_chunks);
+    return true;
+}
+
+// Drops a prefetch mapping from the list, the caller unmaps it.
+static world_mapping_t take_mapping(world_store_t *store, size_t index) {
+    assert(index < store->mapping_count);
+    const world_mapping_t m = store->mappings[index];
+    store->chunk_flags[m.chunk] &= ~WORLD_CHUNK_MAPPED;
+    store->mappings[index] = store->mappings[--store->mapping_count];
+    return m;
+}
+
+static void unmap_chunk(world_store_t *store, size_t index) {
+    const world_mapping_t m = take_mapping(store, index);
+    munmap(m.data, m.size);
+}
+
+void world_store_close(world_store_t *store) {
+    assert(store);
+    while (store->mapping_count) unmap_chunk(store, store->mapping_count - 1);
+    for (size_t i=0; i<store->resident_count; i++) free(store->resident[i].buildings);
+    free(store->resident);
+    free(store->links);
+    free(store->slot_records);
+    free(store->buffer);
+    free(store->chunk_flags);
+    free(store->chunk_resident);
+    free(store->path);
+    memset(store, 0, sizeof(world_store_t));
+}
+
+// -----
+
+static world_chunk_t *get_resident(world_store_t *store, uint32_t chunk) {
+    const uint32_t i = store->chunk_resident[chunk];
+    return i ? store->resident + i - 1 : NULL;
+}
+
+static world_chunk_t *make_resident(world_store_t *store, uint32_t chunk) {
+    world_chunk_t *c = get_resident(store, chunk);
+    if (c) return c;
+
+    if (store->resident_count == store->resident_capacity) {
+        store->resident_capacity = store->resident_capacity ? store->resident_capacity * 2 : 64;
+        store->resident = realloc(store->resident, sizeof(world_chunk_t) * store->resident_capacity);
+        assert(store->resident);
+    }
+    c = store->resident + store->resident_count++;
+    memset(c, 0, sizeof(world_chunk_t));
+    c->chunk = chunk;
+    store->chunk_resident[chunk] = store->resident_count;
+    store->chunk_flags[chunk] |= WORLD_CHUNK_RESIDENT;
+    return c;
+}
+
+static void drop_resident(world_store_t *store, uint32_t chunk) {
+    const uint32_t i = store->chunk_resident[chunk];
+    assert(i);
+    store->resident_buildings -= store->resident[i - 1].building_count;
+    free(store->resident[i - 1].buildings);
+    store->resident[i - 1] = store->resident[--store->resident_count];
+    if (i - 1 < store->resident_count) store->chunk_resident[store->resident[i - 1].chunk] = i;
+    store->chunk_resident[chunk] = 0;
+    store->chunk_flags[chunk] &= ~WORLD_CHUNK_RESIDENT;
+}
+
+static void chunk_add_building(world_store_t *store, world_chunk_t *c, handle_t building) {
+    if (c->building_count == c->building_capacity) {
+        c->building_capacity = c->building_capacity ? c->building_capacity * 2 : 256;
+        c->buildings = realloc(c->buildings, sizeof(handle_t) * c->building_capacity);
+        assert(c->buildings);
+    }
+    c->buildings[c->building_count++] = building;
+    store->resident_buildings++;
+}
+
+// Live building with its origin at pos, from the list of its chunk.
+static handle_t find_building(const world_store_t *store, const game_state_t *gs, coord_t pos) {
+    const world_chunk_t *c = get_resident((world_store_t *)store, chunk_of(pos));
+    if (!c) return HANDLE_NONE;
+    for (size_t i=0; i<c->building_count; i++) {
+        const size_t index = get_building_index(gs, c->buildings[i]);
+        if (index && coord_equals(gs->buildings[index].pos, pos)) return c->buildings[i];
+    }
+    return HANDLE_NONE;
+}
+
+static void add_link(world_store_t *store, coord_t source, coord_t target) {
+    if (store->link_count == store->link_capacity) {
+        store->link_capacity = store->link_capacity ? store->link_capacity * 2 : 256;
+        store->links = realloc(store->links, sizeof(world_link_t) * store->link_capacity);
+        assert(store->links);
+    }
+    store->links[store->link_count++] = (world_link_t) { source, target };
+}
+
+// Connects suspended links whose target chunk is resident again. Links
+// whose source is gone or was connected elsewhere meanwhile are dropped.
+static void resolve_links(world_store_t *store, game_state_t *gs) {
+    for (size_t i=store->link_count; i-->0;) {
+        const world_link_t link = store->links[i];
+        if (!(store->chunk_flags[chunk_of(link.target)] & WORLD_CHUNK_RESIDENT)) continue;
+        store->links[i] = store->links[--store->link_count];
+
+        const handle_t source = find_building(store, gs, link.source);
+        const handle_t target = find_building(store, gs, link.target);
+        if (handle_is_none(source) || handle_is_none(target)) continue;
+        const uint32_t *outputs;
+        if (flow_graph_outputs(&gs->flow_graph, source.index, &outputs)) continue;
+
+        // The target belt keeps the input direction it was saved with.
+        const building_t *t = gs->buildings + get_building_index(gs, target);
+        const uint8_t in_dir = (t->type == BUILDING_TYPE_BELT) ? GET_BELT(gs, t->data)->in_dir : 0;
+        connect_buildings(gs, source, target);
+        if (t->type == BUILDING_TYPE_BELT) GET_BELT(gs, t->data)->in_dir = in_dir;
+    }
+}
+
+// Rebuilds the building lists after edits from outside the store. Chunks
+// with buildings the lists don't have become resident; those with a file
+// are unread until merge_adopted().
+static void refresh_lists(world_store_t *store, game_state_t *gs) {
+    if (store->edit_version == gs->edit_version) return;
+
+    for (size_t i=0; i<store->resident_count; i++) store->resident[i].building_count = 0;
+    store->resident_buildings = 0;
+    for (size_t i=1; i<gs->building_count; i++) {
+        const building_t *b = gs->buildings + i;
+        if (b->flags & ENTITY_FLAGS_DELETED) continue;
+        chunk_add_building(store, make_resident(store, chunk_of(b->pos)), get_building_handle(gs, i));
+    }
+    store->edit_version = gs->edit_version;
+}
+
+// -----
+
+// Maps the file of a chunk, NULL if it has none or it can't be read.
+static void *map_file(const world_store_t *store, uint32_t chunk, size_t *size) {
+    char path[WORLD_PATH_SIZE];
+    chunk_path(store, chunk, "", path);
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("world: can't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("world: can't map %s\n", path);
+        return NULL;
+    }
+    *size = st.st_size;
+    return data;
+}
+
+// Starts reading a chunk ahead of its load.
+static void prefetch_chunk(world_store_t *store, uint32_t chunk) {
+    if (store->mapping_count == WORLD_MAX_MAPPED) return;
+    world_mapping_t m = { .chunk = chunk };
+    m.data = map_file(store, chunk, &m.size);
+    if (!m.data) {
+        store->chunk_flags[chunk] &= ~WORLD_CHUNK_ON_DISK;
+        return;
+    }
+    madvise(m.data, m.size, MADV_WILLNEED);
+    store->mappings[store->mapping_count++] = m;
+    store->chunk_flags[chunk] |= WORLD_CHUNK_MAPPED;
+}
+
+static const world_record_t *check_chunk_file(const void *data, size_t size, uint32_t chunk, size_t *count) {
+    const world_chunk_header_t *header = data;
+    if (size < sizeof(world_chunk_header_t) || header->magic != WORLD_MAGIC || header->version != WORLD_VERSION ||
+            header->chunk != chunk || size != sizeof(world_chunk_header_t) + sizeof(world_record_t) * header->record_count) {
+        return NULL;
+    }
+    *count = header->record_count;
+    return (const world_record_t *)(header + 1);
+}
+
+static handle_t spawn_record(game_state_t *gs, const world_record_t *r) {
+    handle_t building = HANDLE_NONE;
+    switch (r->type) {
+        case BUILDING_TYPE_MINER: building = spawn_miner(gs, r->pos); break;
+        case BUILDING_TYPE_FACTORY: building = spawn_factory(gs, r->pos); break;
+        case BUILDING_TYPE_BELT: building = spawn_belt(gs, r->pos); break;
+    }
+    return building;
+}
+
+// After the links of the chunk, which set belt directions.
+static void restore_record(game_state_t *gs, handle_t building, const world_record_t *r) {
+    const building_t *b = gs->buildings + get_building_index(gs, building);
+    switch (r->type) {
+        case BUILDING_TYPE_MINER:
+            {
+                miner_t *miner = GET_MINER(gs, b->data);
+                miner->work = r->work;
+                miner->state = r->state;
+                miner->next_item = r->next_item;
+            }
+            break;
+        case BUILDING_TYPE_FACTORY:
+            {
+                factory_t *factory = GET_FACTORY(gs, b->data);
+                factory->work = r->work;
+                factory->recipe = r->recipe;
+                factory->state = r->state;
+                factory->pending = r->pending;
+                factory->counts = r->counts;
+            }
+            break;
+        case BUILDING_TYPE_BELT:
+            {
+                belt_t *belt = GET_BELT(gs, b->data);
+                memcpy(belt->items, r->items, BELT_ITEM_COUNT);
+                memcpy(belt->works, r->works, BELT_ITEM_COUNT);
+                belt->in_dir = r->in_dir;
+                belt->out_dir = r->out_dir;
+            }
+            break;
+    }
+}
+
+// Spawns the buildings of a chunk file into the state. Links to other
+// chunks are suspended until resolve_links(). False if the resident budget
+// doesn't allow it; the chunk stays on disk. A merge is of a chunk that is
+// resident already and can't be written back before its file is read, it
+// goes over the budget and only fails if the state is full.
+static bool load_chunk(world_store_t *store, game_state_t *gs, uint32_t chunk, bool merge) {
+    void *data = NULL;
+    size_t size = 0;
+    bool mapped = false;
+
+    const size_t budget = merge ? SIZE_MAX : store->max_resident_buildings;
+    if ((store->chunk_flags[chunk] & WORLD_CHUNK_ON_DISK) && store->resident_buildings >= budget) {
+        return false;
+    }
+
+    if (store->chunk_flags[chunk] & WORLD_CHUNK_MAPPED) {
+        for (size_t i=0; i<store->mapping_count; i++) {
+            if (store->mappings[i].chunk != chunk) continue;
+            const world_mapping_t m = take_mapping(store, i);
+            data = m.data;
+            size = m.size;
+            mapped = true;
+            break;
+        }
+    } else if (store->chunk_flags[chunk] & WORLD_CHUNK_ON_DISK) {
+        data = map_file(store, chunk, &size);
+        if (!data) store->chunk_flags[chunk] &= ~WORLD_CHUNK_ON_DISK;
+    }
+
+    size_t count = 0;
+    const world_record_t *records = NULL;
+    if (data) {
+        records = check_chunk_file(data, size, chunk, &count);
+        if (!records) {
+            // Left alone: without the on disk flag the chunk is never written.
+            printf("world: chunk %u,%u: bad file, ignored\n", chunk % WORLD_GRID, chunk / WORLD_GRID);
+            store->chunk_flags[chunk] &= ~WORLD_CHUNK_ON_DISK;
+        }
+    }
+
+    if (store->resident_buildings + count > budget ||
+            gs->building_count + count >= MAX_ENTITY_COUNT) {
+        if (data) munmap(data, size);
+        return false;
+    }
+
+    world_chunk_t *c = make_resident(store, chunk);
+    c->digest = records ? records_digest(data, size) : 0;
+    store->stats.mapped_loads += mapped;
+
+    if (count) {
+        handle_t *handles = malloc(sizeof(handle_t) * count);
+        assert(handles);
+        for (size_t i=0; i<count; i++) {
+            handles[i] = spawn_record(gs, records + i);
+            chunk_add_building(store, c, handles[i]);
+        }
+        for (size_t i=0; i<count; i++) {
+            const world_record_t *r = records + i;
+            if (r->target == WORLD_TARGET_REMOTE) {
+                add_link(store, r->pos, r->target_pos);
+            } else if (r->target < count) {
+                connect_buildings(gs, handles[i], handles[r->target]);
+            }
+        }
+        for (size_t i=0; i<count; i++) restore_record(gs, handles[i], records + i);
+        free(handles);
+    }
+
+    if (data) munmap(data, size);
+    return true;
+}
+
+// -----
+
+static void *buffer_reserve(world_store_t *store, size_t size) {
+    if (size > store->buffer_capacity) {
+        store->buffer_capacity = size * 2;
+        store->buffer = realloc(store->buffer, store->buffer_capacity);
+        assert(store->buffer);
+    }
+    return store->buffer;
+}
+
+// Chunk file of the live buildings in the list of c into the buffer,
+// returns its size. Suspended links from the chunk are written as outputs,
+// and dropped from the list with take_links.
+static size_t write_records(world_store_t *store, const game_state_t *gs, world_chunk_t *c, bool take_links) {
+    if (store->slot_capacity < gs->building_handles.slot_count) {
+        store->slot_capacity = gs->building_handles.slot_count * 2;
+        store->slot_records = realloc(store->slot_records, sizeof(uint32_t) * store->slot_capacity);
+        assert(store->slot_records);
+    }
+
+    size_t count = 0;
+    for (size_t i=0; i<c->building_count; i++) {
+        const size_t index = get_building_index(gs, c->buildings[i]);
+        if (!index) continue;
+        store->slot_records[c->buildings[i].index] = count++;
+    }
+
+    uint8_t *buffer = buffer_reserve(store, sizeof(world_chunk_header_t) + sizeof(world_record_t) * count);
+    world_chunk_header_t *header = (world_chunk_header_t *)buffer;
+    *header = (world_chunk_header_t) { WORLD_MAGIC, WORLD_VERSION, c->chunk, count, gs->tick };
+    world_record_t *records = (world_record_t *)(header + 1);
+    memset(records, 0, sizeof(world_record_t) * count);
+
+    world_record_t *r = records;
+    for (size_t i=0; i<c->building_count; i++) {
+        const size_t index = get_building_index(gs, c->buildings[i]);
+        if (!index) continue;
+        const building_t *b = gs->buildings + index;
+
+        r->type = b->type;
+        r->pos = b->pos;
+        r->target = WORLD_TARGET_NONE;
+        switch (b->type) {
+            case BUILDING_TYPE_MINER:
+                {
+                    const miner_t *miner = GET_MINER(gs, b->data);
+                    r->work = miner->work;
+                    r->state = miner->state;
+                    r->next_item = miner->next_item;
+                }
+                break;
+            case BUILDING_TYPE_FACTORY:
+                {
+                    const factory_t *factory = GET_FACTORY(gs, b->data);
+                    r->work = factory->work;
+                    r->recipe = factory->recipe;
+                    r->state = factory->state;
+                    r->pending = factory->pending;
+                    r->counts = factory->counts;
+                }
+                break;
+            case BUILDING_TYPE_BELT:
+                {
+                    const belt_t *belt = GET_BELT(gs, b->data);
+                    memcpy(r->items, belt->items, BELT_ITEM_COUNT);
+                    memcpy(r->works, belt->works, BELT_ITEM_COUNT);
+                    r->in_dir = belt->in_dir;
+                    r->out_dir = belt->out_dir;
+                }
+                break;
+        }
+
+        const uint32_t *outputs;
+        if (flow_graph_outputs(&gs->flow_graph, b->slot, &outputs)) {
+            const building_t *t = gs->buildings + gs->building_handles.slots[outputs[0]].dense;
+            if (chunk_of(t->pos) == c->chunk) {
+                r->target = store->slot_records[outputs[0]];
+            } else {
+                r->target = WORLD_TARGET_REMOTE;
+                r->target_pos = t->pos;
+            }
+        }
+        r++;
+    }
+
+    for (size_t l=store->link_count; l-->0;) {
+        const world_link_t link = store->links[l];
+        if (chunk_of(link.source) != c->chunk) continue;
+        for (size_t i=0; i<count; i++) {
+            if (coord_equals(records[i].pos, link.source) && records[i].target == WORLD_TARGET_NONE) {
+                records[i].target = WORLD_TARGET_REMOTE;
+                records[i].target_pos = link.target;
+                break;
+            }
+        }
+        if (take_links) store->links[l] = store->links[--store->link_count];
+    }
+
+    return sizeof(world_chunk_header_t) + sizeof(world_record_t) * count;
+}
+
+// Replaces the file of a chunk, through a temporary file so a failed write
+// leaves the old one.
+static bool write_chunk_file(world_store_t *store, uint32_t chunk, const void *data, size_t size) {
+    char path[WORLD_PATH_SIZE], temp_path[WORLD_PATH_SIZE];
+    chunk_path(store, chunk, "", path);
+    chunk_path(store, chunk, ".tmp", temp_path);
+
+    const int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("world: can't create %s: %s\n", temp_path, strerror(errno));
+        return false;
+    }
+    const uint8_t *p = data;
+    size_t left = size;
+    while (left) {
+        const ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        p += n;
+        left -= n;
+    }
+    close(fd);
+    if (left || rename(temp_path, path) != 0) {
+        printf("world: can't write %s: %s\n", path, strerror(errno));
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+}
+
+// Writes the chunks that changed; with evict, also suspends the links into
+// them from chunks that stay and deletes their buildings. Chunks that fail
+// to write stay resident.
+static void evict_chunks(world_store_t *store, game_state_t *gs, const uint32_t *chunks, size_t n, bool evict) {
+    for (size_t k=0; k<n; k++) store->chunk_flags[chunks[k]] |= WORLD_CHUNK_EVICTING;
+
+    bool *written = calloc(n, sizeof(bool));
+    assert(written);
+
+    // Everything is written while all links are still in place.
+    for (size_t k=0; k<n; k++) {
+        world_chunk_t *c = get_resident(store, chunks[k]);
+        assert(c);
+        if (gs->regions) {
+            for (size_t i=0; i<c->building_count; i++) {
+                const size_t index = get_building_index(gs, c->buildings[i]);
+                if (index) region_scheduler_sync(gs->regions, gs, gs->buildings[index].pos);
+            }
+        }
+
+        const size_t size = write_records(store, gs, c, evict);
+        const uint64_t digest = records_digest(store->buffer, size);
+        const bool empty = size == sizeof(world_chunk_header_t);
+        uint8_t *flags = store->chunk_flags + chunks[k];
+
+        if (!c->digest && (*flags & WORLD_CHUNK_ON_DISK)) {
+            // Not merged with its file yet, writing would lose it.
+            written[k] = false;
+        } else if (empty && !(*flags & WORLD_CHUNK_ON_DISK)) {
+            written[k] = true;
+        } else if (empty) {
+            char path[WORLD_PATH_SIZE];
+            chunk_path(store, chunks[k], "", path);
+            written[k] = unlink(path) == 0;
+            if (written[k]) *flags &= ~WORLD_CHUNK_ON_DISK;
+        } else if (digest == c->digest && (*flags & WORLD_CHUNK_ON_DISK)) {
+            written[k] = true;
+        } else {
+            written[k] = write_chunk_file(store, chunks[k], store->buffer, size);
+            if (written[k]) {
+                c->digest = digest;
+                *flags |= WORLD_CHUNK_ON_DISK;
+                store->stats.writes++;
+            }
+        }
+        if (!written[k] || !evict) continue;
+
+        for (size_t i=0; i<c->building_count; i++) {
+            const size_t index = get_building_index(gs, c->buildings[i]);
+            if (!index) continue;
+            const building_t *b = gs->buildings + index;
+            const uint32_t *inputs;
+            const size_t input_count = flow_graph_inputs(&gs->flow_graph, b->slot, &inputs);
+            for (size_t j=0; j<input_count; j++) {
+                const building_t *s = gs->buildings + gs->building_handles.slots[inputs[j]].dense;
+                if (!(store->chunk_flags[chunk_of(s->pos)] & WORLD_CHUNK_EVICTING)) add_link(store, s->pos, b->pos);
+            }
+        }
+    }
+
+    for (size_t k=0; k<n; k++) {
+        store->chunk_flags[chunks[k]] &= ~WORLD_CHUNK_EVICTING;
+        if (!evict || !written[k]) continue;
+
+        world_chunk_t *c = get_resident(store, chunks[k]);
+        for (size_t i=0; i<c->building_count; i++) delete_building(gs, c->buildings[i]);
+        drop_resident(store, chunks[k]);
+        store->stats.evictions++;
+    }
+    free(written);
+}
+
+// -----
+
+// Reads the files of chunks that were built on while evicted into them.
+static void merge_adopted(world_store_t *store, game_state_t *gs) {
+    for (size_t i=0; i<store->resident_count; i++) {
+        const world_chunk_t *c = store->resident + i;
+        uint8_t *flags = store->chunk_flags + c->chunk;
+        if (c->digest || !(*flags & WORLD_CHUNK_ON_DISK)) continue;
+        const bool reported = *flags & WORLD_CHUNK_UNMERGED;
+        if (!reported) printf("world: chunk %u,%u was built on while evicted, merging\n", c->chunk % WORLD_GRID, c->chunk / WORLD_GRID);
+        if (load_chunk(store, gs, c->chunk, true)) {
+            *flags &= ~WORLD_CHUNK_UNMERGED;
+        } else if (!reported) {
+            // Retried every update, the chunk can't be written back meanwhile.
+            printf("world: chunk %u,%u: no room in the state to merge it\n", c->chunk % WORLD_GRID, c->chunk / WORLD_GRID);
+            *flags |= WORLD_CHUNK_UNMERGED;
+        }
+    }
+}
+
+static bool chunk_pinned(const game_state_t *gs, uint32_t chunk) {
+    if (!gs->regions) return false;
+    // Region chunks are half as wide and centered the same way.
+    const uint32_t x = (chunk % WORLD_GRID) * 2;
+    const uint32_t y = (chunk / WORLD_GRID) * 2;
+    for (uint32_t dy=0; dy<2; dy++) {
+        for (uint32_t dx=0; dx<2; dx++) {
+            if (gs->regions->chunk_modes[(y + dy) * REGION_GRID + x + dx] == REGION_MODE_ACTIVE) return true;
+        }
+    }
+    return false;
+}
+
+// Pinned or next to a pinned chunk, which is loaded for it.
+static bool chunk_near_pinned(const game_state_t *gs, uint32_t chunk) {
+    for (int32_t dy=-1; dy<=1; dy++) {
+        for (int32_t dx=-1; dx<=1; dx++) {
+            const int32_t x = (int32_t)(chunk % WORLD_GRID) + dx;
+            const int32_t y = (int32_t)(chunk / WORLD_GRID) + dy;
+            if (x < 0 || y < 0 || x >= WORLD_GRID || y >= WORLD_GRID) continue;
+            if (chunk_pinned(gs, y * WORLD_GRID + x)) return true;
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    uint32_t chunk;
+    int64_t distance;
+} candidate_t;
+
+static int compare_candidates(const void *a, const void *b) {
+    const int64_t da = ((const candidate_t *)a)->distance;
+    const int64_t db = ((const candidate_t *)b)->distance;
+    return (da > db) - (da < db);
+}
+
+void world_store_update(world_store_t *store, game_state_t *gs, quad_aabb_t view, float velocity_x, float velocity_y) {
+    assert(store);
+    assert(gs);
+    const double start = get_time_ms();
+
+    refresh_lists(store, gs);
+    merge_adopted(store, gs);
+
+    const quad_aabb_t load_cells = {
+        view.x_min - WORLD_LOAD_MARGIN, view.y_min - WORLD_LOAD_MARGIN,
+        view.x_max + WORLD_LOAD_MARGIN, view.y_max + WORLD_LOAD_MARGIN,
+    };
+    const int32_t ahead_x = velocity_x * WORLD_PREFETCH_SECONDS;
+    const int32_t ahead_y = velocity_y * WORLD_PREFETCH_SECONDS;
+    const quad_aabb_t prefetch_cells = {
+        load_cells.x_min + (ahead_x < 0 ? ahead_x : 0), load_cells.y_min + (ahead_y < 0 ? ahead_y : 0),
+        load_cells.x_max + (ahead_x > 0 ? ahead_x : 0), load_cells.y_max + (ahead_y > 0 ? ahead_y : 0),
+    };
+    const chunk_rect_t load = chunk_rect(load_cells);
+    const chunk_rect_t prefetch = chunk_rect(prefetch_cells);
+    const chunk_rect_t keep = {
+        prefetch.x_min - 1, prefetch.y_min - 1, prefetch.x_max + 1, prefetch.y_max + 1,
+    };
+
+    // Needed now: in the loaded area, or next to a pinned active chunk.
+    bool loaded = false;
+    for (int32_t y=load.y_min; y<=load.y_max; y++) {
+        for (int32_t x=load.x_min; x<=load.x_max; x++) {
+            const uint32_t chunk = y * WORLD_GRID + x;
+            const uint8_t flags = store->chunk_flags[chunk];
+            if ((flags & WORLD_CHUNK_RESIDENT) || !load_chunk(store, gs, chunk, false)) continue;
+            // Empty chunks become resident too, for the buildings the UI puts there.
+            if (!(flags & WORLD_CHUNK_ON_DISK)) continue;
+            store->stats.demand_loads++;
+            loaded = true;
+        }
+    }
+    const size_t resident_count = store->resident_count;
+    for (size_t i=0; i<resident_count; i++) {
+        const uint32_t chunk = store->resident[i].chunk;
+        if (!chunk_pinned(gs, chunk)) continue;
+        for (int32_t dy=-1; dy<=1; dy++) {
+            for (int32_t dx=-1; dx<=1; dx++) {
+                const int32_t x = (int32_t)(chunk % WORLD_GRID) + dx;
+                const int32_t y = (int32_t)(chunk / WORLD_GRID) + dy;
+                if (x < 0 || y < 0 || x >= WORLD_GRID || y >= WORLD_GRID) continue;
+                const uint32_t neighbor = y * WORLD_GRID + x;
+                const uint8_t flags = store->chunk_flags[neighbor];
+                if ((flags & WORLD_CHUNK_RESIDENT) || !load_chunk(store, gs, neighbor, false)) continue;
+                if (!(flags & WORLD_CHUNK_ON_DISK)) continue;
+                store->stats.demand_loads++;
+                loaded = true;
+            }
+        }
+    }
+
+    // Ahead of the view: nearest first, mapped to start reading, a few loaded.
+    candidate_t candidates[WORLD_MAX_CANDIDATES];
+    size_t candidate_count = 0;
+    const int32_t center_x = chunk_coord((view.x_min + view.x_max) / 2);
+    const int32_t center_y = chunk_coord((view.y_min + view.y_max) / 2);
+    for (int32_t y=prefetch.y_min; y<=prefetch.y_max && candidate_count<WORLD_MAX_CANDIDATES; y++) {
+        for (int32_t x=prefetch.x_min; x<=prefetch.x_max && candidate_count<WORLD_MAX_CANDIDATES; x++) {
+            const uint32_t chunk = y * WORLD_GRID + x;
+            const uint8_t flags = store->chunk_flags[chunk];
+            if ((flags & WORLD_CHUNK_RESIDENT) || !(flags & WORLD_CHUNK_ON_DISK)) continue;
+            const int64_t dx = x - center_x, dy = y - center_y;
+            candidates[candidate_count++] = (candidate_t) { chunk, dx * dx + dy * dy };
+        }
+    }
+    qsort(candidates, candidate_count, sizeof(candidate_t), compare_candidates);
+    for (size_t i=store->mapping_count; i-->0;) {
+        if (!rect_contains(prefetch, store->mappings[i].chunk)) unmap_chunk(store, i);
+    }
+    size_t prefetch_loads = 0;
+    for (size_t i=0; i<candidate_count; i++) {
+        const uint32_t chunk = candidates[i].chunk;
+        if (!(store->chunk_flags[chunk] & WORLD_CHUNK_MAPPED)) {
+            prefetch_chunk(store, chunk);
+        } else if (prefetch_loads < WORLD_PREFETCH_LOADS && load_chunk(store, gs, chunk, false)) {
+            // Mapped an update ago at least, the readahead had time.
+            store->stats.prefetch_loads++;
+            prefetch_loads++;
+            loaded = true;
+        }
+    }
+
+    if (loaded) resolve_links(store, gs);
+
+    // Idle chunks, then the longest idle ones while over budget.
+    size_t resident_buildings = store->resident_buildings;
+    for (size_t i=0; i<store->resident_count; i++) {
+        world_chunk_t *c = store->resident + i;
+        c->idle = (rect_contains(keep, c->chunk) || chunk_near_pinned(gs, c->chunk)) ? 0 : c->idle + 1;
+    }
+    uint32_t *evicted = malloc(sizeof(uint32_t) * (store->resident_count + 1));
+    assert(evicted);
+    size_t evicted_count = 0;
+    for (size_t i=0; i<store->resident_count; i++) {
+        world_chunk_t *c = store->resident + i;
+        if (c->idle < WORLD_EVICT_IDLE) continue;
+        evicted[evicted_count++] = c->chunk;
+        resident_buildings -= c->building_count;
+    }
+    while (resident_buildings > store->max_resident_buildings) {
+        world_chunk_t *oldest = NULL;
+        for (size_t i=0; i<store->resident_count; i++) {
+            world_chunk_t *c = store->resident + i;
+            if (c->idle && c->idle < WORLD_EVICT_IDLE && (!oldest || c->idle > oldest->idle)) oldest = c;
+        }
+        if (!oldest) break;
+        oldest->idle = WORLD_EVICT_IDLE;
+        evicted[evicted_count++] = oldest->chunk;
+        resident_buildings -= oldest->building_count;
+    }
+    if (evicted_count) evict_chunks(store, gs, evicted, evicted_count, true);
+    free(evicted);
+
+    store->edit_version = gs->edit_version;
+
+    world_store_stats_t *stats = &store->stats;
+    stats->resident_chunks = store->resident_count;
+    stats->resident_buildings = store->resident_buildings;
+    stats->mapped = store->mapping_count;
+    stats->suspended_links = store->link_count;
+    stats->update_ms = get_time_ms() - start;
+}
+
+static void write_all(world_store_t *store, game_state_t *gs, bool evict) {
+    refresh_lists(store, gs);
+    merge_adopted(store, gs);
+
+    const size_t n = store->resident_count;
+    uint32_t *chunks = malloc(sizeof(uint32_t) * (n + 1));
+    assert(chunks);
+    for (size_t i=0; i<n; i++) chunks[i] = store->resident[i].chunk;
+    evict_chunks(store, gs, chunks, n, evict);
+    free(chunks);
+
+    store->edit_version = gs->edit_version;
+    store->stats.resident_chunks = store->resident_count;
+    store->stats.resident_buildings = store->resident_buildings;
+    store->stats.suspended_links = store->link_count;
+}
+
+void world_store_save(world_store_t *store, game_state_t *gs) {
+    assert(store);
+    assert(gs);
+    write_all(store, gs, false);
+}
+
+void world_store_evict_all(world_store_t *store, game_state_t *gs) {
+    assert(store);
+    assert(gs);
+    write_all(store, gs, true);
+}
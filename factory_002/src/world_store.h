@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "game_state.h"
+
+// Out-of-core worlds: the world lives in a directory of chunk files, one
+// per chunk of WORLD_CHUNK_SIZE cells with buildings, and only chunks near
+// the camera or pinned active regions are in the game state:
+//
+// - chunks the view (plus WORLD_LOAD_MARGIN) touches are loaded right away,
+// - chunks the view will touch within WORLD_PREFETCH_SECONDS at its current
+//   velocity are mapped with readahead requested, and a few of them loaded
+//   per update, so a moving camera finds them resident,
+// - chunks outside both for WORLD_EVICT_IDLE updates, or the longest idle
+//   ones while more than max_resident_buildings are resident, are written
+//   back (only if they changed) and deleted from the state.
+//
+// A chunk file holds the buildings whose origin is in the chunk with their
+// state and outputs. Outputs to the same chunk are record indices, outputs
+// to other chunks the target's origin. A link to a chunk that isn't loaded
+// is suspended: its source holds a stale output and blocks until the target
+// chunk is back. Evicted chunks don't simulate; after a reload entities
+// update in a different order, so a streamed world drifts from one that
+// stays resident wherever chunks were evicted.
+//
+// The budget bounds the buildings in the state, not its memory: the entity
+// arrays are sized for MAX_ENTITY_COUNT and keep the pages touched at their
+// high-water mark.
+//
+// Chunks are in the quad tree's root bounds, like region chunks. Loads and
+// evictions are edits of the state between updates, like the ones from the
+// UI; the rewind history doesn't cover them.
+
+#define WORLD_CHUNK_SHIFT       (8)  // 256 cells, 2x2 region chunks
+#define WORLD_CHUNK_SIZE        (1 << WORLD_CHUNK_SHIFT)
+#define WORLD_GRID              (512) // chunks per side, covers the quad tree's root bounds
+#define WORLD_CHUNK_COUNT       (WORLD_GRID * WORLD_GRID)
+#define WORLD_LOAD_MARGIN       (WORLD_CHUNK_SIZE / 2) // cells around the view
+#define WORLD_PREFETCH_SECONDS  (1.5f)
+#define WORLD_PREFETCH_LOADS    (2)   // prefetched chunks loaded per update
+#define WORLD_EVICT_IDLE        (120) // updates
+#define WORLD_MAX_MAPPED        (64)
+
+#define WORLD_CHUNK_ON_DISK     (1)
+#define WORLD_CHUNK_RESIDENT    (2)
+#define WORLD_CHUNK_MAPPED      (4)
+
+typedef struct {
+    uint32_t chunk;
+    uint32_t idle;           // updates outside the loaded and prefetched areas
+    uint64_t digest;         // of the records of the chunk file as last read or written
+    size_t building_count;
+    size_t building_capacity;
+    handle_t *buildings;     // whose origin is in the chunk, may hold stale handles
+} world_chunk_t;
+
+typedef struct {
+    uint32_t chunk;
+    void *data;
+    size_t size;
+} world_mapping_t;
+
+// A link whose target chunk is evicted, the source chunk is resident.
+typedef struct {
+    coord_t source;
+    coord_t target;
+} world_link_t;
+
+typedef struct {
+    size_t resident_chunks;
+    size_t resident_buildings;
+    size_t mapped;
+    size_t suspended_links;
+    uint64_t demand_loads;   // chunk needed in the loaded area right away
+    uint64_t prefetch_loads; // loaded ahead of the view
+    uint64_t mapped_loads;   // of either kind, read from a prefetched mapping
+    uint64_t evictions;
+    uint64_t writes;         // evictions and saves that wrote a file
+    double update_ms;        // of the last update
+} world_store_stats_t;
+
+typedef struct {
+    char *path;
+    size_t max_resident_buildings;
+    size_t opened_chunks;    // on disk when opened
+    size_t resident_buildings; // in the lists of resident chunks
+
+    // By chunk.
+    uint8_t *chunk_flags;    // WORLD_CHUNK_*
+    uint32_t *chunk_resident; // 1 + index into resident, 0 if not resident
+
+    size_t resident_count;
+    size_t resident_capacity;
+    world_chunk_t *resident;
+
+    size_t mapping_count;
+    world_mapping_t mappings[WORLD_MAX_MAPPED];
+
+    size_t link_count;
+    size_t link_capacity;
+    world_link_t *links;
+
+    uint64_t edit_version;   // of the state the building lists match
+
+    // Scratch.
+    size_t slot_capacity;
+    uint32_t *slot_records;  // by building slot, while writing chunks
+    size_t buffer_capacity;
+    uint8_t *buffer;
+
+    world_store_stats_t stats;
+} world_store_t;
+
+// Opens or creates the directory, false if that fails.
+bool world_store_open(world_store_t *store, const char *path);
+// Doesn't write anything, world_store_save() first to keep the resident chunks.
+void world_store_close(world_store_t *store);
+
+// Between updates: loads, prefetches and evicts for a view in cells moving
+// at the given velocity in cells per second. Buildings the state has outside
+// resident chunks (built before streaming, or by the UI) join their chunks.
+void world_store_update(world_store_t *store, game_state_t *gs, quad_aabb_t view, float velocity_x, float velocity_y);
+// Writes the resident chunks that changed, keeps them resident.
+void world_store_save(world_store_t *store, game_state_t *gs);
+// Writes and evicts every resident chunk.
+void world_store_evict_all(world_store_t *store, game_state_t *gs);